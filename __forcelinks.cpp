@@ -28,6 +28,7 @@ extern void __forcelink_to_ks_pending_trigger_cpp();
 extern void __forcelink_to_ks_cancel_inspector_cpp();
 extern void __forcelink_to_ks_single_thread_apartment_imp_cpp();
 extern void __forcelink_to_ks_thread_pool_apartment_imp_cpp();
+extern void __forcelink_to_ks_apartment_fiber_cpp();
 extern void __forcelink_to_ks_notification_center_cpp();
 extern void __forcelink_to_ks_notification_cpp();
 
@@ -46,6 +47,7 @@ void __ks_async_forcelinks() {
     __forcelink_to_ks_cancel_inspector_cpp();
     __forcelink_to_ks_single_thread_apartment_imp_cpp();
     __forcelink_to_ks_thread_pool_apartment_imp_cpp();
+    __forcelink_to_ks_apartment_fiber_cpp();
     __forcelink_to_ks_notification_center_cpp();
     __forcelink_to_ks_notification_cpp();
 }
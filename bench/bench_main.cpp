@@ -22,8 +22,10 @@ int main(int argc, char** argv) {
     benchmark::RunSpecifiedBenchmarks();
 
     ks_apartment::default_mta()->async_stop();
+    ks_apartment::blocking_mta()->async_stop();
     ks_apartment::background_sta()->async_stop();
     ks_apartment::default_mta()->wait();
+    ks_apartment::blocking_mta()->wait();
     ks_apartment::background_sta()->wait();
     return 0;
 }
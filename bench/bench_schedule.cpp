@@ -0,0 +1,243 @@
+﻿/* Copyright 2025 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GBENCH_SCHEDULE_H
+#define GBENCH_SCHEDULE_H
+
+#include "bench_base.h"
+#include "../ks_coroutine.h"
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+
+//统计全局operator new的调用次数（含所有线程），用以考察每一跳（hop）的堆分配次数
+//注：在Linux/mac下替换可执行文件中的operator new对ks-async动态库同样生效；而Windows下dll使用自己的crt堆，统计将不完整
+static std::atomic<size_t> g_bench_new_count{ 0 };
+
+void* operator new(size_t size) {
+    g_bench_new_count.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size != 0 ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+
+//在工作线程内接力schedule：每个fn再schedule下一个fn（与then-continuation的投递方式相同）
+static void ScheduleBench_AllocsPerHop(benchmark::State& state) {
+    const int hop_count = (int)state.range(0);
+    ks_apartment* apartment = ks_apartment::default_mta();
+
+    struct _RELAY {
+        ks_apartment* apartment;
+        int remain_count;
+        ks_event done_event{ false, true };
+
+        void run_next() {
+            uint64_t pad_1 = 1, pad_2 = 2, pad_3 = 3; //使lambda捕获的尺寸接近raw-future中的continuation
+            apartment->schedule([this, pad_1, pad_2, pad_3]() {
+                benchmark::DoNotOptimize(pad_1 + pad_2 + pad_3);
+                if (--remain_count > 0)
+                    run_next();
+                else
+                    done_event.set_event();
+            }, 0);
+        }
+    };
+
+    size_t total_hop_count = 0;
+    size_t total_new_count = 0;
+    for (auto _ : state) {
+        _RELAY relay;
+        relay.apartment = apartment;
+        relay.remain_count = hop_count;
+
+        size_t new_count_begin = g_bench_new_count.load();
+        relay.run_next();
+        relay.done_event.wait();
+        total_new_count += g_bench_new_count.load() - new_count_begin;
+        total_hop_count += hop_count;
+    }
+
+    state.counters["allocs_per_hop"] = benchmark::Counter(total_hop_count != 0 ? double(total_new_count) / double(total_hop_count) : 0.0);
+    state.SetItemsProcessed((int64_t)total_hop_count);
+}
+BENCHMARK(ScheduleBench_AllocsPerHop)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+
+//then链：先构造好整条链（构造本身的分配不计入），再resolve头部promise，统计整条链运行期间的分配次数
+static void FutureThenBench_AllocsPerHop(benchmark::State& state) {
+    const int hop_count = (int)state.range(0);
+    ks_apartment* apartment = ks_apartment::default_mta();
+
+    size_t total_hop_count = 0;
+    size_t total_new_count = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto promise = ks_promise<int>::create();
+        ks_future<int> future = promise.get_future();
+        for (int i = 0; i < hop_count; ++i) {
+            future = future.then<int>(apartment, [](const int& value) { return value + 1; });
+        }
+        state.ResumeTiming();
+
+        size_t new_count_begin = g_bench_new_count.load();
+        promise.resolve(0);
+        future.__wait();
+        total_new_count += g_bench_new_count.load() - new_count_begin;
+        total_hop_count += hop_count;
+
+        state.PauseTiming();
+        future = ks_future<int>::rejected(ks_error::unexpected_error());
+        state.ResumeTiming();
+    }
+
+    state.counters["allocs_per_hop"] = benchmark::Counter(total_hop_count != 0 ? double(total_new_count) / double(total_hop_count) : 0.0);
+    state.SetItemsProcessed((int64_t)total_hop_count);
+}
+BENCHMARK(FutureThenBench_AllocsPerHop)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+//then链的构造：统计每个then节点的分配次数（future节点连同控制块池化为一块，另有用户fn的std::function本身）
+static void FutureThenBench_AllocsPerNode(benchmark::State& state) {
+    const int node_count = (int)state.range(0);
+    ks_apartment* apartment = ks_apartment::default_mta();
+
+    size_t total_node_count = 0;
+    size_t total_new_count = 0;
+    for (auto _ : state) {
+        auto promise = ks_promise<int>::create();
+        ks_future<int> future = promise.get_future();
+
+        size_t new_count_begin = g_bench_new_count.load();
+        for (int i = 0; i < node_count; ++i) {
+            future = future.then<int>(apartment, [](const int& value) { return value + 1; });
+        }
+        total_new_count += g_bench_new_count.load() - new_count_begin;
+        total_node_count += node_count;
+
+        state.PauseTiming();
+        promise.resolve(0);
+        future.__wait();
+        future = ks_future<int>::rejected(ks_error::unexpected_error());
+        state.ResumeTiming();
+    }
+
+    state.counters["allocs_per_node"] = benchmark::Counter(total_node_count != 0 ? double(total_new_count) / double(total_node_count) : 0.0);
+    state.SetItemsProcessed((int64_t)total_node_count);
+}
+BENCHMARK(FutureThenBench_AllocsPerNode)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+
+#if __KS_ASYNC_COROUTINE_ENABLED
+//协程逐个co_await尚未完成的promise-future：统计每次挂起/恢复的分配次数（对照上面then节点的构造及运行）
+static void CoroutineAwaitBench_AllocsPerHop(benchmark::State& state) {
+    const int hop_count = (int)state.range(0);
+    ks_apartment* apartment = ks_apartment::default_mta();
+
+    struct _CORO {
+        static ks_task<int> run(const std::vector<ks_future<int>>* futures, std::atomic<int>* awaiting_index) {
+            int sum = 0;
+            for (int i = 0; i < (int)futures->size(); ++i) {
+                awaiting_index->store(i, std::memory_order_release);
+                sum += co_await (*futures)[i];
+            }
+            co_return sum;
+        }
+    };
+
+    size_t total_hop_count = 0;
+    size_t total_new_count = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::vector<ks_promise<int>> promises;
+        std::vector<ks_future<int>> futures;
+        promises.reserve(hop_count);
+        futures.reserve(hop_count);
+        for (int i = 0; i < hop_count; ++i) {
+            promises.push_back(ks_promise<int>::create());
+            futures.push_back(promises.back().get_future());
+        }
+        std::atomic<int> awaiting_index = { -1 };
+        ks_task<int> task = _CORO::run(&futures, &awaiting_index);
+        state.ResumeTiming();
+
+        //注：在另一套间中resolve，故每次恢复时跨套间schedule（约1次分配，同从外部线程schedule），协程挂起本身不分配
+        size_t new_count_begin = g_bench_new_count.load();
+        ks_future<int> result_future = std::move(task).post(apartment, {});
+        ks_event resolver_done_event{ false, true };
+        ks_apartment::background_sta()->schedule([&promises, &awaiting_index, &resolver_done_event, hop_count]() {
+            for (int i = 0; i < hop_count; ++i) {
+                while (awaiting_index.load(std::memory_order_acquire) < i)
+                    std::this_thread::yield();
+                promises[i].resolve(1);
+            }
+            resolver_done_event.set_event();
+        }, 0);
+        result_future.__wait();
+        resolver_done_event.wait();
+        total_new_count += g_bench_new_count.load() - new_count_begin;
+        total_hop_count += hop_count;
+    }
+
+    state.counters["allocs_per_hop"] = benchmark::Counter(total_hop_count != 0 ? double(total_new_count) / double(total_hop_count) : 0.0);
+    state.SetItemsProcessed((int64_t)total_hop_count);
+}
+BENCHMARK(CoroutineAwaitBench_AllocsPerHop)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+//生产者与消费者位于不同套间的ks_async_generator：统计每个元素的分配次数（缓冲于启动时一次分配，逐个元素不分配future）
+static void AsyncGeneratorBench_AllocsPerItem(benchmark::State& state) {
+    const int item_count = (int)state.range(0);
+    const size_t buffer_capacity = (size_t)state.range(1);
+
+    struct _CORO {
+        static ks_async_generator<int> produce(int n) {
+            for (int i = 0; i < n; ++i)
+                co_yield i;
+        }
+        static ks_task<int> consume(ks_async_generator<int> generator) {
+            int count = 0;
+            while ((co_await generator.next()).is_value())
+                ++count;
+            co_return count;
+        }
+    };
+
+    size_t total_item_count = 0;
+    size_t total_new_count = 0;
+    for (auto _ : state) {
+        size_t new_count_begin = g_bench_new_count.load();
+        ks_async_generator<int> generator = _CORO::produce(item_count);
+        generator.start(ks_apartment::background_sta(), buffer_capacity, {});
+        ks_future<int> result_future = _CORO::consume(std::move(generator)).post(ks_apartment::default_mta(), {});
+        result_future.__wait();
+        total_new_count += g_bench_new_count.load() - new_count_begin;
+        total_item_count += item_count;
+    }
+
+    state.counters["allocs_per_item"] = benchmark::Counter(total_item_count != 0 ? double(total_new_count) / double(total_item_count) : 0.0);
+    state.SetItemsProcessed((int64_t)total_item_count);
+}
+BENCHMARK(AsyncGeneratorBench_AllocsPerItem)->Args({ 10000, 1 })->Args({ 10000, 64 })->Unit(benchmark::kMillisecond);
+#endif
+
+
+#endif // GBENCH_SCHEDULE_H
@@ -921,6 +921,8 @@ void ks_raw_async_flow::do_fire_flow_observers_locked(_x_observer_kind_t kind, c
 				continue;
 			}
 
+			ks_raw_schedule_attrs_rtstt observer_schedule_attrs_rtstt;
+			observer_schedule_attrs_rtstt.apply(observer_item->observer_context.__get_sched_class(), {}, 0);
 			observer_item->apartment->schedule(
 				[this_held = this->shared_from_this(), error, observer_item, observer_owner_locker = observer_context_rtstt.get_owner_locker()]() {
 					switch (observer_item->kind) {
@@ -960,6 +962,8 @@ void ks_raw_async_flow::do_fire_task_observers_locked(_x_observer_kind_t kind, c
 				continue;
 			}
 
+			ks_raw_schedule_attrs_rtstt observer_schedule_attrs_rtstt;
+			observer_schedule_attrs_rtstt.apply(observer_item->observer_context.__get_sched_class(), {}, 0);
 			observer_item->apartment->schedule(
 				[this_held = this->shared_from_this(), task_name, error, observer_item, observer_owner_locker = observer_context_rtstt.get_owner_locker()]() {
 					switch (observer_item->kind) {
@@ -16,9 +16,13 @@ limitations under the License.
 #include "ks_raw_future.h"
 #include "ks_raw_promise.h"
 #include "ks_raw_internal_helper.hpp"
+#include "../ks_apartment_internal_helper.hpp"
 #include "../ktl/ks_concurrency.h"
 #include "../ktl/ks_defer.h"
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
 #include <algorithm>
 
 void __forcelink_to_ks_raw_future_cpp() {}
@@ -45,6 +49,281 @@ __KS_ASYNC_RAW_BEGIN
 
 static thread_local ks_raw_future* tls_current_thread_running_future = nullptr;
 
+//fiber模式的套间中，任务可能在wait时被park，故当前运行中的future须随fiber保存和恢复
+static struct ks_raw_running_future_fiber_local_registrar {
+	ks_raw_running_future_fiber_local_registrar() {
+		ks_apartment::__register_fiber_local_tls([](void* value) -> void* {
+			ks_raw_future* pre_value = tls_current_thread_running_future;
+			tls_current_thread_running_future = (ks_raw_future*)value;
+			return pre_value;
+		});
+	}
+} g_raw_running_future_fiber_local_registrar;
+
+
+//同套间后继的就地执行（见ks_raw_future_baseimp::do_check_could_run_inline_locked）：
+//最外层的就地执行者在栈上构造一个帧，嵌套的就地执行只增加帧的深度；深度达到上限后，后继改为排入帧的蹦床队列，待其返回到最外层后再依次执行，以免栈无限增长；
+//每帧就地执行的总数也有上限，超出后回退为正常schedule，以免长链独占线程而饿死套间中的其他任务
+struct ks_raw_inline_run_frame {
+	int depth = 0;
+	int run_count = 0;
+	std::deque<ks_unique_function<void()>> trampoline_fns;
+};
+
+static constexpr int __INLINE_RUN_DEPTH_LIMIT = 16;
+static constexpr int __INLINE_RUN_COUNT_LIMIT = 256;
+
+static thread_local ks_raw_inline_run_frame* tls_current_inline_run_frame = nullptr;
+
+//就地执行中途可能wait而park当前fiber，故就地执行帧也须随fiber保存和恢复
+static struct ks_raw_inline_run_frame_fiber_local_registrar {
+	ks_raw_inline_run_frame_fiber_local_registrar() {
+		ks_apartment::__register_fiber_local_tls([](void* value) -> void* {
+			ks_raw_inline_run_frame* pre_value = tls_current_inline_run_frame;
+			tls_current_inline_run_frame = (ks_raw_inline_run_frame*)value;
+			return pre_value;
+		});
+	}
+} g_raw_inline_run_frame_fiber_local_registrar;
+
+static inline bool __could_run_inline_on_current_thread() {
+	ks_raw_inline_run_frame* frame = tls_current_inline_run_frame;
+	return frame == nullptr || frame->run_count < __INLINE_RUN_COUNT_LIMIT;
+}
+
+static void __run_inline_on_current_thread(ks_unique_function<void()>&& fn) {
+	ks_raw_inline_run_frame* frame = tls_current_inline_run_frame;
+	if (frame != nullptr) {
+		ASSERT(frame->run_count < __INLINE_RUN_COUNT_LIMIT);
+		++frame->run_count;
+		if (frame->depth < __INLINE_RUN_DEPTH_LIMIT) {
+			++frame->depth;
+			fn();
+			fn = {};
+			--frame->depth;
+		}
+		else {
+			frame->trampoline_fns.push_back(std::move(fn));
+		}
+		return;
+	}
+
+	ks_raw_inline_run_frame outer_frame;
+	outer_frame.depth = 1;
+	outer_frame.run_count = 1;
+	tls_current_inline_run_frame = &outer_frame;
+
+	fn();
+	fn = {};
+	while (!outer_frame.trampoline_fns.empty()) {
+		ks_unique_function<void()> trampoline_fn = std::move(outer_frame.trampoline_fns.front());
+		outer_frame.trampoline_fns.pop_front();
+		trampoline_fn();
+	}
+
+	ASSERT(tls_current_inline_run_frame == &outer_frame);
+	tls_current_inline_run_frame = nullptr;
+}
+
+//wait期间暂停当前的就地执行帧：先执行完其蹦床队列中的后继（所等待者可能正依赖之），wait中（嵌套泵）执行的任务则另起新帧
+class ks_raw_inline_run_frame_suspender final {
+public:
+	ks_raw_inline_run_frame_suspender() {
+		m_suspended_frame = tls_current_inline_run_frame;
+		if (m_suspended_frame != nullptr) {
+			while (!m_suspended_frame->trampoline_fns.empty()) {
+				ks_unique_function<void()> trampoline_fn = std::move(m_suspended_frame->trampoline_fns.front());
+				m_suspended_frame->trampoline_fns.pop_front();
+				trampoline_fn();
+			}
+			tls_current_inline_run_frame = nullptr;
+		}
+	}
+	~ks_raw_inline_run_frame_suspender() {
+		if (m_suspended_frame != nullptr) {
+			ASSERT(tls_current_inline_run_frame == nullptr);
+			tls_current_inline_run_frame = m_suspended_frame;
+		}
+	}
+	_DISABLE_COPY_CONSTRUCTOR(ks_raw_inline_run_frame_suspender);
+
+private:
+	ks_raw_inline_run_frame* m_suspended_frame;
+};
+
+//future对象（连同shared_ptr的控制块）经由线程本地回收池分配（见ks_apartment_tls_block_pool），一次then只需一块
+template <class T, class... ARGs>
+static inline std::shared_ptr<T> __make_pooled_shared(ARGs&&... args) {
+	return std::allocate_shared<T>(ks_apartment_pooled_allocator<T>(), std::forward<ARGs>(args)...);
+}
+
+
+//按调用点（context的from_source_location）统计的任务执行耗时：指数衰减平均值（微秒，新样本权重为1/8）
+//schedule时以之作为预估耗时提示，供shortest_job_first模式的套间排序（见ks_apartment::__get_current_thread_schedule_duration_hint）
+//注：仅当__KS_ASYNC_CONTEXT_FROM_SOURCE_LOCATION_ENABLED开启时context才携带调用点，否则预估耗时恒为0（即未知）
+struct ks_raw_source_location_key {
+	const char* file_name;
+	unsigned int line;
+
+	bool operator==(const ks_raw_source_location_key& r) const { return file_name == r.file_name && line == r.line; }
+};
+
+struct ks_raw_source_location_key_hash {
+	size_t operator()(const ks_raw_source_location_key& key) const { return std::hash<const void*>()(key.file_name) ^ (size_t(key.line) * 0x9E3779B9u); }
+};
+
+//注：为免在schedule和任务完成的热路径上引入全局竞争点，统计表按key分片（各片一把自旋锁，仅在首次遇到某调用点时加锁插入），
+//并于线程本地缓存调用点到统计槽的映射；统计槽为原子量，且节点式容器中的槽地址稳定，故缓存命中后的查询和更新均免锁
+struct ks_raw_source_location_duration_shard {
+	ks_spinlock mutex {};
+	std::unordered_map<ks_raw_source_location_key, std::atomic<int64_t>, ks_raw_source_location_key_hash> slot_map {};
+};
+
+struct ks_raw_source_location_duration_tls_cache_entry {
+	const char* file_name = nullptr;
+	unsigned int line = 0;
+	std::atomic<int64_t>* slot = nullptr;
+};
+
+static constexpr size_t g_source_location_duration_shard_count = 16;
+static constexpr size_t g_source_location_duration_tls_cache_size = 64;
+static ks_raw_source_location_duration_shard g_source_location_duration_shards[g_source_location_duration_shard_count] {};
+static thread_local ks_raw_source_location_duration_tls_cache_entry tls_source_location_duration_cache[g_source_location_duration_tls_cache_size] {};
+
+static std::atomic<int64_t>* __acquire_source_location_duration_slot(const ks_source_location& source_location) {
+	ASSERT(!source_location.is_empty());
+	const ks_raw_source_location_key key{ source_location.file_name(), source_location.line() };
+	const size_t key_hash = ks_raw_source_location_key_hash()(key);
+
+	ks_raw_source_location_duration_tls_cache_entry& cache_entry = tls_source_location_duration_cache[key_hash % g_source_location_duration_tls_cache_size];
+	if (cache_entry.slot != nullptr && cache_entry.file_name == key.file_name && cache_entry.line == key.line)
+		return cache_entry.slot;
+
+	ks_raw_source_location_duration_shard& shard = g_source_location_duration_shards[(key_hash / g_source_location_duration_tls_cache_size) % g_source_location_duration_shard_count];
+	std::atomic<int64_t>* slot;
+	if (true) {
+		std::lock_guard<ks_spinlock> lock(shard.mutex);
+		slot = &shard.slot_map[key]; //新槽值初始化为0，即未知
+	}
+
+	cache_entry.file_name = key.file_name;
+	cache_entry.line = key.line;
+	cache_entry.slot = slot;
+	return slot;
+}
+
+static int64_t __estimate_source_location_duration(ks_apartment* apartment, const ks_source_location& source_location) {
+	if (source_location.is_empty() || apartment == nullptr || !apartment->__is_using_schedule_duration_hint())
+		return 0;
+
+	return __acquire_source_location_duration_slot(source_location)->load(std::memory_order_relaxed);
+}
+
+static void __record_source_location_duration(const ks_source_location& source_location, int64_t duration) {
+	ASSERT(!source_location.is_empty());
+	duration = std::max(duration, int64_t(1)); //至少为1，以区别于未知
+
+	//注：读-改-写非原子，并发完成时可能丢失个别样本，对于预估耗时的指数衰减平均值而言无碍
+	std::atomic<int64_t>* slot = __acquire_source_location_duration_slot(source_location);
+	int64_t estimated_duration = slot->load(std::memory_order_relaxed);
+	estimated_duration = estimated_duration == 0 ? duration : std::max(estimated_duration + (duration - estimated_duration) / 8, int64_t(1));
+	slot->store(estimated_duration, std::memory_order_relaxed);
+}
+
+//注：仅当执行任务的套间（即当前线程套间）使用预估耗时提示时才统计
+class ks_raw_source_location_duration_recorder final {
+public:
+	explicit ks_raw_source_location_duration_recorder(const ks_source_location& source_location) : m_source_location(source_location) {
+		ks_apartment* cur_apartment = ks_apartment::current_thread_apartment();
+		m_recording = !m_source_location.is_empty() && cur_apartment != nullptr && cur_apartment->__is_using_schedule_duration_hint();
+		if (m_recording)
+			m_begin_time = std::chrono::steady_clock::now();
+	}
+
+	~ks_raw_source_location_duration_recorder() {
+		if (m_recording)
+			__record_source_location_duration(m_source_location, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_begin_time).count());
+	}
+
+	_DISABLE_COPY_CONSTRUCTOR(ks_raw_source_location_duration_recorder);
+
+private:
+	const ks_source_location m_source_location;
+	bool m_recording = false;
+	std::chrono::steady_clock::time_point m_begin_time;
+};
+
+
+//批量schedule：在批量期间，schedule被暂存于线程本地，待最外层批量结束时按(套间, 优先级, 调度类别, 截止时刻, 预估耗时)合并为schedule_batch
+//暂存项的id（失败时为0）在flush时经on_scheduled_fn回传
+struct ks_raw_batch_schedule_item {
+	ks_apartment* apartment;
+	int priority;
+	int sched_class;
+	std::chrono::steady_clock::time_point deadline;
+	int64_t duration_hint;
+	ks_unique_function<void()> fn;
+	ks_unique_function<void(uint64_t)> on_scheduled_fn;
+};
+
+struct ks_raw_batch_schedule_data {
+	int depth = 0;
+	std::vector<ks_raw_batch_schedule_item> items;
+};
+
+static thread_local ks_raw_batch_schedule_data tls_current_thread_batch_schedule_data;
+
+static bool __try_defer_schedule_to_batch(ks_apartment* apartment, int priority, ks_unique_function<void()>&& fn, ks_unique_function<void(uint64_t)>&& on_scheduled_fn) {
+	ks_raw_batch_schedule_data* batch_data = &tls_current_thread_batch_schedule_data;
+	if (batch_data->depth == 0)
+		return false;
+
+	batch_data->items.push_back(ks_raw_batch_schedule_item{ apartment, priority, ks_apartment::__get_current_thread_sched_class(), ks_apartment::__get_current_thread_schedule_deadline(), 
+		ks_apartment::__get_current_thread_schedule_duration_hint(), std::move(fn), std::move(on_scheduled_fn) });
+	return true;
+}
+
+static void __flush_batch_schedule_items(std::vector<ks_raw_batch_schedule_item>& items) {
+	std::vector<ks_unique_function<void()>> batch_fns;
+	std::vector<uint64_t> batch_fn_ids;
+	size_t range_begin = 0;
+	while (range_begin < items.size()) {
+		ks_apartment* apartment = items[range_begin].apartment;
+		int priority = items[range_begin].priority;
+		int sched_class = items[range_begin].sched_class;
+		auto deadline = items[range_begin].deadline;
+		int64_t duration_hint = items[range_begin].duration_hint;
+		size_t range_end = range_begin + 1;
+		while (range_end < items.size() && items[range_end].apartment == apartment && items[range_end].priority == priority 
+			&& items[range_end].sched_class == sched_class && items[range_end].deadline == deadline && items[range_end].duration_hint == duration_hint)
+			++range_end;
+
+		batch_fns.clear();
+		batch_fns.reserve(range_end - range_begin);
+		for (size_t i = range_begin; i < range_end; ++i)
+			batch_fns.push_back(std::move(items[i].fn));
+		batch_fn_ids.assign(range_end - range_begin, 0);
+
+		const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(sched_class);
+		const auto pre_deadline = ks_apartment::__exchange_current_thread_schedule_deadline(deadline);
+		const int64_t pre_duration_hint = ks_apartment::__exchange_current_thread_schedule_duration_hint(duration_hint);
+		apartment->schedule_batch(batch_fns.data(), batch_fns.size(), priority, batch_fn_ids.data());
+		ks_apartment::__exchange_current_thread_schedule_duration_hint(pre_duration_hint);
+		ks_apartment::__exchange_current_thread_schedule_deadline(pre_deadline);
+		ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
+		batch_fns.clear();
+
+		for (size_t i = range_begin; i < range_end; ++i) {
+			if (items[i].on_scheduled_fn)
+				items[i].on_scheduled_fn(batch_fn_ids[i - range_begin]);
+		}
+
+		range_begin = range_end;
+	}
+
+	items.clear();
+}
+
 #if __KS_ASYNC_RAW_FUTURE_SPINLOCK_ENABLED
 using ks_raw_future_mutex = ks_spinlock;
 #else
@@ -157,13 +436,14 @@ public:
 	virtual ks_raw_future_ptr noop(ks_apartment* apartment) override final;
 
 public:
+	//注：completed结果在状态字被置为completed之前写好，此后不再改变，故可无锁读取
 	virtual bool is_completed() override final {
-		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
-		return m_completed_result.is_completed();
+		return m_state_word.is_completed();
 	}
 
 	virtual ks_raw_result peek_result() override final {
-		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (!m_state_word.is_completed())
+			return ks_raw_result{};
 		return m_completed_result;
 	}
 
@@ -171,11 +451,17 @@ protected:
 	virtual bool is_cancelable_self() override = 0;
 
 	virtual bool do_check_cancelled() override final {
+		if (m_state_word.is_completed())
+			return false; //同do_check_cancelled_locked
+
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		return this->do_check_cancelled_locked(lock);
 	}
 
 	virtual ks_error do_acquire_cancelled_error(const ks_error& def_error) override final {
+		if (m_state_word.is_completed())
+			return m_completed_result.is_error() ? m_completed_result.to_error() : def_error; //同do_acquire_cancelled_error_locked
+
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		return this->do_acquire_cancelled_error_locked(def_error, lock);
 	}
@@ -233,6 +519,21 @@ protected:
 	}
 
 	virtual bool do_wait() override final {
+		ks_raw_inline_run_frame_suspender inline_run_frame_suspender;
+
+		if (!this->is_completed()) {
+			//优先级继承：等待者以其所在future的优先级（不在future中时视为normal即0）提升上游尚在排队、且优先级更低的任务
+			//注：只有严格更高的优先级才会被传递（见do_inherit_priority_locked），故normal等待者不会把normal任务提升为prior
+			ks_raw_future* cur_future = tls_current_thread_running_future;
+			int waiter_priority = 0;
+			if (cur_future != nullptr && cur_future != this) {
+				const int cur_priority = static_cast<ks_raw_future_baseimp*>(cur_future)->do_peek_living_priority();
+				if (cur_priority < 0x10000)
+					waiter_priority = cur_priority;
+			}
+			this->do_boost_priority(waiter_priority);
+		}
+
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		if (m_completed_result.is_completed())
 			return true;
@@ -245,14 +546,21 @@ protected:
 		if (cur_apartment != nullptr && (cur_apartment->features() & ks_apartment::nested_pump_suppressed_future) == 0) {
 			//若嵌套loop可能会（但常规用法并不会）遭遇相同项，但也不必重复记录，因为一次awaken就触发全部
 			//另外，wait后也不必将cur_apartment从m_waiting_for_me_apartment_1st和m_waiting_for_me_apartment_more中移除，因为do_complete时自会在awaken后全部清除
-			if (std::find(intermediate_data_ptr->m_waiting_for_me_apartments.cbegin(), intermediate_data_ptr->m_waiting_for_me_apartments.cend(), cur_apartment) == intermediate_data_ptr->m_waiting_for_me_apartments.cend()) {
+			if (!intermediate_data_ptr->m_waiting_for_me_apartments.contains(cur_apartment)) {
 				intermediate_data_ptr->m_waiting_for_me_apartments.push_back(cur_apartment);
 			}
 
+			//定向等待：优先就地执行依赖路径上尚在当前套间排队的任务，无可执行者时才回退为泵任意任务（每轮泵之前都会再次尝试）
 			lock.unlock();
 			bool was_satisfied = cur_apartment->__run_nested_pump_loop_for_extern_waiting(
 				this,
-				[this, this_shared = this->shared_from_this()]() -> bool { return ((ks_raw_result volatile&)m_completed_result).is_completed(); });
+				[this, this_shared = this->shared_from_this(), cur_apartment]() -> bool {
+					while (!m_state_word.is_completed()) {
+						if (!this->do_help_run_inline(cur_apartment))
+							return false;
+					}
+					return true;
+				});
 			ASSERT(was_satisfied ? m_completed_result.is_completed() : true);
 
 			lock.lock();
@@ -271,7 +579,10 @@ protected:
 			ASSERT(lock.owns_lock());
 			while (!m_completed_result.is_completed()) {
 				lock.unlock();
-				intermediate_data_ptr->m_completion_waitable_atomic_flag.__wait(false, std::memory_order_acquire); //注：已使用atomic取代cv
+				if (true) {
+					ks_blocking_region blocking_region; //真正阻塞当前线程，支持阻塞补偿的套间（如default_mta）可临时增派线程
+					intermediate_data_ptr->m_completion_waitable_atomic_flag.__wait(false, std::memory_order_acquire); //注：已使用atomic取代cv
+				}
 				lock.lock();
 			}
 
@@ -280,15 +591,19 @@ protected:
 	}
 
 protected:
+	//注：添加后继无需加锁：未completed时压入状态字的后继栈，已completed时则自行feed（completed结果已确定，可无锁读取）
 	virtual void do_add_next(const ks_raw_future_ptr& next_future) override final {
-		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
-		return this->do_add_next_locked(next_future, lock, false);
+		if (m_state_word.try_push_next(next_future))
+			return;
+		this->do_feed_next_after_completed(next_future);
 	}
 
 	virtual void do_add_next_multi(const std::vector<ks_raw_future_ptr>& next_futures) override final {
-		if (!next_futures.empty()) {
-			ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
-			return this->do_add_next_multi_locked(next_futures, lock, false);
+		for (auto next_future_it = next_futures.cbegin(); next_future_it != next_futures.cend(); ++next_future_it) {
+			if (!m_state_word.try_push_next(*next_future_it)) {
+				this->do_feed_next_multi_after_completed(std::vector<ks_raw_future_ptr>(next_future_it, next_futures.cend()));
+				return;
+			}
 		}
 	}
 
@@ -297,71 +612,52 @@ protected:
 		return this->do_complete_locked(result, prefer_apartment, from_internal, from_destructor, lock, false);
 	}
 
-	virtual void do_add_next_locked(const ks_raw_future_ptr& next_future, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
-		ASSERT(lock.owns_lock() && !must_keep_locked);
+public:
+	//注：waiter与后继同样压入状态字的后继栈（无锁），完成时在解锁后直接回调
+	virtual bool __try_add_waiter(ks_raw_future_waiter* waiter) override final {
+		ASSERT(waiter != nullptr);
+		return m_state_word.try_push_waiter(waiter);
+	}
 
-		if (!m_completed_result.is_completed()) {
-			auto intermediate_data_ptr = __get_intermediate_data_ptr(lock);
-			ASSERT(intermediate_data_ptr != nullptr);
+protected:
+	void do_feed_next_after_completed(const ks_raw_future_ptr& next_future) {
+		ASSERT(m_state_word.is_completed());
 
-			ASSERT(intermediate_data_ptr->m_next_future_1st != next_future
-				&& std::find(intermediate_data_ptr->m_next_future_more.cbegin(), intermediate_data_ptr->m_next_future_more.cend(), next_future) == intermediate_data_ptr->m_next_future_more.cend());
-			if (intermediate_data_ptr->m_next_future_1st == nullptr)
-				intermediate_data_ptr->m_next_future_1st = next_future;
-			else
-				intermediate_data_ptr->m_next_future_more.push_back(next_future);
-		}
-		else {
-			ks_raw_result const my_completed_result = m_completed_result;
-			ks_apartment* const prefer_completed_apartment = m_completed_apartment;
-			uint64_t act_schedule_id = prefer_completed_apartment->schedule(
-				[this, this_shared = this->shared_from_this(), next_future, my_completed_result, prefer_completed_apartment]() {
-				next_future->on_feeded_by_prev(my_completed_result, this, prefer_completed_apartment);
-			}, 0);
+		ks_raw_result const my_completed_result = m_completed_result;
+		ks_apartment* const prefer_completed_apartment = m_completed_apartment;
+		ks_unique_function<void()> feed_fn = [this, this_shared = this->shared_from_this(), next_future, my_completed_result, prefer_completed_apartment]() {
+			next_future->on_feeded_by_prev(my_completed_result, this, prefer_completed_apartment);
+		};
 
-			if (act_schedule_id == 0) {
-				lock.unlock();
+		//批量期间（如aggr-future连接多个已完成的前驱时）：暂存而不立即schedule
+		bool deferred = __try_defer_schedule_to_batch(prefer_completed_apartment, 0, std::move(feed_fn), 
+			[next_future, prefer_completed_apartment](uint64_t schedule_id) -> void {
+			if (schedule_id == 0)
 				next_future->do_complete(ks_error::terminated_error(), prefer_completed_apartment, false, false);
-				if (must_keep_locked)
-					lock.lock();
-			}
-		}
+		});
+		if (deferred)
+			return;
+
+		uint64_t act_schedule_id = prefer_completed_apartment->schedule(std::move(feed_fn), 0);
+		if (act_schedule_id == 0)
+			next_future->do_complete(ks_error::terminated_error(), prefer_completed_apartment, false, false);
 	}
 
-	__REAL_IMP void do_add_next_multi_locked(const std::vector<ks_raw_future_ptr>& next_futures, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
-		ASSERT(lock.owns_lock() && !must_keep_locked);
+	void do_feed_next_multi_after_completed(std::vector<ks_raw_future_ptr>&& next_futures) {
+		ASSERT(m_state_word.is_completed());
+		ASSERT(!next_futures.empty());
 
-		if (!next_futures.empty()) {
-			if (!m_completed_result.is_completed()) {
-				auto intermediate_data_ptr = __get_intermediate_data_ptr(lock);
-				ASSERT(intermediate_data_ptr != nullptr);
-
-				auto next_future_it = next_futures.cbegin();
-				if (intermediate_data_ptr->m_next_future_1st == nullptr)
-					intermediate_data_ptr->m_next_future_1st = *next_future_it++;
-				if (next_future_it != next_futures.cend()) {
-					intermediate_data_ptr->m_next_future_more.insert(
-						intermediate_data_ptr->m_next_future_more.end(),
-						next_future_it, next_futures.cend());
-				}
-			}
-			else {
-				ks_raw_result const my_completed_result = m_completed_result;
-				ks_apartment* const prefer_completed_apartment = m_completed_apartment;
-				uint64_t act_schedule_id = prefer_completed_apartment->schedule(
-					[this, this_shared = this->shared_from_this(), next_futures, my_completed_result, prefer_completed_apartment]() {
-					for (auto& next_future : next_futures)
-						next_future->on_feeded_by_prev(my_completed_result, this, prefer_completed_apartment);
-				}, 0);
-
-				if (act_schedule_id == 0) {
-					lock.unlock();
-					for (auto& next_future : next_futures)
-						next_future->do_complete(ks_error::terminated_error(), prefer_completed_apartment, false, false);
-					if (must_keep_locked)
-						lock.lock();
-				}
-			}
+		ks_raw_result const my_completed_result = m_completed_result;
+		ks_apartment* const prefer_completed_apartment = m_completed_apartment;
+		uint64_t act_schedule_id = prefer_completed_apartment->schedule(
+			[this, this_shared = this->shared_from_this(), next_futures, my_completed_result, prefer_completed_apartment]() {
+			for (auto& next_future : next_futures)
+				next_future->on_feeded_by_prev(my_completed_result, this, prefer_completed_apartment);
+		}, 0);
+
+		if (act_schedule_id == 0) {
+			for (auto& next_future : next_futures)
+				next_future->do_complete(ks_error::terminated_error(), prefer_completed_apartment, false, false);
 		}
 	}
 
@@ -379,18 +675,28 @@ protected:
 		ks_apartment* const my_completed_apartment = do_determine_completed_apartment(intermediate_data_ptr != nullptr ? intermediate_data_ptr->m_spec_apartment : nullptr, hint_apartment);
 		m_completed_result = my_completed_result;
 		m_completed_apartment = my_completed_apartment;
+
+		//置状态字为completed（发布completed结果），同时取走全部后继
+		ks_raw_inline_vector<ks_raw_future_ptr, __NEXT_FUTURE_INLINE_COUNT> t_next_futures{};
+		ks_raw_inline_vector<ks_raw_future_waiter*, __WAITER_INLINE_COUNT> t_waiters{};
+		m_state_word.complete_and_take_nexts([&t_next_futures, &t_waiters](ks_raw_future_ptr&& next_future, ks_raw_future_waiter* waiter) {
+			if (waiter != nullptr)
+				t_waiters.push_back(waiter);
+			else
+				t_next_futures.push_back(std::move(next_future));
+		});
+
 		if (__get_mode() == ks_raw_future_mode::DX) {
 			//dx-future是在init时立即do_complete的，状态初始化为completed后就没什么其他要做的事儿了
 			ASSERT(intermediate_data_ptr == nullptr);
+			ASSERT(t_next_futures.empty() && t_waiters.empty());
 			return;
 		}
 
 		//除了dx-future以外，其他类型future还需要在状态转为completed时feed其所有下游
 		ASSERT(intermediate_data_ptr != nullptr);
 
-		ks_raw_future_ptr t_next_future_1st = nullptr;
-		std::vector<ks_raw_future_ptr> t_next_future_more{};
-		std::vector<ks_apartment*> t_waiting_for_me_apartments{};
+		ks_raw_inline_vector<ks_apartment*, __WAITING_APARTMENT_INLINE_COUNT> t_waiting_for_me_apartments{};
 		ks_async_context t_living_context = {};
 		if (intermediate_data_ptr != nullptr) {
 			if (intermediate_data_ptr->m_timeout_schedule_id != 0) {
@@ -405,17 +711,9 @@ protected:
 			intermediate_data_ptr->m_completion_waitable_atomic_flag.test_and_set(std::memory_order_release);
 			intermediate_data_ptr->m_completion_waitable_atomic_flag.__notify_all();  //notify all waiting threads
 
-			//take next-futures
-			t_next_future_1st = std::move(intermediate_data_ptr->m_next_future_1st);
-			t_next_future_more.swap(intermediate_data_ptr->m_next_future_more);
-			intermediate_data_ptr->m_next_future_1st = nullptr;
-			intermediate_data_ptr->m_next_future_more.clear();
-			intermediate_data_ptr->m_next_future_more.shrink_to_fit();
-
 			//take waiting-apartments
-			t_waiting_for_me_apartments.swap(intermediate_data_ptr->m_waiting_for_me_apartments);
+			t_waiting_for_me_apartments = std::move(intermediate_data_ptr->m_waiting_for_me_apartments);
 			intermediate_data_ptr->m_waiting_for_me_apartments.clear();
-			intermediate_data_ptr->m_waiting_for_me_apartments.shrink_to_fit();
 
 			//完毕，自此刻起，本future进入completed稳态，可清除intermediate-data了
 			t_living_context = std::move(intermediate_data_ptr->m_living_context);
@@ -434,36 +732,43 @@ protected:
 			t_living_context = {};
 
 			//feed next-futures
-			if ((t_next_future_1st != nullptr || !t_next_future_more.empty()) && !from_destructor) {
+			if (!t_next_futures.empty() && !from_destructor) {
 				if (from_internal) {
-					if (t_next_future_1st != nullptr)
-						t_next_future_1st->on_feeded_by_prev(my_completed_result, this, my_completed_apartment);
-					for (auto& next_future : t_next_future_more)
+					t_next_futures.for_each([this, &my_completed_result, my_completed_apartment](const ks_raw_future_ptr& next_future) {
 						next_future->on_feeded_by_prev(my_completed_result, this, my_completed_apartment);
+					});
 				}
 				else {
 					uint64_t act_schedule_id = my_completed_apartment->schedule(
 						[this, this_shared = this->shared_from_this(),
-						t_next_future_1st, t_next_future_more,  //因为失败时还需要处理，所以不可以右值引用传递
+						t_next_futures,  //因为失败时还需要处理，所以不可以右值引用传递
 						my_completed_result, my_completed_apartment]() {
-						if (t_next_future_1st != nullptr)
-							t_next_future_1st->on_feeded_by_prev(my_completed_result, this, my_completed_apartment);
-						for (auto& next_future : t_next_future_more)
+						t_next_futures.for_each([this, &my_completed_result, my_completed_apartment](const ks_raw_future_ptr& next_future) {
 							next_future->on_feeded_by_prev(my_completed_result, this, my_completed_apartment);
+						});
 					}, 0);
 
 					if (act_schedule_id == 0) {
-						if (t_next_future_1st != nullptr)
-							t_next_future_1st->on_feeded_by_prev(ks_error::terminated_error(), this, my_completed_apartment);
-						for (auto& next_future : t_next_future_more)
+						t_next_futures.for_each([this, my_completed_apartment](const ks_raw_future_ptr& next_future) {
 							next_future->on_feeded_by_prev(ks_error::terminated_error(), this, my_completed_apartment);
+						});
 					}
 				}
 			}
 
 			//awaken waiting-apartments
-			for (ks_apartment* waiting_apartment : t_waiting_for_me_apartments)
+			t_waiting_for_me_apartments.for_each([this](ks_apartment* waiting_apartment) {
 				waiting_apartment->__awaken_nested_pump_loop_for_extern_waiting_once(this);
+			});
+
+			//notify waiters
+			//注：waiter被回调后可能随即释放其持有的本future（例如协程被恢复并结束），故须保活至本流程结束
+			if (!t_waiters.empty()) {
+				ks_raw_future_ptr this_shared = this->shared_from_this();
+				t_waiters.for_each([&my_completed_result, my_completed_apartment](ks_raw_future_waiter* waiter) {
+					waiter->on_future_completed(my_completed_result, my_completed_apartment);
+				});
+			}
 
 			if (must_keep_locked)
 				lock.lock();
@@ -506,6 +811,72 @@ protected:
 		}
 
 		//schedule timeout
+		this->do_schedule_timeout_fn_locked(intermediate_data_ptr, timeout_remain_ms, error, backtrack, lock);
+	}
+
+	//注：context指定的超时，在future创建时（任务被投递之前）即生效，故可作为任务的截止时刻
+	void do_apply_context_timeout_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, ks_raw_future_unique_lock& lock) {
+		ASSERT(intermediate_data_ptr != nullptr);
+		const int64_t timeout = intermediate_data_ptr->m_living_context.__get_timeout();
+		if (timeout <= 0)
+			return;
+
+		ASSERT(intermediate_data_ptr->m_timeout_time == std::chrono::steady_clock::time_point{});
+		intermediate_data_ptr->m_timeout_time = intermediate_data_ptr->m_create_time + std::chrono::milliseconds(timeout);
+		const int64_t timeout_remain_ms = std::chrono::duration_cast<std::chrono::milliseconds>(intermediate_data_ptr->m_timeout_time - std::chrono::steady_clock::now()).count();
+		this->do_schedule_timeout_fn_locked(intermediate_data_ptr, std::max(timeout_remain_ms, int64_t(0)), ks_error::timeout_error(), false, lock);
+	}
+
+	//schedule所采用的优先级：context的优先级，或由优先级继承而提升后的优先级
+	int do_get_schedule_priority_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, ks_raw_future_unique_lock& lock) {
+		ASSERT(intermediate_data_ptr != nullptr);
+		return std::max(intermediate_data_ptr->m_living_context.__get_priority(), intermediate_data_ptr->m_boosted_priority);
+	}
+
+	//同套间后继的就地执行：将要schedule到的套间恰为当前线程所在的套间时，直接就地执行，省掉一次投递（加锁入队、唤醒及线程切换）
+	//注：idle任务仍须等到空闲时执行，指定了调度类别者仍须经由套间按权重调度，>=0x10000者则另有其就地执行的逻辑
+	bool do_check_could_run_inline_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, ks_apartment* prefer_apartment, int priority, ks_raw_future_unique_lock& lock) {
+		ASSERT(intermediate_data_ptr != nullptr);
+		if (priority < 0 || priority >= 0x10000)
+			return false;
+		if (intermediate_data_ptr->m_spec_apartment != nullptr && intermediate_data_ptr->m_spec_apartment != prefer_apartment)
+			return false;
+		if (intermediate_data_ptr->m_living_context.__get_sched_class() != 0)
+			return false;
+		return prefer_apartment == ks_apartment::current_thread_apartment() && __could_run_inline_on_current_thread();
+	}
+
+	//优先级继承：记下传递来的优先级，若自身任务已schedule而尚未开始执行，则在套间中提升之；
+	//返回false表示priority并不更高，无需再向上游传递。
+	//注：继承的优先级不超过0xFFFF，以免改变“超高优先级时就地执行”的行为
+	bool do_inherit_priority_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, int priority, ks_raw_future_unique_lock& lock) {
+		ASSERT(intermediate_data_ptr != nullptr);
+		priority = std::min(priority, 0xFFFF);
+		if (priority <= this->do_get_schedule_priority_locked(intermediate_data_ptr, lock))
+			return false;
+
+		intermediate_data_ptr->m_boosted_priority = priority;
+		if (intermediate_data_ptr->m_scheduled_fn_id != 0) {
+			ASSERT(intermediate_data_ptr->m_scheduled_apartment != nullptr);
+			intermediate_data_ptr->m_scheduled_apartment->try_boost_priority(intermediate_data_ptr->m_scheduled_fn_id, priority);
+		}
+		return true;
+	}
+
+	//定向等待：自身的任务若正在apartment中排队（已schedule而尚未开始执行），返回其id，否则返回0
+	uint64_t do_peek_scheduled_fn_id_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, ks_apartment* apartment, ks_raw_future_unique_lock& lock) {
+		ASSERT(intermediate_data_ptr != nullptr);
+		return intermediate_data_ptr->m_scheduled_apartment == apartment ? intermediate_data_ptr->m_scheduled_fn_id : 0;
+	}
+
+	int do_peek_living_priority() {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		auto intermediate_data_ptr = __get_intermediate_data_ptr(lock);
+		return intermediate_data_ptr != nullptr ? intermediate_data_ptr->m_living_context.__get_priority() : 0;
+	}
+
+	void do_schedule_timeout_fn_locked(__INTERMEDIATE_DATA* intermediate_data_ptr, int64_t timeout_remain_ms, const ks_error& error, bool backtrack, ks_raw_future_unique_lock& lock) {
+		const std::chrono::steady_clock::time_point t_timeout_time = intermediate_data_ptr->m_timeout_time;
 		intermediate_data_ptr->m_timeout_apartment = do_determine_timeout_apartment(intermediate_data_ptr->m_spec_apartment);
 		intermediate_data_ptr->m_timeout_schedule_id = intermediate_data_ptr->m_timeout_apartment->schedule_delayed(
 			[this, this_shared = this->shared_from_this(), intermediate_data_ptr, t_timeout_time, error, backtrack]() -> void {
@@ -566,9 +937,14 @@ protected:
 	}
 
 protected:
-	ks_raw_result m_completed_result{};
+	ks_raw_future_state_word m_state_word{};  //completed与否及后继栈，见ks_raw_future_state_word
+	ks_raw_result m_completed_result{};       //在状态字被置为completed之前写好，此后不变
 	ks_apartment* m_completed_apartment = nullptr;
 
+	static constexpr size_t __NEXT_FUTURE_INLINE_COUNT = 2;
+	static constexpr size_t __WAITING_APARTMENT_INLINE_COUNT = 2;
+	static constexpr size_t __WAITER_INLINE_COUNT = 1;
+
 	struct __INTERMEDIATE_DATA {
 		ks_apartment* m_spec_apartment = nullptr;                  //const-like
 		ks_async_context m_living_context = {};                    //const-like
@@ -578,10 +954,11 @@ protected:
 		ks_apartment* m_timeout_apartment = nullptr;
 		uint64_t m_timeout_schedule_id = 0;
 
-		ks_raw_future_ptr m_next_future_1st = nullptr;
-		std::vector<ks_raw_future_ptr> m_next_future_more{};
+		int m_boosted_priority = INT_MIN;               //优先级继承：由后继或等待者传递来的优先级（只升不降）
+		ks_apartment* m_scheduled_apartment = nullptr;  //已schedule而尚未开始执行的任务，用于优先级继承时在套间中提升之，及定向等待时就地执行之
+		uint64_t m_scheduled_fn_id = 0;
 
-		std::vector<ks_apartment*> m_waiting_for_me_apartments{};
+		ks_raw_inline_vector<ks_apartment*, __WAITING_APARTMENT_INLINE_COUNT> m_waiting_for_me_apartments{}; //前几个等待者就地存放
 
 		ks_error m_cancelled_error{}; //volatile-like
 
@@ -637,6 +1014,18 @@ protected:
 		_NOOP();
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		//dx-future总是已完成的
+		ASSERT(this->is_completed());
+		_NOOP();
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		//dx-future总是已完成的
+		ASSERT(this->is_completed());
+		return false;
+	}
+
 private:
 	virtual ks_raw_future_mode __get_mode() override { return ks_raw_future_mode::DX; }
 	virtual bool __is_head_future() override { return true; }
@@ -647,6 +1036,9 @@ private:
 	virtual __INTERMEDIATE_DATA* __get_intermediate_data_ptr(ks_raw_future_unique_lock& lock) override { return nullptr; }
 	virtual void __clear_intermediate_data_ptr(__INTERMEDIATE_DATA* intermediate_data_ptr, bool from_destructor, ks_raw_future_unique_lock& lock) override { ASSERT(false); }
 };
+#ifndef _DEBUG
+static_assert(sizeof(ks_raw_dx_future) <= 112, "the size of ks_raw_dx_future is over budget");
+#endif
 
 
 class ks_raw_promise_future final : public ks_raw_future_baseimp {
@@ -681,7 +1073,7 @@ private:
 public:
 	ks_raw_promise_ptr create_promise_representative() {
 		return std::static_pointer_cast<ks_raw_promise>(
-			std::make_shared<ks_raw_promise_representative>(
+			__make_pooled_shared<ks_raw_promise_representative>(
 				std::static_pointer_cast<ks_raw_promise_future>(this->shared_from_this())));
 	}
 
@@ -701,6 +1093,16 @@ protected:
 		this->do_complete(error, nullptr, false, false);
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		//promise-future没有排队中的任务
+		_NOOP();
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		//promise-future没有排队中的任务
+		return false;
+	}
+
 private:
 	virtual ks_raw_future_mode __get_mode() override { return ks_raw_future_mode::PROMISE; }
 	virtual bool __is_head_future() override { return true; }
@@ -743,7 +1145,7 @@ private:
 				//若最终未被settle过，则自动reject，以确保future最终completed
 				ks_raw_future_unique_lock lock(m_promise_future->__get_mutex(), m_promise_future->__is_using_pseudo_mutex());
 				ASSERT((m_promise_future->m_completed_result.is_completed())
-					|| (m_promise_future->__get_intermediate_data_ex_ptr(lock)->m_next_future_1st == nullptr && m_promise_future->__get_intermediate_data_ex_ptr(lock)->m_next_future_more.empty()));
+					|| !m_promise_future->m_state_word.has_next());
 			}
 		#endif
 		}
@@ -784,6 +1186,7 @@ public:
 	void init(ks_apartment* spec_apartment, std::function<ks_raw_result()>&& task_fn, const ks_async_context& living_context, int64_t delay) {
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		do_init_base_locked(spec_apartment, living_context, &m_intermediate_data_ex, lock);
+		do_apply_context_timeout_locked(&m_intermediate_data_ex, lock);
 		do_submit_locked(std::move(task_fn), delay, &m_intermediate_data_ex, lock, false);
 	}
 
@@ -800,12 +1203,13 @@ private:
 
 		ks_apartment* prefer_apartment = this->do_determine_prefer_apartment(intermediate_data_ex_ptr->m_spec_apartment);
 
-		std::function<void()> pending_schedule_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
+		ks_unique_function<void()> pending_schedule_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
 			ks_raw_future_unique_lock lock2(__get_mutex(), __is_using_pseudo_mutex());
 			if (m_completed_result.is_completed())
 				return; //pre-check cancelled
 
 			intermediate_data_ex_ptr->m_pending_schedule_id = 0; //这个变量第一时间被清0
+			intermediate_data_ex_ptr->m_scheduled_fn_id = 0;
 
 			ASSERT(!intermediate_data_ex_ptr->m_pending_touched_flag);
 			intermediate_data_ex_ptr->m_pending_touched_flag = true;
@@ -824,10 +1228,13 @@ private:
 				std::function<ks_raw_result()> t_task_fn = std::move(intermediate_data_ex_ptr->m_task_fn);
 				lock2.unlock();
 				ks_defer defer_relock2([&lock2]() { lock2.lock(); });
-				if (cancelled_error.has_code())
+				if (cancelled_error.has_code()) {
 					result = cancelled_error;
-				else
+				}
+				else {
+					ks_raw_source_location_duration_recorder duration_recorder(context.__get_from_source_location());
 					result = t_task_fn().require_completed_or_error();
+				}
 				t_task_fn = {};
 				defer_relock2.apply();
 			}
@@ -838,7 +1245,7 @@ private:
 			this->do_complete_locked(result, prefer_apartment, true, false, lock2, false);
 		};
 
-		int priority = intermediate_data_ex_ptr->m_living_context.__get_priority();
+		int priority = this->do_get_schedule_priority_locked(intermediate_data_ex_ptr, lock);
 		bool could_run_locally = (m_task_mode == ks_raw_future_mode::TASK) && (priority >= 0x10000) && (intermediate_data_ex_ptr->m_spec_apartment == nullptr || intermediate_data_ex_ptr->m_spec_apartment == prefer_apartment);
 		if (could_run_locally) {
 			lock.unlock();
@@ -848,7 +1255,30 @@ private:
 				lock.lock();
 		}
 		else {
+			ks_raw_schedule_attrs_rtstt schedule_attrs_rtstt;
+			schedule_attrs_rtstt.apply(intermediate_data_ex_ptr->m_living_context.__get_sched_class(), intermediate_data_ex_ptr->m_timeout_time, 
+				__estimate_source_location_duration(prefer_apartment, intermediate_data_ex_ptr->m_living_context.__get_from_source_location()));
+
 			intermediate_data_ex_ptr->m_pending_aparrment = prefer_apartment;
+			if (m_task_mode == ks_raw_future_mode::TASK) {
+				//批量期间：暂存而不立即schedule，待flush时再回填m_pending_schedule_id（若届时task尚未开始执行）
+				bool deferred = __try_defer_schedule_to_batch(prefer_apartment, priority, std::move(pending_schedule_fn), 
+					[this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr](uint64_t schedule_id) -> void {
+					ks_raw_future_unique_lock lock2(__get_mutex(), __is_using_pseudo_mutex());
+					if (schedule_id == 0) {
+						//schedule失败，则立即将this标记为错误即可
+						return this->do_complete_locked(ks_error::terminated_error(), nullptr, false, false, lock2, false);
+					}
+					if (!m_completed_result.is_completed() && !intermediate_data_ex_ptr->m_pending_touched_flag) {
+						intermediate_data_ex_ptr->m_pending_schedule_id = schedule_id;
+						intermediate_data_ex_ptr->m_scheduled_apartment = intermediate_data_ex_ptr->m_pending_aparrment;
+						intermediate_data_ex_ptr->m_scheduled_fn_id = schedule_id;
+					}
+				});
+				if (deferred)
+					return;
+			}
+
 			intermediate_data_ex_ptr->m_pending_schedule_id = (m_task_mode == ks_raw_future_mode::TASK)
 				? intermediate_data_ex_ptr->m_pending_aparrment->schedule(std::move(pending_schedule_fn), priority)
 				: intermediate_data_ex_ptr->m_pending_aparrment->schedule_delayed(std::move(pending_schedule_fn), priority, intermediate_data_ex_ptr->m_delay);
@@ -856,6 +1286,9 @@ private:
 				//schedule失败，则立即将this标记为错误即可
 				return this->do_complete_locked(ks_error::terminated_error(), nullptr, false, false, lock, false);
 			}
+
+			intermediate_data_ex_ptr->m_scheduled_apartment = intermediate_data_ex_ptr->m_pending_aparrment;
+			intermediate_data_ex_ptr->m_scheduled_fn_id = intermediate_data_ex_ptr->m_pending_schedule_id;
 		}
 	}
 
@@ -887,6 +1320,32 @@ protected:
 		}
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//task-future为链头，提升其自身尚在排队的任务即可
+		this->do_inherit_priority_locked(intermediate_data_ex_ptr, priority, lock);
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return false;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//task-future为链头，只看其自身的任务是否在apartment中排队
+		const uint64_t fn_id = this->do_peek_scheduled_fn_id_locked(intermediate_data_ex_ptr, apartment, lock);
+		lock.unlock();
+		return fn_id != 0 && apartment->__try_run_scheduled_fn_inline(fn_id);
+	}
+
 private:
 	const ks_raw_future_mode m_task_mode;  //const-like
 	virtual ks_raw_future_mode __get_mode() override { return m_task_mode; }
@@ -947,15 +1406,16 @@ public:
 	}
 	_DISABLE_COPY_CONSTRUCTOR(ks_raw_pipe_future);
 
-	void init(ks_apartment* spec_apartment, std::function<ks_raw_result(const ks_raw_result&)>&& fn_ex, const ks_async_context& living_context, const ks_raw_future_ptr& prev_future) {
+	void init(ks_apartment* spec_apartment, ks_unique_function<ks_raw_result(const ks_raw_result&)>&& fn_ex, const ks_async_context& living_context, const ks_raw_future_ptr& prev_future) {
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		do_init_base_locked(spec_apartment, living_context, &m_intermediate_data_ex, lock);
+		do_apply_context_timeout_locked(&m_intermediate_data_ex, lock);
 		do_connect_locked(std::move(fn_ex), prev_future, &m_intermediate_data_ex, lock, false);
 	}
 
 private:
 	struct __INTERMEDIATE_DATA_EX;
-	void do_connect_locked(std::function<ks_raw_result(const ks_raw_result&)>&& fn_ex, const ks_raw_future_ptr& prev_future, __INTERMEDIATE_DATA_EX* intermediate_data_ex_ptr, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
+	void do_connect_locked(ks_unique_function<ks_raw_result(const ks_raw_result&)>&& fn_ex, const ks_raw_future_ptr& prev_future, __INTERMEDIATE_DATA_EX* intermediate_data_ex_ptr, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
 		ASSERT(intermediate_data_ex_ptr != nullptr);
 		ASSERT(intermediate_data_ex_ptr == __get_intermediate_data_ex_ptr(lock));
 		ASSERT(lock.owns_lock() && !must_keep_locked);
@@ -964,10 +1424,13 @@ private:
 
 		intermediate_data_ex_ptr->m_fn_ex = std::move(fn_ex);
 		intermediate_data_ex_ptr->m_prev_future_weak = prev_future;
+		const int priority = intermediate_data_ex_ptr->m_living_context.__get_priority();
 
 		lock.unlock();
 
 		prev_future->do_add_next(this->shared_from_this());
+		if (priority > 0 && priority < 0x10000)
+			prev_future->do_boost_priority(priority); //优先级继承：高优先级的后继提升上游尚在排队的任务（>=0x10000仅表示就地执行，不参与）
 
 		if (must_keep_locked)
 			lock.lock();
@@ -1012,15 +1475,20 @@ protected:
 			return;
 		}
 
-		int priority = intermediate_data_ex_ptr->m_living_context.__get_priority();
+		int priority = this->do_get_schedule_priority_locked(intermediate_data_ex_ptr, lock);
 		ks_apartment* prefer_apartment = do_determine_prefer_apartment_2(intermediate_data_ex_ptr->m_spec_apartment, prev_advice_apartment);
 		bool could_run_locally = (priority >= 0x10000) && (intermediate_data_ex_ptr->m_spec_apartment == nullptr || intermediate_data_ex_ptr->m_spec_apartment == prefer_apartment);
 
-		std::function<void()> run_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prev_result, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
+		//注：prev_result暂存于intermediate-data中而不被run_fn捕获，使run_fn足够小，可就地存放于ks_unique_function中而免于堆分配
+		intermediate_data_ex_ptr->m_prev_result = prev_result;
+
+		ks_unique_function<void()> run_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
 			ks_raw_future_unique_lock lock2(__get_mutex(), __is_using_pseudo_mutex());
 			if (m_completed_result.is_completed())
 				return; //pre-check cancelled
 
+			intermediate_data_ex_ptr->m_scheduled_fn_id = 0;
+
 			ks_raw_running_future_rtstt running_future_rtstt;
 			ks_raw_living_context_rtstt living_context_rtstt;
 			running_future_rtstt.apply(this, &tls_current_thread_running_future);
@@ -1028,14 +1496,18 @@ protected:
 
 			ks_raw_result result;
 			try {
-				ks_raw_result prev_result_alt = prev_result;
-				if (prev_result.is_value() && this->do_check_cancelled_locked(lock2))
+				ks_raw_result prev_result_alt = std::move(intermediate_data_ex_ptr->m_prev_result);
+				intermediate_data_ex_ptr->m_prev_result = {};
+				if (prev_result_alt.is_value() && this->do_check_cancelled_locked(lock2))
 					prev_result_alt = this->do_acquire_cancelled_error_locked(ks_error::unexpected_error(), lock2);
 
-				std::function<ks_raw_result(const ks_raw_result&)> fn_ex = std::move(intermediate_data_ex_ptr->m_fn_ex);
+				ks_unique_function<ks_raw_result(const ks_raw_result&)> fn_ex = std::move(intermediate_data_ex_ptr->m_fn_ex);
 				lock2.unlock();
 				ks_defer defer_relock2([&lock2]() { lock2.lock(); });
-				result = fn_ex(prev_result_alt).require_completed_or_error();
+				if (true) {
+					ks_raw_source_location_duration_recorder duration_recorder(context.__get_from_source_location());
+					result = fn_ex(prev_result_alt).require_completed_or_error();
+				}
 				fn_ex = {};
 				defer_relock2.apply();
 			}
@@ -1053,11 +1525,23 @@ protected:
 			return;
 		}
 
+		if (this->do_check_could_run_inline_locked(intermediate_data_ex_ptr, prefer_apartment, priority, lock)) {
+			lock.unlock();
+			__run_inline_on_current_thread(std::move(run_fn));
+			return;
+		}
+
+		ks_raw_schedule_attrs_rtstt schedule_attrs_rtstt;
+		schedule_attrs_rtstt.apply(intermediate_data_ex_ptr->m_living_context.__get_sched_class(), intermediate_data_ex_ptr->m_timeout_time, 
+			__estimate_source_location_duration(prefer_apartment, intermediate_data_ex_ptr->m_living_context.__get_from_source_location()));
 		uint64_t act_schedule_id = prefer_apartment->schedule(std::move(run_fn), priority);
 		if (act_schedule_id == 0) {
 			//schedule失败，则立即将this标记为错误即可
 			return this->do_complete_locked(ks_error::terminated_error(), prefer_apartment, true, false, lock, false);
 		}
+
+		intermediate_data_ex_ptr->m_scheduled_apartment = prefer_apartment;
+		intermediate_data_ex_ptr->m_scheduled_fn_id = act_schedule_id;
 	}
 
 	virtual bool is_cancelable_self() override {
@@ -1099,6 +1583,41 @@ protected:
 		}
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//记下（待被prev喂入而schedule时采用）或提升已在排队的任务，且尚未被prev喂入时继续向上游传递
+		if (!this->do_inherit_priority_locked(intermediate_data_ex_ptr, priority, lock))
+			return;
+
+		ks_raw_future_ptr not_completed_prev_future = !intermediate_data_ex_ptr->m_prev_future_completed_flag ? intermediate_data_ex_ptr->m_prev_future_weak.lock() : nullptr;
+		lock.unlock();
+		if (not_completed_prev_future != nullptr)
+			not_completed_prev_future->do_boost_priority(priority);
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return false;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//自身的任务已在apartment中排队则执行之，否则（尚未被prev喂入）沿prev向上游查找
+		const uint64_t fn_id = this->do_peek_scheduled_fn_id_locked(intermediate_data_ex_ptr, apartment, lock);
+		ks_raw_future_ptr not_completed_prev_future = fn_id == 0 && !intermediate_data_ex_ptr->m_prev_future_completed_flag ? intermediate_data_ex_ptr->m_prev_future_weak.lock() : nullptr;
+		lock.unlock();
+		if (fn_id != 0)
+			return apartment->__try_run_scheduled_fn_inline(fn_id);
+		return not_completed_prev_future != nullptr && not_completed_prev_future->do_help_run_inline(apartment);
+	}
+
 private:
 	bool __my_cancelable_flag() const {
 		//pipe-future部分是非cancelable的（on_xxxx和forward）
@@ -1128,8 +1647,9 @@ private:
 #endif
 
 	struct __INTERMEDIATE_DATA_EX : __INTERMEDIATE_DATA {
-		std::function<ks_raw_result(const ks_raw_result&)> m_fn_ex;  //在complete后被自动清除
+		ks_unique_function<ks_raw_result(const ks_raw_result&)> m_fn_ex;  //在complete后被自动清除
 		std::weak_ptr<ks_raw_future> m_prev_future_weak;             //在complete后被自动清除
+		ks_raw_result m_prev_result;                                 //在run时被取走，或在complete后被自动清除
 		bool m_prev_future_completed_flag = false;
 	};
 
@@ -1145,10 +1665,16 @@ private:
 
 		m_intermediate_data_ex.m_fn_ex = {};
 		m_intermediate_data_ex.m_prev_future_weak.reset();
+		m_intermediate_data_ex.m_prev_result = {};
 
 		//m_intermediate_data_ex_ptr.reset();
 	}
 };
+//注：then/trap/on_xxx的future节点（连同控制块）须在一块池化内存中放下，其尺寸须严格控制
+//（_DEBUG下ks_any带有类型信息等调试字段，故尺寸预算只在非_DEBUG下检查）
+#ifndef _DEBUG
+static_assert(sizeof(ks_raw_pipe_future) <= 392, "the size of ks_raw_pipe_future is over budget");
+#endif
 
 
 class ks_raw_flatten_future final : public ks_raw_future_baseimp {
@@ -1161,15 +1687,16 @@ public:
 	}
 	_DISABLE_COPY_CONSTRUCTOR(ks_raw_flatten_future);
 		
-	void init(ks_apartment* spec_apartment, std::function<ks_raw_future_ptr(const ks_raw_result&)>&& afn_ex, const ks_async_context& living_context, const ks_raw_future_ptr& prev_future) {
+	void init(ks_apartment* spec_apartment, ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)>&& afn_ex, const ks_async_context& living_context, const ks_raw_future_ptr& prev_future) {
 		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
 		do_init_base_locked(spec_apartment, living_context, &m_intermediate_data_ex, lock);
+		do_apply_context_timeout_locked(&m_intermediate_data_ex, lock);
 		do_connect_locked(std::move(afn_ex), prev_future, &m_intermediate_data_ex, lock, false);
 	}
 
 private:
 	struct __INTERMEDIATE_DATA_EX;
-	void do_connect_locked(std::function<ks_raw_future_ptr(const ks_raw_result&)>&& afn_ex, const ks_raw_future_ptr& prev_future, __INTERMEDIATE_DATA_EX* intermediate_data_ex_ptr, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
+	void do_connect_locked(ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)>&& afn_ex, const ks_raw_future_ptr& prev_future, __INTERMEDIATE_DATA_EX* intermediate_data_ex_ptr, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
 		ASSERT(intermediate_data_ex_ptr != nullptr);
 		ASSERT(intermediate_data_ex_ptr == __get_intermediate_data_ex_ptr(lock));
 		ASSERT(lock.owns_lock() && !must_keep_locked);
@@ -1181,10 +1708,13 @@ private:
 
 		auto this_shared = this->shared_from_this();
 		auto context = intermediate_data_ex_ptr->m_living_context;
+		const int priority = context.__get_priority();
 
 		lock.unlock();
 
 		prev_future->do_add_next(this->shared_from_this());
+		if (priority > 0 && priority < 0x10000)
+			prev_future->do_boost_priority(priority); //优先级继承：高优先级的后继提升上游尚在排队的任务（>=0x10000仅表示就地执行，不参与）
 
 		if (must_keep_locked)
 			lock.lock();
@@ -1224,15 +1754,20 @@ protected:
 			return;
 		}
 
-		int priority = intermediate_data_ex_ptr->m_living_context.__get_priority();
+		int priority = this->do_get_schedule_priority_locked(intermediate_data_ex_ptr, lock);
 		ks_apartment* prefer_apartment = do_determine_prefer_apartment_2(intermediate_data_ex_ptr->m_spec_apartment, prev_advice_apartment);
 		bool could_run_locally = (priority >= 0x10000) && (intermediate_data_ex_ptr->m_spec_apartment == nullptr || intermediate_data_ex_ptr->m_spec_apartment == prefer_apartment);
 
-		std::function<void()> run_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prev_result, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
+		//注：prev_result暂存于intermediate-data中而不被run_fn捕获，使run_fn足够小，可就地存放于ks_unique_function中而免于堆分配
+		intermediate_data_ex_ptr->m_prev_result = prev_result;
+
+		ks_unique_function<void()> run_fn = [this, this_shared = this->shared_from_this(), intermediate_data_ex_ptr, prefer_apartment, context = intermediate_data_ex_ptr->m_living_context]() mutable -> void {
 			ks_raw_future_unique_lock lock2(__get_mutex(), __is_using_pseudo_mutex());
 			if (m_completed_result.is_completed())
 				return; //pre-check cancelled
 
+			intermediate_data_ex_ptr->m_scheduled_fn_id = 0;
+
 			ks_raw_running_future_rtstt running_future_rtstt;
 			ks_raw_living_context_rtstt living_context_rtstt;
 			running_future_rtstt.apply(this, &tls_current_thread_running_future);
@@ -1241,14 +1776,18 @@ protected:
 			ks_raw_future_ptr extern_future;
 			ks_error immediate_error;
 			try {
-				ks_raw_result prev_result_alt = prev_result;
-				if (prev_result.is_value() && this->do_check_cancelled_locked(lock2))
+				ks_raw_result prev_result_alt = std::move(intermediate_data_ex_ptr->m_prev_result);
+				intermediate_data_ex_ptr->m_prev_result = {};
+				if (prev_result_alt.is_value() && this->do_check_cancelled_locked(lock2))
 					prev_result_alt = this->do_acquire_cancelled_error_locked(ks_error::unexpected_error(), lock2);
 
-				std::function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = std::move(intermediate_data_ex_ptr->m_afn_ex);
+				ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = std::move(intermediate_data_ex_ptr->m_afn_ex);
 				lock2.unlock();
 				ks_defer defer_relock2([&lock2]() { lock2.lock(); });
-				extern_future = afn_ex(prev_result_alt);
+				if (true) {
+					ks_raw_source_location_duration_recorder duration_recorder(context.__get_from_source_location());
+					extern_future = afn_ex(prev_result_alt);
+				}
 				if (extern_future == nullptr) {
 					ASSERT(false);
 					immediate_error = ks_error::unexpected_error();
@@ -1268,6 +1807,7 @@ protected:
 			else {
 				//extern_future出现
 				intermediate_data_ex_ptr->m_extern_future_weak = extern_future;
+				const int inherited_priority = this->do_get_schedule_priority_locked(intermediate_data_ex_ptr, lock2);
 
 				lock2.unlock();
 				extern_future->on_completion([this, this_shared, intermediate_data_ex_ptr, prefer_apartment](const ks_raw_result& extern_result) {
@@ -1279,6 +1819,10 @@ protected:
 
 					this->do_complete_locked(extern_result, prefer_apartment, false, false, lock3, false);
 				}, make_async_context().set_priority(0x10000), prefer_apartment);
+
+				//优先级继承：extern_future承接this的优先级
+				if (inherited_priority > 0 && inherited_priority < 0x10000)
+					extern_future->do_boost_priority(inherited_priority);
 			}
 		};
 
@@ -1289,11 +1833,23 @@ protected:
 			return;
 		}
 
+		if (this->do_check_could_run_inline_locked(intermediate_data_ex_ptr, prefer_apartment, priority, lock)) {
+			lock.unlock();
+			__run_inline_on_current_thread(std::move(run_fn));
+			return;
+		}
+
+		ks_raw_schedule_attrs_rtstt schedule_attrs_rtstt;
+		schedule_attrs_rtstt.apply(intermediate_data_ex_ptr->m_living_context.__get_sched_class(), intermediate_data_ex_ptr->m_timeout_time, 
+			__estimate_source_location_duration(prefer_apartment, intermediate_data_ex_ptr->m_living_context.__get_from_source_location()));
 		uint64_t act_schedule_id = prefer_apartment->schedule(std::move(run_fn), priority);
 		if (act_schedule_id == 0) {
 			//schedule失败，则立即将this标记为错误即可
 			return this->do_complete_locked(ks_error::terminated_error(), prefer_apartment, true, false, lock, false);
 		}
+
+		intermediate_data_ex_ptr->m_scheduled_apartment = prefer_apartment;
+		intermediate_data_ex_ptr->m_scheduled_fn_id = act_schedule_id;
 	}
 
 	virtual bool is_cancelable_self() override {
@@ -1325,6 +1881,47 @@ protected:
 			not_completed_prev_future->do_try_cancel(error, true);
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//记下或提升已在排队的任务，并向上游传递：尚未被prev喂入时传给prev，extern_future出现后则传给extern_future
+		if (!this->do_inherit_priority_locked(intermediate_data_ex_ptr, priority, lock))
+			return;
+
+		ks_raw_future_ptr not_completed_prev_future = !intermediate_data_ex_ptr->m_prev_future_completed_flag ? intermediate_data_ex_ptr->m_prev_future_weak.lock() : nullptr;
+		ks_raw_future_ptr not_completed_extern_future = !intermediate_data_ex_ptr->m_extern_future_completed_flag ? intermediate_data_ex_ptr->m_extern_future_weak.lock() : nullptr;
+		lock.unlock();
+		if (not_completed_prev_future != nullptr)
+			not_completed_prev_future->do_boost_priority(priority);
+		if (not_completed_extern_future != nullptr)
+			not_completed_extern_future->do_boost_priority(priority);
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return false;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//自身的任务已在apartment中排队则执行之，否则沿prev或extern_future向上游查找
+		const uint64_t fn_id = this->do_peek_scheduled_fn_id_locked(intermediate_data_ex_ptr, apartment, lock);
+		ks_raw_future_ptr not_completed_prev_future = fn_id == 0 && !intermediate_data_ex_ptr->m_prev_future_completed_flag ? intermediate_data_ex_ptr->m_prev_future_weak.lock() : nullptr;
+		ks_raw_future_ptr not_completed_extern_future = fn_id == 0 && !intermediate_data_ex_ptr->m_extern_future_completed_flag ? intermediate_data_ex_ptr->m_extern_future_weak.lock() : nullptr;
+		lock.unlock();
+		if (fn_id != 0)
+			return apartment->__try_run_scheduled_fn_inline(fn_id);
+		if (not_completed_prev_future != nullptr && not_completed_prev_future->do_help_run_inline(apartment))
+			return true;
+		return not_completed_extern_future != nullptr && not_completed_extern_future->do_help_run_inline(apartment);
+	}
+
 private:
 	const ks_raw_future_mode m_flatten_mode;  //const-like
 	virtual ks_raw_future_mode __get_mode() override { return m_flatten_mode; }
@@ -1340,8 +1937,9 @@ private:
 #endif
 
 	struct __INTERMEDIATE_DATA_EX : __INTERMEDIATE_DATA {
-		std::function<ks_raw_future_ptr(const ks_raw_result&)> m_afn_ex; //在complete后被自动清除
+		ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)> m_afn_ex; //在complete后被自动清除
 		std::weak_ptr<ks_raw_future> m_prev_future_weak;                 //在complete后被自动清除
+		ks_raw_result m_prev_result;                                     //在run时被取走，或在complete后被自动清除
 		std::weak_ptr<ks_raw_future> m_extern_future_weak;               //中间过程中初始化，在complete后被自动清除
 		bool m_prev_future_completed_flag = false;
 		bool m_extern_future_completed_flag = false;
@@ -1359,11 +1957,15 @@ private:
 
 		m_intermediate_data_ex.m_afn_ex = {};
 		m_intermediate_data_ex.m_prev_future_weak.reset();
+		m_intermediate_data_ex.m_prev_result = {};
 		m_intermediate_data_ex.m_extern_future_weak.reset();
 
 		//m_intermediate_data_ex_ptr.reset();
 	}
 };
+#ifndef _DEBUG
+static_assert(sizeof(ks_raw_flatten_future) <= 408, "the size of ks_raw_flatten_future is over budget");
+#endif
 
 
 class ks_raw_aggr_future final : public ks_raw_future_baseimp {
@@ -1404,12 +2006,22 @@ private:
 		intermediate_data_ex_ptr->m_prev_prefer_apartment_seq_cache.resize(prev_futures.size(), nullptr);
 		intermediate_data_ex_ptr->m_prev_first_resolved_index = -1;
 		intermediate_data_ex_ptr->m_prev_first_rejected_index = -1;
+		const int priority = intermediate_data_ex_ptr->m_living_context.__get_priority();
 
 		lock.unlock();
 
 		ks_raw_future_ptr this_shared = this->shared_from_this();
-		for (auto& prev_future : prev_futures)
-			prev_future->do_add_next(this_shared);
+		if (true) {
+			ks_raw_future::__begin_batch_schedule(); //若多个前驱已完成，则各feed合并为一次schedule_batch
+			ks_defer defer_end_batch_schedule([]() { ks_raw_future::__end_batch_schedule(); });
+			for (auto& prev_future : prev_futures)
+				prev_future->do_add_next(this_shared);
+		}
+
+		if (priority > 0 && priority < 0x10000) {
+			for (auto& prev_future : prev_futures)
+				prev_future->do_boost_priority(priority); //优先级继承：高优先级的后继提升上游尚在排队的任务（>=0x10000仅表示就地执行，不参与）
+		}
 
 		if (must_keep_locked)
 			lock.lock();
@@ -1496,6 +2108,60 @@ protected:
 		}
 	}
 
+	virtual void do_boost_priority(int priority) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//aggr-future自身无任务，只向各尚未完成的prev传递
+		if (!this->do_inherit_priority_locked(intermediate_data_ex_ptr, priority, lock))
+			return;
+
+		std::vector<ks_raw_future_ptr> not_completed_prev_future_vec;
+		not_completed_prev_future_vec.reserve(intermediate_data_ex_ptr->m_prev_future_weak_seq.size());
+		for (size_t i = 0; i < intermediate_data_ex_ptr->m_prev_future_weak_seq.size(); ++i) {
+			if (intermediate_data_ex_ptr->m_not_completed_prev_future_raw_p_seq[i] != nullptr) {
+				auto prev_future_opt = intermediate_data_ex_ptr->m_prev_future_weak_seq[i].lock();
+				if (prev_future_opt != nullptr)
+					not_completed_prev_future_vec.push_back(std::move(prev_future_opt));
+			}
+		}
+
+		lock.unlock();
+		for (auto& prev_fut : not_completed_prev_future_vec)
+			prev_fut->do_boost_priority(priority);
+	}
+
+	virtual bool do_help_run_inline(ks_apartment* apartment) override {
+		ks_raw_future_unique_lock lock(__get_mutex(), __is_using_pseudo_mutex());
+		if (m_completed_result.is_completed())
+			return false;
+
+		auto intermediate_data_ex_ptr = __get_intermediate_data_ex_ptr(lock);
+		ASSERT(intermediate_data_ex_ptr != nullptr);
+
+		//aggr-future自身无任务，在各尚未完成的prev中查找，执行其一即可
+		std::vector<ks_raw_future_ptr> not_completed_prev_future_vec;
+		not_completed_prev_future_vec.reserve(intermediate_data_ex_ptr->m_prev_future_weak_seq.size());
+		for (size_t i = 0; i < intermediate_data_ex_ptr->m_prev_future_weak_seq.size(); ++i) {
+			if (intermediate_data_ex_ptr->m_not_completed_prev_future_raw_p_seq[i] != nullptr) {
+				auto prev_future_opt = intermediate_data_ex_ptr->m_prev_future_weak_seq[i].lock();
+				if (prev_future_opt != nullptr)
+					not_completed_prev_future_vec.push_back(std::move(prev_future_opt));
+			}
+		}
+
+		lock.unlock();
+		for (auto& prev_fut : not_completed_prev_future_vec) {
+			if (prev_fut->do_help_run_inline(apartment))
+				return true;
+		}
+		return false;
+	}
+
 private:
 	void do_check_and_try_settle_me_locked(const ks_raw_result& prev_result, ks_apartment* prev_advice_apartment, ks_raw_future_unique_lock& lock, bool must_keep_locked) {
 		ASSERT(lock.owns_lock() && !must_keep_locked);
@@ -1622,33 +2288,33 @@ private:
 
 //ks_raw_future静态方法实现
 ks_raw_future_ptr ks_raw_future::resolved(const ks_raw_value& value, ks_apartment* apartment) {
-	auto dx_future = std::make_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
+	auto dx_future = __make_pooled_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
 	dx_future->init(apartment, ks_raw_result(value));
 	return std::static_pointer_cast<ks_raw_future>(std::move(dx_future));
 }
 
 ks_raw_future_ptr ks_raw_future::rejected(const ks_error& error, ks_apartment* apartment) {
-	auto dx_future = std::make_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
+	auto dx_future = __make_pooled_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
 	dx_future->init(apartment, ks_raw_result(error));
 	return std::static_pointer_cast<ks_raw_future>(std::move(dx_future));
 }
 
 ks_raw_future_ptr ks_raw_future::__from_result(const ks_raw_result& result, ks_apartment* apartment) {
 	ASSERT(result.is_completed());
-	auto dx_future = std::make_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
+	auto dx_future = __make_pooled_shared<ks_raw_dx_future>(ks_raw_future_mode::DX);
 	dx_future->init(apartment, result.is_completed() ? result : ks_raw_result(ks_error::unexpected_error()));
 	return std::static_pointer_cast<ks_raw_future>(std::move(dx_future));
 }
 
 
 ks_raw_future_ptr ks_raw_future::post(std::function<ks_raw_result()>&& task_fn, const ks_async_context& context, ks_apartment* apartment) {
-	auto task_future = std::make_shared<ks_raw_task_future>(ks_raw_future_mode::TASK);
+	auto task_future = __make_pooled_shared<ks_raw_task_future>(ks_raw_future_mode::TASK);
 	task_future->init(apartment, std::move(task_fn), context, 0);
 	return std::static_pointer_cast<ks_raw_future>(std::move(task_future));
 }
 
 ks_raw_future_ptr ks_raw_future::post_delayed(std::function<ks_raw_result()>&& task_fn, const ks_async_context& context, ks_apartment* apartment, int64_t delay) {
-	auto task_future = std::make_shared<ks_raw_task_future>(ks_raw_future_mode::TASK_DELAYED);
+	auto task_future = __make_pooled_shared<ks_raw_task_future>(ks_raw_future_mode::TASK_DELAYED);
 	task_future->init(apartment, std::move(task_fn), context, delay);
 	return std::static_pointer_cast<ks_raw_future>(std::move(task_future));
 }
@@ -1658,7 +2324,7 @@ ks_raw_future_ptr ks_raw_future::all(const std::vector<ks_raw_future_ptr>& futur
 	if (futures.empty())
 		return ks_raw_future::resolved(ks_raw_value::of<std::vector<ks_raw_value>>(std::vector<ks_raw_value>()), apartment);
 
-	auto aggr_future = std::make_shared<ks_raw_aggr_future>(ks_raw_future_mode::ALL);
+	auto aggr_future = __make_pooled_shared<ks_raw_aggr_future>(ks_raw_future_mode::ALL);
 	aggr_future->init(apartment, futures);
 	return std::static_pointer_cast<ks_raw_future>(std::move(aggr_future));
 }
@@ -1667,7 +2333,7 @@ ks_raw_future_ptr ks_raw_future::all_completed(const std::vector<ks_raw_future_p
 	if (futures.empty())
 		return ks_raw_future::resolved(ks_raw_value::of<std::vector<ks_raw_result>>(std::vector<ks_raw_result>()), apartment);
 
-	auto aggr_future = std::make_shared<ks_raw_aggr_future>(ks_raw_future_mode::ALL_COMPLETED);
+	auto aggr_future = __make_pooled_shared<ks_raw_aggr_future>(ks_raw_future_mode::ALL_COMPLETED);
 	aggr_future->init(apartment, futures);
 	return std::static_pointer_cast<ks_raw_future>(std::move(aggr_future));
 }
@@ -1678,11 +2344,29 @@ ks_raw_future_ptr ks_raw_future::any(const std::vector<ks_raw_future_ptr>& futur
 	if (futures.size() == 1)
 		return futures.at(0);
 
-	auto aggr_future = std::make_shared<ks_raw_aggr_future>(ks_raw_future_mode::ANY);
+	auto aggr_future = __make_pooled_shared<ks_raw_aggr_future>(ks_raw_future_mode::ANY);
 	aggr_future->init(apartment, futures);
 	return std::static_pointer_cast<ks_raw_future>(std::move(aggr_future));
 }
 
+void ks_raw_future::__begin_batch_schedule() {
+	++tls_current_thread_batch_schedule_data.depth;
+}
+
+void ks_raw_future::__end_batch_schedule() {
+	ks_raw_batch_schedule_data* batch_data = &tls_current_thread_batch_schedule_data;
+	ASSERT(batch_data->depth > 0);
+	if (--batch_data->depth != 0)
+		return;
+
+	if (!batch_data->items.empty()) {
+		//先取出再flush，flush过程中（如schedule失败时的回调）再发起的schedule不再被暂存
+		std::vector<ks_raw_batch_schedule_item> items;
+		items.swap(batch_data->items);
+		__flush_batch_schedule_items(items);
+	}
+}
+
 void ks_raw_future::set_timeout(int64_t timeout, bool backtrack) {
 	return this->do_set_timeout(timeout, ks_error::timeout_error(), backtrack);
 }
@@ -1716,7 +2400,7 @@ void ks_raw_future::__wait() {
 }
 
 ks_raw_promise_ptr ks_raw_promise::create(ks_apartment* apartment) {
-	auto promise_future = std::make_shared<ks_raw_promise_future>(ks_raw_future_mode::PROMISE);
+	auto promise_future = __make_pooled_shared<ks_raw_promise_future>(ks_raw_future_mode::PROMISE);
 	promise_future->init(apartment);
 	return promise_future->create_promise_representative();
 }
@@ -1725,39 +2409,39 @@ ks_raw_promise_ptr ks_raw_promise::create(ks_apartment* apartment) {
 
 //ks_raw_future基础pipe方法实现
 ks_raw_future_ptr ks_raw_future_baseimp::then(std::function<ks_raw_result(const ks_raw_value &)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	std::function<ks_raw_result(const ks_raw_result&)> fn_ex = [fn = std::move(fn)](const ks_raw_result& input)->ks_raw_result {
+	ks_unique_function<ks_raw_result(const ks_raw_result&)> fn_ex = [fn = std::move(fn)](const ks_raw_result& input)->ks_raw_result {
 		if (input.is_value())
 			return fn(input.to_value());
 		else
 			return input;
 	};
 
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::THEN);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::THEN);
 	pipe_future->init(apartment, std::move(fn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::trap(std::function<ks_raw_result(const ks_error &)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	std::function<ks_raw_result(const ks_raw_result&)> fn_ex = [fn = std::move(fn)](const ks_raw_result& input)->ks_raw_result {
+	ks_unique_function<ks_raw_result(const ks_raw_result&)> fn_ex = [fn = std::move(fn)](const ks_raw_result& input)->ks_raw_result {
 		if (input.is_error())
 			return fn(input.to_error());
 		else
 			return input;
 	};
 
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::TRAP);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::TRAP);
 	pipe_future->init(apartment, std::move(fn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::transform(std::function<ks_raw_result(const ks_raw_result &)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::TRANSFORM);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::TRANSFORM);
 	pipe_future->init(apartment, std::move(fn), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::flat_then(std::function<ks_raw_future_ptr(const ks_raw_value&)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	std::function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = [fn = std::move(fn), apartment](const ks_raw_result& input)->ks_raw_future_ptr {
+	ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = [fn = std::move(fn), apartment](const ks_raw_result& input)->ks_raw_future_ptr {
 		if (!input.is_value())
 			return ks_raw_future::rejected(input.to_error(), apartment);
 
@@ -1766,13 +2450,13 @@ ks_raw_future_ptr ks_raw_future_baseimp::flat_then(std::function<ks_raw_future_p
 		return extern_future;
 	};
 
-	auto flatten_future = std::make_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_THEN);
+	auto flatten_future = __make_pooled_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_THEN);
 	flatten_future->init(apartment, std::move(afn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(flatten_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::flat_trap(std::function<ks_raw_future_ptr(const ks_error&)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	std::function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = [fn = std::move(fn), apartment](const ks_raw_result& input)->ks_raw_future_ptr {
+	ks_unique_function<ks_raw_future_ptr(const ks_raw_result&)> afn_ex = [fn = std::move(fn), apartment](const ks_raw_result& input)->ks_raw_future_ptr {
 		if (!input.is_error())
 			return ks_raw_future::resolved(input.to_value(), apartment);
 
@@ -1781,13 +2465,13 @@ ks_raw_future_ptr ks_raw_future_baseimp::flat_trap(std::function<ks_raw_future_p
 		return extern_future;
 	};
 
-	auto flatten_future = std::make_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_TRAP);
+	auto flatten_future = __make_pooled_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_TRAP);
 	flatten_future->init(apartment, std::move(afn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(flatten_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::flat_transform(std::function<ks_raw_future_ptr(const ks_raw_result&)>&& fn, const ks_async_context& context, ks_apartment* apartment) {
-	auto flatten_future = std::make_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_TRANSFORM);
+	auto flatten_future = __make_pooled_shared<ks_raw_flatten_future>(ks_raw_future_mode::FLATTEN_TRANSFORM);
 	flatten_future->init(apartment, std::move(fn), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(flatten_future));
 }
@@ -1799,7 +2483,7 @@ ks_raw_future_ptr ks_raw_future_baseimp::on_success(std::function<void(const ks_
 		return input;
 	};
 
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_SUCCESS);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_SUCCESS);
 	pipe_future->init(apartment, std::move(fn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
@@ -1811,7 +2495,7 @@ ks_raw_future_ptr ks_raw_future_baseimp::on_failure(std::function<void(const ks_
 		return input;
 	};
 
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_FAILURE);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_FAILURE);
 	pipe_future->init(apartment, std::move(fn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
@@ -1822,13 +2506,13 @@ ks_raw_future_ptr ks_raw_future_baseimp::on_completion(std::function<void(const
 		return input;
 	};
 
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_COMPLETION);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::ON_COMPLETION);
 	pipe_future->init(apartment, std::move(fn_ex), context, this->shared_from_this());
 	return std::static_pointer_cast<ks_raw_future>(std::move(pipe_future));
 }
 
 ks_raw_future_ptr ks_raw_future_baseimp::noop(ks_apartment* apartment) {
-	auto pipe_future = std::make_shared<ks_raw_pipe_future>(ks_raw_future_mode::FORWARD);
+	auto pipe_future = __make_pooled_shared<ks_raw_pipe_future>(ks_raw_future_mode::FORWARD);
 	pipe_future->init(apartment,
 		[](const auto& input) -> auto { return input; },
 		make_async_context().set_priority(0x10000), 
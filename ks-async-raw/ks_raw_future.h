@@ -41,6 +41,19 @@ struct ks_raw_future_ptr : std::shared_ptr<ks_raw_future> {
 };
 
 
+//轻量的完成等待者（供协程等使用）：由调用者持有并保证存活至被回调，无需为之构造后继future，亦不经套间调度。
+//注：on_future_completed在完成future的线程上（已解锁后）被直接调用，应尽快返回（例如只是将后续工作schedule到某套间）。
+_INTERFACE_LIKE class ks_raw_future_waiter {
+public:
+	virtual void on_future_completed(const ks_raw_result& result, ks_apartment* completed_apartment) = 0;
+
+protected:
+	ks_raw_future_waiter() noexcept = default;
+	~ks_raw_future_waiter() noexcept = default;  //protected
+	_DISABLE_COPY_CONSTRUCTOR(ks_raw_future_waiter);
+};
+
+
 _INTERFACE_LIKE class ks_raw_future {
 protected:
 	ks_raw_future() noexcept = default;
@@ -59,6 +72,10 @@ public:
 	KS_ASYNC_API static ks_raw_future_ptr all_completed(const std::vector<ks_raw_future_ptr>& futures, ks_apartment* apartment);
 	KS_ASYNC_API static ks_raw_future_ptr any(const std::vector<ks_raw_future_ptr>& futures, ks_apartment* apartment);
 
+	//注：在__begin_batch_schedule与__end_batch_schedule之间，本线程发起的post等不立即schedule，而是在（最外层）end时合并为套间的schedule_batch调用。
+	KS_ASYNC_API static void __begin_batch_schedule();
+	KS_ASYNC_API static void __end_batch_schedule();
+
 public:
 	virtual ks_raw_future_ptr then(std::function<ks_raw_result(const ks_raw_value &)>&& fn, const ks_async_context& context, ks_apartment* apartment) = 0;
 	virtual ks_raw_future_ptr trap(std::function<ks_raw_result(const ks_error&)>&& fn, const ks_async_context& context, ks_apartment* apartment) = 0;
@@ -88,6 +105,9 @@ public:
 	//慎用，使用不当可能会造成死锁或卡顿！
 	virtual void __wait();
 
+	//登记waiter，将在完成时被回调一次；若已completed则不登记而返回false（此时可直接peek_result）
+	virtual bool __try_add_waiter(ks_raw_future_waiter* waiter) = 0;
+
 protected:
 	virtual void do_add_next(const ks_raw_future_ptr& next_future) = 0;
 	virtual void do_add_next_multi(const std::vector<ks_raw_future_ptr>& next_futures) = 0;
@@ -102,6 +122,12 @@ protected:
 	virtual bool do_check_cancelled() = 0;
 	virtual ks_error do_acquire_cancelled_error(const ks_error& def_error) = 0;
 
+	//优先级继承：将priority传递给上游尚未完成的future，尚在排队的任务被提升（只升不降）
+	virtual void do_boost_priority(int priority) = 0;
+
+	//定向等待：若自身或上游尚未完成的future的任务正在apartment中排队，则将其取出并就地执行，返回true表示执行了任务
+	virtual bool do_help_run_inline(ks_apartment* apartment) = 0;
+
 	virtual bool do_wait() = 0;
 
 protected:
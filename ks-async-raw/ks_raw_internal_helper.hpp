@@ -17,6 +17,11 @@ limitations under the License.
 
 #include "../ks_async_base.h"
 #include "ks_raw_future.h"
+#include "../ks_apartment_internal_helper.hpp"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
 
 __KS_ASYNC_RAW_BEGIN
 
@@ -114,4 +119,264 @@ private:
 };
 
 
+class ks_raw_schedule_attrs_rtstt final {
+public:
+	ks_raw_schedule_attrs_rtstt() {}
+	~ks_raw_schedule_attrs_rtstt() { this->try_unapply(); }
+
+	_DISABLE_COPY_CONSTRUCTOR(ks_raw_schedule_attrs_rtstt);
+
+public:
+	//注：sched_class为0（即context未指定调度类别）时不作改变，沿用当前线程的调度类别；
+	//deadline和duration_hint则总是被设置（空即无截止时刻，0即耗时未知），以免误用外层的值
+	void apply(int sched_class, std::chrono::steady_clock::time_point deadline, int64_t duration_hint) {
+		if (m_applied_flag) {
+			ASSERT(false);
+			this->try_unapply();
+		}
+
+		m_applied_flag = true;
+		m_sched_class_applied_flag = sched_class != 0;
+		if (m_sched_class_applied_flag)
+			m_sched_class_backup = ks_apartment::__exchange_current_thread_sched_class(sched_class);
+		m_deadline_backup = ks_apartment::__exchange_current_thread_schedule_deadline(deadline);
+		m_duration_hint_backup = ks_apartment::__exchange_current_thread_schedule_duration_hint(duration_hint);
+	}
+
+	void try_unapply() {
+		if (!m_applied_flag)
+			return;
+
+		m_applied_flag = false;
+		if (m_sched_class_applied_flag)
+			ks_apartment::__exchange_current_thread_sched_class(m_sched_class_backup);
+		ks_apartment::__exchange_current_thread_schedule_deadline(m_deadline_backup);
+		ks_apartment::__exchange_current_thread_schedule_duration_hint(m_duration_hint_backup);
+		m_sched_class_applied_flag = false;
+		m_sched_class_backup = 0;
+		m_deadline_backup = {};
+		m_duration_hint_backup = 0;
+	}
+
+private:
+	bool m_applied_flag = false;
+	bool m_sched_class_applied_flag = false;
+	int m_sched_class_backup = 0;
+	std::chrono::steady_clock::time_point m_deadline_backup = {};
+	int64_t m_duration_hint_backup = 0;
+};
+
+
+
+//前N项就地存放的小数组，超出部分才放入（按需分配的）溢出vector
+//用于future的后继和等待者：绝大多数future只有1~2个后继、至多1个等待者，故通常免于堆分配
+template <class T, size_t N>
+class ks_raw_inline_vector final {
+public:
+	ks_raw_inline_vector() = default;
+
+	ks_raw_inline_vector(const ks_raw_inline_vector& r) : m_inline_count(r.m_inline_count) {
+		std::copy(r.m_inline_items, r.m_inline_items + r.m_inline_count, m_inline_items);
+		if (r.m_overflow_items != nullptr && !r.m_overflow_items->empty())
+			m_overflow_items.reset(new std::vector<T>(*r.m_overflow_items));
+	}
+
+	ks_raw_inline_vector(ks_raw_inline_vector&& r) noexcept : m_inline_count(r.m_inline_count), m_overflow_items(std::move(r.m_overflow_items)) {
+		std::move(r.m_inline_items, r.m_inline_items + r.m_inline_count, m_inline_items);
+		std::fill(r.m_inline_items, r.m_inline_items + r.m_inline_count, T());
+		r.m_inline_count = 0;
+	}
+
+	ks_raw_inline_vector& operator=(const ks_raw_inline_vector& r) {
+		if (this != &r) {
+			ks_raw_inline_vector t(r);
+			*this = std::move(t);
+		}
+		return *this;
+	}
+
+	ks_raw_inline_vector& operator=(ks_raw_inline_vector&& r) noexcept {
+		if (this != &r) {
+			this->clear();
+			std::move(r.m_inline_items, r.m_inline_items + r.m_inline_count, m_inline_items);
+			std::fill(r.m_inline_items, r.m_inline_items + r.m_inline_count, T());
+			m_inline_count = r.m_inline_count;
+			m_overflow_items = std::move(r.m_overflow_items);
+			r.m_inline_count = 0;
+		}
+		return *this;
+	}
+
+public:
+	bool empty() const noexcept { return m_inline_count == 0; } //注：溢出部分非空时，就地部分必然已满
+	size_t size() const noexcept { return m_inline_count + (m_overflow_items != nullptr ? m_overflow_items->size() : 0); }
+
+	bool contains(const T& item) const {
+		if (std::find(m_inline_items, m_inline_items + m_inline_count, item) != m_inline_items + m_inline_count)
+			return true;
+		return m_overflow_items != nullptr && std::find(m_overflow_items->cbegin(), m_overflow_items->cend(), item) != m_overflow_items->cend();
+	}
+
+	void push_back(const T& item) {
+		if (m_inline_count < N) {
+			m_inline_items[m_inline_count++] = item;
+			return;
+		}
+		if (m_overflow_items == nullptr)
+			m_overflow_items.reset(new std::vector<T>());
+		m_overflow_items->push_back(item);
+	}
+
+	template <class IT>
+	void append(IT first, IT last) {
+		for (; first != last; ++first)
+			this->push_back(*first);
+	}
+
+	template <class FN>
+	void for_each(FN&& fn) const {
+		for (size_t i = 0; i < m_inline_count; ++i)
+			fn(m_inline_items[i]);
+		if (m_overflow_items != nullptr) {
+			for (const T& item : *m_overflow_items)
+				fn(item);
+		}
+	}
+
+	//清空并释放溢出部分
+	void clear() noexcept {
+		std::fill(m_inline_items, m_inline_items + m_inline_count, T());
+		m_inline_count = 0;
+		m_overflow_items.reset();
+	}
+
+private:
+	T m_inline_items[N] = {};
+	size_t m_inline_count = 0;
+	std::unique_ptr<std::vector<T>> m_overflow_items;
+};
+
+
+
+//future的状态字：未completed时为后继链表（Treiber栈）的栈顶，completed时为completed标记
+//completed时（须先写好completed结果）以一次exchange关闭之并取走全部后继，压入后继则是一次CAS；二者竞争时必有一方胜出：
+//或后继在关闭前压入（由completer负责feed），或压入时发现已关闭（此时completed结果已确定，可无锁读取，由压入者自行feed）
+//注：只有压入和一次性整体取走，而没有单个弹出，故不存在ABA问题；
+//首个后继的节点就地存放（绝大多数future只有一个后继），其余节点才经由线程本地回收池分配
+class ks_raw_future_state_word final {
+public:
+	ks_raw_future_state_word() noexcept : m_word(nullptr), m_embed_node_used(false) {}
+	_DISABLE_COPY_CONSTRUCTOR(ks_raw_future_state_word);
+
+	~ks_raw_future_state_word() {
+		_NEXT_NODE* node = m_word.load(std::memory_order_relaxed);
+		if (node != _completed_mark())
+			this->_free_node_list(node);
+	}
+
+public:
+	bool is_completed() const noexcept {
+		return m_word.load(std::memory_order_acquire) == _completed_mark();
+	}
+
+	bool has_next() const noexcept {
+		_NEXT_NODE* node = m_word.load(std::memory_order_acquire);
+		return node != nullptr && node != _completed_mark();
+	}
+
+	//压入后继；已completed时返回false
+	bool try_push_next(const ks_raw_future_ptr& next_future) {
+		if (this->is_completed())
+			return false;
+		return this->_try_push_node(this->_alloc_node(next_future, nullptr));
+	}
+
+	//压入waiter（与后继同序）；已completed时返回false
+	bool try_push_waiter(ks_raw_future_waiter* waiter) {
+		if (this->is_completed())
+			return false;
+		return this->_try_push_node(this->_alloc_node(nullptr, waiter));
+	}
+
+	//置为completed，并按压入的顺序取走全部后继和waiter：fn(next_future, waiter)，二者恰有其一非空
+	template <class FN>
+	void complete_and_take_nexts(FN&& fn) {
+		_NEXT_NODE* head = m_word.exchange(_completed_mark(), std::memory_order_acq_rel);
+		ASSERT(head != _completed_mark());
+
+		_NEXT_NODE* reversed_head = nullptr;
+		while (head != nullptr) {
+			_NEXT_NODE* next = head->next;
+			head->next = reversed_head;
+			reversed_head = head;
+			head = next;
+		}
+
+		for (_NEXT_NODE* node = reversed_head; node != nullptr; ) {
+			_NEXT_NODE* next = node->next;
+			fn(std::move(node->next_future), node->waiter);
+			this->_free_node(node);
+			node = next;
+		}
+	}
+
+private:
+	struct _NEXT_NODE {
+		ks_raw_future_ptr next_future;
+		ks_raw_future_waiter* waiter;
+		_NEXT_NODE* next;
+	};
+
+	static _NEXT_NODE* _completed_mark() noexcept { return reinterpret_cast<_NEXT_NODE*>(uintptr_t(1)); }
+
+	bool _try_push_node(_NEXT_NODE* node) {
+		_NEXT_NODE* cur_head = m_word.load(std::memory_order_acquire);
+		while (cur_head != _completed_mark()) {
+			node->next = cur_head;
+			if (m_word.compare_exchange_weak(cur_head, node, std::memory_order_release, std::memory_order_acquire))
+				return true;
+		}
+
+		//已被并发completed：只释放本节点（其next指向的是已被取走的节点）
+		this->_free_node(node);
+		return false;
+	}
+
+	_NEXT_NODE* _alloc_node(const ks_raw_future_ptr& next_future, ks_raw_future_waiter* waiter) {
+		if (!m_embed_node_used.exchange(true, std::memory_order_relaxed)) {
+			m_embed_node.next_future = next_future;
+			m_embed_node.waiter = waiter;
+			m_embed_node.next = nullptr;
+			return &m_embed_node;
+		}
+
+		_NEXT_NODE* node = ks_apartment_pooled_allocator<_NEXT_NODE>().allocate(1);
+		return new (node) _NEXT_NODE{ next_future, waiter, nullptr };
+	}
+
+	void _free_node(_NEXT_NODE* node) noexcept {
+		if (node == &m_embed_node) {
+			m_embed_node.next_future.reset(); //就地节点只用一次，不再归还
+			return;
+		}
+
+		node->~_NEXT_NODE();
+		ks_apartment_pooled_allocator<_NEXT_NODE>().deallocate(node, 1);
+	}
+
+	void _free_node_list(_NEXT_NODE* node) noexcept {
+		while (node != nullptr) {
+			_NEXT_NODE* next = node->next;
+			this->_free_node(node);
+			node = next;
+		}
+	}
+
+private:
+	std::atomic<_NEXT_NODE*> m_word;
+	std::atomic<bool> m_embed_node_used;
+	_NEXT_NODE m_embed_node = { nullptr, nullptr, nullptr };
+};
+
+
 __KS_ASYNC_RAW_END
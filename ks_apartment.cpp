@@ -16,14 +16,18 @@ limitations under the License.
 #include "ks_apartment.h"
 #include "ks_single_thread_apartment_imp.h"
 #include "ks_thread_pool_apartment_imp.h"
+#include "ks_apartment_fiber.h"
 #include <thread>
 #include <map>
 #include <cmath>
+#include <fstream>
+#include <system_error>
 
 void __forcelink_to_ks_apartment_cpp() {}
 
 #if defined(_WIN32)
 	#include <Windows.h>
+	#include <process.h>
 	static inline void __native_set_current_thread_name(const char* thread_name) {
 		typedef HRESULT(WINAPI* PFN_SetThreadDescription)(HANDLE hThread, PCWSTR lpThreadDescription);
 		static PFN_SetThreadDescription __pfnSetThreadDescription = (PFN_SetThreadDescription)::GetProcAddress(::GetModuleHandleW(L"Kernel32.dll"), "SetThreadDescription");
@@ -59,27 +63,168 @@ void __forcelink_to_ks_apartment_cpp() {}
 		}
 	}
 
+	static inline bool __native_set_current_thread_cpu_affinity(const std::vector<int>& cpu_ids) {
+		DWORD_PTR mask = 0;
+		for (int cpu_id : cpu_ids) {
+			if (cpu_id >= 0 && cpu_id < (int)(sizeof(DWORD_PTR) * 8))
+				mask |= DWORD_PTR(1) << cpu_id;
+		}
+		return mask != 0 && ::SetThreadAffinityMask(::GetCurrentThread(), mask) != 0;
+	}
+
+	static inline void __native_start_thread(std::function<void()>&& thread_fn, size_t stack_size) {
+		auto* thread_fn_ptr = new std::function<void()>(std::move(thread_fn));
+		HANDLE thread_handle = (HANDLE)::_beginthreadex(nullptr, (unsigned)stack_size, [](void* param) -> unsigned {
+			std::unique_ptr<std::function<void()>> thread_fn_holder((std::function<void()>*)param);
+			(*thread_fn_holder)();
+			return 0;
+		}, thread_fn_ptr, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr); //只保留（reserve）而不提交栈空间
+		if (thread_handle == nullptr) {
+			delete thread_fn_ptr;
+			throw std::system_error(errno, std::generic_category(), "_beginthreadex failed");
+		}
+		::CloseHandle(thread_handle);
+	}
+
+	static inline std::vector<std::vector<int>> __native_get_numa_node_cpu_ids() {
+		std::vector<std::vector<int>> node_cpu_ids;
+		ULONG highest_node = 0;
+		if (::GetNumaHighestNodeNumber(&highest_node)) {
+			for (ULONG node = 0; node <= highest_node; ++node) {
+				ULONGLONG mask = 0;
+				if (!::GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0)
+					continue;
+				std::vector<int> cpu_ids;
+				for (int cpu_id = 0; cpu_id < 64; ++cpu_id) {
+					if (mask & (ULONGLONG(1) << cpu_id))
+						cpu_ids.push_back(cpu_id);
+				}
+				node_cpu_ids.push_back(std::move(cpu_ids));
+			}
+		}
+		return node_cpu_ids;
+	}
+
 #elif defined(__APPLE__)
 	#include <pthread.h>
 	static inline void __native_set_current_thread_name(const char* thread_name) {
 		pthread_setname_np(thread_name);
 	}
+
+	static inline bool __native_set_current_thread_cpu_affinity(const std::vector<int>& cpu_ids) {
+		return false; //macOS不支持绑定线程到cpu
+	}
+
+	static inline std::vector<std::vector<int>> __native_get_numa_node_cpu_ids() {
+		return {};
+	}
 #else
 	#include <pthread.h>
 	static inline void __native_set_current_thread_name(const char* thread_name) {
 		pthread_setname_np(pthread_self(), thread_name);
 	}
+
+	static inline bool __native_set_current_thread_cpu_affinity(const std::vector<int>& cpu_ids) {
+	#if defined(__linux__)
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		bool has_cpu = false;
+		for (int cpu_id : cpu_ids) {
+			if (cpu_id >= 0 && cpu_id < CPU_SETSIZE) {
+				CPU_SET(cpu_id, &cpu_set);
+				has_cpu = true;
+			}
+		}
+		return has_cpu && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+	#else
+		return false;
+	#endif
+	}
+
+	static inline std::vector<int> __parse_sysfs_cpu_list(const std::string& list_str) {
+		//格式形如"0-3,8-11"
+		std::vector<int> ids;
+		size_t pos = 0;
+		while (pos < list_str.size()) {
+			size_t end = list_str.find(',', pos);
+			if (end == std::string::npos)
+				end = list_str.size();
+			const std::string range_str = list_str.substr(pos, end - pos);
+			if (!range_str.empty() && range_str[0] >= '0' && range_str[0] <= '9') {
+				const size_t dash = range_str.find('-');
+				const int first = atoi(range_str.c_str());
+				const int last = dash != std::string::npos ? atoi(range_str.c_str() + dash + 1) : first;
+				for (int id = first; id <= last; ++id)
+					ids.push_back(id);
+			}
+			pos = end + 1;
+		}
+		return ids;
+	}
+
+	static inline std::vector<std::vector<int>> __native_get_numa_node_cpu_ids() {
+		std::vector<std::vector<int>> node_cpu_ids;
+	#if defined(__linux__)
+		std::string online_str;
+		std::ifstream online_file("/sys/devices/system/node/online");
+		if (online_file && std::getline(online_file, online_str)) {
+			for (int node : __parse_sysfs_cpu_list(online_str)) {
+				std::string cpu_list_str;
+				std::ifstream cpu_list_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				if (!cpu_list_file || !std::getline(cpu_list_file, cpu_list_str))
+					continue;
+				std::vector<int> cpu_ids = __parse_sysfs_cpu_list(cpu_list_str);
+				if (!cpu_ids.empty()) //无cpu的节点（仅有内存）被略过
+					node_cpu_ids.push_back(std::move(cpu_ids));
+			}
+		}
+	#endif
+		return node_cpu_ids;
+	}
+#endif
+
+#if !defined(_WIN32)
+	#include <limits.h>
+	#include <unistd.h>
+	static inline void __native_start_thread(std::function<void()>&& thread_fn, size_t stack_size) {
+		const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+		stack_size = (stack_size + page_size - 1) / page_size * page_size;
+		if (stack_size < (size_t)PTHREAD_STACK_MIN)
+			stack_size = (size_t)PTHREAD_STACK_MIN;
+
+		pthread_attr_t thread_attr;
+		pthread_attr_init(&thread_attr);
+		pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setstacksize(&thread_attr, stack_size);
+
+		auto* thread_fn_ptr = new std::function<void()>(std::move(thread_fn));
+		pthread_t thread_id;
+		int err = pthread_create(&thread_id, &thread_attr, [](void* param) -> void* {
+			std::unique_ptr<std::function<void()>> thread_fn_holder((std::function<void()>*)param);
+			(*thread_fn_holder)();
+			return nullptr;
+		}, thread_fn_ptr);
+		pthread_attr_destroy(&thread_attr);
+		if (err != 0) {
+			delete thread_fn_ptr;
+			throw std::system_error(err, std::system_category(), "pthread_create failed");
+		}
+	}
 #endif
 
 
 static ks_apartment* g_ui_sta = nullptr;
 static ks_apartment* g_master_sta = nullptr;
 static thread_local ks_apartment* tls_current_thread_apartment = nullptr;
+static thread_local int tls_current_thread_sched_class = 0;
+static thread_local std::chrono::steady_clock::time_point tls_current_thread_schedule_deadline = {};
+static thread_local int64_t tls_current_thread_schedule_duration_hint = 0;
 
 static ks_spinlock g_public_apartment_mutex {};
 static std::map<std::string, ks_apartment*> g_public_apartment_map {};
 
 static std::atomic<size_t> g_default_mta_max_thread_count = { 0 };
+static std::atomic<size_t> g_blocking_mta_max_thread_count = { 0 };
 static std::atomic<void(*)()> g_unified_raw_thread_init_fn = { nullptr };
 static std::atomic<void(*)()> g_unified_raw_thread_term_fn = { nullptr };
 
@@ -101,6 +246,16 @@ namespace {
 		return max_thread_count;
 	}
 
+	static size_t __determine_blocking_mta_max_thread_count() {
+		size_t max_thread_count = g_blocking_mta_max_thread_count.load(std::memory_order_relaxed);
+		if (max_thread_count == 0) {
+			constexpr size_t _BLOCKING_THREAD_COUNT_DEFAULT = 256; //阻塞任务的线程大多在睡眠，故线程数与cpu核数无关
+			max_thread_count = _BLOCKING_THREAD_COUNT_DEFAULT;
+		}
+
+		return max_thread_count;
+	}
+
 	static std::function<void()> __determine_unified_thread_init_fn() {
 		auto* raw_thread_init_fn = g_unified_raw_thread_init_fn.load(std::memory_order_relaxed);
 		if (raw_thread_init_fn != nullptr)
@@ -139,11 +294,27 @@ ks_apartment* ks_apartment::default_mta() noexcept {
 	static ks_thread_pool_apartment_imp g_default_mta(
 		"default_mta", 
 		__determine_default_mta_max_thread_count(),
-		ks_thread_pool_apartment_imp::auto_register_flag | ks_thread_pool_apartment_imp::endless_instance_flag,
+		ks_thread_pool_apartment_imp::auto_register_flag | ks_thread_pool_apartment_imp::endless_instance_flag | ks_thread_pool_apartment_imp::work_stealing_flag | ks_thread_pool_apartment_imp::elastic_flag | ks_thread_pool_apartment_imp::blocking_compensation_flag,
 		__determine_unified_thread_init_fn(), __determine_unified_thread_term_fn());
 	return &g_default_mta;
 }
 
+ks_apartment* ks_apartment::blocking_mta() noexcept {
+	//按队列长度弹性扩充、空闲超时退休（不做work-stealing，阻塞任务无cache亲和可言）；
+	//阻塞任务多为浅调用栈的系统调用，故使用较小的线程栈，以免数百个线程占用大量虚拟内存
+	static ks_thread_pool_apartment_imp* g_blocking_mta = []() {
+		constexpr size_t _BLOCKING_THREAD_STACK_SIZE = 512 * 1024;
+		static ks_thread_pool_apartment_imp g_blocking_mta_instance(
+			"blocking_mta",
+			__determine_blocking_mta_max_thread_count(),
+			ks_thread_pool_apartment_imp::auto_register_flag | ks_thread_pool_apartment_imp::endless_instance_flag | ks_thread_pool_apartment_imp::elastic_flag,
+			__determine_unified_thread_init_fn(), __determine_unified_thread_term_fn());
+		g_blocking_mta_instance.set_thread_stack_size(_BLOCKING_THREAD_STACK_SIZE);
+		return &g_blocking_mta_instance;
+	}();
+	return g_blocking_mta;
+}
+
 ks_apartment* ks_apartment::current_thread_apartment() noexcept {
 	return tls_current_thread_apartment;
 }
@@ -164,6 +335,18 @@ ks_apartment* ks_apartment::current_thread_apartment_or(ks_apartment* or_apartme
 	return cur_apartment;
 }
 
+bool ks_apartment::is_yield_needed() {
+	ks_apartment* apartment = ks_apartment::current_thread_apartment();
+	return apartment != nullptr && apartment->__check_yield_needed();
+}
+
+bool ks_apartment::yield_if_needed() {
+	ks_apartment* apartment = ks_apartment::current_thread_apartment();
+	if (apartment == nullptr || !apartment->__check_yield_needed())
+		return false;
+	return apartment->__try_yield_current_fiber();
+}
+
 ks_apartment* ks_apartment::find_public_apartment(const char* name) noexcept {
 	std::unique_lock<ks_spinlock> lock(g_public_apartment_mutex);
 	ASSERT(name != nullptr);
@@ -190,17 +373,50 @@ ks_apartment* ks_apartment::find_public_apartment(const char* name) noexcept {
 
 
 void ks_apartment::__set_default_mta_max_thread_count(size_t max_thread_count) {
-	ASSERT(ks_apartment::find_public_apartment("default_mta") == nullptr);
 	g_default_mta_max_thread_count.store(max_thread_count, std::memory_order_relaxed);
+
+	//若default_mta已被创建，则在运行时调整其最大线程数
+	ks_apartment* default_mta = ks_apartment::find_public_apartment("default_mta");
+	if (default_mta != nullptr) {
+		static_cast<ks_thread_pool_apartment_imp*>(default_mta)->set_max_thread_count(__determine_default_mta_max_thread_count());
+	}
+}
+
+void ks_apartment::__set_blocking_mta_max_thread_count(size_t max_thread_count) {
+	g_blocking_mta_max_thread_count.store(max_thread_count, std::memory_order_relaxed);
+
+	//若blocking_mta已被创建，则在运行时调整其最大线程数
+	ks_apartment* blocking_mta = ks_apartment::find_public_apartment("blocking_mta");
+	if (blocking_mta != nullptr) {
+		static_cast<ks_thread_pool_apartment_imp*>(blocking_mta)->set_max_thread_count(__determine_blocking_mta_max_thread_count());
+	}
+}
+
+const std::vector<std::vector<int>>& ks_apartment::__get_numa_node_cpu_ids() {
+	static const std::vector<std::vector<int>> g_numa_node_cpu_ids = []() {
+		std::vector<std::vector<int>> node_cpu_ids = __native_get_numa_node_cpu_ids();
+		if (node_cpu_ids.empty()) {
+			//无法获取拓扑时，视为单节点
+			std::vector<int> cpu_ids;
+			const int cpu_count = (int)std::thread::hardware_concurrency();
+			for (int cpu_id = 0; cpu_id < (cpu_count > 0 ? cpu_count : 1); ++cpu_id)
+				cpu_ids.push_back(cpu_id);
+			node_cpu_ids.push_back(std::move(cpu_ids));
+		}
+		return node_cpu_ids;
+	}();
+	return g_numa_node_cpu_ids;
 }
 
 void ks_apartment::__set_unified_raw_thread_init_fn(void(*raw_thread_init_fn)()) {
 	ASSERT(ks_apartment::find_public_apartment("default_mta") == nullptr);
+	ASSERT(ks_apartment::find_public_apartment("blocking_mta") == nullptr);
 	ASSERT(ks_apartment::find_public_apartment("background_sta") == nullptr);
 	g_unified_raw_thread_init_fn.store(raw_thread_init_fn, std::memory_order_relaxed);
 }
 void ks_apartment::__set_unified_raw_thread_term_fn(void(*raw_thread_term_fn)()) {
 	ASSERT(ks_apartment::find_public_apartment("default_mta") == nullptr);
+	ASSERT(ks_apartment::find_public_apartment("blocking_mta") == nullptr);
 	ASSERT(ks_apartment::find_public_apartment("background_sta") == nullptr);
 	g_unified_raw_thread_term_fn.store(raw_thread_term_fn, std::memory_order_relaxed);
 }
@@ -223,11 +439,61 @@ void ks_apartment::__set_current_thread_apartment(ks_apartment* current_thread_a
 	tls_current_thread_apartment = current_thread_apartment;
 }
 
+int ks_apartment::__get_current_thread_sched_class() noexcept {
+	return tls_current_thread_sched_class;
+}
+
+int ks_apartment::__exchange_current_thread_sched_class(int sched_class) noexcept {
+	const int pre_sched_class = tls_current_thread_sched_class;
+	tls_current_thread_sched_class = sched_class;
+	return pre_sched_class;
+}
+
+std::chrono::steady_clock::time_point ks_apartment::__get_current_thread_schedule_deadline() noexcept {
+	return tls_current_thread_schedule_deadline;
+}
+
+std::chrono::steady_clock::time_point ks_apartment::__exchange_current_thread_schedule_deadline(std::chrono::steady_clock::time_point deadline) noexcept {
+	const auto pre_deadline = tls_current_thread_schedule_deadline;
+	tls_current_thread_schedule_deadline = deadline;
+	return pre_deadline;
+}
+
+int64_t ks_apartment::__get_current_thread_schedule_duration_hint() noexcept {
+	return tls_current_thread_schedule_duration_hint;
+}
+
+int64_t ks_apartment::__exchange_current_thread_schedule_duration_hint(int64_t duration_hint) noexcept {
+	const int64_t pre_duration_hint = tls_current_thread_schedule_duration_hint;
+	tls_current_thread_schedule_duration_hint = duration_hint;
+	return pre_duration_hint;
+}
+
+bool ks_apartment::__register_fiber_local_tls(void* (*exchange_fn)(void* value)) {
+	return ks_apartment_fiber::register_local_tls(exchange_fn);
+}
+
 void ks_apartment::__set_current_thread_name(const char* thread_name) {
 	ASSERT(thread_name != nullptr);
 	__native_set_current_thread_name(thread_name);
 }
 
+bool ks_apartment::__set_current_thread_cpu_affinity(const std::vector<int>& cpu_ids) {
+	if (cpu_ids.empty())
+		return false;
+	return __native_set_current_thread_cpu_affinity(cpu_ids);
+}
+
+void ks_apartment::__start_native_thread(std::function<void()>&& thread_fn, size_t stack_size) {
+	ASSERT(thread_fn);
+	if (stack_size == 0) {
+		std::thread(std::move(thread_fn)).detach();
+		return;
+	}
+
+	__native_start_thread(std::move(thread_fn), stack_size);
+}
+
 void ks_apartment::__register_public_apartment(const char* name, ks_apartment* apartment) {
 	std::unique_lock<ks_spinlock> lock(g_public_apartment_mutex);
 	ASSERT(name != nullptr && apartment != nullptr);
@@ -17,7 +17,10 @@ limitations under the License.
 
 #include "ks_async_base.h"
 #include "ktl/ks_functional.h"
+#include "ktl/ks_unique_function.h"
 #include "ktl/ks_concurrency.h"
+#include <vector>
+#include <chrono>
 
 
 _INTERFACE_LIKE class ks_apartment {
@@ -31,6 +34,7 @@ public:
 	KS_ASYNC_API static ks_apartment* master_sta() noexcept;     //主逻辑[单线程]套间，亦由APP框架提供（可以与ui-sta相同，但最好区别开）
 	KS_ASYNC_API static ks_apartment* background_sta() noexcept; //后台[单线程]套间
 	KS_ASYNC_API static ks_apartment* default_mta() noexcept;    //默认[多线程]套间
+	KS_ASYNC_API static ks_apartment* blocking_mta() noexcept;   //阻塞[多线程]套间，专供执行阻塞调用（同步I/O等），以免其占用default_mta等计算套间的线程
 
 	KS_ASYNC_API static ks_apartment* current_thread_apartment() noexcept;
 	KS_ASYNC_API static ks_apartment* current_thread_apartment_or_default_mta() noexcept;
@@ -38,6 +42,14 @@ public:
 
 	KS_ASYNC_API static ks_apartment* find_public_apartment(const char* name) noexcept;
 
+public:
+	//注：协作式让出，供长任务在执行中途（如每处理一段数据后）调用，以免其阻塞排在后面的更高优先级的任务；检查的开销很小。
+	//is_yield_needed：当前套间中有prior任务待执行（当前任务非prior时），或当前任务的时间片（见各套间实现的set_yield_time_slice）已用尽而有其他任务在等待。
+	//yield_if_needed：若需让出且当前任务运行于fiber模式的套间中，则将其续体重新排队（排在已待执行的任务之后）并park当前fiber，轮到时恢复执行，返回true；
+	//否则不让出，返回false（非fiber模式下，长任务宜改用ks_future_util::post_resumable分段执行）。
+	KS_ASYNC_API static bool is_yield_needed();
+	KS_ASYNC_API static bool yield_if_needed();
+
 public:
 	enum { //feature consts
 		sequential_feature            = 0x0001,
@@ -61,12 +73,32 @@ public:
 
 public:
 	//注：schedule方法的uint返回值代表异步过程的id，且成功时要求返回一个“非零值”，后续可被用于try_unschedule调用传参。
-	virtual uint64_t schedule(std::function<void()>&& fn, int priority) = 0;
-	virtual uint64_t schedule_delayed(std::function<void()>&& fn, int priority, int64_t delay) = 0;
+	//注：fn采用ks_unique_function（可由std::function或lambda隐式转换），捕获不多的lambda可免于堆分配。
+	//注：原先fn为std::function<void()>，在本库之外实现的套间（如APP框架提供的ui_sta、master_sta）须将重写签名随之改为ks_unique_function<void()>&&，详见doc/ks_apartment.md。
+	virtual uint64_t schedule(ks_unique_function<void()>&& fn, int priority) = 0;
+	virtual uint64_t schedule_delayed(ks_unique_function<void()>&& fn, int priority, int64_t delay) = 0;
+
+	//注：schedule_batch方法批量投递fns[0, fn_count)（各fn被移走），各fn的id依次写入out_fn_ids（可为nullptr，失败者为0），返回成功投递的数量。
+	//默认实现为逐个schedule；套间实现可重写之，以一次加锁完成整批投递。
+	virtual size_t schedule_batch(ks_unique_function<void()>* fns, size_t fn_count, int priority, uint64_t* out_fn_ids) {
+		size_t scheduled_count = 0;
+		for (size_t i = 0; i < fn_count; ++i) {
+			uint64_t fn_id = this->schedule(std::move(fns[i]), priority);
+			if (out_fn_ids != nullptr)
+				out_fn_ids[i] = fn_id;
+			if (fn_id != 0)
+				++scheduled_count;
+		}
+		return scheduled_count;
+	}
 
 	//注：try_unschedule方法会尝试取消指定的异步过程，其前提是指定的异步过程还未开始执行，若已开始（甚至已完成）则不会再被取消了。
 	virtual void try_unschedule(uint64_t id) = 0;
 
+	//注：try_boost_priority方法会尝试将指定的、尚在排队的异步过程提升至priority（只升不降），用于优先级继承，成功时返回true。
+	//默认实现为不支持；套间实现可重写之。
+	virtual bool try_boost_priority(uint64_t id, int priority) { return false; }
+
 public:
 	virtual void atfork_prepare() { ASSERT(false); throw std::runtime_error("this apartment doesn't support fork"); }
 	virtual void atfork_parent() { ASSERT(false); throw std::runtime_error("this apartment doesn't support fork"); }
@@ -78,16 +110,61 @@ public:
 	//其存在的问题和隐患包括：
 	//1、若出现嵌套wait，则只能后入先出
 	//2、仍无法杜绝逻辑上的死锁，需要业务逻辑实现者自己保证
+	//fiber模式的套间（见各套间实现的fiber_mode_flag）则不嵌套泵任务，而是park当前任务所在的fiber、使工作线程返回调度循环，
+	//待被awaken后再恢复执行之，故多个wait可乱序完成，也不会因嵌套而加深线程栈。
 	//另：在调用__run_nested_pump_loop_for_extern_waiting处，只可以对current_thread_apartment对象调用该方法
 	virtual bool __run_nested_pump_loop_for_extern_waiting(void* extern_obj, std::function<bool()>&& extern_pred_fn) { ASSERT(false); throw std::runtime_error("this apartment doesn't support nested pump-loop"); }
 	virtual void __awaken_nested_pump_loop_for_extern_waiting_once(void* extern_obj) { ASSERT(false); throw std::runtime_error("this apartment doesn't support nested pump-loop"); }
 
+	//注：协助实现future::wait的“定向等待”：若指定的异步过程（id同schedule返回值）尚在本套间排队，则将其取出并在当前线程就地执行，返回true；
+	//若已开始执行、已撤销、尚未到期或不存在，则返回false。future::wait优先以此执行依赖路径上的任务，无可执行者时才回退为泵任意任务。
+	//另：同__run_nested_pump_loop_for_extern_waiting，只可以对current_thread_apartment对象调用该方法
+	virtual bool __try_run_scheduled_fn_inline(uint64_t id) { return false; }
+
+	//注：协助实现ks_blocking_region的内部方法：当前线程即将阻塞（或阻塞已结束），支持阻塞补偿的套间可临时增派线程以补足并发度。
+	//默认实现为不支持（忽略）；另：同__run_nested_pump_loop_for_extern_waiting，只可以对current_thread_apartment对象调用该方法
+	virtual void __enter_blocking_region() {}
+	virtual void __leave_blocking_region() {}
+
+	//注：协助实现yield_if_needed的内部方法：检查当前任务是否需让出；让出当前fiber（非fiber模式等不支持时返回false）。
+	//默认实现为不支持；另：同__run_nested_pump_loop_for_extern_waiting，只可以对current_thread_apartment对象调用该方法
+	virtual bool __check_yield_needed() { return false; }
+	virtual bool __try_yield_current_fiber() { return false; }
+
+	//注：__is_using_schedule_duration_hint方法返回该套间是否使用预估耗时提示（即shortest_job_first模式），
+	//不使用时，调用方可省去预估耗时的统计和查询
+	virtual bool __is_using_schedule_duration_hint() { return false; }
+
 public:
-	//注：设定default-mta最大线程数，请在首次调用default_mta()方法前调用。
+	//注：设定default-mta最大线程数（0为按cpu核数自动确定），可在运行时调用。
 	KS_ASYNC_API static void __set_default_mta_max_thread_count(size_t max_thread_count);
+	//注：设定blocking-mta最大线程数（0为默认值256），可在运行时调用。
+	KS_ASYNC_API static void __set_blocking_mta_max_thread_count(size_t max_thread_count);
 	KS_ASYNC_API static void __set_unified_raw_thread_init_fn(void(*raw_thread_init_fn)());
 	KS_ASYNC_API static void __set_unified_raw_thread_term_fn(void(*raw_thread_term_fn)());
 
+	//注：NUMA拓扑，即各节点的cpu编号列表（不含无cpu的节点）；Linux下读自/sys，无法获取时视为单节点。
+	KS_ASYNC_API static const std::vector<std::vector<int>>& __get_numa_node_cpu_ids();
+
+	//注：当前线程的调度类别（租户/QoS标签，默认为0）。future在schedule前将其置为context所指定的调度类别；
+	//支持调度类别的套间在schedule时读取之，并在执行任务期间将其置为该任务的调度类别（故由任务内投递的任务沿用其类别）。
+	KS_ASYNC_API static int __get_current_thread_sched_class() noexcept;
+	KS_ASYNC_API static int __exchange_current_thread_sched_class(int sched_class) noexcept; //返回原值
+
+	//注：当前线程所投递任务的截止时刻（默认为空，即无截止时刻）。future在schedule前将其置为自身的超时时刻；
+	//deadline_first模式的套间在schedule时读取之，按截止时刻先后排序（与调度类别不同，它不被任务内投递的任务沿用）。
+	KS_ASYNC_API static std::chrono::steady_clock::time_point __get_current_thread_schedule_deadline() noexcept;
+	KS_ASYNC_API static std::chrono::steady_clock::time_point __exchange_current_thread_schedule_deadline(std::chrono::steady_clock::time_point deadline) noexcept; //返回原值
+
+	//注：当前线程所投递任务的预估执行耗时（微秒，默认为0，即未知）。future在schedule前将其置为按调用点统计的历史耗时；
+	//shortest_job_first模式的套间在schedule时读取之，同优先级内预估耗时短者先执行（同样不被任务内投递的任务沿用）。
+	KS_ASYNC_API static int64_t __get_current_thread_schedule_duration_hint() noexcept;
+	KS_ASYNC_API static int64_t __exchange_current_thread_schedule_duration_hint(int64_t duration_hint) noexcept; //返回原值
+
+	//注：登记fiber局部的线程局部变量。fiber模式的套间在切换fiber时，以exchange_fn（以新值替换并返回原值）保存和恢复之，
+	//使之随fiber而非随线程（如当前运行中的future）；调度类别、截止时刻和预估耗时已内置。应在静态初始化期间登记，槽位用尽时返回false。
+	KS_ASYNC_API static bool __register_fiber_local_tls(void* (*exchange_fn)(void* value));
+
 protected:
 	//注：ui_sta和master_sta由APP框架提供。
 	//注意：current_thread_apartment是TLS变量，各色套间线程实现者务必对其进行正确初始化。
@@ -97,7 +174,31 @@ protected:
 
 	KS_ASYNC_API static void __set_current_thread_apartment(ks_apartment* current_thread_apartment);
 	KS_ASYNC_API static void __set_current_thread_name(const char* thread_name);
+	KS_ASYNC_API static bool __set_current_thread_cpu_affinity(const std::vector<int>& cpu_ids);
+
+	//注：创建分离的线程，stack_size为栈大小（0为平台默认，即同std::thread；非0时按页对齐且不小于平台下限），失败时抛出std::system_error。
+	KS_ASYNC_API static void __start_native_thread(std::function<void()>&& thread_fn, size_t stack_size);
 
 	KS_ASYNC_API static void __register_public_apartment(const char* name, ks_apartment* apartment);
 	KS_ASYNC_API static void __unregister_public_apartment(const char* name, ks_apartment* apartment);
 };
+
+
+//阻塞区间：在即将阻塞当前线程的代码段（同步I/O、等待锁、等待其他线程等）外声明之。
+//若当前线程属于支持阻塞补偿的线程池套间（如default_mta），则在阻塞期间临时增派一个补偿线程，阻塞结束后多出的线程随即退休；
+//否则无作用。可嵌套，仅最外层生效。
+class ks_blocking_region final {
+public:
+	KS_ASYNC_INLINE_API ks_blocking_region() : m_apartment(ks_apartment::current_thread_apartment()) {
+		if (m_apartment != nullptr)
+			m_apartment->__enter_blocking_region();
+	}
+	KS_ASYNC_INLINE_API ~ks_blocking_region() {
+		if (m_apartment != nullptr)
+			m_apartment->__leave_blocking_region();
+	}
+	_DISABLE_COPY_CONSTRUCTOR(ks_blocking_region);
+
+private:
+	ks_apartment* const m_apartment;
+};
@@ -0,0 +1,264 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+	#define _XOPEN_SOURCE 600 //ucontext（须在任何系统头文件之前定义）
+#endif
+
+#include "ks_apartment_fiber.h"
+#include "ks_apartment.h"
+#include <atomic>
+#include <vector>
+#include <exception>
+
+#if defined(_WIN32)
+	#include <Windows.h>
+#else
+	#include <ucontext.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+void __forcelink_to_ks_apartment_fiber_cpp() {}
+
+
+static constexpr size_t _FIBER_STACK_SIZE = 256 * 1024; //fiber栈大小（不含保护页）
+static constexpr size_t _FIBER_POOL_MAX_COUNT = 16;     //每线程池化的空闲fiber数上限
+
+static thread_local ks_apartment_fiber* tls_current_fiber = nullptr;
+
+static std::atomic<void* (*)(void*)> g_local_tls_exchange_fns[8];
+static std::atomic<size_t> g_local_tls_count = { 0 };
+
+
+struct ks_apartment_fiber::_NATIVE_CONTEXT {
+#if defined(_WIN32)
+	LPVOID fiber_handle = nullptr;
+	LPVOID caller_handle = nullptr;
+#else
+	ucontext_t fiber_context;
+	ucontext_t caller_context;
+	void* stack_mem = nullptr;
+	size_t stack_mem_size = 0;
+#endif
+};
+
+struct ks_apartment_fiber::_THREAD_FIBER_POOL {
+	std::vector<ks_apartment_fiber*> idle_fibers;
+
+	~_THREAD_FIBER_POOL() {
+		for (ks_apartment_fiber* fiber : idle_fibers)
+			delete fiber;
+		idle_fibers.clear();
+	}
+};
+
+
+ks_apartment_fiber::~ks_apartment_fiber() {
+	ASSERT(tls_current_fiber != this);
+	if (m_native_context == nullptr)
+		return;
+
+#if defined(_WIN32)
+	if (m_native_context->fiber_handle != nullptr)
+		::DeleteFiber(m_native_context->fiber_handle);
+#else
+	if (m_native_context->stack_mem != nullptr)
+		::munmap(m_native_context->stack_mem, m_native_context->stack_mem_size);
+#endif
+
+	delete m_native_context;
+	m_native_context = nullptr;
+}
+
+bool ks_apartment_fiber::run(ks_unique_function<void()>&& fn) {
+	ASSERT(tls_current_fiber == nullptr);
+	ks_apartment_fiber* fiber = _acquire();
+	fiber->m_fn = std::move(fn);
+	_capture_local_state(&fiber->m_local_state); //新fiber继承当前线程的线程局部状态
+	return _switch_in(fiber);
+}
+
+bool ks_apartment_fiber::resume(ks_apartment_fiber* fiber) {
+	ASSERT(tls_current_fiber == nullptr);
+	ASSERT(fiber != nullptr && !fiber->m_finished);
+	return _switch_in(fiber);
+}
+
+ks_apartment_fiber* ks_apartment_fiber::current() noexcept {
+	return tls_current_fiber;
+}
+
+void ks_apartment_fiber::park() {
+	ks_apartment_fiber* fiber = tls_current_fiber;
+	ASSERT(fiber != nullptr);
+	_switch_out(fiber);
+	ASSERT(tls_current_fiber == fiber); //resumed
+}
+
+bool ks_apartment_fiber::register_local_tls(void* (*exchange_fn)(void* value)) {
+	static_assert(sizeof(g_local_tls_exchange_fns) / sizeof(g_local_tls_exchange_fns[0]) == _LOCAL_TLS_MAX_COUNT, "the size of g_local_tls_exchange_fns must be _LOCAL_TLS_MAX_COUNT");
+	ASSERT(exchange_fn != nullptr);
+	const size_t index = g_local_tls_count.load();
+	if (index >= _LOCAL_TLS_MAX_COUNT) {
+		ASSERT(false);
+		return false;
+	}
+
+	//注：应在静态初始化期间（单线程）登记，故不必考虑并发登记
+	g_local_tls_exchange_fns[index].store(exchange_fn);
+	g_local_tls_count.store(index + 1);
+	return true;
+}
+
+ks_apartment_fiber* ks_apartment_fiber::_acquire() {
+	_THREAD_FIBER_POOL* pool = _get_thread_fiber_pool();
+	if (!pool->idle_fibers.empty()) {
+		ks_apartment_fiber* fiber = pool->idle_fibers.back();
+		pool->idle_fibers.pop_back();
+		return fiber;
+	}
+
+	ks_apartment_fiber* fiber = new ks_apartment_fiber();
+	fiber->m_native_context = new _NATIVE_CONTEXT();
+
+#if defined(_WIN32)
+	fiber->m_native_context->fiber_handle = ::CreateFiber(_FIBER_STACK_SIZE, &ks_apartment_fiber::_native_entry_proc, fiber);
+	if (fiber->m_native_context->fiber_handle == nullptr) {
+		delete fiber;
+		throw std::bad_alloc();
+	}
+#else
+	const size_t page_size = (size_t)::sysconf(_SC_PAGESIZE);
+	const size_t stack_mem_size = _FIBER_STACK_SIZE + page_size;
+	void* stack_mem = ::mmap(nullptr, stack_mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (stack_mem == MAP_FAILED) {
+		delete fiber;
+		throw std::bad_alloc();
+	}
+	::mprotect(stack_mem, page_size, PROT_NONE); //栈底的保护页，栈溢出时立即崩溃而不是破坏其他内存
+	fiber->m_native_context->stack_mem = stack_mem;
+	fiber->m_native_context->stack_mem_size = stack_mem_size;
+
+	::getcontext(&fiber->m_native_context->fiber_context);
+	fiber->m_native_context->fiber_context.uc_stack.ss_sp = (char*)stack_mem + page_size;
+	fiber->m_native_context->fiber_context.uc_stack.ss_size = _FIBER_STACK_SIZE;
+	fiber->m_native_context->fiber_context.uc_link = nullptr; //入口函数永不返回
+	::makecontext(&fiber->m_native_context->fiber_context, &ks_apartment_fiber::_native_entry_proc, 0);
+#endif
+
+	return fiber;
+}
+
+void ks_apartment_fiber::_release(ks_apartment_fiber* fiber) {
+	ASSERT(!fiber->m_finished && !fiber->m_fn);
+	_THREAD_FIBER_POOL* pool = _get_thread_fiber_pool();
+	if (pool->idle_fibers.size() < _FIBER_POOL_MAX_COUNT)
+		pool->idle_fibers.push_back(fiber);
+	else
+		delete fiber;
+}
+
+ks_apartment_fiber::_THREAD_FIBER_POOL* ks_apartment_fiber::_get_thread_fiber_pool() {
+	static thread_local _THREAD_FIBER_POOL tls_fiber_pool;
+	return &tls_fiber_pool;
+}
+
+bool ks_apartment_fiber::_switch_in(ks_apartment_fiber* fiber) {
+	//线程局部状态：切入时换为fiber的，切出后换回调度循环的（二者交替保存于m_local_state中）
+	_exchange_local_state(&fiber->m_local_state);
+	tls_current_fiber = fiber;
+
+#if defined(_WIN32)
+	if (!::IsThreadAFiber())
+		::ConvertThreadToFiber(nullptr); //调度循环所在的线程须先转为fiber，方可切换
+	fiber->m_native_context->caller_handle = ::GetCurrentFiber();
+	::SwitchToFiber(fiber->m_native_context->fiber_handle);
+#else
+	::swapcontext(&fiber->m_native_context->caller_context, &fiber->m_native_context->fiber_context);
+#endif
+
+	ASSERT(tls_current_fiber == fiber);
+	tls_current_fiber = nullptr;
+	_exchange_local_state(&fiber->m_local_state);
+
+	if (fiber->m_finished) {
+		fiber->m_finished = false;
+		_release(fiber);
+		return true;
+	}
+
+	return false;
+}
+
+void ks_apartment_fiber::_switch_out(ks_apartment_fiber* fiber) {
+#if defined(_WIN32)
+	::SwitchToFiber(fiber->m_native_context->caller_handle);
+#else
+	::swapcontext(&fiber->m_native_context->fiber_context, &fiber->m_native_context->caller_context);
+#endif
+}
+
+void ks_apartment_fiber::_capture_local_state(_LOCAL_STATE* state) {
+	state->sched_class = ks_apartment::__get_current_thread_sched_class();
+	state->schedule_deadline = ks_apartment::__get_current_thread_schedule_deadline();
+	state->schedule_duration_hint = ks_apartment::__get_current_thread_schedule_duration_hint();
+
+	const size_t count = g_local_tls_count.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < count; ++i) {
+		auto* exchange_fn = g_local_tls_exchange_fns[i].load(std::memory_order_relaxed);
+		void* value = exchange_fn(nullptr);
+		exchange_fn(value);
+		state->registered_tls_values[i] = value;
+	}
+}
+
+void ks_apartment_fiber::_exchange_local_state(_LOCAL_STATE* state) {
+	state->sched_class = ks_apartment::__exchange_current_thread_sched_class(state->sched_class);
+	state->schedule_deadline = ks_apartment::__exchange_current_thread_schedule_deadline(state->schedule_deadline);
+	state->schedule_duration_hint = ks_apartment::__exchange_current_thread_schedule_duration_hint(state->schedule_duration_hint);
+
+	const size_t count = g_local_tls_count.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < count; ++i) {
+		auto* exchange_fn = g_local_tls_exchange_fns[i].load(std::memory_order_relaxed);
+		state->registered_tls_values[i] = exchange_fn(state->registered_tls_values[i]);
+	}
+}
+
+#if defined(_WIN32)
+void __stdcall ks_apartment_fiber::_native_entry_proc(void* param) {
+	ks_apartment_fiber* fiber = (ks_apartment_fiber*)param;
+#else
+void ks_apartment_fiber::_native_entry_proc() {
+	ks_apartment_fiber* fiber = tls_current_fiber;
+#endif
+	ASSERT(fiber != nullptr && fiber == tls_current_fiber);
+
+	//fiber被池化复用：每次执行完fn后切回调度循环，下次被run时从此处继续执行新的fn
+	while (true) {
+		try {
+			fiber->m_fn();
+		}
+		catch (...) {
+			//异常不可越过fiber的入口传播（与在线程上直接执行任务时一样，视为致命错误）
+			ASSERT(false);
+			std::terminate();
+		}
+
+		fiber->m_fn = {};
+		fiber->m_finished = true;
+		_switch_out(fiber);
+	}
+}
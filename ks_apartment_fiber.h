@@ -0,0 +1,81 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#pragma once
+
+#include "ks_async_base.h"
+#include "ktl/ks_unique_function.h"
+#include <chrono>
+
+
+//有栈协程（fiber），供套间以fiber模式执行任务（内部使用）：
+//任务在池化的fiber栈上执行，wait时park当前fiber，工作线程随即返回调度循环继续执行其他任务，待条件满足后再resume之。
+//注：fiber只可在park它的线程上被resume（不跨线程迁移，以免线程局部变量的地址被编译器缓存而出错）；
+//fiber切换时，调度类别等线程局部状态（及经ks_apartment::__register_fiber_local_tls登记者）随fiber保存和恢复。
+//实现：Windows下使用系统fiber，其他平台使用ucontext。
+class ks_apartment_fiber final {
+public:
+	_DISABLE_COPY_CONSTRUCTOR(ks_apartment_fiber);
+
+	//在（池中复用或新建的）fiber上执行fn，fiber继承当前线程的线程局部状态；
+	//fn执行完毕时返回true（fiber被回收），中途park时返回false（fiber由park的调用者负责记录，以便之后resume）
+	static bool run(ks_unique_function<void()>&& fn);
+	//恢复执行被park的fiber，返回值同run；只可在调度循环中（即不在fiber中时）调用
+	static bool resume(ks_apartment_fiber* fiber);
+
+	//当前线程正在执行的fiber，不在fiber中时为nullptr
+	static ks_apartment_fiber* current() noexcept;
+	//park当前fiber，切回调度循环（即run或resume的调用处），被resume后返回
+	static void park();
+
+	//登记随fiber保存和恢复的线程局部变量（见ks_apartment::__register_fiber_local_tls）
+	static bool register_local_tls(void* (*exchange_fn)(void* value));
+
+private:
+	ks_apartment_fiber() = default;
+	~ks_apartment_fiber();
+
+	enum { _LOCAL_TLS_MAX_COUNT = 8 };
+
+	struct _LOCAL_STATE {
+		int sched_class = 0;
+		std::chrono::steady_clock::time_point schedule_deadline = {};
+		int64_t schedule_duration_hint = 0;
+		void* registered_tls_values[_LOCAL_TLS_MAX_COUNT] = {};
+	};
+
+	struct _NATIVE_CONTEXT;
+	struct _THREAD_FIBER_POOL;
+
+	static _THREAD_FIBER_POOL* _get_thread_fiber_pool();
+	static ks_apartment_fiber* _acquire();
+	static void _release(ks_apartment_fiber* fiber);
+	static bool _switch_in(ks_apartment_fiber* fiber);
+	static void _switch_out(ks_apartment_fiber* fiber);
+	static void _capture_local_state(_LOCAL_STATE* state);
+	static void _exchange_local_state(_LOCAL_STATE* state);
+
+#if defined(_WIN32)
+	static void __stdcall _native_entry_proc(void* param);
+#else
+	static void _native_entry_proc();
+#endif
+
+private:
+	_NATIVE_CONTEXT* m_native_context = nullptr;
+	ks_unique_function<void()> m_fn;
+	_LOCAL_STATE m_local_state;
+	bool m_finished = false;
+};
@@ -0,0 +1,526 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#pragma once
+
+#include "ks_async_base.h"
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <memory>
+#include <chrono>
+#include <atomic>
+
+
+//可撤销任务（延时任务和idle任务）的槽位表
+//fn_id的低位为槽位序号+1，高位为递增序列号（即代际标记）；不占槽位的fn_id低位为0
+//槽位状态在任务待执行时等于其fn_id，撤销和认领（出队执行）都是一次CAS(fn_id->0)，二者只有一方能成功，
+//故撤销无需加锁、无需查找队列，被撤销的任务在出队时才被丢弃（惰性删除）
+//槽位的分配和回收须在套间锁内进行，撤销和认领则可在任意线程无锁进行
+//另：亦可分配不可撤销的槽位（fn_id带_UNCANCELLABLE_FLAG），仅供套间按id索引排队中的任务（如优先级继承），其撤销总是失败
+class ks_apartment_fn_slot_table final {
+public:
+	ks_apartment_fn_slot_table() = default;
+	_DISABLE_COPY_CONSTRUCTOR(ks_apartment_fn_slot_table);
+
+	~ks_apartment_fn_slot_table() {
+		for (auto& segment : m_segments) {
+			std::atomic<uint64_t>* segment_p = segment.load(std::memory_order_relaxed);
+			if (segment_p != nullptr)
+				delete[] segment_p;
+		}
+	}
+
+public:
+	static constexpr uint64_t make_unslotted_fn_id(uint64_t seq) { return seq << _SLOT_INDEX_BITS; }
+	static constexpr bool is_slotted_fn_id(uint64_t fn_id) { return (fn_id & _SLOT_INDEX_MASK) != 0; }
+	static constexpr uint32_t slot_index_of(uint64_t fn_id) { return uint32_t((fn_id & _SLOT_INDEX_MASK) - 1); }
+
+	//分配槽位并返回fn_id；槽位耗尽时（极端情况）退化为不占槽位的fn_id
+	uint64_t alloc_slotted_fn_id_locked(uint64_t seq, bool cancellable = true) {
+		uint32_t slot_index;
+		if (!m_free_slot_indices.empty()) {
+			slot_index = m_free_slot_indices.back();
+			m_free_slot_indices.pop_back();
+		}
+		else if (m_next_unused_slot_index < _SLOT_CAPACITY) {
+			slot_index = m_next_unused_slot_index++;
+			const size_t segment_index = slot_index / _SEGMENT_SLOT_COUNT;
+			if (m_segments[segment_index].load(std::memory_order_relaxed) == nullptr) {
+				std::atomic<uint64_t>* segment_p = new std::atomic<uint64_t>[_SEGMENT_SLOT_COUNT];
+				for (size_t i = 0; i < _SEGMENT_SLOT_COUNT; ++i)
+					segment_p[i].store(0, std::memory_order_relaxed);
+				m_segments[segment_index].store(segment_p, std::memory_order_release);
+			}
+		}
+		else {
+			ASSERT(!cancellable); //仅供索引的槽位耗尽时，退化为不可索引即可
+			return make_unslotted_fn_id(seq);
+		}
+
+		const uint64_t fn_id = make_unslotted_fn_id(seq) | (uint64_t(slot_index) + 1) | (cancellable ? 0 : _UNCANCELLABLE_FLAG);
+		_slot_of(slot_index)->store(fn_id, std::memory_order_release);
+		m_used_slot_count_v.store(m_used_slot_count_v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return fn_id;
+	}
+
+	void free_slot_locked(uint64_t fn_id) {
+		if (!is_slotted_fn_id(fn_id))
+			return;
+
+		const uint32_t slot_index = slot_index_of(fn_id);
+		ASSERT(_slot_of(slot_index)->load(std::memory_order_relaxed) != fn_id); //须已被认领或撤销
+		m_free_slot_indices.push_back(slot_index);
+		m_used_slot_count_v.store(m_used_slot_count_v.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	}
+
+	//撤销与认领：成功者唯一（不占槽位的fn_id，撤销总是失败、认领总是成功）
+	bool try_cancel(uint64_t fn_id) {
+		return is_slotted_fn_id(fn_id) && (fn_id & _UNCANCELLABLE_FLAG) == 0 && _try_finish(fn_id);
+	}
+	bool try_claim(uint64_t fn_id) {
+		return !is_slotted_fn_id(fn_id) || _try_finish(fn_id);
+	}
+
+	bool check_pending(uint64_t fn_id) const {
+		if (!is_slotted_fn_id(fn_id))
+			return true;
+		std::atomic<uint64_t>* slot = _slot_of_or_null(slot_index_of(fn_id));
+		return slot != nullptr && slot->load(std::memory_order_acquire) == fn_id;
+	}
+
+	size_t used_slot_count() const { return m_used_slot_count_v.load(std::memory_order_relaxed); }
+
+private:
+	static constexpr int _SLOT_INDEX_BITS = 20;
+	static constexpr uint64_t _SLOT_INDEX_MASK = (uint64_t(1) << _SLOT_INDEX_BITS) - 1;
+	static constexpr uint32_t _SLOT_CAPACITY = uint32_t(_SLOT_INDEX_MASK); //序号+1须非0，故可用槽位数为2^20-1
+	static constexpr uint64_t _UNCANCELLABLE_FLAG = uint64_t(1) << 63; //序列号左移_SLOT_INDEX_BITS后不会触及最高位
+	static constexpr uint32_t _SEGMENT_SLOT_COUNT = 4096;
+	static constexpr size_t _SEGMENT_COUNT = (size_t(_SLOT_CAPACITY) + _SEGMENT_SLOT_COUNT - 1) / _SEGMENT_SLOT_COUNT;
+
+	std::atomic<uint64_t>* _slot_of(uint32_t slot_index) const {
+		std::atomic<uint64_t>* segment_p = m_segments[slot_index / _SEGMENT_SLOT_COUNT].load(std::memory_order_acquire);
+		ASSERT(segment_p != nullptr);
+		return &segment_p[slot_index % _SEGMENT_SLOT_COUNT];
+	}
+
+	std::atomic<uint64_t>* _slot_of_or_null(uint32_t slot_index) const {
+		if (slot_index >= _SLOT_CAPACITY)
+			return nullptr;
+		std::atomic<uint64_t>* segment_p = m_segments[slot_index / _SEGMENT_SLOT_COUNT].load(std::memory_order_acquire);
+		return segment_p != nullptr ? &segment_p[slot_index % _SEGMENT_SLOT_COUNT] : nullptr;
+	}
+
+	bool _try_finish(uint64_t fn_id) {
+		std::atomic<uint64_t>* slot = _slot_of_or_null(slot_index_of(fn_id));
+		if (slot == nullptr)
+			return false;
+		uint64_t expected = fn_id;
+		return slot->compare_exchange_strong(expected, 0, std::memory_order_acq_rel, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::atomic<uint64_t>*> m_segments[_SEGMENT_COUNT] = {};
+	std::vector<uint32_t> m_free_slot_indices; //locked
+	uint32_t m_next_unused_slot_index = 0; //locked
+	std::atomic<size_t> m_used_slot_count_v{ 0 }; //仅在锁内修改
+};
+
+
+//延时任务的4叉最小堆（按until_time排序，until_time相同时按fn_id即投递次序）
+//插入和弹出为O(log4(n))；被撤销的任务由使用方惰性删除（出堆时丢弃，或积压较多时调用remove_if整体清理）
+//（FN_ITEM须具备until_time和fn_id字段；亦可经TIME_FIELD指定其他时刻字段作为排序键，如EDF模式下的deadline_time）
+template <class FN_ITEM, std::chrono::steady_clock::time_point FN_ITEM::* TIME_FIELD = &FN_ITEM::until_time>
+class ks_apartment_delaying_fn_heap final {
+public:
+	using fn_item_ptr = std::shared_ptr<FN_ITEM>;
+
+	ks_apartment_delaying_fn_heap() = default;
+	_DISABLE_COPY_CONSTRUCTOR(ks_apartment_delaying_fn_heap);
+
+public:
+	bool empty() const { return m_entries.empty(); }
+	size_t size() const { return m_entries.size(); }
+
+	const fn_item_ptr& front() const {
+		ASSERT(!m_entries.empty());
+		return m_entries[0].fn_item;
+	}
+
+	void push(fn_item_ptr&& fn_item) {
+		_ENTRY entry;
+		entry.until_time = (*fn_item).*TIME_FIELD;
+		entry.fn_id = fn_item->fn_id;
+		entry.fn_item = std::move(fn_item);
+		m_entries.push_back(std::move(entry));
+		_sift_up(m_entries.size() - 1);
+	}
+
+	fn_item_ptr pop_front() {
+		ASSERT(!m_entries.empty());
+		fn_item_ptr fn_item = std::move(m_entries[0].fn_item);
+		if (m_entries.size() > 1) {
+			m_entries[0] = std::move(m_entries.back());
+			m_entries.pop_back();
+			_sift_down(0);
+		}
+		else {
+			m_entries.pop_back();
+		}
+		return fn_item;
+	}
+
+	//移除满足条件的项（移入removed_fn_items，以便在锁外释放），之后整体重建堆
+	template <class PRED>
+	size_t remove_if(PRED&& pred, std::vector<fn_item_ptr>* removed_fn_items) {
+		auto where_it = std::partition(m_entries.begin(), m_entries.end(), [&pred](const _ENTRY& entry) { return !pred(entry.fn_item); });
+		const size_t removed_count = size_t(m_entries.end() - where_it);
+		if (removed_count == 0)
+			return 0;
+
+		for (auto it = where_it; it != m_entries.end(); ++it)
+			removed_fn_items->push_back(std::move(it->fn_item));
+		m_entries.erase(where_it, m_entries.end());
+
+		const size_t count = m_entries.size();
+		if (count > 1) {
+			for (size_t index = (count - 2) / 4 + 1; index-- > 0; )
+				_sift_down(index);
+		}
+		return removed_count;
+	}
+
+	bool contains(uint64_t fn_id) const {
+		for (const _ENTRY& entry : m_entries) {
+			if (entry.fn_id == fn_id)
+				return true;
+		}
+		return false;
+	}
+
+	template <class FN>
+	void for_each(FN&& fn) const {
+		for (const _ENTRY& entry : m_entries)
+			fn(entry.fn_item);
+	}
+
+	void clear() {
+		m_entries.clear();
+	}
+
+	void swap(ks_apartment_delaying_fn_heap& r) noexcept {
+		m_entries.swap(r.m_entries);
+	}
+
+private:
+	struct _ENTRY {
+		std::chrono::steady_clock::time_point until_time; //冗余存放排序键，以免比较时访问fn_item
+		uint64_t fn_id;
+		fn_item_ptr fn_item;
+	};
+
+	static bool _less(const _ENTRY& a, const _ENTRY& b) {
+		return a.until_time < b.until_time || (a.until_time == b.until_time && a.fn_id < b.fn_id);
+	}
+
+	void _sift_up(size_t index) {
+		_ENTRY entry = std::move(m_entries[index]);
+		while (index > 0) {
+			size_t parent_index = (index - 1) / 4;
+			if (!_less(entry, m_entries[parent_index]))
+				break;
+			m_entries[index] = std::move(m_entries[parent_index]);
+			index = parent_index;
+		}
+		m_entries[index] = std::move(entry);
+	}
+
+	void _sift_down(size_t index) {
+		const size_t count = m_entries.size();
+		_ENTRY entry = std::move(m_entries[index]);
+		while (true) {
+			size_t first_child_index = index * 4 + 1;
+			if (first_child_index >= count)
+				break;
+
+			size_t min_child_index = first_child_index;
+			size_t end_child_index = std::min(first_child_index + 4, count);
+			for (size_t child_index = first_child_index + 1; child_index < end_child_index; ++child_index) {
+				if (_less(m_entries[child_index], m_entries[min_child_index]))
+					min_child_index = child_index;
+			}
+
+			if (!_less(m_entries[min_child_index], entry))
+				break;
+			m_entries[index] = std::move(m_entries[min_child_index]);
+			index = min_child_index;
+		}
+		m_entries[index] = std::move(entry);
+	}
+
+private:
+	std::vector<_ENTRY> m_entries;
+};
+
+
+//带老化的优先级任务队列（4叉最大堆），用于prior和idle队列
+//priority取int全域，插入和弹出为O(log4(n))；同优先级的任务按投递次序（FIFO）
+//老化：排序键为priority*AGING_STEP_COUNT-入队序号，即任务每等待AGING_STEP_COUNT次后续入队，其有效优先级便提升1级，
+//故后来的高优先级任务至多越过它有限次，低优先级任务不会被无限期饿死
+//（FN_ITEM须具备priority和fn_id字段）
+template <class FN_ITEM>
+class ks_apartment_priority_fn_heap final {
+public:
+	using fn_item_ptr = std::shared_ptr<FN_ITEM>;
+	static constexpr int64_t AGING_STEP_COUNT = 32;
+
+	ks_apartment_priority_fn_heap() = default;
+	_DISABLE_COPY_CONSTRUCTOR(ks_apartment_priority_fn_heap);
+
+public:
+	bool empty() const { return m_entries.empty(); }
+	size_t size() const { return m_entries.size(); }
+
+	const fn_item_ptr& front() const {
+		ASSERT(!m_entries.empty());
+		return m_entries[0].fn_item;
+	}
+
+	void push(fn_item_ptr&& fn_item) {
+		_ENTRY entry;
+		entry.seq = ++m_last_seq;
+		entry.aged_key = int64_t(fn_item->priority) * AGING_STEP_COUNT - int64_t(entry.seq);
+		entry.fn_item = std::move(fn_item);
+		m_entries.push_back(std::move(entry));
+		_sift_up(m_entries.size() - 1);
+	}
+
+	fn_item_ptr pop_front() {
+		ASSERT(!m_entries.empty());
+		fn_item_ptr fn_item = std::move(m_entries[0].fn_item);
+		if (m_entries.size() > 1) {
+			m_entries[0] = std::move(m_entries.back());
+			m_entries.pop_back();
+			_sift_down(0);
+		}
+		else {
+			m_entries.pop_back();
+		}
+		return fn_item;
+	}
+
+	//移除满足条件的项（移入removed_fn_items，以便在锁外释放），之后整体重建堆
+	template <class PRED>
+	size_t remove_if(PRED&& pred, std::vector<fn_item_ptr>* removed_fn_items) {
+		auto where_it = std::partition(m_entries.begin(), m_entries.end(), [&pred](const _ENTRY& entry) { return !pred(entry.fn_item); });
+		const size_t removed_count = size_t(m_entries.end() - where_it);
+		if (removed_count == 0)
+			return 0;
+
+		for (auto it = where_it; it != m_entries.end(); ++it)
+			removed_fn_items->push_back(std::move(it->fn_item));
+		m_entries.erase(where_it, m_entries.end());
+
+		const size_t count = m_entries.size();
+		if (count > 1) {
+			for (size_t index = (count - 2) / 4 + 1; index-- > 0; )
+				_sift_down(index);
+		}
+		return removed_count;
+	}
+
+	bool contains(uint64_t fn_id) const {
+		for (const _ENTRY& entry : m_entries) {
+			if (entry.fn_item->fn_id == fn_id)
+				return true;
+		}
+		return false;
+	}
+
+	void clear() {
+		m_entries.clear();
+	}
+
+	void swap(ks_apartment_priority_fn_heap& r) noexcept {
+		m_entries.swap(r.m_entries);
+		std::swap(m_last_seq, r.m_last_seq);
+	}
+
+private:
+	struct _ENTRY {
+		int64_t aged_key; //冗余存放排序键，以免比较时访问fn_item
+		uint64_t seq;
+		fn_item_ptr fn_item;
+	};
+
+	static bool _greater(const _ENTRY& a, const _ENTRY& b) {
+		return a.aged_key > b.aged_key || (a.aged_key == b.aged_key && a.seq < b.seq);
+	}
+
+	void _sift_up(size_t index) {
+		_ENTRY entry = std::move(m_entries[index]);
+		while (index > 0) {
+			size_t parent_index = (index - 1) / 4;
+			if (!_greater(entry, m_entries[parent_index]))
+				break;
+			m_entries[index] = std::move(m_entries[parent_index]);
+			index = parent_index;
+		}
+		m_entries[index] = std::move(entry);
+	}
+
+	void _sift_down(size_t index) {
+		const size_t count = m_entries.size();
+		_ENTRY entry = std::move(m_entries[index]);
+		while (true) {
+			size_t first_child_index = index * 4 + 1;
+			if (first_child_index >= count)
+				break;
+
+			size_t max_child_index = first_child_index;
+			size_t end_child_index = std::min(first_child_index + 4, count);
+			for (size_t child_index = first_child_index + 1; child_index < end_child_index; ++child_index) {
+				if (_greater(m_entries[child_index], m_entries[max_child_index]))
+					max_child_index = child_index;
+			}
+
+			if (!_greater(m_entries[max_child_index], entry))
+				break;
+			m_entries[index] = std::move(m_entries[max_child_index]);
+			index = max_child_index;
+		}
+		m_entries[index] = std::move(entry);
+	}
+
+private:
+	std::vector<_ENTRY> m_entries;
+	uint64_t m_last_seq = 0;
+};
+
+
+//线程本地的定长内存块回收池（带上限），用于_FN_ITEM这类被频繁分配释放的小对象
+//块在哪个线程释放，就回收到哪个线程的池中；池满则直接归还给系统，线程退出时池中的块全部归还
+template <size_t BLOCK_SIZE>
+class ks_apartment_tls_block_pool final {
+public:
+	static constexpr size_t block_size = BLOCK_SIZE;
+	static constexpr size_t max_cached_count = 256;
+
+	static void* alloc() {
+		_TLS_STATE* state = _prepare_tls_state();
+		if (state->free_head != nullptr) {
+			_FREE_BLOCK* block = state->free_head;
+			state->free_head = block->next;
+			--state->free_count;
+			return block;
+		}
+		return ::operator new(BLOCK_SIZE);
+	}
+
+	static void free(void* p) noexcept {
+		_TLS_STATE* state = _prepare_tls_state();
+		if (state->alive && state->free_count < max_cached_count) {
+			_FREE_BLOCK* block = static_cast<_FREE_BLOCK*>(p);
+			block->next = state->free_head;
+			state->free_head = block;
+			++state->free_count;
+			return;
+		}
+		::operator delete(p);
+	}
+
+private:
+	struct _FREE_BLOCK {
+		_FREE_BLOCK* next;
+	};
+	static_assert(BLOCK_SIZE >= sizeof(_FREE_BLOCK), "block too small");
+
+	//注：状态为平凡类型的thread_local（无析构，线程存续期间始终可访问），另由一个cleaner在线程退出时清空池，
+	//此后（如其他thread_local析构时）再释放的块直接归还给系统
+	struct _TLS_STATE {
+		_FREE_BLOCK* free_head;
+		size_t free_count;
+		bool inited;
+		bool alive;
+	};
+
+	struct _TLS_CLEANER {
+		~_TLS_CLEANER() {
+			_TLS_STATE* state = &tls_state;
+			state->alive = false;
+			while (state->free_head != nullptr) {
+				_FREE_BLOCK* block = state->free_head;
+				state->free_head = block->next;
+				::operator delete(block);
+			}
+			state->free_count = 0;
+		}
+	};
+
+	static _TLS_STATE* _prepare_tls_state() noexcept {
+		_TLS_STATE* state = &tls_state;
+		if (!state->inited) {
+			static thread_local _TLS_CLEANER tls_cleaner;
+			(void)tls_cleaner;
+			state->inited = true;
+			state->alive = true;
+		}
+		return state;
+	}
+
+	static thread_local _TLS_STATE tls_state;
+};
+
+template <size_t BLOCK_SIZE>
+thread_local typename ks_apartment_tls_block_pool<BLOCK_SIZE>::_TLS_STATE ks_apartment_tls_block_pool<BLOCK_SIZE>::tls_state = { nullptr, 0, false, false };
+
+
+//使用ks_apartment_tls_block_pool的分配器，一般配合std::allocate_shared使用（控制块与对象共处一块）
+template <class T>
+class ks_apartment_pooled_allocator {
+public:
+	using value_type = T;
+
+	ks_apartment_pooled_allocator() noexcept = default;
+	template <class U>
+	ks_apartment_pooled_allocator(const ks_apartment_pooled_allocator<U>&) noexcept {}
+
+	T* allocate(size_t n) {
+		if (n == 1 && alignof(T) <= alignof(std::max_align_t))
+			return static_cast<T*>(_POOL::alloc());
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n) noexcept {
+		if (n == 1 && alignof(T) <= alignof(std::max_align_t))
+			_POOL::free(p);
+		else
+			::operator delete(p);
+	}
+
+	template <class U>
+	bool operator==(const ks_apartment_pooled_allocator<U>&) const noexcept { return true; }
+	template <class U>
+	bool operator!=(const ks_apartment_pooled_allocator<U>&) const noexcept { return false; }
+
+private:
+	using _POOL = ks_apartment_tls_block_pool<(sizeof(T) + 15) / 16 * 16>;
+};
+
+template <class T>
+inline std::shared_ptr<T> ks_apartment_make_pooled_shared() {
+	return std::allocate_shared<T>(ks_apartment_pooled_allocator<T>());
+}
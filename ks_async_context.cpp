@@ -47,6 +47,20 @@ ks_async_context& ks_async_context::__bind_from_source_location(const ks_source_
 	return *this;
 }
 
+ks_async_context& ks_async_context::set_timeout(int64_t timeout) {
+	if (timeout > 0) {
+		do_prepare_fat_data_cow();
+		m_fat_data_p->timeout = timeout;
+	}
+	else {
+		if (m_fat_data_p != nullptr && m_fat_data_p->timeout != 0) {
+			do_prepare_fat_data_cow();
+			m_fat_data_p->timeout = 0;
+		}
+	}
+	return *this;
+}
+
 ks_async_context& ks_async_context::set_parent(const ks_async_context& parent, bool inherit_attrs) {
 	//注：只保存parent.m_fat_data_p，不必保存parent.m_priority（因为无用）
 	if (parent.m_fat_data_p != nullptr) {
@@ -64,6 +78,7 @@ ks_async_context& ks_async_context::set_parent(const ks_async_context& parent, b
 
 	if (inherit_attrs) {
 		m_priority = parent.__get_priority();
+		m_sched_class = parent.__get_sched_class();
 	}
 
 	return *this;
@@ -181,6 +196,10 @@ void ks_async_context::do_prepare_fat_data_cow() {
 		fatDataCopy->controller_data_ptr = fatDataOrig->controller_data_ptr;
 		fatDataCopy->parent_fat_data_p = fatDataOrig->parent_fat_data_p;
 		__do_addref_fat_data(fatDataCopy->parent_fat_data_p);
+		fatDataCopy->timeout = fatDataOrig->timeout;
+#if __KS_ASYNC_CONTEXT_FROM_SOURCE_LOCATION_ENABLED
+		fatDataCopy->from_source_location = fatDataOrig->from_source_location;
+#endif
 
 		__do_release_fat_data(m_fat_data_p);
 		m_fat_data_p = fatDataCopy;
@@ -28,18 +28,21 @@ class ks_async_context final {
 public:
 	//注意：这个默认构造即将被废弃！
 	KS_ASYNC_INLINE_API ks_async_context() noexcept 
-		: m_fat_data_p(nullptr), m_priority(0) {}
+		: m_fat_data_p(nullptr), m_priority(0), m_sched_class(0) {}
 
 	KS_ASYNC_INLINE_API ks_async_context(const ks_async_context& r) noexcept {
 		m_fat_data_p = r.m_fat_data_p;
 		__do_addref_fat_data(m_fat_data_p);
 		m_priority = r.m_priority;
+		m_sched_class = r.m_sched_class;
 	}
 	KS_ASYNC_INLINE_API ks_async_context(ks_async_context&& r) noexcept {
 		m_fat_data_p = r.m_fat_data_p;
 		m_priority = r.m_priority;
+		m_sched_class = r.m_sched_class;
 		r.m_fat_data_p = nullptr;
 		r.m_priority = 0;
+		r.m_sched_class = 0;
 	}
 
 	KS_ASYNC_INLINE_API _NOINLINE ks_async_context& operator=(const ks_async_context& r) noexcept {
@@ -50,6 +53,7 @@ public:
 				__do_addref_fat_data(m_fat_data_p);
 			}
 			m_priority = r.m_priority;
+			m_sched_class = r.m_sched_class;
 		}
 		return *this;
 	}
@@ -58,8 +62,10 @@ public:
 			__do_release_fat_data(m_fat_data_p);
 			m_fat_data_p = r.m_fat_data_p;
 			m_priority = r.m_priority;
+			m_sched_class = r.m_sched_class;
 			r.m_fat_data_p = nullptr;
 			r.m_priority = 0;
+			r.m_sched_class = 0;
 		}
 		return *this;
 	}
@@ -88,6 +94,16 @@ public:
 		return *this;
 	}
 
+	//注：超时（毫秒），以此context创建的future自创建起超时，如同对其调用了set_timeout；0为不超时。
+	//超时在future创建时即已确定，故亦可作为其任务的截止时刻（见各套间的deadline_first_flag）。
+	KS_ASYNC_API ks_async_context& set_timeout(int64_t timeout);
+
+	//注：调度类别（租户/QoS标签），0为不指定（沿用当前线程的调度类别），见ks_thread_pool_apartment_imp::set_sched_class_policy。
+	KS_ASYNC_INLINE_API ks_async_context& set_sched_class(int sched_class) {
+		m_sched_class = sched_class;
+		return *this;
+	}
+
 private:
 	template <class SMART_PTR>
 	_NOINLINE void do_bind_owner(SMART_PTR&& owner_ptr, std::false_type owner_ptr_is_weak) {
@@ -143,6 +159,14 @@ public:
 		return m_priority;
 	}
 
+	KS_ASYNC_INLINE_API int __get_sched_class() const noexcept {
+		return m_sched_class;
+	}
+
+	KS_ASYNC_INLINE_API int64_t __get_timeout() const noexcept {
+		return m_fat_data_p != nullptr ? m_fat_data_p->timeout : 0;
+	}
+
 public: //called by ks_raw_future internally
 	KS_ASYNC_API bool __check_owner_expired() const noexcept;
 	KS_ASYNC_INLINE_API ks_any __lock_owner_ptr() const noexcept { return __do_lock_owner_ptr_recursively(m_fat_data_p); }
@@ -165,6 +189,7 @@ public:
 		//if (this != &r) {
 			std::swap(m_fat_data_p, r.m_fat_data_p);
 			std::swap(m_priority, r.m_priority);
+			std::swap(m_sched_class, r.m_sched_class);
 		//}
 	}
 
@@ -183,6 +208,9 @@ private:
 		//关于parent
 		_FAT_DATA* parent_fat_data_p = nullptr;
 
+		//关于timeout
+		int64_t timeout = 0;
+
 #if __KS_ASYNC_CONTEXT_FROM_SOURCE_LOCATION_ENABLED
 		//关于from_source_location
 		ks_source_location from_source_location = ks_source_location(nullptr);
@@ -213,6 +241,7 @@ private:
 private:
 	_FAT_DATA* m_fat_data_p; //_FAT_DATA结构体有点大，采用COW技术优化
 	int m_priority;
+	int m_sched_class;
 };
 
 
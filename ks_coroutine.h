@@ -0,0 +1,786 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#pragma once
+
+#include "ks_async_base.h"
+#include "ks_future.h"
+#include "ks_promise.h"
+#include "ks_cancel_inspector.h"
+#include "ktl/ks_concurrency.h"
+
+//C++20协程支持（编译器不支持协程时本头文件为空）：
+//co_await ks_future<T>得到其值（失败时抛出其ks_error），挂起时只登记一个轻量的waiter，而不构造then-node；
+//ks_task<T>为协程返回类型，经post在指定套间中启动，此后每次co_await后亦恢复于该套间；
+//在ks_task中co_await另一个ks_task时，直接切入子task，子task完成后以对称转移（symmetric transfer）切回，均不经套间调度。
+//ks_async_generator<T>为流式生产者协程的返回类型，co_yield逐个产出值，消费者co_await next()逐个取得，二者可位于不同套间。
+//注：协程体中未捕获的ks_error即为ks_task的失败结果（与then-fn中抛出ks_error一致），其他异常则视为致命错误。
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define __KS_ASYNC_COROUTINE_ENABLED  1
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <atomic>
+#include <vector>
+#include <optional>
+
+template <class T> class ks_task;
+template <class T> class ks_future_awaiter;
+template <class T> class __ks_task_awaiter;
+template <class T> class __ks_task_promise;
+class __ks_task_promise_base;
+template <class T> class ks_async_generator;
+template <class T> class __ks_async_generator_next_awaiter;
+
+
+_NAMESPACE_LIKE class ks_coroutine_util final { //as namespace
+public:
+	struct cancel_inspector_t {};
+	struct resume_on_t { ks_apartment* apartment; };
+
+	//ks_task中：ks_cancel_inspector* inspector = co_await ks_coroutine_util::cancel_inspector();
+	static cancel_inspector_t cancel_inspector() noexcept { return cancel_inspector_t{}; }
+
+	//ks_task中：co_await ks_coroutine_util::resume_on(apartment); 切换到apartment中继续执行，此后亦恢复于该套间
+	static resume_on_t resume_on(ks_apartment* apartment) noexcept { ASSERT(apartment != nullptr); return resume_on_t{ apartment }; }
+
+private:
+	template <class T>
+	static const __ks_async_raw::ks_raw_future_ptr& __get_raw_future(const ks_future<T>& future) noexcept { return future.__get_raw(); }
+
+	template <class T2> friend class ks_future_awaiter;
+};
+
+
+//co_await ks_future<T>的awaiter：在ks_task中恢复于task的套间，在其他协程中则恢复于挂起时的当前套间（或default_mta）
+template <class T>
+class ks_future_awaiter final : private __ks_async_raw::ks_raw_future_waiter {
+public:
+	explicit ks_future_awaiter(const ks_future<T>& future, __ks_task_promise_base* task_promise) noexcept
+		: m_future(future), m_task_promise(task_promise) {}
+	_DISABLE_COPY_CONSTRUCTOR(ks_future_awaiter);
+
+	bool await_ready() const noexcept {
+		return m_future.is_completed();
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle);
+
+	T await_resume() {
+		if (m_terminated)
+			throw ks_error::terminated_error();
+		if (m_task_promise != nullptr)
+			__throw_if_task_cancelled(m_task_promise);
+
+		ks_result<T> result = m_future.peek_result();
+		if (!result.is_value())
+			throw result.to_error();
+		if constexpr (!std::is_void_v<T>)
+			return result.to_value();
+	}
+
+private:
+	virtual void on_future_completed(const __ks_async_raw::ks_raw_result& result, ks_apartment* completed_apartment) override {
+		//注：schedule成功后协程可能随即在他处恢复并销毁本awaiter，故此后不可再访问成员
+		std::coroutine_handle<> handle = m_handle;
+		uint64_t act_schedule_id = m_resume_apartment->schedule([handle]() { handle.resume(); }, m_resume_priority);
+		if (act_schedule_id == 0) {
+			m_terminated = true;
+			handle.resume(); //套间已关闭，只好就地恢复（await_resume将抛出terminated_error）
+		}
+	}
+
+	static void __throw_if_task_cancelled(__ks_task_promise_base* task_promise);
+
+private:
+	ks_future<T> m_future;
+	__ks_task_promise_base* m_task_promise;
+	std::coroutine_handle<> m_handle = nullptr;
+	ks_apartment* m_resume_apartment = nullptr;
+	int m_resume_priority = 0;
+	bool m_terminated = false;
+};
+
+template <class T>
+inline ks_future_awaiter<T> operator co_await(const ks_future<T>& future) noexcept {
+	return ks_future_awaiter<T>(future, nullptr);
+}
+
+
+//ks_task（及ks_async_generator）的await_transform专门处理的类型，其余awaitable原样透传
+template <class A> struct __ks_is_task_special_awaitable : std::false_type {};
+template <class T> struct __ks_is_task_special_awaitable<ks_future<T>> : std::true_type {};
+template <class T> struct __ks_is_task_special_awaitable<ks_task<T>> : std::true_type {};
+template <class T> struct __ks_is_task_special_awaitable<__ks_async_generator_next_awaiter<T>> : std::true_type {};
+template <> struct __ks_is_task_special_awaitable<ks_coroutine_util::cancel_inspector_t> : std::true_type {};
+template <> struct __ks_is_task_special_awaitable<ks_coroutine_util::resume_on_t> : std::true_type {};
+
+
+//ks_task（及ks_async_generator）的promise-type公共部分，同时作为协程体的ks_cancel_inspector
+class __ks_task_promise_base : public ks_cancel_inspector {
+public:
+	__ks_task_promise_base() noexcept = default;
+	_DISABLE_COPY_CONSTRUCTOR(__ks_task_promise_base);
+
+	virtual bool check_cancelled() override {
+		return this->__acquire_cancelled_error().has_code();
+	}
+
+public:
+	ks_apartment* __get_apartment() const noexcept { return m_apartment; }
+	int __get_priority() const noexcept { return m_priority; }
+
+	//取消来源：外部（ks_task的结果future已被提前completed即被try_cancel或超时，ks_async_generator的消费者已放弃），context的controller被取消或owner已失效，或父task被取消
+	ks_error __acquire_cancelled_error() const noexcept {
+		ks_error error = this->do_peek_extern_cancelled_error();
+		if (error.has_code())
+			return error;
+		if (m_context.__check_controller_cancelled() || m_context.__check_owner_expired())
+			return ks_error::cancelled_error();
+		if (m_parent != nullptr)
+			return m_parent->__acquire_cancelled_error();
+		return ks_error();
+	}
+
+	void __throw_if_cancelled() const {
+		ks_error error = this->__acquire_cancelled_error();
+		if (error.has_code())
+			throw error;
+	}
+
+public: //await_transform
+	template <class T2>
+	ks_future_awaiter<T2> await_transform(const ks_future<T2>& future) noexcept {
+		return ks_future_awaiter<T2>(future, this);
+	}
+
+	template <class T2>
+	__ks_task_awaiter<T2> await_transform(ks_task<T2>&& task) noexcept {
+		return __ks_task_awaiter<T2>(std::move(task), this);
+	}
+
+	template <class T2>
+	__ks_async_generator_next_awaiter<T2> await_transform(__ks_async_generator_next_awaiter<T2>&& next_awaiter) noexcept {
+		return __ks_async_generator_next_awaiter<T2>(next_awaiter.m_promise, this);
+	}
+
+	auto await_transform(ks_coroutine_util::cancel_inspector_t) noexcept {
+		return __cancel_inspector_awaiter{ this };
+	}
+
+	auto await_transform(ks_coroutine_util::resume_on_t resume_on) noexcept {
+		return __resume_on_awaiter{ this, resume_on.apartment };
+	}
+
+	template <class A> requires (!__ks_is_task_special_awaitable<std::remove_cvref_t<A>>::value)
+	A&& await_transform(A&& awaitable) noexcept {
+		return std::forward<A>(awaitable);
+	}
+
+protected:
+	virtual ks_error do_peek_extern_cancelled_error() const noexcept = 0;
+
+	void do_init_as_top(ks_apartment* apartment, const ks_async_context& context) {
+		m_apartment = apartment;
+		m_priority = context.__get_priority();
+		m_context = context;
+	}
+
+	void do_init_as_child(__ks_task_promise_base* parent, std::coroutine_handle<> continuation) noexcept {
+		m_apartment = parent->m_apartment;
+		m_priority = parent->m_priority;
+		m_parent = parent;
+		m_continuation = continuation;
+	}
+
+	struct __initial_awaiter {
+		__ks_task_promise_base* promise;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+		void await_resume() const { promise->__throw_if_cancelled(); } //与pipe-future一样，若启动前已被取消则不执行协程体
+	};
+
+	struct __cancel_inspector_awaiter {
+		__ks_task_promise_base* promise;
+		bool await_ready() const noexcept { return true; }
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+		ks_cancel_inspector* await_resume() const noexcept { return promise; }
+	};
+
+	struct __resume_on_awaiter {
+		__ks_task_promise_base* promise;
+		ks_apartment* apartment;
+		bool terminated = false;
+
+		bool await_ready() const noexcept {
+			return apartment == ks_apartment::current_thread_apartment();
+		}
+		bool await_suspend(std::coroutine_handle<> handle) {
+			uint64_t act_schedule_id = apartment->schedule([handle]() { handle.resume(); }, promise->m_priority);
+			if (act_schedule_id == 0) {
+				terminated = true;
+				return false;
+			}
+			return true;
+		}
+		void await_resume() {
+			if (terminated)
+				throw ks_error::terminated_error();
+			promise->m_apartment = apartment;
+			promise->__throw_if_cancelled();
+		}
+	};
+
+protected:
+	ks_apartment* m_apartment = nullptr;
+	int m_priority = 0;
+	ks_async_context m_context = {};
+	__ks_task_promise_base* m_parent = nullptr;
+	std::coroutine_handle<> m_continuation = nullptr; //子task完成后对称转移回到的等待者
+
+	//子task与父task的交接：二者谁后到达，谁负责继续执行父task
+	enum { __CHILD_RUNNING = 0, __CHILD_COMPLETED = 1, __PARENT_SUSPENDED = 2 };
+	std::atomic<int> m_child_handover_state = { __CHILD_RUNNING };
+
+	template <class T2> friend class __ks_task_awaiter;
+};
+
+template <class T>
+inline bool ks_future_awaiter<T>::await_suspend(std::coroutine_handle<> handle) {
+	m_handle = handle;
+	if (m_task_promise != nullptr) {
+		m_resume_apartment = m_task_promise->__get_apartment();
+		m_resume_priority = m_task_promise->__get_priority();
+	}
+	else {
+		m_resume_apartment = ks_apartment::current_thread_apartment_or_default_mta();
+	}
+
+	//注：若已completed则不登记，也不挂起
+	return ks_coroutine_util::__get_raw_future(m_future)->__try_add_waiter(this);
+}
+
+template <class T>
+inline void ks_future_awaiter<T>::__throw_if_task_cancelled(__ks_task_promise_base* task_promise) {
+	task_promise->__throw_if_cancelled();
+}
+
+
+template <class T>
+class __ks_task_promise_result : public __ks_task_promise_base {
+public:
+	void return_value(const T& value) { m_result = ks_result<T>(value); }
+	void return_value(T&& value) { m_result = ks_result<T>(std::move(value)); }
+
+protected:
+	ks_result<T> m_result = ks_result<T>::__bare();
+};
+
+template <>
+class __ks_task_promise_result<void> : public __ks_task_promise_base {
+public:
+	void return_void() { m_result = ks_result<void>(nothing); }
+
+protected:
+	ks_result<void> m_result = ks_result<void>::__bare();
+};
+
+
+template <class T>
+class __ks_task_promise final : public __ks_task_promise_result<T> {
+public:
+	__ks_task_promise() noexcept = default;
+	_DISABLE_COPY_CONSTRUCTOR(__ks_task_promise);
+
+	ks_task<T> get_return_object() noexcept {
+		return ks_task<T>(std::coroutine_handle<__ks_task_promise>::from_promise(*this));
+	}
+
+	__ks_task_promise_base::__initial_awaiter initial_suspend() noexcept {
+		return __ks_task_promise_base::__initial_awaiter{ this };
+	}
+
+	struct __final_awaiter {
+		bool await_ready() const noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<__ks_task_promise> handle) noexcept {
+			__ks_task_promise& promise = handle.promise();
+			if (promise.m_continuation) {
+				//子task（帧由等待者负责销毁）：若父task已挂起，则对称转移回到父task；否则父task尚在切入子task的流程中，由其直接继续
+				if (promise.m_child_handover_state.exchange(__ks_task_promise_base::__CHILD_COMPLETED, std::memory_order_acq_rel) == __ks_task_promise_base::__PARENT_SUSPENDED)
+					return promise.m_continuation;
+				return std::noop_coroutine();
+			}
+
+			//顶层task：先销毁帧，再settle结果future
+			ks_promise<T> result_promise = std::move(promise.m_result_promise);
+			ks_result<T> result = std::move(promise.m_result);
+			handle.destroy();
+			result_promise.try_settle(result);
+			return std::noop_coroutine();
+		}
+		void await_resume() const noexcept {}
+	};
+
+	__final_awaiter final_suspend() noexcept {
+		return __final_awaiter{};
+	}
+
+	void unhandled_exception() {
+		try {
+			throw;
+		}
+		catch (const ks_error& error) {
+			this->m_result = ks_result<T>(error);
+		}
+	}
+
+private:
+	virtual ks_error do_peek_extern_cancelled_error() const noexcept override {
+		if (m_result_future.is_null() || !m_result_future.is_completed())
+			return ks_error();
+		ks_result<T> result = m_result_future.peek_result();
+		return result.is_error() ? result.to_error() : ks_error::unexpected_error();
+	}
+
+	void do_init_as_top(ks_apartment* apartment, const ks_async_context& context, const ks_promise<T>& result_promise) {
+		__ks_task_promise_base::do_init_as_top(apartment, context);
+		m_result_promise = result_promise;
+		m_result_future = result_promise.get_future();
+	}
+
+private:
+	ks_promise<T> m_result_promise = nullptr;
+	ks_future<T> m_result_future = nullptr;
+
+	template <class T2> friend class ks_task;
+	template <class T2> friend class __ks_task_awaiter;
+};
+
+
+//在ks_task中co_await子task：就地切入子task，子task同步完成时父task不挂起而直接继续，否则待子task完成后对称转移回来（均不经套间调度）
+//注：不以对称转移切入子task，是因为未实现尾调用时（如-O0），大量串行的同步子task会使栈不断增长
+template <class T>
+class __ks_task_awaiter final {
+public:
+	explicit __ks_task_awaiter(ks_task<T>&& task, __ks_task_promise_base* parent) noexcept
+		: m_task(std::move(task)), m_parent(parent) {}
+	_DISABLE_COPY_CONSTRUCTOR(__ks_task_awaiter);
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> parent_handle) {
+		ASSERT(!m_task.is_null());
+		__ks_task_promise<T>& child_promise = m_task.m_handle.promise();
+		child_promise.do_init_as_child(m_parent, parent_handle);
+		m_task.m_handle.resume();
+		return child_promise.m_child_handover_state.exchange(__ks_task_promise_base::__PARENT_SUSPENDED, std::memory_order_acq_rel) != __ks_task_promise_base::__CHILD_COMPLETED;
+	}
+
+	T await_resume() {
+		m_parent->__throw_if_cancelled();
+
+		const ks_result<T>& result = m_task.m_handle.promise().m_result;
+		ASSERT(result.is_completed());
+		if (!result.is_value())
+			throw result.to_error();
+		if constexpr (!std::is_void_v<T>)
+			return result.to_value();
+	}
+
+private:
+	ks_task<T> m_task; //析构时销毁子task的帧
+	__ks_task_promise_base* m_parent;
+};
+
+
+template <class T>
+class ks_task final {
+public:
+	using promise_type = __ks_task_promise<T>;
+	using value_type = T;
+	using this_task_type = ks_task<T>;
+
+	ks_task(nullptr_t) noexcept : m_handle(nullptr) {}
+
+	ks_task(ks_task&& r) noexcept : m_handle(std::exchange(r.m_handle, nullptr)) {}
+	ks_task& operator=(ks_task&& r) noexcept {
+		if (this != &r) {
+			if (m_handle)
+				m_handle.destroy();
+			m_handle = std::exchange(r.m_handle, nullptr);
+		}
+		return *this;
+	}
+
+	~ks_task() {
+		if (m_handle)
+			m_handle.destroy(); //未启动即被丢弃
+	}
+
+	_DISABLE_COPY_CONSTRUCTOR(ks_task);
+
+public:
+	bool is_null() const noexcept {
+		return !m_handle;
+	}
+
+	//在apartment中启动，协程体此后亦恢复于该套间；返回其结果future（对该future的try_cancel、超时，以及context的取消均会在协程下次恢复时生效）
+	ks_future<T> post(ks_apartment* apartment, const ks_async_context& context = {}) && {
+		ASSERT(apartment != nullptr);
+		ASSERT(!this->is_null());
+
+		ks_promise<T> result_promise = ks_promise<T>::create();
+		ks_future<T> result_future = result_promise.get_future();
+		if (context.__get_timeout() > 0)
+			result_future.set_timeout(context.__get_timeout());
+
+		std::coroutine_handle<promise_type> handle = std::exchange(m_handle, nullptr);
+		handle.promise().do_init_as_top(apartment, context, result_promise);
+
+		uint64_t act_schedule_id = apartment->schedule([handle]() { handle.resume(); }, context.__get_priority());
+		if (act_schedule_id == 0) {
+			handle.destroy();
+			result_promise.reject(ks_error::terminated_error());
+		}
+
+		return result_future;
+	}
+
+private:
+	explicit ks_task(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) {}
+
+	friend class __ks_task_promise<T>;
+	friend class __ks_task_awaiter<T>;
+
+private:
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+
+//ks_async_generator的promise-type：生产者协程体经co_yield把值放入一个有界环形缓冲，缓冲满时挂起，待消费者取走后再于生产者套间中恢复；
+//消费者在他处co_await next()，缓冲为空时挂起，待生产者co_yield（或结束）后再于消费者套间中恢复。逐个元素既不分配future，也不分配缓冲。
+//帧的销毁：消费者放弃（即ks_async_generator析构）时，若生产者未在执行中则由消费者销毁，否则由生产者在结束时自行销毁。
+template <class T>
+class __ks_async_generator_promise final : public __ks_task_promise_base {
+public:
+	__ks_async_generator_promise() noexcept = default;
+	_DISABLE_COPY_CONSTRUCTOR(__ks_async_generator_promise);
+
+	ks_async_generator<T> get_return_object() noexcept {
+		return ks_async_generator<T>(std::coroutine_handle<__ks_async_generator_promise>::from_promise(*this));
+	}
+
+	__ks_task_promise_base::__initial_awaiter initial_suspend() noexcept {
+		return __ks_task_promise_base::__initial_awaiter{ this };
+	}
+
+	struct __yield_awaiter {
+		__ks_async_generator_promise* promise;
+		T value;
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<__ks_async_generator_promise> handle) {
+			//注：生产者一旦可被他处恢复或销毁（即解锁后），本awaiter随时可能失效，故此后只可访问局部变量
+			std::unique_lock<ks_mutex> lock(promise->m_mutex);
+			if (promise->m_consumer_detached.load(std::memory_order_relaxed))
+				return false; //消费者已放弃，不再挂起（await_resume将抛出cancelled_error）
+
+			promise->_push_value_locked(std::move(value));
+			__ks_async_generator_next_awaiter<T>* consumer_awaiter = std::exchange(promise->m_consumer_awaiter, nullptr);
+			bool should_suspend = promise->m_count == promise->m_ring.size();
+			if (should_suspend)
+				promise->m_producer_state = __PRODUCER_SUSPENDED_FULL;
+			lock.unlock();
+
+			if (consumer_awaiter != nullptr)
+				consumer_awaiter->__wake();
+			return should_suspend;
+		}
+		void await_resume() {
+			if (std::exchange(promise->m_terminated, false))
+				throw ks_error::terminated_error();
+			promise->__throw_if_cancelled();
+		}
+	};
+
+	__yield_awaiter yield_value(const T& value) {
+		return __yield_awaiter{ this, value };
+	}
+	__yield_awaiter yield_value(T&& value) {
+		return __yield_awaiter{ this, std::move(value) };
+	}
+
+	struct __final_awaiter {
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<__ks_async_generator_promise> handle) noexcept {
+			__ks_async_generator_promise& promise = handle.promise();
+			std::unique_lock<ks_mutex> lock(promise.m_mutex);
+			bool consumer_detached = promise.m_consumer_detached.load(std::memory_order_relaxed);
+			promise.m_producer_state = __PRODUCER_DONE;
+			__ks_async_generator_next_awaiter<T>* consumer_awaiter = std::exchange(promise.m_consumer_awaiter, nullptr);
+			lock.unlock();
+
+			if (consumer_detached)
+				handle.destroy(); //消费者已放弃，帧由生产者自行销毁
+			else if (consumer_awaiter != nullptr)
+				consumer_awaiter->__wake();
+		}
+		void await_resume() const noexcept {}
+	};
+
+	__final_awaiter final_suspend() noexcept {
+		return __final_awaiter{};
+	}
+
+	void return_void() noexcept {}
+
+	void unhandled_exception() {
+		try {
+			throw;
+		}
+		catch (const ks_error& error) {
+			m_final_error = error;
+		}
+	}
+
+private:
+	enum { __PRODUCER_NOT_STARTED = 0, __PRODUCER_RUNNING = 1, __PRODUCER_SUSPENDED_FULL = 2, __PRODUCER_DONE = 3 };
+
+	virtual ks_error do_peek_extern_cancelled_error() const noexcept override {
+		return m_consumer_detached.load(std::memory_order_relaxed) ? ks_error::cancelled_error() : ks_error();
+	}
+
+	void _push_value_locked(T&& value) {
+		ASSERT(m_count < m_ring.size());
+		m_ring[(m_head + m_count) % m_ring.size()].emplace(std::move(value));
+		++m_count;
+	}
+
+	T _pop_value_locked() {
+		ASSERT(m_count > 0);
+		T value = std::move(*m_ring[m_head]);
+		m_ring[m_head].reset();
+		m_head = (m_head + 1) % m_ring.size();
+		--m_count;
+		return value;
+	}
+
+	//返回false表示套间已关闭
+	bool _start(ks_apartment* apartment, size_t buffer_capacity, const ks_async_context& context) {
+		__ks_task_promise_base::do_init_as_top(apartment, context);
+		m_ring.resize(buffer_capacity > 0 ? buffer_capacity : 1);
+		m_producer_state = __PRODUCER_RUNNING;
+
+		std::coroutine_handle<__ks_async_generator_promise> handle = std::coroutine_handle<__ks_async_generator_promise>::from_promise(*this);
+		uint64_t act_schedule_id = apartment->schedule([handle]() { handle.resume(); }, m_priority);
+		if (act_schedule_id == 0) {
+			m_final_error = ks_error::terminated_error();
+			m_producer_state = __PRODUCER_DONE;
+			return false;
+		}
+		return true;
+	}
+
+	//返回true表示帧应由调用者（消费者）销毁
+	bool _detach() {
+		std::unique_lock<ks_mutex> lock(m_mutex);
+		m_consumer_detached.store(true, std::memory_order_relaxed);
+		return m_producer_state != __PRODUCER_RUNNING;
+	}
+
+	//消费者：有值或已结束时返回true，否则登记consumer_awaiter并返回false
+	bool _try_ready_or_wait(__ks_async_generator_next_awaiter<T>* consumer_awaiter) {
+		std::unique_lock<ks_mutex> lock(m_mutex);
+		if (m_count > 0 || m_producer_state == __PRODUCER_DONE)
+			return true;
+		ASSERT(m_consumer_awaiter == nullptr);
+		m_consumer_awaiter = consumer_awaiter;
+		return false;
+	}
+
+	//消费者：取出一个值（或结束时的错误），若生产者因缓冲满而挂起则唤醒之
+	ks_result<T> _take() {
+		std::unique_lock<ks_mutex> lock(m_mutex);
+		if (m_count == 0) {
+			ASSERT(m_producer_state == __PRODUCER_DONE);
+			return m_final_error;
+		}
+
+		T value = this->_pop_value_locked();
+		bool should_wake_producer = m_producer_state == __PRODUCER_SUSPENDED_FULL;
+		if (should_wake_producer)
+			m_producer_state = __PRODUCER_RUNNING;
+		lock.unlock();
+
+		if (should_wake_producer) {
+			//注：生产者此时已挂起，且只可由本消费者恢复或销毁，故可安全访问其帧
+			std::coroutine_handle<__ks_async_generator_promise> handle = std::coroutine_handle<__ks_async_generator_promise>::from_promise(*this);
+			uint64_t act_schedule_id = m_apartment->schedule([handle]() { handle.resume(); }, m_priority);
+			if (act_schedule_id == 0) {
+				m_terminated = true;
+				handle.resume(); //套间已关闭，只好就地恢复（生产者的co_yield将抛出terminated_error）
+			}
+		}
+
+		return ks_result<T>(std::move(value));
+	}
+
+private:
+	ks_mutex m_mutex;
+	std::vector<std::optional<T>> m_ring; //有界环形缓冲，于启动时一次分配
+	size_t m_head = 0;
+	size_t m_count = 0;
+	int m_producer_state = __PRODUCER_NOT_STARTED;
+	std::atomic<bool> m_consumer_detached = { false };
+	__ks_async_generator_next_awaiter<T>* m_consumer_awaiter = nullptr; //挂起等待中的消费者
+	ks_error m_final_error = ks_error::eof_error(); //生产者正常结束时为eof_error
+	bool m_terminated = false;
+
+	template <class T2> friend class ks_async_generator;
+	template <class T2> friend class __ks_async_generator_next_awaiter;
+};
+
+
+//co_await ks_async_generator<T>::next()的awaiter：得到下一个值，生产者结束后得到eof_error（或其失败时的ks_error）；
+//在ks_task中恢复于task的套间，在其他协程中则恢复于挂起时的当前套间（或default_mta）
+template <class T>
+class __ks_async_generator_next_awaiter final {
+public:
+	explicit __ks_async_generator_next_awaiter(__ks_async_generator_promise<T>* promise, __ks_task_promise_base* task_promise) noexcept
+		: m_promise(promise), m_task_promise(task_promise) {}
+	_DISABLE_COPY_CONSTRUCTOR(__ks_async_generator_next_awaiter);
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle) {
+		m_handle = handle;
+		if (m_task_promise != nullptr) {
+			m_resume_apartment = m_task_promise->__get_apartment();
+			m_resume_priority = m_task_promise->__get_priority();
+		}
+		else {
+			m_resume_apartment = ks_apartment::current_thread_apartment_or_default_mta();
+		}
+
+		//注：登记后随时可能被生产者唤醒，故此后不可再访问成员
+		return !m_promise->_try_ready_or_wait(this);
+	}
+
+	ks_result<T> await_resume() {
+		if (m_terminated)
+			return ks_error::terminated_error();
+		if (m_task_promise != nullptr)
+			m_task_promise->__throw_if_cancelled();
+		return m_promise->_take();
+	}
+
+private:
+	//由生产者调用（已在锁外）
+	void __wake() {
+		std::coroutine_handle<> handle = m_handle;
+		uint64_t act_schedule_id = m_resume_apartment->schedule([handle]() { handle.resume(); }, m_resume_priority);
+		if (act_schedule_id == 0) {
+			m_terminated = true;
+			handle.resume(); //套间已关闭，只好就地恢复
+		}
+	}
+
+private:
+	__ks_async_generator_promise<T>* m_promise;
+	__ks_task_promise_base* m_task_promise;
+	std::coroutine_handle<> m_handle = nullptr;
+	ks_apartment* m_resume_apartment = nullptr;
+	int m_resume_priority = 0;
+	bool m_terminated = false;
+
+	friend class __ks_async_generator_promise<T>;
+	friend class __ks_task_promise_base;
+};
+
+
+template <class T>
+class ks_async_generator final {
+	static_assert(!std::is_void_v<T>, "ks_async_generator<void> is not supported");
+
+public:
+	using promise_type = __ks_async_generator_promise<T>;
+	using value_type = T;
+	using this_generator_type = ks_async_generator<T>;
+
+	ks_async_generator(nullptr_t) noexcept : m_handle(nullptr) {}
+
+	ks_async_generator(ks_async_generator&& r) noexcept : m_handle(std::exchange(r.m_handle, nullptr)), m_started(std::exchange(r.m_started, false)) {}
+	ks_async_generator& operator=(ks_async_generator&& r) noexcept {
+		if (this != &r) {
+			this->__detach();
+			m_handle = std::exchange(r.m_handle, nullptr);
+			m_started = std::exchange(r.m_started, false);
+		}
+		return *this;
+	}
+
+	~ks_async_generator() {
+		this->__detach();
+	}
+
+	_DISABLE_COPY_CONSTRUCTOR(ks_async_generator);
+
+public:
+	bool is_null() const noexcept {
+		return !m_handle;
+	}
+
+	//在apartment中启动生产者，协程体此后亦恢复于该套间；生产者最多可领先消费者buffer_capacity个值（至少为1）
+	//context的controller被取消或owner失效时，生产者在下次恢复时结束，消费者随后得到cancelled_error
+	void start(ks_apartment* apartment, size_t buffer_capacity = 1, const ks_async_context& context = {}) {
+		ASSERT(apartment != nullptr);
+		ASSERT(!this->is_null() && !m_started);
+		m_started = true;
+		m_handle.promise()._start(apartment, buffer_capacity, context);
+	}
+
+	//ks_result<T> result = co_await generator.next(); 生产者结束后result为eof_error（或其失败时的ks_error）
+	//注：同一时刻只可有一个消费者在等待
+	__ks_async_generator_next_awaiter<T> next() {
+		ASSERT(!this->is_null() && m_started);
+		return __ks_async_generator_next_awaiter<T>(&m_handle.promise(), nullptr);
+	}
+
+private:
+	explicit ks_async_generator(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) {}
+
+	//消费者放弃：生产者未在执行中则就地销毁帧，否则由生产者在下次恢复时（因cancelled_error）结束并自行销毁
+	void __detach() noexcept {
+		if (m_handle) {
+			std::coroutine_handle<promise_type> handle = std::exchange(m_handle, nullptr);
+			if (handle.promise()._detach())
+				handle.destroy();
+		}
+	}
+
+	friend class __ks_async_generator_promise<T>;
+
+private:
+	std::coroutine_handle<promise_type> m_handle;
+	bool m_started = false;
+};
+
+
+#endif //__cpp_impl_coroutine
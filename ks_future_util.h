@@ -18,6 +18,7 @@ limitations under the License.
 #include "ks_async_base.h"
 #include "ks_future.h"
 #include "ks_promise.h"
+#include "ktl/ks_defer.h"
 
 
 _NAMESPACE_LIKE class ks_future_util final { //as namespace
@@ -222,6 +223,23 @@ public: //repeat, repeat_periodic, repeat_productive
 		ks_apartment* consume_apartment, CONSUME_FN&& consume_fn,
 		const ks_async_context& context = {});
 
+public: //post_resumable
+	//注：可续的长任务：在apartment中反复调用fn，每次执行一段，全部完成时返回true；
+	//其间若ks_apartment::is_yield_needed（有更高优先级的任务待执行或时间片已用尽），则结束本轮、重新投递，待轮到时继续调用fn。
+	//非fiber模式的套间中无法以ks_apartment::yield_if_needed挂起任务，长任务可以此分段执行，而无需自行重新投递。
+	template <class FN, class _ = std::enable_if_t<
+		std::is_convertible_v<FN, std::function<bool()>> ||
+		std::is_convertible_v<FN, std::function<bool(ks_cancel_inspector*)>>>>
+	static ks_future<void> post_resumable(
+		ks_apartment* apartment, FN&& fn,
+		const ks_async_context& context = {});
+
+private:
+	template <class FN>
+	static std::function<bool(ks_cancel_inspector*)> __wrap_resumable_fn_by_arglist(FN&& fn, std::integral_constant<int, 1>);
+	template <class FN>
+	static std::function<bool(ks_cancel_inspector*)> __wrap_resumable_fn_by_arglist(FN&& fn, std::integral_constant<int, 2>);
+
 private:
 	struct __periodic_data_t {
 		ks_apartment* apartment;
@@ -150,10 +150,15 @@ _NOINLINE ks_future<void> ks_future_util::parallel(
 	else {
 		std::vector<ks_future<void>> future_vec;
 		future_vec.reserve(fns.size());
+
+		//注：批量投递，各task合并为一次schedule_batch
+		ks_raw_future::__begin_batch_schedule();
+		ks_defer defer_end_batch_schedule([]() { ks_raw_future::__end_batch_schedule(); });
 		for (const auto& fn : fns) {
 			future_vec.push_back(
 				ks_future_util::post<void>(apartment, fn, context));
 		}
+		defer_end_batch_schedule.apply();
 
 		return ks_future_util::all(future_vec);
 	}
@@ -177,11 +182,15 @@ _NOINLINE ks_future<void> ks_future_util::parallel_n(
 		std::vector<ks_future<void>> future_vec;
 		future_vec.reserve(n);
 
+		//注：批量投递，各task合并为一次schedule_batch
+		ks_raw_future::__begin_batch_schedule();
+		ks_defer defer_end_batch_schedule([]() { ks_raw_future::__end_batch_schedule(); });
 		for (size_t i = 0; i < n; ++i) {
 			future_vec.push_back(
 				ks_future_util::post<void>(apartment, fn, context)
 			);
 		}
+		defer_end_batch_schedule.apply();
 
 		//std::__try_prune_if_mutable_rvalue_reference<FN>(fn);
 		return ks_future_util::all(future_vec);
@@ -385,6 +394,41 @@ _NOINLINE ks_future<void> ks_future_util::repeat_productive(
 }
 
 
+template <class FN, class _>
+_NOINLINE ks_future<void> ks_future_util::post_resumable(
+	ks_apartment* apartment, FN&& fn,
+	const ks_async_context& context) {
+
+	constexpr int arglist_mode = std::is_convertible_v<FN, std::function<bool(ks_cancel_inspector*)>> ? 2 : 1;
+	std::function<bool(ks_cancel_inspector*)> step_fn = __wrap_resumable_fn_by_arglist(std::forward<FN>(fn), std::integral_constant<int, arglist_mode>());
+
+	//每轮在一个任务中连续调用step_fn，直至全部完成（以eof结束repeat）或需让出（结束本轮，由repeat重新投递）
+	return ks_future_util::repeat_productive<nothing_t>(
+		apartment, []() -> nothing_t { return nothing; },
+		apartment, [step_fn](const nothing_t&, ks_cancel_inspector* inspector) -> ks_result<void> {
+			while (true) {
+				if (step_fn(inspector))
+					return ks_error::eof_error();
+				if (inspector->check_cancelled())
+					return ks_error::cancelled_error();
+				if (ks_apartment::is_yield_needed())
+					return nothing;
+			}
+		},
+		context);
+}
+
+template <class FN>
+inline std::function<bool(ks_cancel_inspector*)> ks_future_util::__wrap_resumable_fn_by_arglist(FN&& fn, std::integral_constant<int, 1>) {
+	return [fn = std::function<bool()>(std::forward<FN>(fn))](ks_cancel_inspector*) -> bool { return fn(); };
+}
+
+template <class FN>
+inline std::function<bool(ks_cancel_inspector*)> ks_future_util::__wrap_resumable_fn_by_arglist(FN&& fn, std::integral_constant<int, 2>) {
+	return std::function<bool(ks_cancel_inspector*)>(std::forward<FN>(fn));
+}
+
+
 template <class _>
 _NOINLINE void ks_future_util::__schedule_periodic_once(const std::shared_ptr<__periodic_data_t>& data, int64_t next_delay) {
 	ks_future_util
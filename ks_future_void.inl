@@ -299,6 +299,18 @@ public: //post, post_delayed, post_pending
 		return ks_future<void>::post(apartment, std::forward<FN>(task_fn), context);
 	}
 
+	//注：在blocking_mta中执行阻塞调用（同步I/O等），以免其占用计算套间的线程。
+	template <class FN, class _ = std::enable_if_t<
+		std::is_convertible_v<FN, std::function<void()>> || 
+		std::is_convertible_v<FN, std::function<ks_result<void>()>> || 
+		std::is_convertible_v<FN, std::function<ks_future<void>()>> ||
+		std::is_convertible_v<FN, std::function<void(ks_cancel_inspector*)>> || 
+		std::is_convertible_v<FN, std::function<ks_result<void>(ks_cancel_inspector*)>> || 
+		std::is_convertible_v<FN, std::function<ks_future<void>(ks_cancel_inspector*)>>>>
+	static ks_future<void> post_blocking(FN&& task_fn, const ks_async_context& context = {}) {
+		return ks_future<void>::post(ks_apartment::blocking_mta(), std::forward<FN>(task_fn), context);
+	}
+
 	template <class FN, class _ = std::enable_if_t<
 		std::is_convertible_v<FN, std::function<void()>> || 
 		std::is_convertible_v<FN, std::function<ks_result<void>()>> ||
@@ -518,6 +530,7 @@ private:
 	template <class T2> friend class ks_promise;
 	friend class ks_future_util;
 	friend class ks_async_flow;
+	friend class ks_coroutine_util;
 
 private:
 	ks_future<nothing_t> m_nothing_future;
@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include "ks_single_thread_apartment_imp.h"
+#include "ks_apartment_fiber.h"
 #include "ktl/ks_defer.h"
 #include <thread>
 #include <algorithm>
@@ -25,6 +26,27 @@ static std::atomic<uint64_t> g_last_fn_id { 0 };
 
 static thread_local int tls_current_thread_pump_loop_depth = 0;
 
+//当前任务的优先级（随fiber保存和恢复）及其时间片的起始时刻（空为尚未计时），用于判断是否需让出（见__check_yield_needed）
+static thread_local int tls_current_thread_running_fn_priority = 0;
+static thread_local std::chrono::steady_clock::time_point tls_current_thread_time_slice_begin_time = {};
+
+static void* _exchange_current_thread_running_fn_priority(void* value) {
+	const int pre_priority = tls_current_thread_running_fn_priority;
+	tls_current_thread_running_fn_priority = (int)(intptr_t)value;
+	return (void*)(intptr_t)pre_priority;
+}
+static const bool g_running_fn_priority_registered = ks_apartment::__register_fiber_local_tls(&_exchange_current_thread_running_fn_priority);
+
+//开始执行任务：置当前任务的优先级，其时间片待首次检查时才开始计时（免于每个任务都读取时钟）；返回原优先级，以便嵌套执行后恢复
+static int _begin_running_fn(int priority) {
+	const int pre_priority = tls_current_thread_running_fn_priority;
+	tls_current_thread_running_fn_priority = priority;
+	tls_current_thread_time_slice_begin_time = {};
+	return pre_priority;
+}
+
+static constexpr size_t _IDLE_FN_BYPASS_MAX_COUNT = 32; //idle任务至多连续被越过的次数，即其在繁忙时至少可获得约1/33的执行份额
+
 
 ks_single_thread_apartment_imp::ks_single_thread_apartment_imp(const char* name, uint flags) 
 	: ks_single_thread_apartment_imp(name, flags, nullptr, nullptr) {
@@ -122,7 +144,7 @@ void ks_single_thread_apartment_imp::wait() {
 		m_d->stopped_state_cv.wait(lock);
 	}
 
-	ASSERT(m_d->now_fn_queue_prior.empty() && m_d->now_fn_queue_normal.empty());
+	ASSERT(m_d->now_fn_queue_prior.empty() && m_d->now_fn_queue_normal.empty() && m_d->now_fn_queue_deadline.empty() && m_d->now_fn_queue_sjf.empty());
 }
 
 bool ks_single_thread_apartment_imp::is_stopped() {
@@ -144,7 +166,55 @@ bool ks_single_thread_apartment_imp::is_stopping_or_stopped() {
 }
 
 
-uint64_t ks_single_thread_apartment_imp::schedule(std::function<void()>&& fn, int priority) {
+uint64_t ks_single_thread_apartment_imp::schedule(ks_unique_function<void()>&& fn, int priority) {
+	if (priority >= 0 && m_d->inbound_ready_v && m_d->state_v == _STATE::RUNNING) {
+		//快速路径：以一次CAS放入入站链表，不加锁；仅当工作线程已挂起等待时，才加锁唤醒之
+		//（idle任务须在锁内分配撤销槽位，故不走快速路径）
+		uint64_t fn_id = ks_apartment_fn_slot_table::make_unslotted_fn_id(++g_last_fn_id);
+		ASSERT(fn_id != 0);
+
+		auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
+		fn_item->fn = std::move(fn);
+		fn_item->fn_id = fn_id;
+		fn_item->priority = priority;
+		if (m_d->flags & deadline_first_flag)
+			fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+		if (m_d->flags & shortest_job_first_flag)
+			fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
+
+		auto* inbound_list = priority == 0 ? &m_d->inbound_list_normal : &m_d->inbound_list_prior;
+		_do_push_fn_item_into_inbound_list(inbound_list, std::move(fn_item));
+
+		//注：入链后须再检查状态：若与stop竞争，而工作线程退出时对入站链表的清理已经完成（即已STOPPED），则本任务不会再被执行或释放，
+		//故由本线程取回入站链表中的残留任务，在锁外释放之，并返回0（若仍为STOPPING，则退出时的清理尚在其后，随同清理即可）
+		if (m_d->state_v != _STATE::RUNNING) {
+			std::unique_lock<ks_mutex> lock(m_d->mutex);
+			if (m_d->state_v == _STATE::STOPPED) {
+				std::vector<std::shared_ptr<_FN_ITEM>> t_fn_items;
+				for (auto* list : { &m_d->inbound_list_prior, &m_d->inbound_list_normal }) {
+					_FN_ITEM* raw_fn_item = list->exchange(nullptr, std::memory_order_acquire);
+					while (raw_fn_item != nullptr) {
+						_FN_ITEM* next = raw_fn_item->inbound_next;
+						raw_fn_item->inbound_next = nullptr;
+						t_fn_items.push_back(std::move(raw_fn_item->inbound_self_ref));
+						raw_fn_item = next;
+					}
+				}
+				lock.unlock();
+				t_fn_items.clear();
+				return 0;
+			}
+		}
+
+		//注：consumer_parked_v须在入链之后读取，与工作线程等待前的检查顺序相反，避免遗漏唤醒
+		if (m_d->consumer_parked_v.load()) {
+			std::unique_lock<ks_mutex> lock(m_d->mutex);
+			m_d->any_fn_queue_cv.notify_one();
+		}
+
+		return fn_id;
+	}
+
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
 	_try_start_locked(lock);
 
@@ -153,22 +223,29 @@ uint64_t ks_single_thread_apartment_imp::schedule(std::function<void()>&& fn, in
 		return 0;
 	}
 
-	uint64_t fn_id = ++g_last_fn_id;
+	uint64_t fn_id = priority < 0
+		? m_d->fn_slot_table.alloc_slotted_fn_id_locked(++g_last_fn_id)  //idle任务可撤销，占用槽位
+		: ks_apartment_fn_slot_table::make_unslotted_fn_id(++g_last_fn_id);
 	ASSERT(fn_id != 0);
 	ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
 
-	auto fn_item = std::make_shared<_FN_ITEM>();
+	auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
 	fn_item->fn = std::move(fn);
 	fn_item->fn_id = fn_id;
 	fn_item->priority = priority;
+	if (m_d->flags & deadline_first_flag)
+		fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+	if (m_d->flags & shortest_job_first_flag)
+		fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
 
+	_do_drain_inbound_lists_locked(m_d, lock); //先转入已在入站链表中的任务，以保持次序
 	_do_put_fn_item_into_now_list_locked(m_d, std::move(fn_item), lock);
 	_prepare_work_thread_locked(this, m_d, lock);
 
 	return fn_id;
 }
 
-uint64_t ks_single_thread_apartment_imp::schedule_delayed(std::function<void()>&& fn, int priority, int64_t delay) {
+uint64_t ks_single_thread_apartment_imp::schedule_delayed(ks_unique_function<void()>&& fn, int priority, int64_t delay) {
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
 	_try_start_locked(lock);
 
@@ -177,15 +254,19 @@ uint64_t ks_single_thread_apartment_imp::schedule_delayed(std::function<void()>&
 		return 0;
 	}
 
-	uint64_t fn_id = ++g_last_fn_id;
+	uint64_t fn_id = m_d->fn_slot_table.alloc_slotted_fn_id_locked(++g_last_fn_id); //延时任务可撤销，占用槽位
 	ASSERT(fn_id != 0);
 	ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
 
-	auto fn_item = std::make_shared<_FN_ITEM>();
+	auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
 	fn_item->fn = std::move(fn);
 	fn_item->until_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
 	fn_item->fn_id = fn_id;
 	fn_item->priority = priority;
+	if (m_d->flags & deadline_first_flag)
+		fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+	if (m_d->flags & shortest_job_first_flag)
+		fn_item->sjf_rank_time = fn_item->until_time + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
 	fn_item->delay = delay;
 	fn_item->is_delaying_fn = true;
 
@@ -195,38 +276,77 @@ uint64_t ks_single_thread_apartment_imp::schedule_delayed(std::function<void()>&
 	return fn_id;
 }
 
-void ks_single_thread_apartment_imp::try_unschedule(uint64_t id) {
-	if (id == 0)
-		return;
+size_t ks_single_thread_apartment_imp::schedule_batch(ks_unique_function<void()>* fns, size_t fn_count, int priority, uint64_t* out_fn_ids) {
+	if (fn_count == 0)
+		return 0;
 
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	_try_start_locked(lock);
 
-	auto do_erase_fn_from = [](std::deque<std::shared_ptr<_FN_ITEM>>* fn_queue, uint64_t fn_id) -> std::shared_ptr<_FN_ITEM> {
-		auto it = std::find_if(fn_queue->begin(), fn_queue->end(),
-			[fn_id](const auto& item) {return item->fn_id == fn_id; });
-		if (it == fn_queue->end())
-			return nullptr;
+	if (m_d->state_v == _STATE::STOPPED) {
+		ASSERT(false);
+		if (out_fn_ids != nullptr)
+			std::fill(out_fn_ids, out_fn_ids + fn_count, uint64_t(0));
+		return 0;
+	}
 
-		std::shared_ptr<_FN_ITEM> found_fn = std::move(*it);
-		fn_queue->erase(it);
-		return found_fn;
-	};
+	_do_drain_inbound_lists_locked(m_d, lock); //先转入已在入站链表中的任务，以保持次序
+
+	//一次性预留连续的序列号，整批入队后再统一唤醒（单线程，notify一次即可）
+	const uint64_t first_seq = g_last_fn_id.fetch_add(fn_count) + 1;
+	for (size_t i = 0; i < fn_count; ++i) {
+		uint64_t fn_id = priority < 0
+			? m_d->fn_slot_table.alloc_slotted_fn_id_locked(first_seq + i)  //idle任务可撤销，占用槽位
+			: ks_apartment_fn_slot_table::make_unslotted_fn_id(first_seq + i);
+		ASSERT(fn_id != 0);
+		ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
+
+		auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
+		fn_item->fn = std::move(fns[i]);
+		fn_item->fn_id = fn_id;
+		fn_item->priority = priority;
+		if (m_d->flags & deadline_first_flag)
+			fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+		if (m_d->flags & shortest_job_first_flag)
+			fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
+
+		_do_put_fn_item_into_now_list_locked(m_d, std::move(fn_item), lock, false);
+		if (out_fn_ids != nullptr)
+			out_fn_ids[i] = fn_id;
+	}
 
-	//检查延时任务队列
-	std::shared_ptr<_FN_ITEM> found_fn = do_erase_fn_from(&m_d->delaying_fn_queue, id);
-	//检查idle任务队列
-	if (found_fn == nullptr)
-		found_fn = do_erase_fn_from(&m_d->now_fn_queue_idle, id);
-	//对于其他任务队列（normal和prior），没有检查的必要和意义
+	m_d->any_fn_queue_cv.notify_one();
+	_prepare_work_thread_locked(this, m_d, lock);
 
-	//release fn
-	lock.unlock();
-	if (found_fn != nullptr) {
-		found_fn->fn = {};
-		found_fn = nullptr;
+	return fn_count;
+}
+
+void ks_single_thread_apartment_imp::try_unschedule(uint64_t id) {
+	if (id == 0)
+		return;
+
+	//撤销仅是对槽位的一次CAS，无需加锁查找；被撤销的任务滞留在队列中，待出队时丢弃（惰性删除）
+	//对于不占槽位的任务（normal和prior），没有撤销的必要和意义
+	if (!m_d->fn_slot_table.try_cancel(id))
+		return;
+
+	const size_t lazily_cancelled_count = ++m_d->lazily_cancelled_count_v;
+	if (lazily_cancelled_count >= 64 && lazily_cancelled_count * 2 > m_d->fn_slot_table.used_slot_count()) {
+		//滞留的已撤销任务过多时，压缩队列，以及时释放它们的fn
+		std::vector<std::shared_ptr<_FN_ITEM>> removed_fn_items;
+		std::unique_lock<ks_mutex> lock(m_d->mutex);
+		_do_compact_cancelled_fn_items_locked(m_d, &removed_fn_items, lock);
+
+		//release fn
+		lock.unlock();
+		removed_fn_items.clear();
 	}
 }
 
+void ks_single_thread_apartment_imp::set_yield_time_slice(int64_t time_slice) {
+	m_d->yield_time_slice_v.store(time_slice > 0 ? time_slice : 0);
+}
+
 void ks_single_thread_apartment_imp::_try_start_locked(std::unique_lock<ks_mutex>& lock) {
 	if (m_d->state_v == _STATE::NOT_START) {
 		m_d->state_v = _STATE::RUNNING;
@@ -241,12 +361,13 @@ void ks_single_thread_apartment_imp::_try_stop_locked(bool should_thread_exit, s
 	std::function<void()> t_thread_term_fn;
 
 	if (m_d->state_v == _STATE::RUNNING) {
+		m_d->inbound_ready_v = false;
 		if (m_d->isolated_thread_opt != nullptr || (m_d->flags & no_isolated_thread_flag)) {
 			m_d->state_v = _STATE::STOPPING;
 			m_d->any_fn_queue_cv.notify_all(); //trigger thread
 		}
 		else {
-			ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
+			ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_deadline.size() + m_d->now_fn_queue_sjf.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
 			m_d->state_v = _STATE::STOPPED;
 			m_d->stopped_state_cv.notify_all();
 			m_d->thread_init_fn.swap(t_thread_init_fn); //final cleanup
@@ -254,7 +375,7 @@ void ks_single_thread_apartment_imp::_try_stop_locked(bool should_thread_exit, s
 		}
 	}
 	else if (m_d->state_v == _STATE::NOT_START) {
-		ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
+		ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_deadline.size() + m_d->now_fn_queue_sjf.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
 		m_d->state_v = _STATE::STOPPED;
 		m_d->stopped_state_cv.notify_all();
 		m_d->thread_init_fn.swap(t_thread_init_fn); //final cleanup
@@ -277,8 +398,10 @@ void ks_single_thread_apartment_imp::_try_stop_locked(bool should_thread_exit, s
 
 
 void ks_single_thread_apartment_imp::_prepare_work_thread_locked(ks_single_thread_apartment_imp* self, const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
-	if (d->isolated_thread_opt != nullptr || (d->flags & no_isolated_thread_flag))
+	if (d->isolated_thread_opt != nullptr || (d->flags & no_isolated_thread_flag)) {
+		d->inbound_ready_v = (d->state_v == _STATE::RUNNING);
 		return;
+	}
 
 	bool need_thread_flag = false;
 	if (d->state_v == _STATE::RUNNING || !d->should_thread_exit_v) {
@@ -291,6 +414,8 @@ void ks_single_thread_apartment_imp::_prepare_work_thread_locked(ks_single_threa
 		std::thread([self, d]() {
 			_work_thread_proc(self, d); 
 		}).detach();
+
+		d->inbound_ready_v = (d->state_v == _STATE::RUNNING);
 	}
 }
 
@@ -339,14 +464,16 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 		});
 #endif
 
+		//drain inbound lists
+		_do_drain_inbound_lists_locked(d, lock);
+
 		//try next delaying_fn
 		if (!d->delaying_fn_queue.empty()) {
 			size_t moved_fn_count = 0;
 			const auto now = std::chrono::steady_clock::now();
 			while (!d->delaying_fn_queue.empty() && d->delaying_fn_queue.front()->until_time <= now) {
 				//直接将到期的delaying项移入now队列
-				_do_put_fn_item_into_now_list_locked(d, std::move(d->delaying_fn_queue.front()), lock);
-				d->delaying_fn_queue.pop_front();
+				_do_put_fn_item_into_now_list_locked(d, d->delaying_fn_queue.pop_front(), lock);
 				++moved_fn_count;
 			}
 
@@ -356,16 +483,41 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 			}
 		}
 
+		//try next ready fiber (fiber模式：已被awaken的fiber先于新任务恢复执行)
+		if (!d->ready_fibers.empty()) {
+			ks_apartment_fiber* fiber = d->ready_fibers.front();
+			d->ready_fibers.pop_front();
+
+			ASSERT(!d->busy_thread_flag);
+			d->busy_thread_flag = true;
+
+			ks_defer defer_dec_busy_thread_flag([&d, &lock]() {
+				ASSERT(lock.owns_lock());
+				ASSERT(d->busy_thread_flag);
+				d->busy_thread_flag = false;
+			});
+
+			lock.unlock();
+			tls_current_thread_time_slice_begin_time = {}; //被恢复的fiber重新计时其时间片
+			ks_apartment_fiber::resume(fiber); //若再次park，则已被重新登记于parked_fibers
+
+			lock.lock(); //for busy_thread_flag
+			continue;
+		}
+
 		//try next now_fn
 		if (true) {
-			auto* now_fn_queue_sel = !d->now_fn_queue_prior.empty() ? &d->now_fn_queue_prior : &d->now_fn_queue_normal;
-			if (now_fn_queue_sel->empty() && !d->now_fn_queue_idle.empty() && d->state_v == _STATE::RUNNING)
-				now_fn_queue_sel = &d->now_fn_queue_idle;
-
-			if (!now_fn_queue_sel->empty()) {
+			auto now_fn_item = _try_pop_now_fn_item_locked(d, d->state_v == _STATE::RUNNING, lock);
+			if (now_fn_item != nullptr) {
 				//pop and exec a fn
-				auto now_fn_item = std::move(now_fn_queue_sel->front());
-				now_fn_queue_sel->pop_front();
+				if (!_try_claim_fn_item_locked(d, now_fn_item, lock)) {
+					//已被撤销，丢弃（在锁外释放fn）
+					lock.unlock();
+					now_fn_item->fn = {};
+					now_fn_item.reset();
+					lock.lock();
+					continue;
+				}
 
 				ASSERT(!d->busy_thread_flag);
 				d->busy_thread_flag = true;
@@ -377,8 +529,7 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 				});
 
 				lock.unlock();
-				now_fn_item->fn();
-				now_fn_item->fn = {};
+				_exec_fn_item(d, now_fn_item);
 				now_fn_item.reset();
 
 				lock.lock(); //for working_rc and busy_thread_count
@@ -387,33 +538,58 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 		}
 
 		//pump-idle
+		if (d->state_v != _STATE::RUNNING && !d->parked_fibers.empty()) {
+			//同嵌套泵在非RUNNING时退出，被park的fiber亦全部唤醒，其wait将以失败返回
+			for (auto& parked_item : d->parked_fibers)
+				d->ready_fibers.push_back(parked_item.fiber);
+			d->parked_fibers.clear();
+			continue;
+		}
+
 		if (d->state_v == _STATE::STOPPING && d->should_thread_exit_v) {
 			break; //end
 		}
 
 		//waiting
+		//先置parked标记、再检查入站链表（与schedule快速路径的次序相反），避免遗漏唤醒
+		d->consumer_parked_v.store(true);
+		if (!_check_inbound_lists_empty(d)) {
+			d->consumer_parked_v.store(false);
+			continue;
+		}
+
 		if (d->state_v == _STATE::RUNNING && !d->delaying_fn_queue.empty()) {
 			d->any_fn_queue_cv.wait_until(lock, d->delaying_fn_queue.front()->until_time);
 		}
 		else {
 			d->any_fn_queue_cv.wait(lock);
 		}
+
+		d->consumer_parked_v.store(false, std::memory_order_relaxed);
 	}
 
 	--tls_current_thread_pump_loop_depth;
 	ASSERT(tls_current_thread_pump_loop_depth == 0);
 
-	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_prior;
+	ks_apartment_priority_fn_heap<_FN_ITEM> t_now_fn_queue_prior;
+	ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::deadline_time> t_now_fn_queue_deadline;
+	ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::sjf_rank_time> t_now_fn_queue_sjf;
 	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_normal;
-	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_idle;
-	std::deque<std::shared_ptr<_FN_ITEM>> t_delaying_fn_queue;
+	ks_apartment_priority_fn_heap<_FN_ITEM> t_now_fn_queue_idle;
+	ks_apartment_delaying_fn_heap<_FN_ITEM> t_delaying_fn_queue;
+	std::vector<std::shared_ptr<_FN_ITEM>> t_cancelled_fn_items;
 	std::function<void()> t_thread_init_fn;
 	std::function<void()> t_thread_term_fn;
 	if (true) {
 		std::unique_lock<ks_mutex> lock(d->mutex);
 		if (d->state_v == _STATE::STOPPING) {
-			ASSERT(d->now_fn_queue_idle.empty() && d->delaying_fn_queue.empty());
+			_do_drain_inbound_lists_locked(d, lock); //与stop竞争而入链的任务，随同清理
+			_do_compact_cancelled_fn_items_locked(d, &t_cancelled_fn_items, lock); //滞留的已撤销任务
+			ASSERT(d->delaying_fn_queue.empty());
 			d->now_fn_queue_prior.swap(t_now_fn_queue_prior);
+			d->prior_fn_count_v.store(0, std::memory_order_relaxed);
+			d->now_fn_queue_deadline.swap(t_now_fn_queue_deadline);
+			d->now_fn_queue_sjf.swap(t_now_fn_queue_sjf);
 			d->now_fn_queue_normal.swap(t_now_fn_queue_normal);
 			d->now_fn_queue_idle.swap(t_now_fn_queue_idle);
 			d->delaying_fn_queue.swap(t_delaying_fn_queue);
@@ -429,9 +605,12 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 	}
 
 	t_now_fn_queue_prior.clear();
+	t_now_fn_queue_deadline.clear();
+	t_now_fn_queue_sjf.clear();
 	t_now_fn_queue_normal.clear();
 	t_now_fn_queue_idle.clear();
 	t_delaying_fn_queue.clear();
+	t_cancelled_fn_items.clear();
 	t_thread_init_fn = nullptr;
 	t_thread_term_fn = nullptr;
 	using_thread_init_fn = nullptr;
@@ -440,64 +619,92 @@ void ks_single_thread_apartment_imp::_work_thread_proc(ks_single_thread_apartmen
 	ASSERT(ks_apartment::current_thread_apartment() == self);
 }
 
-void ks_single_thread_apartment_imp::_do_put_fn_item_into_now_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock) {
-	auto* now_fn_queue_sel = 
-		(fn_item->is_delaying_fn && (d->flags & delayed_always_low_prior_flag)) ? &d->now_fn_queue_idle :  //延时任务强制为低优先级?
-		fn_item->priority == 0 ? &d->now_fn_queue_normal :  //priority=0为普通优先级
-		fn_item->priority > 0 ? &d->now_fn_queue_prior :    //priority>0为高优先级
-		&d->now_fn_queue_idle;                              //priority<0为低优先级，简单地加入到idle队列
+void ks_single_thread_apartment_imp::_do_put_fn_item_into_now_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock, bool should_notify) {
+	if (fn_item->is_delaying_fn && (d->flags & delayed_always_low_prior_flag))
+		d->now_fn_queue_idle.push(std::move(fn_item));        //延时任务强制为低优先级?
+	else if (fn_item->priority == 0 && fn_item->deadline_time != std::chrono::steady_clock::time_point{})
+		d->now_fn_queue_deadline.push(std::move(fn_item));    //priority=0且带截止时刻（仅deadline_first_flag模式），按截止时刻排序
+	else if (fn_item->priority == 0 && (d->flags & shortest_job_first_flag)) {
+		//priority=0且为SJF模式，按投递时刻+预估耗时排序
+		d->now_fn_queue_sjf.push(std::move(fn_item));
+	}
+	else if (fn_item->priority == 0)
+		d->now_fn_queue_normal.push_back(std::move(fn_item)); //priority=0为普通优先级，直入
+	else if (fn_item->priority > 0) {
+		d->now_fn_queue_prior.push(std::move(fn_item));       //priority>0为高优先级
+		d->prior_fn_count_v.store(d->now_fn_queue_prior.size(), std::memory_order_relaxed);
+	}
+	else
+		d->now_fn_queue_idle.push(std::move(fn_item));        //priority<0为低优先级，加入到idle队列
 
-	if (now_fn_queue_sel == &d->now_fn_queue_normal) {
-		//normal队列（priority===0）直入
-		now_fn_queue_sel->push_back(std::move(fn_item));
+	if (should_notify)
+		d->any_fn_queue_cv.notify_one();
+}
+
+std::shared_ptr<ks_single_thread_apartment_imp::_FN_ITEM> ks_single_thread_apartment_imp::_try_pop_now_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, bool idle_allowed, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//次序：prior > normal > idle；但idle任务被连续越过_IDLE_FN_BYPASS_MAX_COUNT次后，轮到它一次
+	const bool idle_selectable = idle_allowed && !d->now_fn_queue_idle.empty();
+	if (idle_selectable && (d->idle_fn_bypassed_count >= _IDLE_FN_BYPASS_MAX_COUNT || (d->now_fn_queue_prior.empty() && d->now_fn_queue_deadline.empty() && d->now_fn_queue_sjf.empty() && d->now_fn_queue_normal.empty()))) {
+		d->idle_fn_bypassed_count = 0;
+		return d->now_fn_queue_idle.pop_front();
 	}
-	else if (now_fn_queue_sel->empty()) {
-		//空队列直入
-		now_fn_queue_sel->push_back(std::move(fn_item));
+
+	std::shared_ptr<_FN_ITEM> fn_item;
+	if (!d->now_fn_queue_prior.empty()) {
+		fn_item = d->now_fn_queue_prior.pop_front();
+		d->prior_fn_count_v.store(d->now_fn_queue_prior.size(), std::memory_order_relaxed);
+	}
+	else if (!d->now_fn_queue_deadline.empty()) {
+		//EDF：已过截止时刻者排在最前，它们会立即以timeout_error完成而不执行任务函数
+		fn_item = d->now_fn_queue_deadline.pop_front();
 	}
-	else if (fn_item->priority <= now_fn_queue_sel->back()->priority) {
-		//最小优先级：接在队尾
-		now_fn_queue_sel->push_back(std::move(fn_item));
+	else if (!d->now_fn_queue_sjf.empty()) {
+		fn_item = d->now_fn_queue_sjf.pop_front();
 	}
-	else if (fn_item->priority > now_fn_queue_sel->front()->priority) {
-		//最大优先级：插在队头
-		now_fn_queue_sel->push_front(std::move(fn_item));
+	else if (!d->now_fn_queue_normal.empty()) {
+		fn_item = std::move(d->now_fn_queue_normal.front());
+		d->now_fn_queue_normal.pop_front();
 	}
 	else {
-		//根据优先级插队
-		auto where_it = std::upper_bound(
-			now_fn_queue_sel->begin(), now_fn_queue_sel->end(), fn_item,
-			[](const std::shared_ptr<_FN_ITEM>& a, const std::shared_ptr<_FN_ITEM>& b) { return a->priority > b->priority; });
-		now_fn_queue_sel->insert(where_it, std::move(fn_item));
+		return nullptr;
+	}
+
+	if (idle_selectable)
+		++d->idle_fn_bypassed_count;
+	return fn_item;
+}
+
+std::shared_ptr<ks_single_thread_apartment_imp::_FN_ITEM> ks_single_thread_apartment_imp::_try_take_now_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//从各now队列中取出指定的项（线性查找，仅用于定向等待）
+	auto match_fn = [fn_id](const std::shared_ptr<_FN_ITEM>& fn_item) -> bool { return fn_item->fn_id == fn_id; };
+	std::vector<std::shared_ptr<_FN_ITEM>> taken_fn_items;
+
+	auto it = std::find_if(d->now_fn_queue_normal.begin(), d->now_fn_queue_normal.end(), match_fn);
+	if (it != d->now_fn_queue_normal.end()) {
+		taken_fn_items.push_back(std::move(*it));
+		d->now_fn_queue_normal.erase(it);
+	}
+	else if (d->now_fn_queue_prior.remove_if(match_fn, &taken_fn_items) == 0
+		&& d->now_fn_queue_deadline.remove_if(match_fn, &taken_fn_items) == 0
+		&& d->now_fn_queue_sjf.remove_if(match_fn, &taken_fn_items) == 0
+		&& d->now_fn_queue_idle.remove_if(match_fn, &taken_fn_items) == 0) {
+		return nullptr;
 	}
 
-	d->any_fn_queue_cv.notify_one();
+	d->prior_fn_count_v.store(d->now_fn_queue_prior.size(), std::memory_order_relaxed);
+	ASSERT(taken_fn_items.size() == 1);
+	return std::move(taken_fn_items.front());
 }
 
 void ks_single_thread_apartment_imp::_do_put_fn_item_into_delaying_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock) {
 	bool should_notify =
 		(d->delaying_fn_queue.empty() || fn_item->until_time < d->delaying_fn_queue.front()->until_time) &&
-		(d->now_fn_queue_prior.empty() && d->now_fn_queue_normal.empty() && d->now_fn_queue_idle.empty());
+		(d->now_fn_queue_prior.empty() && d->now_fn_queue_deadline.empty() && d->now_fn_queue_sjf.empty() && d->now_fn_queue_normal.empty() && d->now_fn_queue_idle.empty());
 
 	//（忽略priority）
-	if (d->delaying_fn_queue.empty()) {
-		//空队列直入
-		d->delaying_fn_queue.push_back(std::move(fn_item));
-	}
-	else if (fn_item->until_time >= d->delaying_fn_queue.back()->until_time) {
-		//最大延时项：插在队尾
-		d->delaying_fn_queue.push_back(std::move(fn_item));
-	}
-	else if (fn_item->until_time < d->delaying_fn_queue.front()->until_time) {
-		//最小延时项：插在队头
-		d->delaying_fn_queue.push_front(std::move(fn_item));
-	}
-	else {
-		//新项的目标时点落在当前队列的时段区间内：插队
-		auto where_it = std::upper_bound(d->delaying_fn_queue.begin(), d->delaying_fn_queue.end(), fn_item,
-			[](const std::shared_ptr<_FN_ITEM>& a, const std::shared_ptr<_FN_ITEM>& b) { return a->until_time < b->until_time; });
-		d->delaying_fn_queue.insert(where_it, std::move(fn_item));
-	}
+	d->delaying_fn_queue.push(std::move(fn_item));
 
 	if (should_notify) {
 		//只需notify_one即可，即使有多项。
@@ -507,6 +714,97 @@ void ks_single_thread_apartment_imp::_do_put_fn_item_into_delaying_list_locked(c
 	}
 }
 
+void ks_single_thread_apartment_imp::_do_push_fn_item_into_inbound_list(std::atomic<_FN_ITEM*>* inbound_list, std::shared_ptr<_FN_ITEM>&& fn_item) {
+	_FN_ITEM* raw_fn_item = fn_item.get();
+	ASSERT(raw_fn_item->inbound_self_ref == nullptr);
+	raw_fn_item->inbound_self_ref = std::move(fn_item);
+
+	_FN_ITEM* old_head = inbound_list->load(std::memory_order_relaxed);
+	do {
+		raw_fn_item->inbound_next = old_head;
+	} while (!inbound_list->compare_exchange_weak(old_head, raw_fn_item));
+}
+
+void ks_single_thread_apartment_imp::_do_drain_inbound_lists_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+
+	for (auto* inbound_list : { &d->inbound_list_prior, &d->inbound_list_normal }) {
+		if (inbound_list->load(std::memory_order_relaxed) == nullptr)
+			continue;
+
+		//整体摘下（exchange对多消费者也是安全的，故非工作线程亦可在锁内drain）
+		_FN_ITEM* raw_fn_item = inbound_list->exchange(nullptr, std::memory_order_acquire);
+
+		//逆序为FIFO
+		_FN_ITEM* reversed_head = nullptr;
+		while (raw_fn_item != nullptr) {
+			_FN_ITEM* next = raw_fn_item->inbound_next;
+			raw_fn_item->inbound_next = reversed_head;
+			reversed_head = raw_fn_item;
+			raw_fn_item = next;
+		}
+
+		while (reversed_head != nullptr) {
+			_FN_ITEM* next = reversed_head->inbound_next;
+			reversed_head->inbound_next = nullptr;
+			_do_put_fn_item_into_now_list_locked(d, std::move(reversed_head->inbound_self_ref), lock);
+			reversed_head = next;
+		}
+	}
+}
+
+bool ks_single_thread_apartment_imp::_check_inbound_lists_empty(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d) {
+	return d->inbound_list_prior.load() == nullptr
+		&& d->inbound_list_normal.load() == nullptr;
+}
+
+ks_single_thread_apartment_imp::_SINGLE_THREAD_APARTMENT_DATA::~_SINGLE_THREAD_APARTMENT_DATA() {
+	//释放残留在入站链表中的任务（在stop之后才入链的）
+	for (auto* inbound_list : { &inbound_list_prior, &inbound_list_normal }) {
+		_FN_ITEM* raw_fn_item = inbound_list->exchange(nullptr);
+		while (raw_fn_item != nullptr) {
+			_FN_ITEM* next = raw_fn_item->inbound_next;
+			std::shared_ptr<_FN_ITEM> fn_item = std::move(raw_fn_item->inbound_self_ref);
+			fn_item.reset();
+			raw_fn_item = next;
+		}
+	}
+}
+
+bool ks_single_thread_apartment_imp::_try_claim_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item, std::unique_lock<ks_mutex>& lock) {
+	if (!ks_apartment_fn_slot_table::is_slotted_fn_id(fn_item->fn_id))
+		return true;
+
+	bool claimed = d->fn_slot_table.try_claim(fn_item->fn_id);
+	d->fn_slot_table.free_slot_locked(fn_item->fn_id);
+	if (!claimed) {
+		ASSERT(d->lazily_cancelled_count_v.load() > 0);
+		--d->lazily_cancelled_count_v;
+	}
+	return claimed;
+}
+
+void ks_single_thread_apartment_imp::_do_compact_cancelled_fn_items_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::vector<std::shared_ptr<_FN_ITEM>>* removed_fn_items, std::unique_lock<ks_mutex>& lock) {
+	auto check_cancelled_fn = [&d](const std::shared_ptr<_FN_ITEM>& fn_item) -> bool {
+		return !d->fn_slot_table.check_pending(fn_item->fn_id);
+	};
+
+	const size_t removed_start = removed_fn_items->size();
+
+	//检查延时任务队列
+	d->delaying_fn_queue.remove_if(check_cancelled_fn, removed_fn_items);
+	//检查idle任务队列
+	d->now_fn_queue_idle.remove_if(check_cancelled_fn, removed_fn_items);
+	//（已到期而移入prior和normal队列的被撤销任务，很快就会出队丢弃，不必检查）
+
+	for (size_t i = removed_start; i < removed_fn_items->size(); ++i)
+		d->fn_slot_table.free_slot_locked((*removed_fn_items)[i]->fn_id);
+
+	const size_t removed_count = removed_fn_items->size() - removed_start;
+	ASSERT(d->lazily_cancelled_count_v.load() >= removed_count);
+	d->lazily_cancelled_count_v -= removed_count;
+}
+
 #ifdef _DEBUG
 bool ks_single_thread_apartment_imp::_check_fn_id_exists_when_debug_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock) {
 	auto do_check_fn_exists = [](std::deque<std::shared_ptr<_FN_ITEM>>* fn_queue, uint64_t a_fn_id) -> bool {
@@ -514,10 +812,12 @@ bool ks_single_thread_apartment_imp::_check_fn_id_exists_when_debug_locked(const
 			[a_fn_id](const auto& item) {return item->fn_id == a_fn_id; }) != fn_queue->cend();
 	};
 
-	return do_check_fn_exists(&d->now_fn_queue_prior, fn_id)
+	return d->now_fn_queue_prior.contains(fn_id)
+		|| d->now_fn_queue_deadline.contains(fn_id)
+		|| d->now_fn_queue_sjf.contains(fn_id)
 		|| do_check_fn_exists(&d->now_fn_queue_normal, fn_id)
-		|| do_check_fn_exists(&d->now_fn_queue_idle, fn_id)
-		|| do_check_fn_exists(&d->delaying_fn_queue, fn_id);
+		|| d->now_fn_queue_idle.contains(fn_id)
+		|| d->delaying_fn_queue.contains(fn_id);
 }
 #endif
 
@@ -586,6 +886,11 @@ bool ks_single_thread_apartment_imp::__run_nested_pump_loop_for_extern_waiting(v
 		return false;
 	}
 
+	if ((m_d->flags & fiber_mode_flag) != 0 && ks_apartment_fiber::current() != nullptr) {
+		//fiber模式：park当前fiber而非嵌套泵任务
+		return _park_current_fiber_for_extern_waiting(m_d, extern_obj, std::move(extern_pred_fn));
+	}
+
 	ASSERT(tls_current_thread_pump_loop_depth >= 1);
 	++tls_current_thread_pump_loop_depth;
 
@@ -617,14 +922,16 @@ bool ks_single_thread_apartment_imp::__run_nested_pump_loop_for_extern_waiting(v
 		ASSERT(d->working_flag_v);
 #endif
 
+		//drain inbound lists
+		_do_drain_inbound_lists_locked(d, lock);
+
 		//try next delaying_fn
 		if (!d->delaying_fn_queue.empty()) {
 			size_t moved_fn_count = 0;
 			const auto now = std::chrono::steady_clock::now();
 			while (!d->delaying_fn_queue.empty() && d->delaying_fn_queue.front()->until_time <= now) {
 				//直接将到期的delaying项移入now队列
-				_do_put_fn_item_into_now_list_locked(d, std::move(d->delaying_fn_queue.front()), lock);
-				d->delaying_fn_queue.pop_front();
+				_do_put_fn_item_into_now_list_locked(d, d->delaying_fn_queue.pop_front(), lock);
 				++moved_fn_count;
 			}
 
@@ -636,19 +943,24 @@ bool ks_single_thread_apartment_imp::__run_nested_pump_loop_for_extern_waiting(v
 
 		//try next now_fn
 		if (true) {
-			auto* now_fn_queue_sel = !d->now_fn_queue_prior.empty() ? &d->now_fn_queue_prior : &d->now_fn_queue_normal;
-			if (now_fn_queue_sel->empty() && !d->now_fn_queue_idle.empty() && d->state_v == _STATE::RUNNING)
-				now_fn_queue_sel = &d->now_fn_queue_idle;
-
-			if (!now_fn_queue_sel->empty()) {
+			auto now_fn_item = _try_pop_now_fn_item_locked(d, d->state_v == _STATE::RUNNING, lock);
+			if (now_fn_item != nullptr) {
 				//pop and exec a fn
-				auto now_fn_item = std::move(now_fn_queue_sel->front());
-				now_fn_queue_sel->pop_front();
-
+				if (!_try_claim_fn_item_locked(d, now_fn_item, lock)) {
+					//已被撤销，丢弃（在锁外释放fn）
+					lock.unlock();
+					now_fn_item->fn = {};
+					now_fn_item.reset();
+					lock.lock();
+					continue;
+				}
+
+				const int pre_priority = _begin_running_fn(now_fn_item->priority);
 				lock.unlock();
 				now_fn_item->fn();
 				now_fn_item->fn = {};
 				now_fn_item.reset();
+				_begin_running_fn(pre_priority);
 
 				lock.lock(); //for working_rc and busy_thread_count
 				continue;
@@ -670,10 +982,18 @@ bool ks_single_thread_apartment_imp::__run_nested_pump_loop_for_extern_waiting(v
 			d->busy_thread_flag = true;
 		});
 
+		d->consumer_parked_v.store(true);
+		if (!_check_inbound_lists_empty(d)) {
+			d->consumer_parked_v.store(false);
+			continue;
+		}
+
 		if (!d->delaying_fn_queue.empty()) 
 			d->any_fn_queue_cv.wait_until(lock, d->delaying_fn_queue.front()->until_time);
 		else 
 			d->any_fn_queue_cv.wait(lock);
+
+		d->consumer_parked_v.store(false, std::memory_order_relaxed);
 	}
 
 	return was_satisified;
@@ -681,5 +1001,174 @@ bool ks_single_thread_apartment_imp::__run_nested_pump_loop_for_extern_waiting(v
 
 void ks_single_thread_apartment_imp::__awaken_nested_pump_loop_for_extern_waiting_once(void* extern_obj) {
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
+
+	//fiber模式：将等待extern_obj的fiber移入ready队列
+	++m_d->fiber_awaken_seq;
+	if (!m_d->parked_fibers.empty()) {
+		auto it = std::stable_partition(m_d->parked_fibers.begin(), m_d->parked_fibers.end(), 
+			[extern_obj](const _SINGLE_THREAD_APARTMENT_DATA::_PARKED_FIBER_ITEM& parked_item) { return parked_item.extern_obj != extern_obj; });
+		for (auto it2 = it; it2 != m_d->parked_fibers.end(); ++it2) 
+			m_d->ready_fibers.push_back(it2->fiber);
+		m_d->parked_fibers.erase(it, m_d->parked_fibers.end());
+	}
+
 	m_d->any_fn_queue_cv.notify_all();
 }
+
+void ks_single_thread_apartment_imp::_exec_fn_item(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item) {
+	_begin_running_fn(fn_item->priority);
+	if ((d->flags & fiber_mode_flag) != 0) 
+		ks_apartment_fiber::run(std::move(fn_item->fn)); //若中途park，fiber会被登记于parked_fibers，之后由工作线程resume
+	else 
+		fn_item->fn();
+	fn_item->fn = {};
+}
+
+bool ks_single_thread_apartment_imp::_park_current_fiber_for_extern_waiting(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, void* extern_obj, std::function<bool()>&& extern_pred_fn) {
+	ks_apartment_fiber* fiber = ks_apartment_fiber::current();
+	ASSERT(fiber != nullptr);
+
+	while (true) {
+		uint64_t awaken_seq;
+		if (true) {
+			std::unique_lock<ks_mutex> lock(d->mutex);
+			awaken_seq = d->fiber_awaken_seq;
+		}
+
+		if (extern_pred_fn()) 
+			return true; //waiting was satisified, ok
+
+		std::unique_lock<ks_mutex> lock(d->mutex);
+		if (d->fiber_awaken_seq != awaken_seq)
+			continue; //检查pred期间可能已被awaken，须重新检查
+		if (d->state_v != _STATE::RUNNING)
+			return false; //同嵌套泵，非RUNNING时放弃等待
+
+		d->parked_fibers.push_back({ extern_obj, fiber });
+		lock.unlock();
+		ks_apartment_fiber::park();
+	}
+}
+
+bool ks_single_thread_apartment_imp::__try_run_scheduled_fn_inline(uint64_t id) {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+	if (id == 0)
+		return false;
+
+	auto d = m_d;
+	std::unique_lock<ks_mutex> lock(d->mutex);
+	ASSERT(d->busy_thread_flag);
+
+	//入站链表中的任务须先转入now队列，方可被查找
+	_do_drain_inbound_lists_locked(d, lock);
+
+	auto fn_item = _try_take_now_fn_item_locked(d, id, lock);
+	if (fn_item == nullptr)
+		return false;
+
+	if (!_try_claim_fn_item_locked(d, fn_item, lock)) {
+		//已被撤销，丢弃（在锁外释放fn）
+		lock.unlock();
+		fn_item->fn = {};
+		fn_item.reset();
+		return false;
+	}
+
+	//exec the fn inline
+	const int pre_priority = _begin_running_fn(fn_item->priority);
+	lock.unlock();
+	fn_item->fn();
+	fn_item->fn = {};
+	fn_item.reset();
+
+	_begin_running_fn(pre_priority);
+	return true;
+}
+
+bool ks_single_thread_apartment_imp::__is_using_schedule_duration_hint() {
+	return (m_d->flags & shortest_job_first_flag) != 0;
+}
+
+bool ks_single_thread_apartment_imp::__check_yield_needed() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+
+	//有prior任务待执行（含尚在入站链表中者），而当前任务非prior，则让位之
+	if (tls_current_thread_running_fn_priority <= 0 
+		&& (m_d->prior_fn_count_v.load(std::memory_order_relaxed) != 0 || m_d->inbound_list_prior.load(std::memory_order_relaxed) != nullptr))
+		return true;
+
+	//时间片：自任务内首次检查时起算；用尽时若有同级或更高优先级的任务在等待则让出，否则重新计时
+	const int64_t time_slice = m_d->yield_time_slice_v.load(std::memory_order_relaxed);
+	if (time_slice <= 0)
+		return false;
+
+	const auto now = std::chrono::steady_clock::now();
+	if (tls_current_thread_time_slice_begin_time == std::chrono::steady_clock::time_point{}) {
+		tls_current_thread_time_slice_begin_time = now;
+		return false;
+	}
+	if (now < tls_current_thread_time_slice_begin_time + std::chrono::milliseconds(time_slice))
+		return false;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	if (_check_fn_pending_for_yield_locked(m_d, lock))
+		return true;
+
+	tls_current_thread_time_slice_begin_time = now;
+	return false;
+}
+
+bool ks_single_thread_apartment_imp::__try_yield_current_fiber() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+
+	if ((m_d->flags & fiber_mode_flag) == 0 || ks_apartment_fiber::current() == nullptr) {
+		tls_current_thread_time_slice_begin_time = {}; //无法让出，则重新计时，以免此后每次检查都因时间片已用尽而加锁
+		return false;
+	}
+
+	return _park_current_fiber_for_yield(this, m_d);
+}
+
+bool ks_single_thread_apartment_imp::_park_current_fiber_for_yield(ks_single_thread_apartment_imp* self, const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d) {
+	ks_apartment_fiber* fiber = ks_apartment_fiber::current();
+	ASSERT(fiber != nullptr);
+
+	if (true) {
+		std::unique_lock<ks_mutex> lock(d->mutex);
+		if (d->state_v != _STATE::RUNNING)
+			return false;
+
+		//以fiber自身为extern_obj登记，由续体awaken之
+		d->parked_fibers.push_back({ fiber, fiber });
+	}
+
+	//续体以当前任务的优先级投递，排在已待执行的任务之后；轮到它时，将fiber移入ready队列，由工作线程恢复执行
+	//（若期间套间被stop，被park的fiber会被全部唤醒，续体则随队列被丢弃或空转）
+	self->schedule([self, fiber]() { self->__awaken_nested_pump_loop_for_extern_waiting_once(fiber); }, tls_current_thread_running_fn_priority);
+	ks_apartment_fiber::park();
+	return true;
+}
+
+bool ks_single_thread_apartment_imp::_check_fn_pending_for_yield_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//与当前任务同级或更高优先级的任务（prior/normal/idle三级）在等待；已被awaken的fiber总算在内
+	const int running_priority = tls_current_thread_running_fn_priority;
+	if (!d->ready_fibers.empty() || !d->now_fn_queue_prior.empty() || d->inbound_list_prior.load() != nullptr)
+		return true;
+	if (running_priority > 0)
+		return false;
+	if (!d->now_fn_queue_deadline.empty() || !d->now_fn_queue_sjf.empty() || !d->now_fn_queue_normal.empty() || d->inbound_list_normal.load() != nullptr)
+		return true;
+	if (running_priority == 0)
+		return false;
+	return !d->now_fn_queue_idle.empty();
+}
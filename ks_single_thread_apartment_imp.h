@@ -17,9 +17,12 @@ limitations under the License.
 
 #include "ks_async_base.h"
 #include "ks_apartment.h"
+#include "ks_apartment_internal_helper.hpp"
 #include "ktl/ks_concurrency.h"
 #include <deque>
 
+class ks_apartment_fiber;
+
 
 class ks_single_thread_apartment_imp final : public ks_apartment {
 public:
@@ -31,6 +34,9 @@ public:
 		endless_instance_flag           = 0x01000000,
 		no_isolated_thread_flag         = 0x02000000,
 		delayed_always_low_prior_flag   = 0x04000000,
+		fiber_mode_flag                 = 0x00100000, //fiber模式：任务在池化的fiber栈上执行，wait时park其fiber（而非嵌套泵任务），待被唤醒后恢复执行
+		deadline_first_flag             = 0x40000000, //EDF模式：带截止时刻（future的超时）的normal任务按截止时刻先后执行，且先于无截止时刻的normal任务
+		shortest_job_first_flag         = 0x80000000, //SJF模式：normal任务按“投递时刻+预估耗时（按调用点统计的历史耗时）”排序，短任务先于长任务执行，而长任务至多被推迟其预估耗时
 	};
 
 	KS_ASYNC_API explicit ks_single_thread_apartment_imp(const char* name, uint flags = 0);
@@ -51,11 +57,16 @@ public:
 	virtual bool is_stopped() override;
 	virtual bool is_stopping_or_stopped() override;
 
-	virtual uint64_t schedule(std::function<void()>&& fn, int priority) override;
-	virtual uint64_t schedule_delayed(std::function<void()>&& fn, int priority, int64_t delay) override;
+	virtual uint64_t schedule(ks_unique_function<void()>&& fn, int priority) override;
+	virtual uint64_t schedule_delayed(ks_unique_function<void()>&& fn, int priority, int64_t delay) override;
+	virtual size_t schedule_batch(ks_unique_function<void()>* fns, size_t fn_count, int priority, uint64_t* out_fn_ids) override;
 
 	virtual void try_unschedule(uint64_t id) override;
 
+public:
+	//注：让出的时间片（毫秒，见ks_apartment::is_yield_needed），自任务内首次检查时起算，0为不按时间片让出（仍让位于prior任务）。
+	KS_ASYNC_API void set_yield_time_slice(int64_t time_slice);
+
 #if __KS_APARTMENT_ATFORK_ENABLED
 	virtual void atfork_prepare() override;
 	virtual void atfork_parent() override;
@@ -64,6 +75,10 @@ public:
 
 	virtual bool __run_nested_pump_loop_for_extern_waiting(void* extern_obj, std::function<bool()>&& extern_pred_fn) override;
 	virtual void __awaken_nested_pump_loop_for_extern_waiting_once(void* extern_obj) override;
+	virtual bool __try_run_scheduled_fn_inline(uint64_t id) override;
+	virtual bool __check_yield_needed() override;
+	virtual bool __try_yield_current_fiber() override;
+	virtual bool __is_using_schedule_duration_hint() override;
 
 private:
 	struct _SINGLE_THREAD_APARTMENT_DATA;
@@ -75,18 +90,37 @@ private:
 	static void _work_thread_proc(ks_single_thread_apartment_imp* self, const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d);
 
 private:
+	//注：_FN_ITEM经由线程本地回收池分配（见ks_apartment_make_pooled_shared），fn为带小缓冲区的ks_unique_function
 	struct _FN_ITEM {
-		std::function<void()> fn;
+		ks_unique_function<void()> fn;
 		std::chrono::steady_clock::time_point until_time;
+		std::chrono::steady_clock::time_point deadline_time; //截止时刻，仅deadline_first_flag模式（空为无截止时刻）
+		std::chrono::steady_clock::time_point sjf_rank_time; //SJF排序键，即投递（或延时到期）时刻+预估耗时，仅shortest_job_first_flag模式
 		uint64_t fn_id;
 		int64_t delay = 0;
 		int priority = 0;
 		bool is_delaying_fn = false;
+
+		_FN_ITEM* inbound_next = nullptr; //用于无锁入站链表
+		std::shared_ptr<_FN_ITEM> inbound_self_ref; //在入站链表中时持有自身，转入now队列时移出
 	};
 
-	static void _do_put_fn_item_into_now_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock);
+	static void _do_put_fn_item_into_now_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock, bool should_notify = true);
+	static std::shared_ptr<_FN_ITEM> _try_pop_now_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, bool idle_allowed, std::unique_lock<ks_mutex>& lock);
+	static std::shared_ptr<_FN_ITEM> _try_take_now_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock);
+	static void _exec_fn_item(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item);
+	static bool _park_current_fiber_for_extern_waiting(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, void* extern_obj, std::function<bool()>&& extern_pred_fn);
+	static bool _park_current_fiber_for_yield(ks_single_thread_apartment_imp* self, const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d);
+	static bool _check_fn_pending_for_yield_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
 	static void _do_put_fn_item_into_delaying_list_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock);
 
+	static bool _try_claim_fn_item_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item, std::unique_lock<ks_mutex>& lock);
+	static void _do_compact_cancelled_fn_items_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::vector<std::shared_ptr<_FN_ITEM>>* removed_fn_items, std::unique_lock<ks_mutex>& lock);
+
+	static void _do_push_fn_item_into_inbound_list(std::atomic<_FN_ITEM*>* inbound_list, std::shared_ptr<_FN_ITEM>&& fn_item);
+	static void _do_drain_inbound_lists_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static bool _check_inbound_lists_empty(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d);
+
 #ifdef _DEBUG
 	static bool _check_fn_id_exists_when_debug_locked(const std::shared_ptr<_SINGLE_THREAD_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock);
 #endif
@@ -98,6 +132,8 @@ private:
 	};
 
 	struct _SINGLE_THREAD_APARTMENT_DATA {
+		~_SINGLE_THREAD_APARTMENT_DATA();
+
 		ks_mutex mutex;
 
 		std::string name; //const-like
@@ -105,13 +141,38 @@ private:
 		std::function<void()> thread_init_fn = nullptr; //const-like, optional
 		std::function<void()> thread_term_fn = nullptr; //const-like, optional
 
-		//prior简化为三级：>0为高优先，=0为普通，<0为低且简单地加入到idle队列
-		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_prior;
+		//prior分为三个队列：>0为高优先，=0为普通，<0为低且加入到idle队列；prior和idle队列内部再按优先级（带老化）排序
+		ks_apartment_priority_fn_heap<_FN_ITEM> now_fn_queue_prior;
 		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_normal;
-		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_idle; //idle任务地位低下，与prior和normal不是同等对待
-		std::deque<std::shared_ptr<_FN_ITEM>> delaying_fn_queue;
+		ks_apartment_priority_fn_heap<_FN_ITEM> now_fn_queue_idle; //idle任务地位低下，与prior和normal不是同等对待
+		size_t idle_fn_bypassed_count = 0; //idle任务被越过的次数，达到上限则轮到idle任务一次（跨队列老化）
+		ks_apartment_delaying_fn_heap<_FN_ITEM> delaying_fn_queue; //4叉最小堆
+		ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::deadline_time> now_fn_queue_deadline; //带截止时刻的normal任务，按截止时刻排序（仅deadline_first_flag模式）
+		ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::sjf_rank_time> now_fn_queue_sjf; //normal任务，按投递时刻+预估耗时排序（仅shortest_job_first_flag模式）
+		std::atomic<size_t> prior_fn_count_v{ 0 }; //now_fn_queue_prior.size()的镜像，用于在锁外检查是否需让位于prior任务（见is_yield_needed）
+		std::atomic<int64_t> yield_time_slice_v{ 10 }; //让出的时间片（毫秒），0为不按时间片让出
+
+		//延时任务和idle任务占用槽位，可被O(1)撤销；被撤销的任务仍滞留在队列中，待出队或压缩时丢弃
+		ks_apartment_fn_slot_table fn_slot_table;
+		std::atomic<size_t> lazily_cancelled_count_v{ 0 }; //已撤销而仍滞留在队列中的任务数
 		ks_condition_variable any_fn_queue_cv{};
 
+		//无锁入站链表（多生产者单消费者，分prior和normal两级）：schedule时以一次CAS入链，不加锁；
+		//工作线程在锁内将其批量转入上述now队列。链表为LIFO次序，转入时逆序以保持FIFO
+		std::atomic<_FN_ITEM*> inbound_list_prior{ nullptr };
+		std::atomic<_FN_ITEM*> inbound_list_normal{ nullptr };
+		std::atomic<bool> consumer_parked_v{ false }; //工作线程正在（或即将）cv上等待，此时入链者须加锁唤醒之
+		std::atomic<bool> inbound_ready_v{ false }; //RUNNING且工作线程已就绪，方可走入站链表（在锁外被访问，故为atomic）
+
+		//fiber模式：因wait而被park的fiber（按所等待的extern_obj登记），被awaken后移入ready_fibers，由工作线程先于新任务恢复执行
+		struct _PARKED_FIBER_ITEM {
+			void* extern_obj;
+			ks_apartment_fiber* fiber;
+		};
+		std::vector<_PARKED_FIBER_ITEM> parked_fibers;
+		std::deque<ks_apartment_fiber*> ready_fibers;
+		uint64_t fiber_awaken_seq = 0; //每次awaken递增，park前据此判断期间是否错过了唤醒
+
 		std::shared_ptr<_THREAD_ITEM> isolated_thread_opt; //only when !no_isolated_thread_flag
 		bool busy_thread_flag = false;
 
@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include "ks_thread_pool_apartment_imp.h"
+#include "ks_apartment_fiber.h"
 #include "ktl/ks_defer.h"
 #include <thread>
 #include <algorithm>
@@ -26,6 +27,46 @@ static std::atomic<uint64_t> g_last_fn_id{ 0 };
 static thread_local size_t tls_current_thread_index_plus = 0;
 static thread_local int  tls_current_thread_pump_loop_depth = 0;
 static thread_local bool tls_current_thread_pump_loop_busy_for_idle_flag = false;
+static thread_local void* tls_current_thread_item_for_work_stealing = nullptr; //_THREAD_ITEM*，仅work-stealing模式
+static thread_local int  tls_current_thread_blocking_region_depth = 0;
+
+//当前任务的优先级（随fiber保存和恢复）及其时间片的起始时刻（空为尚未计时），用于判断是否需让出（见__check_yield_needed）
+static thread_local int tls_current_thread_running_fn_priority = 0;
+static thread_local std::chrono::steady_clock::time_point tls_current_thread_time_slice_begin_time = {};
+static thread_local std::chrono::steady_clock::time_point tls_current_thread_yield_locked_check_time = {}; //上次加锁检查是否需让出的时刻
+
+static void* _exchange_current_thread_running_fn_priority(void* value) {
+	const int pre_priority = tls_current_thread_running_fn_priority;
+	tls_current_thread_running_fn_priority = (int)(intptr_t)value;
+	return (void*)(intptr_t)pre_priority;
+}
+static const bool g_running_fn_priority_registered = ks_apartment::__register_fiber_local_tls(&_exchange_current_thread_running_fn_priority);
+
+//开始执行任务：置当前任务的优先级，其时间片待首次检查时才开始计时（免于每个任务都读取时钟）；返回原优先级，以便嵌套执行后恢复
+static int _begin_running_fn(int priority) {
+	const int pre_priority = tls_current_thread_running_fn_priority;
+	tls_current_thread_running_fn_priority = priority;
+	tls_current_thread_time_slice_begin_time = {};
+	tls_current_thread_yield_locked_check_time = {};
+	return pre_priority;
+}
+
+static constexpr int _LOCAL_FN_BATCH_MAX_COUNT = 32; //在锁外连续执行本地任务的最大批量
+static constexpr int64_t _ELASTIC_THREAD_IDLE_TIMEOUT_DEFAULT = 60 * 1000; //elastic_flag模式下线程空闲退休的默认时长（毫秒）
+static constexpr size_t _IDLE_FN_BYPASS_MAX_COUNT = 32; //idle任务至多连续被越过的次数，即其在繁忙时至少可获得约1/33的执行份额
+static constexpr int64_t _YIELD_LOCKED_CHECK_MIN_INTERVAL_US = 1000; //加锁检查是否需让出的最小间隔（微秒），以免频繁调用yield_if_needed的任务争抢套间锁
+static constexpr size_t _BLOCKING_COMPENSATION_MAX_COUNT = 256; //阻塞补偿可超出max_thread_count的线程数上限
+static constexpr size_t _PREWARM_STACK_PREFAULT_SIZE = 64 * 1024; //prewarm_flag模式下预先触及的线程栈大小
+
+
+//逐页写入，预先触及当前线程栈顶以下size字节（缺页在此发生，而非在首批任务的执行中）
+_NOINLINE static void __prefault_current_thread_stack(size_t size) {
+	volatile char page[4096];
+	page[0] = 0;
+	if (size > sizeof(page))
+		__prefault_current_thread_stack(size - sizeof(page));
+	page[sizeof(page) - 1] = 0; //递归之后再写一次，以免被优化为尾调用
+}
 
 
 ks_thread_pool_apartment_imp::ks_thread_pool_apartment_imp(const char* name, size_t max_thread_count, uint flags) 
@@ -38,8 +79,13 @@ ks_thread_pool_apartment_imp::ks_thread_pool_apartment_imp(const char* name, siz
 	ASSERT(max_thread_count >= 1);
 
 	m_d->name = name != nullptr ? name : "";
-	m_d->max_thread_count = max_thread_count >= 1 ? max_thread_count : 1;
+	m_d->max_thread_count_v = max_thread_count >= 1 ? max_thread_count : 1;
+	m_d->is_sequential = m_d->max_thread_count_v == 1;
 	m_d->flags = flags;
+	if (m_d->flags & elastic_flag)
+		m_d->thread_idle_timeout = _ELASTIC_THREAD_IDLE_TIMEOUT_DEFAULT;
+	if (m_d->flags & numa_aware_flag)
+		m_d->numa_node_cpu_ids = ks_apartment::__get_numa_node_cpu_ids();
 	m_d->thread_init_fn = std::move(thread_init_fn);
 	m_d->thread_term_fn = std::move(thread_term_fn);
 
@@ -69,12 +115,12 @@ const char* ks_thread_pool_apartment_imp::name() {
 }
 
 uint ks_thread_pool_apartment_imp::features() {
-	return (m_d->max_thread_count == 1 ? sequential_feature : 0)
+	return (m_d->is_sequential ? sequential_feature : 0)
 		 | atfork_aware_future | nested_pump_aware_future;
 }
 
 size_t ks_thread_pool_apartment_imp::concurrency() {
-	return m_d->max_thread_count;
+	return m_d->max_thread_count_v.load(std::memory_order_relaxed);
 }
 
 
@@ -105,7 +151,7 @@ void ks_thread_pool_apartment_imp::wait() {
 		m_d->stopped_state_cv.wait(lock);
 	}
 
-	ASSERT(m_d->now_fn_queue_prior.empty() && m_d->now_fn_queue_normal.empty());
+	ASSERT(m_d->now_fn_queue_prior.empty() && m_d->now_fn_queue_normal.empty() && m_d->now_fn_queue_deadline.empty() && m_d->now_fn_queue_sjf.empty());
 }
 
 bool ks_thread_pool_apartment_imp::is_stopped() {
@@ -113,7 +159,7 @@ bool ks_thread_pool_apartment_imp::is_stopped() {
 	if (state == _STATE::STOPPING && !m_d->should_thread_exit_v) {
 		std::unique_lock<ks_mutex> lock(m_d->mutex);
 		m_d->should_thread_exit_v = true;
-		m_d->any_fn_queue_cv.notify_all();
+		_unpark_all_threads_locked(m_d, lock);
 		lock.unlock();
 		state = m_d->state_v;
 	}
@@ -127,7 +173,51 @@ bool ks_thread_pool_apartment_imp::is_stopping_or_stopped() {
 }
 
 
-uint64_t ks_thread_pool_apartment_imp::schedule(std::function<void()>&& fn, int priority) {
+uint64_t ks_thread_pool_apartment_imp::schedule(ks_unique_function<void()>&& fn, int priority) {
+	if ((m_d->flags & work_stealing_flag) && priority == 0 && tls_current_thread_item_for_work_stealing != nullptr
+		&& ks_apartment::current_thread_apartment() == this && m_d->state_v == _STATE::RUNNING && !m_d->has_sched_class_policy_v.load(std::memory_order_relaxed)
+		&& !((m_d->flags & deadline_first_flag) && ks_apartment::__get_current_thread_schedule_deadline() != std::chrono::steady_clock::time_point{})
+		&& !(m_d->flags & shortest_job_first_flag)) {
+		//work-stealing模式：本套间工作线程内投递的normal任务，直接放入本线程的lifo-slot，无需加全局锁
+		_THREAD_ITEM* thread_item = (_THREAD_ITEM*)tls_current_thread_item_for_work_stealing;
+
+		uint64_t fn_id = ks_apartment_fn_slot_table::make_unslotted_fn_id(++g_last_fn_id);
+		ASSERT(fn_id != 0);
+
+		auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
+		fn_item->fn = std::move(fn);
+		fn_item->fn_id = fn_id;
+		fn_item->priority = priority;
+		fn_item->sched_class = ks_apartment::__get_current_thread_sched_class();
+		if (m_d->flags & deadline_first_flag)
+			fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+		if (m_d->flags & shortest_job_first_flag)
+			fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
+		if (m_d->grow_wait_threshold_v.load(std::memory_order_relaxed) > 0)
+			fn_item->queued_time = std::chrono::steady_clock::now();
+
+		bool has_stealable_fn = false;
+		if (true) {
+			std::lock_guard<ks_spinlock> local_lock(thread_item->local_mutex);
+			if (thread_item->local_lifo_slot != nullptr)
+				thread_item->local_fn_queue.push_back(std::move(thread_item->local_lifo_slot)); //原lifo-slot中的任务被挤入本地队列
+			thread_item->local_lifo_slot = std::move(fn_item);
+			has_stealable_fn = !thread_item->local_fn_queue.empty();
+			m_d->local_fn_count_v.fetch_add(1);
+		}
+
+		//注：lifo-slot中的任务将由本线程在当前任务结束后立即执行，不必唤醒其他线程；
+		//而本地队列中有积压时，则唤醒（或创建）一个线程来窃取。
+		//waiting_thread_count_v须在local_fn_count_v递增之后读取，与工作线程等待前的检查顺序相反，避免遗漏唤醒。
+		if (has_stealable_fn && (m_d->waiting_thread_count_v.load() != 0 || !m_d->thread_pool_full_v.load())) {
+			std::unique_lock<ks_mutex> lock(m_d->mutex);
+			_unpark_one_thread_locked(m_d, lock);
+			_prepare_work_thread_locked(this, m_d, lock);
+		}
+
+		return fn_id;
+	}
+
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
 	_try_start_locked(lock);
 
@@ -136,22 +226,28 @@ uint64_t ks_thread_pool_apartment_imp::schedule(std::function<void()>&& fn, int
 		return 0;
 	}
 
-	uint64_t fn_id = ++g_last_fn_id;
+	uint64_t fn_id = m_d->fn_slot_table.alloc_slotted_fn_id_locked(++g_last_fn_id, priority < 0); //占用槽位以便按id查找，仅idle任务可撤销
 	ASSERT(fn_id != 0);
 	ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
 
-	auto fn_item = std::make_shared<_FN_ITEM>();
+	auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
 	fn_item->fn = std::move(fn);
 	fn_item->fn_id = fn_id;
 	fn_item->priority = priority;
+	fn_item->sched_class = ks_apartment::__get_current_thread_sched_class();
+	if (m_d->flags & deadline_first_flag)
+		fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+	if (m_d->flags & shortest_job_first_flag)
+		fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
 
+	_do_index_fn_item_locked(m_d, fn_item.get(), lock);
 	_do_put_fn_item_into_now_list_locked(m_d, std::move(fn_item), lock);
 	_prepare_work_thread_locked(this, m_d, lock);
 
 	return fn_id;
 }
 
-uint64_t ks_thread_pool_apartment_imp::schedule_delayed(std::function<void()>&& fn, int priority, int64_t delay) {
+uint64_t ks_thread_pool_apartment_imp::schedule_delayed(ks_unique_function<void()>&& fn, int priority, int64_t delay) {
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
 	_try_start_locked(lock);
 
@@ -160,60 +256,229 @@ uint64_t ks_thread_pool_apartment_imp::schedule_delayed(std::function<void()>&&
 		return 0;
 	}
 
-	uint64_t fn_id = ++g_last_fn_id;
+	uint64_t fn_id = m_d->fn_slot_table.alloc_slotted_fn_id_locked(++g_last_fn_id); //延时任务可撤销，占用槽位
 	ASSERT(fn_id != 0);
 	ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
 
-	auto fn_item = std::make_shared<_FN_ITEM>();
+	auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
 	fn_item->fn = std::move(fn);
 	fn_item->until_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
 	fn_item->fn_id = fn_id;
 	fn_item->priority = priority;
+	fn_item->sched_class = ks_apartment::__get_current_thread_sched_class();
+	if (m_d->flags & deadline_first_flag)
+		fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+	if (m_d->flags & shortest_job_first_flag)
+		fn_item->sjf_rank_time = fn_item->until_time + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
 	fn_item->delay = delay;
 	fn_item->is_delaying_fn = true;
 
+	_do_index_fn_item_locked(m_d, fn_item.get(), lock);
 	_do_put_fn_item_into_delaying_list_locked(m_d, std::move(fn_item), lock);
 	_prepare_work_thread_locked(this, m_d, lock);
 
 	return fn_id;
 }
 
+size_t ks_thread_pool_apartment_imp::schedule_batch(ks_unique_function<void()>* fns, size_t fn_count, int priority, uint64_t* out_fn_ids) {
+	if (fn_count == 0)
+		return 0;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	_try_start_locked(lock);
+
+	if (m_d->state_v == _STATE::STOPPED) {
+		ASSERT(false);
+		if (out_fn_ids != nullptr)
+			std::fill(out_fn_ids, out_fn_ids + fn_count, uint64_t(0));
+		return 0;
+	}
+
+	//一次性预留连续的序列号，整批入队后再统一唤醒
+	const uint64_t first_seq = g_last_fn_id.fetch_add(fn_count) + 1;
+	for (size_t i = 0; i < fn_count; ++i) {
+		uint64_t fn_id = m_d->fn_slot_table.alloc_slotted_fn_id_locked(first_seq + i, priority < 0); //占用槽位以便按id查找，仅idle任务可撤销
+		ASSERT(fn_id != 0);
+		ASSERT(!_check_fn_id_exists_when_debug_locked(m_d, fn_id, lock));
+
+		auto fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
+		fn_item->fn = std::move(fns[i]);
+		fn_item->fn_id = fn_id;
+		fn_item->priority = priority;
+		fn_item->sched_class = ks_apartment::__get_current_thread_sched_class();
+		if (m_d->flags & deadline_first_flag)
+			fn_item->deadline_time = ks_apartment::__get_current_thread_schedule_deadline();
+		if (m_d->flags & shortest_job_first_flag)
+			fn_item->sjf_rank_time = std::chrono::steady_clock::now() + std::chrono::microseconds(ks_apartment::__get_current_thread_schedule_duration_hint());
+
+		_do_index_fn_item_locked(m_d, fn_item.get(), lock);
+		_do_put_fn_item_into_now_list_locked(m_d, std::move(fn_item), lock, false);
+		if (out_fn_ids != nullptr)
+			out_fn_ids[i] = fn_id;
+	}
+
+	//恰好唤醒min(fn_count, 空闲线程数)个线程，不足部分由_prepare_work_thread_locked按需创建新线程
+	const size_t active_thread_count = _get_active_thread_count_locked(m_d, lock);
+	const size_t idle_thread_count = active_thread_count > m_d->busy_thread_count ? active_thread_count - m_d->busy_thread_count : 0;
+	if (fn_count >= idle_thread_count) {
+		_unpark_all_threads_locked(m_d, lock);
+	}
+	else {
+		for (size_t i = 0; i < fn_count; ++i)
+			_unpark_one_thread_locked(m_d, lock);
+	}
+
+	_prepare_work_thread_locked(this, m_d, lock);
+
+	return fn_count;
+}
+
 void ks_thread_pool_apartment_imp::try_unschedule(uint64_t id) {
 	if (id == 0)
 		return;
 
+	//撤销仅是对槽位的一次CAS，无需加锁查找；被撤销的任务滞留在队列中，待出队时丢弃（惰性删除）
+	//对于normal和prior任务（其槽位仅供按id索引，不可撤销），没有撤销的必要和意义
+	if (!m_d->fn_slot_table.try_cancel(id))
+		return;
+
+	const size_t lazily_cancelled_count = ++m_d->lazily_cancelled_count_v;
+	if (lazily_cancelled_count >= 64 && lazily_cancelled_count * 2 > m_d->fn_slot_table.used_slot_count()) {
+		//滞留的已撤销任务过多时，压缩队列，以及时释放它们的fn
+		std::vector<std::shared_ptr<_FN_ITEM>> removed_fn_items;
+		std::unique_lock<ks_mutex> lock(m_d->mutex);
+		_do_compact_cancelled_fn_items_locked(m_d, &removed_fn_items, lock);
+
+		//release fn
+		lock.unlock();
+		removed_fn_items.clear();
+	}
+}
+
+bool ks_thread_pool_apartment_imp::try_boost_priority(uint64_t id, int priority) {
+	if (id == 0)
+		return false;
+
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	if (m_d->state_v != _STATE::RUNNING)
+		return false;
 
-	auto do_erase_fn_from = [](std::deque<std::shared_ptr<_FN_ITEM>>*fn_queue, uint64_t fn_id) -> std::shared_ptr<_FN_ITEM> {
-		auto it = std::find_if(fn_queue->begin(), fn_queue->end(),
-			[fn_id](const auto& item) {return item->fn_id == fn_id; });
-		if (it == fn_queue->end())
-			return nullptr;
+	//经槽位索引按id查找（只升不降）
+	//注：work-stealing本地队列（含lifo-slot）中的任务不在索引中，不予提升：lifo-slot中的任务本就紧接着执行，
+	//本地队列中的则由本线程依次执行或被空闲线程窃取，且本地队列不区分优先级，提升亦无从生效
+	_FN_ITEM* fn_item = _find_queued_fn_item_locked(m_d, id, lock);
+	if (fn_item == nullptr || fn_item->priority >= priority)
+		return false;
 
-		std::shared_ptr<_FN_ITEM> found_fn = std::move(*it);
-		fn_queue->erase(it);
-		return found_fn;
-	};
+	//未到期的延时任务，仅更新其priority即可（延时队列按到期时刻排序，不受影响）
+	if (fn_item->is_in_delaying_queue) {
+		fn_item->priority = priority;
+		fn_item->is_delaying_fn = false; //提升后不再受delayed_always_low_prior_flag约束
+		return true;
+	}
 
-	//检查延时任务队列
-	std::shared_ptr<_FN_ITEM> found_fn = do_erase_fn_from(&m_d->delaying_fn_queue, id);
-	//检查idle任务队列
-	if (found_fn == nullptr)
-		found_fn = do_erase_fn_from(&m_d->now_fn_queue_idle, id);
-	//对于其他任务队列（normal和prior），没有检查的必要和意义
+	//已在now队列中的任务，按新的priority重新入队（原项留作空壳，免于从队列中间删除）
+	std::shared_ptr<_FN_ITEM> boosted_fn_item = _try_detach_now_fn_item_locked(m_d, id, lock);
+	ASSERT(boosted_fn_item != nullptr);
+	boosted_fn_item->priority = priority;
+	boosted_fn_item->is_delaying_fn = false;
+	_do_put_fn_item_into_now_list_locked(m_d, std::move(boosted_fn_item), lock);
+	return true;
+}
 
-	//release fn
-	lock.unlock();
-	if (found_fn != nullptr) {
-		found_fn->fn = {};
-		found_fn = nullptr;
+bool ks_thread_pool_apartment_imp::set_max_thread_count(size_t max_thread_count) {
+	ASSERT(max_thread_count >= 1);
+	if (m_d->is_sequential) {
+		ASSERT(false);
+		return false;
 	}
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	const size_t old_max_thread_count = m_d->max_thread_count_v;
+	m_d->max_thread_count_v = max_thread_count >= 1 ? max_thread_count : 1;
+	m_d->thread_pool_full_v = _get_active_thread_count_locked(m_d, lock) >= _get_compensated_max_thread_count_locked(m_d, lock);
+
+	if (m_d->max_thread_count_v < old_max_thread_count)
+		_unpark_all_threads_locked(m_d, lock); //唤醒空闲线程，多出的线程将退休
+	else if (m_d->state_v == _STATE::RUNNING && (m_d->flags & prewarm_flag))
+		_prewarm_work_threads_locked(this, m_d, lock);
+	else if (m_d->state_v == _STATE::RUNNING)
+		_prepare_work_thread_locked(this, m_d, lock);
+
+	return true;
+}
+
+ks_thread_pool_apartment_imp::thread_stats ks_thread_pool_apartment_imp::get_thread_stats() {
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	thread_stats stats;
+	stats.max_thread_count = m_d->max_thread_count_v;
+	stats.active_thread_count = _get_active_thread_count_locked(m_d, lock);
+	stats.busy_thread_count = m_d->busy_thread_count;
+	stats.blocking_thread_count = m_d->blocking_thread_count;
+	stats.queued_fn_count = m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_deadline.size() + m_d->now_fn_queue_sjf.size() + m_d->now_fn_queue_normal.size()
+		+ m_d->sched_class_fn_count + m_d->now_fn_queue_idle.size() + m_d->local_fn_count_v.load();
+	return stats;
+}
+
+void ks_thread_pool_apartment_imp::set_elastic_policy(int64_t thread_idle_timeout, int64_t grow_wait_threshold) {
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	m_d->thread_idle_timeout = thread_idle_timeout > 0 ? thread_idle_timeout : 0;
+	m_d->grow_wait_threshold_v = grow_wait_threshold > 0 ? grow_wait_threshold : 0;
+	_unpark_all_threads_locked(m_d, lock); //令空闲线程重新计算退休时刻
+}
+
+void ks_thread_pool_apartment_imp::set_thread_cpu_affinity(const std::vector<int>& cpu_ids) {
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	m_d->thread_cpu_ids = cpu_ids;
+}
+
+void ks_thread_pool_apartment_imp::set_thread_stack_size(size_t stack_size) {
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	m_d->thread_stack_size = stack_size;
+}
+
+void ks_thread_pool_apartment_imp::set_sched_class_policy(int sched_class, uint weight, size_t reserved_thread_count) {
+	ASSERT(weight != 0);
+	if (weight == 0)
+		weight = 1;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+
+	_SCHED_CLASS_ITEM* sched_class_item = nullptr;
+	for (const auto& item : m_d->sched_class_items) {
+		if (item->sched_class == sched_class) {
+			sched_class_item = item.get();
+			break;
+		}
+	}
+
+	if (sched_class_item == nullptr) {
+		m_d->sched_class_items.push_back(std::make_unique<_SCHED_CLASS_ITEM>());
+		sched_class_item = m_d->sched_class_items.back().get();
+		sched_class_item->sched_class = sched_class;
+		if (m_d->sched_class_cursor + 1 == m_d->sched_class_items.size())
+			++m_d->sched_class_cursor; //游标原指向now_fn_queue_normal，其序号随之后移
+	}
+
+	m_d->total_reserved_thread_count = m_d->total_reserved_thread_count - sched_class_item->reserved_thread_count + reserved_thread_count;
+	sched_class_item->weight = weight;
+	sched_class_item->reserved_thread_count = reserved_thread_count;
+	m_d->has_sched_class_policy_v = true;
+
+	//预留变化后，原先受限的任务或已可执行
+	_unpark_all_threads_locked(m_d, lock);
+}
+
+void ks_thread_pool_apartment_imp::set_yield_time_slice(int64_t time_slice) {
+	m_d->yield_time_slice_v.store(time_slice > 0 ? time_slice : 0);
 }
 
 
 void ks_thread_pool_apartment_imp::_try_start_locked(std::unique_lock<ks_mutex>& lock) {
 	if (m_d->state_v == _STATE::NOT_START) {
 		m_d->state_v = _STATE::RUNNING;
+		if (m_d->flags & prewarm_flag)
+			_prewarm_work_threads_locked(this, m_d, lock);
 	}
 }
 
@@ -227,10 +492,10 @@ void ks_thread_pool_apartment_imp::_try_stop_locked(bool should_thread_exit, std
 	if (m_d->state_v == _STATE::RUNNING) {
 		if (!m_d->thread_pool.empty()) {
 			m_d->state_v = _STATE::STOPPING;
-			m_d->any_fn_queue_cv.notify_all(); //trigger threads
+			_unpark_all_threads_locked(m_d, lock); //trigger threads
 		}
 		else {
-			ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
+			ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_deadline.size() + m_d->now_fn_queue_sjf.size() + m_d->sched_class_fn_count + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
 			m_d->state_v = _STATE::STOPPED;
 			m_d->stopped_state_cv.notify_all();
 			m_d->thread_init_fn.swap(t_thread_init_fn); //final cleanup
@@ -238,7 +503,7 @@ void ks_thread_pool_apartment_imp::_try_stop_locked(bool should_thread_exit, std
 		}
 	}
 	else if (m_d->state_v == _STATE::NOT_START) {
-		ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
+		ASSERT(m_d->now_fn_queue_prior.size() + m_d->now_fn_queue_normal.size() + m_d->now_fn_queue_deadline.size() + m_d->now_fn_queue_sjf.size() + m_d->sched_class_fn_count + m_d->now_fn_queue_idle.size() + m_d->delaying_fn_queue.size() == 0);
 		m_d->state_v = _STATE::STOPPED;
 		m_d->stopped_state_cv.notify_all();
 		m_d->thread_init_fn.swap(t_thread_init_fn); //final cleanup
@@ -247,7 +512,7 @@ void ks_thread_pool_apartment_imp::_try_stop_locked(bool should_thread_exit, std
 
 	if (should_thread_exit && !m_d->should_thread_exit_v) {
 		m_d->should_thread_exit_v = true;
-		m_d->any_fn_queue_cv.notify_all();
+		_unpark_all_threads_locked(m_d, lock);
 	}
 
 	if (t_thread_init_fn || t_thread_term_fn) {
@@ -260,30 +525,139 @@ void ks_thread_pool_apartment_imp::_try_stop_locked(bool should_thread_exit, std
 }
 
 
-void ks_thread_pool_apartment_imp::_prepare_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
-	if (d->thread_pool.size() >= d->max_thread_count)
+void ks_thread_pool_apartment_imp::_prepare_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock, bool fn_waited_too_long) {
+	const size_t max_thread_count = _get_compensated_max_thread_count_locked(d, lock);
+	size_t active_thread_count = _get_active_thread_count_locked(d, lock);
+	if (active_thread_count >= max_thread_count)
 		return;
 
 	size_t needed_thread_count = 0;
 	if (d->state_v == _STATE::RUNNING || !d->should_thread_exit_v) {
-		needed_thread_count = d->busy_thread_count + d->now_fn_queue_prior.size() + d->now_fn_queue_normal.size();
+		needed_thread_count = d->busy_thread_count + d->now_fn_queue_prior.size() + d->now_fn_queue_deadline.size() + d->now_fn_queue_sjf.size() + d->now_fn_queue_normal.size() + d->sched_class_fn_count;
 		if (d->state_v == _STATE::RUNNING)
 			needed_thread_count += d->now_fn_queue_idle.size() + (d->delaying_fn_queue.empty() ? 0 : 1);
 
+		if (d->flags & work_stealing_flag)
+			needed_thread_count += d->local_fn_count_v.load();
+
 		if (needed_thread_count == 0)
 			needed_thread_count = 1;
-		else if (needed_thread_count > d->max_thread_count)
-			needed_thread_count = d->max_thread_count;
+		else if (needed_thread_count > max_thread_count)
+			needed_thread_count = max_thread_count;
+	}
+
+	if (d->grow_wait_threshold_v.load(std::memory_order_relaxed) > 0 && active_thread_count != 0 && needed_thread_count > active_thread_count
+		&& (d->now_fn_queue_idle.empty() || active_thread_count > d->busy_thread_count_for_idle + 1)) {
+		//弹性扩充：尚有空闲线程、或队首任务的等待时长未超过阈值时，不扩充；否则仅扩充1个线程
+		//（若现有线程都不可执行idle任务，则仍按队列长度扩充，以免idle任务被饿死）
+		if (d->busy_thread_count < active_thread_count)
+			return;
+		if (!fn_waited_too_long && !_check_fn_queue_waited_too_long_locked(d, lock))
+			return;
+		needed_thread_count = active_thread_count + 1;
+	}
+
+	for (; active_thread_count < needed_thread_count; ++active_thread_count) {
+		_spawn_work_thread_locked(self, d, lock);
+	}
+
+	d->thread_pool_full_v = active_thread_count >= max_thread_count;
+}
+
+void ks_thread_pool_apartment_imp::_prewarm_work_threads_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	const size_t max_thread_count = d->max_thread_count_v;
+	size_t active_thread_count = _get_active_thread_count_locked(d, lock);
+	for (; active_thread_count < max_thread_count; ++active_thread_count) {
+		_spawn_work_thread_locked(self, d, lock);
 	}
 
-	for (size_t i = d->thread_pool.size(); i < needed_thread_count; ++i) {
+	d->thread_pool_full_v = active_thread_count >= _get_compensated_max_thread_count_locked(d, lock);
+}
+
+void ks_thread_pool_apartment_imp::_spawn_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+
+	//优先复用已退休且已退出的线程的槽位
+	//注：已退休而尚未退出的线程仍在使用其槽位（park_cv、本地队列等），且退出时要据retired标记扣减retiring_thread_count，故其槽位暂不可复用
+	size_t thread_index = 0;
+	while (thread_index < d->thread_pool.size() && !(d->thread_pool[thread_index]->retired && d->thread_pool[thread_index]->exited))
+		++thread_index;
+	if (thread_index == d->thread_pool.size()) {
 		d->thread_pool.push_back(std::make_shared<_THREAD_ITEM>());
-		d->living_thread_count++;
+	}
+	else {
+		d->thread_pool[thread_index]->retired = false;
+		d->thread_pool[thread_index]->exited = false;
+	}
+
+	if (!d->numa_node_cpu_ids.empty())
+		d->thread_pool[thread_index]->numa_node = thread_index % d->numa_node_cpu_ids.size(); //各节点轮流分配
+
+	d->living_thread_count++;
 
-		std::thread([self, d, thread_index = d->thread_pool.size() - 1]() {
-			_work_thread_proc(self, d, thread_index);
-		}).detach();
+	ks_apartment::__start_native_thread([self, d, thread_index]() {
+		_work_thread_proc(self, d, thread_index);
+	}, d->thread_stack_size);
+}
+
+std::vector<int> ks_thread_pool_apartment_imp::_determine_thread_cpu_ids_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, size_t thread_index, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (d->numa_node_cpu_ids.empty())
+		return d->thread_cpu_ids;
+
+	const std::vector<int>& node_cpu_ids = d->numa_node_cpu_ids[d->thread_pool[thread_index]->numa_node];
+	if (d->numa_node_cpu_ids.size() == 1 && d->thread_cpu_ids.empty())
+		return {}; //单节点，不必绑定
+
+	std::vector<int> cpu_ids;
+	for (int cpu_id : node_cpu_ids) {
+		if (d->thread_cpu_ids.empty() || std::find(d->thread_cpu_ids.cbegin(), d->thread_cpu_ids.cend(), cpu_id) != d->thread_cpu_ids.cend())
+			cpu_ids.push_back(cpu_id);
+	}
+	return !cpu_ids.empty() ? cpu_ids : node_cpu_ids;
+}
+
+size_t ks_thread_pool_apartment_imp::_get_active_thread_count_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	ASSERT(d->living_thread_count >= d->retiring_thread_count);
+	return d->living_thread_count - d->retiring_thread_count;
+}
+
+size_t ks_thread_pool_apartment_imp::_get_compensated_max_thread_count_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//处于阻塞区间中的线程不计入并发度，故线程数上限临时调高相应数量
+	return d->max_thread_count_v + std::min(d->blocking_thread_count, _BLOCKING_COMPENSATION_MAX_COUNT);
+}
+
+bool ks_thread_pool_apartment_imp::_check_fn_queue_waited_too_long_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//注：prior队列按优先级插队，其队首未必最早入队，这里仅作近似判断
+	const auto deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(d->grow_wait_threshold_v.load(std::memory_order_relaxed));
+	if ((!d->now_fn_queue_prior.empty() && d->now_fn_queue_prior.front()->queued_time <= deadline)
+		|| (!d->now_fn_queue_deadline.empty() && d->now_fn_queue_deadline.front()->queued_time <= deadline)
+		|| (!d->now_fn_queue_sjf.empty() && d->now_fn_queue_sjf.front()->queued_time <= deadline)
+		|| (!d->now_fn_queue_normal.empty() && d->now_fn_queue_normal.front()->queued_time <= deadline))
+		return true;
+
+	for (const auto& sched_class_item : d->sched_class_items) {
+		if (!sched_class_item->fn_queue.empty() && sched_class_item->fn_queue.front()->queued_time <= deadline)
+			return true;
 	}
+	return false;
+}
+
+void ks_thread_pool_apartment_imp::_try_grow_work_thread_on_dequeue_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const _FN_ITEM* local_fn_item, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	const int64_t grow_wait_threshold = d->grow_wait_threshold_v.load(std::memory_order_relaxed);
+	if (grow_wait_threshold <= 0 || d->thread_pool_full_v.load(std::memory_order_relaxed))
+		return;
+
+	//全局队列的积压由_prepare_work_thread_locked检查其队首的等待时长；
+	//而本地队列无从检查，故以刚取出的本地任务的等待时长为准（仅当仍有本地任务积压时）
+	const bool local_fn_waited_too_long = local_fn_item != nullptr && d->local_fn_count_v.load() != 0
+		&& local_fn_item->queued_time + std::chrono::milliseconds(grow_wait_threshold) <= std::chrono::steady_clock::now();
+	_prepare_work_thread_locked(self, d, lock, local_fn_waited_too_long);
 }
 
 void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, size_t thread_index) {
@@ -294,18 +668,41 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 
 	if (true) {
 		std::stringstream thread_name_ss;
-		thread_name_ss << d->name << "'s work-thread [" << thread_index << "/" << d->max_thread_count << "]";
+		thread_name_ss << d->name << "'s work-thread [" << thread_index << "/" << d->max_thread_count_v << "]";
 		ks_apartment::__set_current_thread_name(thread_name_ss.str().c_str());
 	}
 
 	std::function<void()> using_thread_init_fn;
 	std::function<void()> using_thread_term_fn;
+	std::vector<int> using_cpu_ids;
+	size_t using_stack_size = 0;
+	_THREAD_ITEM* work_stealing_thread_item = nullptr;
 	if (true) {
 		std::unique_lock<ks_mutex> lock(d->mutex);
 		using_thread_init_fn = d->thread_init_fn;
 		using_thread_term_fn = d->thread_term_fn;
+		using_cpu_ids = _determine_thread_cpu_ids_locked(d, thread_index, lock);
+		using_stack_size = d->thread_stack_size;
+		if (d->flags & work_stealing_flag)
+			work_stealing_thread_item = d->thread_pool[thread_index].get();
+	}
+
+	if (!using_cpu_ids.empty()) {
+		bool affinity_ok = ks_apartment::__set_current_thread_cpu_affinity(using_cpu_ids);
+		_UNUSED(affinity_ok); //绑定失败时（如平台不支持）仍照常运行
+	}
+
+	if (d->flags & prewarm_flag) {
+		//预先触及线程栈（在绑定cpu之后，使页面分配在所属NUMA节点上）；
+		//TLS则已在上面访问tls_current_thread_index_plus时随本模块的TLS块一并分配
+		__prefault_current_thread_stack(using_stack_size != 0 && using_stack_size / 4 < _PREWARM_STACK_PREFAULT_SIZE ? using_stack_size / 4 : _PREWARM_STACK_PREFAULT_SIZE);
 	}
 
+	ASSERT(tls_current_thread_item_for_work_stealing == nullptr);
+	tls_current_thread_item_for_work_stealing = work_stealing_thread_item;
+	bool yield_to_global_normal_flag = false; //执行完一批本地任务后，先让一次全局normal任务，以免外部投递的任务被饿死
+	std::chrono::steady_clock::time_point idle_since_time = {}; //本线程开始空闲的时刻，用于弹性退休
+
 	if (using_thread_init_fn) {
 		using_thread_init_fn();
 	}
@@ -332,14 +729,23 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 		});
 #endif
 
+		//retire (shrink)：线程数超出了被调小的max_thread_count，则在本地任务执行完后退休
+		if (d->state_v == _STATE::RUNNING && _get_active_thread_count_locked(d, lock) > _get_compensated_max_thread_count_locked(d, lock)
+			&& (work_stealing_thread_item == nullptr || _check_local_fn_queue_empty(work_stealing_thread_item))
+			&& d->thread_pool[thread_index]->parked_fiber_count == 0) {
+			++d->retiring_thread_count;
+			d->thread_pool[thread_index]->retired = true;
+			d->thread_pool_full_v = _get_active_thread_count_locked(d, lock) >= _get_compensated_max_thread_count_locked(d, lock);
+			break; //end
+		}
+
 		//try next delaying_fn
 		if (!d->delaying_fn_queue.empty()) {
 			size_t moved_fn_count = 0;
 			const auto now = std::chrono::steady_clock::now();
 			while (!d->delaying_fn_queue.empty() && d->delaying_fn_queue.front()->until_time <= now) {
 				//直接将到期的delaying项移入now队列
-				_do_put_fn_item_into_now_list_locked(d, std::move(d->delaying_fn_queue.front()), lock);
-				d->delaying_fn_queue.pop_front();
+				_do_put_fn_item_into_now_list_locked(d, d->delaying_fn_queue.pop_front(), lock);
 				++moved_fn_count;
 			}
 
@@ -349,28 +755,94 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 			}
 		}
 
+		//try next ready fiber (fiber模式：已被awaken的fiber先于新任务恢复执行，且只在原线程上)
+		if (!d->thread_pool[thread_index]->ready_fibers.empty()) {
+			_THREAD_ITEM* thread_item = d->thread_pool[thread_index].get();
+			ks_apartment_fiber* fiber = thread_item->ready_fibers.front();
+			thread_item->ready_fibers.pop_front();
+			ASSERT(thread_item->parked_fiber_count >= 1);
+			--thread_item->parked_fiber_count;
+
+			ASSERT(d->busy_thread_count < d->living_thread_count);
+			++d->busy_thread_count;
+			idle_since_time = {};
+
+			ks_defer defer_dec_busy_thread_count([&d, &lock]() {
+				ASSERT(lock.owns_lock());
+				ASSERT(d->busy_thread_count >= 1);
+				--d->busy_thread_count;
+			});
+
+			lock.unlock();
+			tls_current_thread_time_slice_begin_time = {}; //被恢复的fiber重新计时其时间片
+			tls_current_thread_yield_locked_check_time = {};
+			ks_apartment_fiber::resume(fiber); //若再次park，则已被重新登记于parked_fibers
+
+			lock.lock(); //for working_rc and busy_thread_count
+			continue;
+		}
+
+		//try next local_fn (work-stealing)
+		//次序：prior > 本线程本地任务 > 全局normal > 窃取其他线程的本地任务 > idle
+		if (work_stealing_thread_item != nullptr && d->now_fn_queue_prior.empty() && !(yield_to_global_normal_flag && !_check_normal_fn_queue_empty_locked(d, lock))) {
+			auto local_fn_item = _try_pop_local_fn_item(d, work_stealing_thread_item);
+			if (local_fn_item == nullptr && _check_normal_fn_queue_empty_locked(d, lock))
+				local_fn_item = _try_steal_local_fn_item_locked(d, work_stealing_thread_item, thread_index, lock);
+
+			if (local_fn_item != nullptr) {
+				ASSERT(d->busy_thread_count < d->living_thread_count);
+				++d->busy_thread_count;
+				idle_since_time = {};
+				_try_grow_work_thread_on_dequeue_locked(self, d, local_fn_item.get(), lock);
+
+				ks_defer defer_dec_busy_thread_count([&d, &lock]() {
+					ASSERT(lock.owns_lock());
+					ASSERT(d->busy_thread_count >= 1);
+					--d->busy_thread_count;
+				});
+
+				lock.unlock();
+				_run_local_fn_items_batch(d, work_stealing_thread_item, std::move(local_fn_item));
+
+				lock.lock(); //for working_rc and busy_thread_count
+				yield_to_global_normal_flag = true;
+				continue;
+			}
+		}
+
 		//try next now_fn
 		if (true) {
-			auto* now_fn_queue_sel = !d->now_fn_queue_prior.empty() ? &d->now_fn_queue_prior : &d->now_fn_queue_normal;
-			if (now_fn_queue_sel->empty() && !d->now_fn_queue_idle.empty() && d->thread_pool.size() > 1 && d->busy_thread_count_for_idle + 1 < d->thread_pool.size() && d->state_v == _STATE::RUNNING)
-				now_fn_queue_sel = &d->now_fn_queue_idle; //保留1个线程不去执行idle任务（除非是单线程套间）
-
-			if (!now_fn_queue_sel->empty()) {
+			const bool idle_allowed = d->living_thread_count > 1 && d->busy_thread_count_for_idle + 1 < d->living_thread_count && d->state_v == _STATE::RUNNING; //保留1个线程不去执行idle任务（除非是单线程套间）
+			bool is_now_fn_from_idle = false;
+			auto now_fn_item = _try_pop_now_fn_item_locked(d, idle_allowed, &is_now_fn_from_idle, lock);
+			if (now_fn_item != nullptr) {
 				//pop and exec a fn
-				bool is_now_fn_from_idle = now_fn_queue_sel == &d->now_fn_queue_idle;
-				auto now_fn_item = std::move(now_fn_queue_sel->front());
-				now_fn_queue_sel->pop_front();
+				if (!_try_claim_fn_item_locked(d, now_fn_item, lock)) {
+					//已被撤销，丢弃（在锁外释放fn）
+					lock.unlock();
+					now_fn_item->fn = {};
+					now_fn_item.reset();
+					lock.lock();
+					continue;
+				}
+				yield_to_global_normal_flag = false;
 
-				ASSERT(d->busy_thread_count < d->thread_pool.size());
+				ASSERT(d->busy_thread_count < d->living_thread_count);
 				++d->busy_thread_count;
 				if (is_now_fn_from_idle) {
-					ASSERT(d->busy_thread_count_for_idle + 1 < d->thread_pool.size());
+					ASSERT(d->busy_thread_count_for_idle + 1 < d->living_thread_count);
 					++d->busy_thread_count_for_idle;
 					ASSERT(!tls_current_thread_pump_loop_busy_for_idle_flag);
 					tls_current_thread_pump_loop_busy_for_idle_flag = true;
 				}
-
-				ks_defer defer_dec_busy_thread_count([&d, is_now_fn_from_idle, &lock]() {
+				_SCHED_CLASS_ITEM* sched_class_item = now_fn_item->sched_class_item;
+				if (sched_class_item != nullptr)
+					++sched_class_item->busy_thread_count;
+				idle_since_time = {};
+				_try_grow_work_thread_on_dequeue_locked(self, d, nullptr, lock);
+
+				const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(now_fn_item->sched_class);
+				ks_defer defer_dec_busy_thread_count([&d, is_now_fn_from_idle, sched_class_item, pre_sched_class, &lock]() {
 					ASSERT(lock.owns_lock());
 					ASSERT(d->busy_thread_count >= 1);
 					--d->busy_thread_count;
@@ -380,11 +852,15 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 						ASSERT(tls_current_thread_pump_loop_busy_for_idle_flag);
 						tls_current_thread_pump_loop_busy_for_idle_flag = false;
 					}
+					if (sched_class_item != nullptr) {
+						ASSERT(sched_class_item->busy_thread_count >= 1);
+						--sched_class_item->busy_thread_count;
+					}
+					ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
 				});
 
 				lock.unlock();
-				now_fn_item->fn();
-				now_fn_item->fn = {};
+				_exec_fn_item(d, now_fn_item);
 				now_fn_item.reset();
 
 				lock.lock(); //for working_rc and busy_thread_count
@@ -393,41 +869,109 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 		}
 
 		//pump-idle
-		if (d->state_v == _STATE::STOPPING && d->should_thread_exit_v) {
+		if (d->state_v != _STATE::RUNNING && d->thread_pool[thread_index]->parked_fiber_count != 0) {
+			//同嵌套泵在非RUNNING时退出，本线程被park的fiber亦全部唤醒，其wait将以失败返回
+			_THREAD_ITEM* thread_item = d->thread_pool[thread_index].get();
+			auto it = std::stable_partition(d->parked_fibers.begin(), d->parked_fibers.end(),
+				[thread_item](const _THREAD_POOL_APARTMENT_DATA::_PARKED_FIBER_ITEM& parked_item) { return parked_item.thread_item != thread_item; });
+			for (auto it2 = it; it2 != d->parked_fibers.end(); ++it2)
+				thread_item->ready_fibers.push_back(it2->fiber);
+			d->parked_fibers.erase(it, d->parked_fibers.end());
+			if (!thread_item->ready_fibers.empty())
+				continue;
+		}
+
+		if (d->state_v == _STATE::STOPPING && d->should_thread_exit_v && (work_stealing_thread_item == nullptr || d->local_fn_count_v.load() == 0)
+			&& d->thread_pool[thread_index]->parked_fiber_count == 0) {
 			break; //end
 		}
 
+		//retire (idle)：空闲超时则退休，但至少保留1个线程；
+		//负责等待延时任务到期的线程不退休，idle任务尚未执行完时亦不退休（以免余下线程不足以执行idle任务）
+		std::chrono::steady_clock::time_point retire_time = {};
+		if (d->thread_idle_timeout > 0 && d->state_v == _STATE::RUNNING && _get_active_thread_count_locked(d, lock) > 1
+			&& d->now_fn_queue_idle.empty() && (d->delaying_fn_queue.empty() || d->delaying_fn_queue.front()->is_waiting_until_flag)
+			&& (work_stealing_thread_item == nullptr || d->local_fn_count_v.load() == 0)
+			&& d->thread_pool[thread_index]->parked_fiber_count == 0) {
+			const auto now = std::chrono::steady_clock::now();
+			if (idle_since_time == std::chrono::steady_clock::time_point{})
+				idle_since_time = now;
+			retire_time = idle_since_time + std::chrono::milliseconds(d->thread_idle_timeout);
+			if (retire_time <= now) {
+				++d->retiring_thread_count;
+				d->thread_pool[thread_index]->retired = true;
+				d->thread_pool_full_v = false;
+				break; //end
+			}
+		}
+
 		//waiting
+		if (work_stealing_thread_item != nullptr) {
+			//先登记为等待者、再检查本地任务数（与schedule中的local路径次序相反），避免遗漏唤醒
+			d->waiting_thread_count_v.fetch_add(1);
+			if (d->local_fn_count_v.load() != 0) {
+				d->waiting_thread_count_v.fetch_sub(1);
+				continue; //仍有其他线程的本地任务可窃取
+			}
+		}
+
 		if (d->state_v == _STATE::RUNNING && !d->delaying_fn_queue.empty() && !d->delaying_fn_queue.front()->is_waiting_until_flag) {
 			const auto waiting_fn_item = d->delaying_fn_queue.front();
 			waiting_fn_item->is_waiting_until_flag = true;
-			d->any_fn_queue_cv.wait_until(lock, waiting_fn_item->until_time); //waiting
+			_park_current_thread_locked(d, d->thread_pool[thread_index].get(), &waiting_fn_item->until_time, lock); //waiting
 			waiting_fn_item->is_waiting_until_flag = false;
 		}
+		else if (retire_time != std::chrono::steady_clock::time_point{}) {
+			_park_current_thread_locked(d, d->thread_pool[thread_index].get(), &retire_time, lock); //waiting, or retire when timeout
+		}
 		else {
-			d->any_fn_queue_cv.wait(lock);
+			_park_current_thread_locked(d, d->thread_pool[thread_index].get(), nullptr, lock);
 		}
+
+		if (work_stealing_thread_item != nullptr)
+			d->waiting_thread_count_v.fetch_sub(1);
 	}
 
 	--tls_current_thread_pump_loop_depth;
 	ASSERT(tls_current_thread_pump_loop_depth == 0);
 
-	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_prior;
+	ASSERT(tls_current_thread_item_for_work_stealing == work_stealing_thread_item);
+	tls_current_thread_item_for_work_stealing = nullptr;
+
+	ks_apartment_priority_fn_heap<_FN_ITEM> t_now_fn_queue_prior;
+	ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::deadline_time> t_now_fn_queue_deadline;
+	ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::sjf_rank_time> t_now_fn_queue_sjf;
 	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_normal;
-	std::deque<std::shared_ptr<_FN_ITEM>> t_now_fn_queue_idle;
-	std::deque<std::shared_ptr<_FN_ITEM>> t_delaying_fn_queue;
+	ks_apartment_priority_fn_heap<_FN_ITEM> t_now_fn_queue_idle;
+	ks_apartment_delaying_fn_heap<_FN_ITEM> t_delaying_fn_queue;
+	std::vector<std::shared_ptr<_FN_ITEM>> t_cancelled_fn_items;
 	std::function<void()> t_thread_init_fn;
 	std::function<void()> t_thread_term_fn;
 	if (true) {
 		std::unique_lock<ks_mutex> lock(d->mutex);
+		if (d->thread_pool[thread_index]->retired) {
+			ASSERT(d->retiring_thread_count > 0);
+			d->retiring_thread_count--;
+		}
+		d->thread_pool[thread_index]->exited = true;
 		ASSERT(d->living_thread_count > 0);
 		d->living_thread_count--;
 		if (d->state_v == _STATE::STOPPING && d->living_thread_count == 0) {
+			_do_compact_cancelled_fn_items_locked(d, &t_cancelled_fn_items, lock); //滞留的已撤销任务
 			ASSERT(d->now_fn_queue_idle.empty() && d->delaying_fn_queue.empty());
 			d->now_fn_queue_prior.swap(t_now_fn_queue_prior);
+			d->now_fn_queue_deadline.swap(t_now_fn_queue_deadline);
+			d->now_fn_queue_sjf.swap(t_now_fn_queue_sjf);
 			d->now_fn_queue_normal.swap(t_now_fn_queue_normal);
+			for (const auto& sched_class_item : d->sched_class_items) {
+				for (auto& fn_item : sched_class_item->fn_queue)
+					t_now_fn_queue_normal.push_back(std::move(fn_item));
+				sched_class_item->fn_queue.clear();
+			}
+			d->sched_class_fn_count = 0;
 			d->now_fn_queue_idle.swap(t_now_fn_queue_idle);
 			d->delaying_fn_queue.swap(t_delaying_fn_queue);
+			d->slotted_fn_items.clear(); //其所指的项随各队列一并释放
 			d->thread_init_fn.swap(t_thread_init_fn); //final cleanup
 			d->thread_term_fn.swap(t_thread_term_fn); //final cleanup
 			d->state_v = _STATE::STOPPED;
@@ -440,9 +984,12 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 	}
 
 	t_now_fn_queue_prior.clear();
+	t_now_fn_queue_deadline.clear();
+	t_now_fn_queue_sjf.clear();
 	t_now_fn_queue_normal.clear();
 	t_now_fn_queue_idle.clear();
 	t_delaying_fn_queue.clear();
+	t_cancelled_fn_items.clear();
 	t_thread_init_fn = nullptr;
 	t_thread_term_fn = nullptr;
 	using_thread_init_fn = nullptr;
@@ -452,71 +999,449 @@ void ks_thread_pool_apartment_imp::_work_thread_proc(ks_thread_pool_apartment_im
 	ASSERT(tls_current_thread_index_plus == thread_index + 1);
 }
 
-void ks_thread_pool_apartment_imp::_do_put_fn_item_into_now_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock) {
-	auto* now_fn_queue_sel = 
-		(fn_item->is_delaying_fn && (d->flags & delayed_always_low_prior_flag)) ? &d->now_fn_queue_idle :  //延时任务强制为低优先级?
-		fn_item->priority == 0 ? &d->now_fn_queue_normal :  //priority=0为普通优先级
-		fn_item->priority > 0 ? &d->now_fn_queue_prior :    //priority>0为高优先级
-		&d->now_fn_queue_idle;                              //priority<0为低优先级，简单地加入到idle队列
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_pop_local_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item) {
+	std::lock_guard<ks_spinlock> local_lock(thread_item->local_mutex);
 
-	if (now_fn_queue_sel == &d->now_fn_queue_normal) {
-		//normal队列（priority===0）直入
-		now_fn_queue_sel->push_back(std::move(fn_item));
+	std::shared_ptr<_FN_ITEM> fn_item;
+	if (thread_item->local_lifo_slot != nullptr) {
+		fn_item = std::move(thread_item->local_lifo_slot);
 	}
-	else if (now_fn_queue_sel->empty()) {
-		//空队列直入
-		now_fn_queue_sel->push_back(std::move(fn_item));
+	else if (!thread_item->local_fn_queue.empty()) {
+		fn_item = std::move(thread_item->local_fn_queue.front());
+		thread_item->local_fn_queue.pop_front();
 	}
-	else if (fn_item->priority <= now_fn_queue_sel->back()->priority) {
-		//最小优先级：接在队尾
-		now_fn_queue_sel->push_back(std::move(fn_item));
+	else {
+		return nullptr;
 	}
-	else if (fn_item->priority > now_fn_queue_sel->front()->priority) {
-		//最大优先级：插在队头
-		now_fn_queue_sel->push_front(std::move(fn_item));
+
+	ASSERT(d->local_fn_count_v.load() != 0);
+	d->local_fn_count_v.fetch_sub(1);
+	return fn_item;
+}
+
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_take_local_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, uint64_t fn_id) {
+	std::lock_guard<ks_spinlock> local_lock(thread_item->local_mutex);
+
+	std::shared_ptr<_FN_ITEM> fn_item;
+	if (thread_item->local_lifo_slot != nullptr && thread_item->local_lifo_slot->fn_id == fn_id) {
+		fn_item = std::move(thread_item->local_lifo_slot);
 	}
 	else {
-		//根据优先级插队
-		auto where_it = std::upper_bound(
-			now_fn_queue_sel->begin(), now_fn_queue_sel->end(), fn_item,
-			[](const std::shared_ptr<_FN_ITEM>& a, const std::shared_ptr<_FN_ITEM>& b) { return a->priority > b->priority; });
-		now_fn_queue_sel->insert(where_it, std::move(fn_item));
+		auto it = std::find_if(thread_item->local_fn_queue.begin(), thread_item->local_fn_queue.end(),
+			[fn_id](const std::shared_ptr<_FN_ITEM>& item) { return item->fn_id == fn_id; });
+		if (it == thread_item->local_fn_queue.end())
+			return nullptr;
+
+		fn_item = std::move(*it);
+		thread_item->local_fn_queue.erase(it);
 	}
 
-	d->any_fn_queue_cv.notify_one();
+	ASSERT(d->local_fn_count_v.load() != 0);
+	d->local_fn_count_v.fetch_sub(1);
+	return fn_item;
 }
 
-void ks_thread_pool_apartment_imp::_do_put_fn_item_into_delaying_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock) {
-	bool should_notify = d->delaying_fn_queue.empty() || fn_item->until_time < d->delaying_fn_queue.front()->until_time;
+void ks_thread_pool_apartment_imp::_park_current_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, const std::chrono::steady_clock::time_point* until_time, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	ASSERT(!thread_item->parked);
+	thread_item->parked = true;
+	d->parked_thread_stack.push_back(thread_item);
+	d->parked_thread_count_v.store(d->parked_thread_stack.size(), std::memory_order_relaxed);
+
+	if (until_time != nullptr)
+		thread_item->park_cv.wait_until(lock, *until_time);
+	else
+		thread_item->park_cv.wait(lock);
+
+	if (thread_item->parked) {
+		//超时或虚假唤醒，自行出栈
+		auto it = std::find(d->parked_thread_stack.begin(), d->parked_thread_stack.end(), thread_item);
+		ASSERT(it != d->parked_thread_stack.end());
+		if (it != d->parked_thread_stack.end())
+			d->parked_thread_stack.erase(it);
+		d->parked_thread_count_v.store(d->parked_thread_stack.size(), std::memory_order_relaxed);
+		thread_item->parked = false;
+	}
+}
 
-	//（忽略priority）
-	if (d->delaying_fn_queue.empty()) {
-		//空队列直入
-		d->delaying_fn_queue.push_back(std::move(fn_item));
+void ks_thread_pool_apartment_imp::_unpark_one_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (d->parked_thread_stack.empty())
+		return; //全部线程都在忙，它们会在完成手头任务后接着处理
+
+	_THREAD_ITEM* thread_item = d->parked_thread_stack.back(); //最近空闲的线程
+	d->parked_thread_stack.pop_back();
+	d->parked_thread_count_v.store(d->parked_thread_stack.size(), std::memory_order_relaxed);
+	ASSERT(thread_item->parked);
+	thread_item->parked = false;
+	thread_item->park_cv.notify_one();
+}
+
+void ks_thread_pool_apartment_imp::_unpark_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (!thread_item->parked)
+		return; //该线程正忙，它会在完成手头任务后接着处理
+
+	auto it = std::find(d->parked_thread_stack.begin(), d->parked_thread_stack.end(), thread_item);
+	ASSERT(it != d->parked_thread_stack.end());
+	if (it != d->parked_thread_stack.end())
+		d->parked_thread_stack.erase(it);
+	d->parked_thread_count_v.store(d->parked_thread_stack.size(), std::memory_order_relaxed);
+	thread_item->parked = false;
+	thread_item->park_cv.notify_one();
+}
+
+void ks_thread_pool_apartment_imp::_unpark_all_threads_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	for (_THREAD_ITEM* thread_item : d->parked_thread_stack) {
+		ASSERT(thread_item->parked);
+		thread_item->parked = false;
+		thread_item->park_cv.notify_one();
+	}
+	d->parked_thread_stack.clear();
+	d->parked_thread_count_v.store(0, std::memory_order_relaxed);
+}
+
+bool ks_thread_pool_apartment_imp::_check_local_fn_queue_empty(_THREAD_ITEM* thread_item) {
+	std::lock_guard<ks_spinlock> local_lock(thread_item->local_mutex);
+	return thread_item->local_lifo_slot == nullptr && thread_item->local_fn_queue.empty();
+}
+
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_steal_local_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thief_thread_item, size_t thief_thread_index, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (d->local_fn_count_v.load() == 0)
+		return nullptr;
+
+	//注：窃取在全局锁内进行，同一时刻至多一个窃取者，故逐个尝试受害者即可
+	//numa_aware_flag模式下，先窃取同节点的线程，仅当同节点已无可窃取的任务时才跨节点窃取
+	const size_t thread_count = d->thread_pool.size();
+	const bool numa_aware = d->numa_node_cpu_ids.size() > 1;
+	for (size_t i = 1; i < thread_count * (numa_aware ? 2 : 1); ++i) {
+		if (i == thread_count)
+			continue;
+		_THREAD_ITEM* victim_thread_item = d->thread_pool[(thief_thread_index + i) % thread_count].get();
+		ASSERT(victim_thread_item != thief_thread_item);
+		if (numa_aware && (victim_thread_item->numa_node == thief_thread_item->numa_node) != (i < thread_count))
+			continue; //第一轮仅同节点，第二轮仅跨节点
+
+		std::shared_ptr<_FN_ITEM> stolen_fn_item;
+		std::deque<std::shared_ptr<_FN_ITEM>> stolen_more_fn_queue;
+		if (true) {
+			std::lock_guard<ks_spinlock> victim_lock(victim_thread_item->local_mutex);
+			auto& victim_fn_queue = victim_thread_item->local_fn_queue;
+			if (!victim_fn_queue.empty()) {
+				//从队头（较早投递的一端）窃取一半
+				stolen_fn_item = std::move(victim_fn_queue.front());
+				victim_fn_queue.pop_front();
+				const size_t stolen_more_count = victim_fn_queue.size() / 2;
+				for (size_t k = 0; k < stolen_more_count; ++k) {
+					stolen_more_fn_queue.push_back(std::move(victim_fn_queue.front()));
+					victim_fn_queue.pop_front();
+				}
+			}
+			else if (victim_thread_item->local_lifo_slot != nullptr) {
+				//受害者的本地队列已空，但其lifo-slot中的任务迟迟未被执行（受害者正忙于长任务）
+				stolen_fn_item = std::move(victim_thread_item->local_lifo_slot);
+			}
+			else {
+				continue;
+			}
+
+			d->local_fn_count_v.fetch_sub(1); //被转移至窃取者本地队列的任务仍计数在内
+		}
+
+		if (!stolen_more_fn_queue.empty()) {
+			std::lock_guard<ks_spinlock> thief_lock(thief_thread_item->local_mutex);
+			for (auto& fn_item : stolen_more_fn_queue)
+				thief_thread_item->local_fn_queue.push_back(std::move(fn_item));
+		}
+
+		return stolen_fn_item;
+	}
+
+	return nullptr;
+}
+
+void ks_thread_pool_apartment_imp::_run_local_fn_items_batch(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::shared_ptr<_FN_ITEM>&& first_fn_item) {
+	//在锁外连续执行一批本地任务，以摊薄全局锁的开销；
+	//一旦出现prior任务（或atforking），则及时中止，回到主循环中按序调度
+	std::shared_ptr<_FN_ITEM> fn_item = std::move(first_fn_item);
+	int batch_count = 0;
+	const int pre_sched_class = ks_apartment::__get_current_thread_sched_class();
+	ks_defer defer_restore_sched_class([pre_sched_class]() { ks_apartment::__exchange_current_thread_sched_class(pre_sched_class); });
+	while (fn_item != nullptr) {
+		ks_apartment::__exchange_current_thread_sched_class(fn_item->sched_class);
+		_exec_fn_item(d, fn_item);
+		fn_item.reset();
+
+		if (++batch_count >= _LOCAL_FN_BATCH_MAX_COUNT)
+			break;
+		if (d->prior_fn_count_v.load(std::memory_order_relaxed) != 0)
+			break;
+#if __KS_APARTMENT_ATFORK_ENABLED
+		if (d->atforking_flag_v)
+			break;
+#endif
+
+		fn_item = _try_pop_local_fn_item(d, thread_item);
 	}
-	else if (fn_item->until_time >= d->delaying_fn_queue.back()->until_time) {
-		//最大延时项：插在队尾
-		d->delaying_fn_queue.push_back(std::move(fn_item));
+}
+
+void ks_thread_pool_apartment_imp::_do_put_fn_item_into_now_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock, bool should_notify) {
+	if (d->grow_wait_threshold_v.load(std::memory_order_relaxed) > 0)
+		fn_item->queued_time = std::chrono::steady_clock::now();
+	fn_item->is_in_delaying_queue = false;
+
+	if (fn_item->is_delaying_fn && (d->flags & delayed_always_low_prior_flag)) {
+		d->now_fn_queue_idle.push(std::move(fn_item));        //延时任务强制为低优先级?
 	}
-	else if (fn_item->until_time < d->delaying_fn_queue.front()->until_time) {
-		//最小延时项：插在队头
-		d->delaying_fn_queue.push_front(std::move(fn_item));
+	else if (fn_item->priority == 0 && fn_item->deadline_time != std::chrono::steady_clock::time_point{}) {
+		d->now_fn_queue_deadline.push(std::move(fn_item));    //priority=0且带截止时刻（仅deadline_first_flag模式），按截止时刻排序
+	}
+	else if (fn_item->priority == 0) {
+		//priority=0为普通优先级，直入（已配置的调度类别则入其队列）
+		_SCHED_CLASS_ITEM* sched_class_item = nullptr;
+		for (const auto& item : d->sched_class_items) {
+			if (item->sched_class == fn_item->sched_class) {
+				sched_class_item = item.get();
+				break;
+			}
+		}
+
+		if (sched_class_item != nullptr) {
+			fn_item->sched_class_item = sched_class_item;
+			sched_class_item->fn_queue.push_back(std::move(fn_item));
+			++d->sched_class_fn_count;
+		}
+		else if ((d->flags & shortest_job_first_flag) && d->sched_class_items.empty()) {
+			//SJF：按投递时刻+预估耗时排序（未配置调度类别时才生效，否则仍参与各类别间的加权轮转）
+			d->now_fn_queue_sjf.push(std::move(fn_item));
+		}
+		else {
+			d->now_fn_queue_normal.push_back(std::move(fn_item));
+		}
+	}
+	else if (fn_item->priority > 0) {
+		d->now_fn_queue_prior.push(std::move(fn_item));       //priority>0为高优先级
+		d->prior_fn_count_v.store(d->now_fn_queue_prior.size(), std::memory_order_relaxed);
 	}
 	else {
-		//新项的目标时点落在当前队列的时段区间内：插队
-		auto where_it = std::upper_bound(d->delaying_fn_queue.begin(), d->delaying_fn_queue.end(), fn_item,
-			[](const std::shared_ptr<_FN_ITEM>& a, std::shared_ptr<_FN_ITEM>& b) { return a->until_time < b->until_time; });
-		d->delaying_fn_queue.insert(where_it, std::move(fn_item));
+		d->now_fn_queue_idle.push(std::move(fn_item));        //priority<0为低优先级，加入到idle队列
+	}
+
+	if (should_notify)
+		_unpark_one_thread_locked(d, lock);
+}
+
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_pop_now_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, bool idle_allowed, bool* is_from_idle, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (is_from_idle != nullptr)
+		*is_from_idle = false;
+
+	//次序：prior > normal > idle；但idle任务被连续越过_IDLE_FN_BYPASS_MAX_COUNT次后，轮到它一次
+	const bool idle_selectable = idle_allowed && !d->now_fn_queue_idle.empty();
+	std::shared_ptr<_FN_ITEM> fn_item;
+	if (!idle_selectable || d->idle_fn_bypassed_count < _IDLE_FN_BYPASS_MAX_COUNT) {
+		if (!d->now_fn_queue_prior.empty()) {
+			fn_item = d->now_fn_queue_prior.pop_front();
+			d->prior_fn_count_v.store(d->now_fn_queue_prior.size(), std::memory_order_relaxed);
+		}
+		else {
+			fn_item = _try_pop_normal_fn_item_locked(d, lock); //normal任务可能因调度类别的预留而暂不可执行
+		}
 	}
 
+	if (fn_item == nullptr) {
+		if (!idle_selectable)
+			return nullptr;
+
+		d->idle_fn_bypassed_count = 0;
+		if (is_from_idle != nullptr)
+			*is_from_idle = true;
+		return d->now_fn_queue_idle.pop_front();
+	}
+
+	if (idle_selectable)
+		++d->idle_fn_bypassed_count;
+	return fn_item;
+}
+
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_pop_normal_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//EDF：带截止时刻的任务先于其他normal任务；已过截止时刻者排在最前，它们会立即以timeout_error完成而不执行任务函数
+	if (!d->now_fn_queue_deadline.empty())
+		return d->now_fn_queue_deadline.pop_front();
+	if (!d->now_fn_queue_sjf.empty())
+		return d->now_fn_queue_sjf.pop_front();
+
+	if (d->sched_class_items.empty()) {
+		if (d->now_fn_queue_normal.empty())
+			return nullptr;
+
+		auto fn_item = std::move(d->now_fn_queue_normal.front());
+		d->now_fn_queue_normal.pop_front();
+		return fn_item;
+	}
+
+	//加权轮转（deficit-round-robin）：游标所指队列的配额用尽、或为空、或受预留所限时，轮到下一个队列并重新获得其weight配额
+	//至多绕行一整圈（含回到起点的队列）
+	const size_t queue_count = d->sched_class_items.size() + 1;
+	for (size_t n = 0; n <= queue_count; ++n) {
+		_SCHED_CLASS_ITEM* sched_class_item = d->sched_class_cursor < d->sched_class_items.size() ? d->sched_class_items[d->sched_class_cursor].get() : nullptr;
+		auto* fn_queue = sched_class_item != nullptr ? &sched_class_item->fn_queue : &d->now_fn_queue_normal;
+		if (d->sched_class_deficit != 0 && !fn_queue->empty() && _check_sched_class_runnable_locked(d, sched_class_item, lock)) {
+			--d->sched_class_deficit;
+			auto fn_item = std::move(fn_queue->front());
+			fn_queue->pop_front();
+			if (sched_class_item != nullptr) {
+				ASSERT(d->sched_class_fn_count >= 1);
+				--d->sched_class_fn_count;
+			}
+			return fn_item;
+		}
+
+		d->sched_class_cursor = (d->sched_class_cursor + 1) % queue_count;
+		d->sched_class_deficit = d->sched_class_cursor < d->sched_class_items.size() ? d->sched_class_items[d->sched_class_cursor]->weight : 1;
+	}
+
+	return nullptr;
+}
+
+ks_thread_pool_apartment_imp::_FN_ITEM* ks_thread_pool_apartment_imp::_find_queued_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//经槽位索引O(1)查找尚在全局队列（含延时队列）中、且未被撤销和认领的项
+	if (!ks_apartment_fn_slot_table::is_slotted_fn_id(fn_id))
+		return nullptr;
+
+	const uint32_t slot_index = ks_apartment_fn_slot_table::slot_index_of(fn_id);
+	if (slot_index >= d->slotted_fn_items.size())
+		return nullptr;
+
+	_FN_ITEM* fn_item = d->slotted_fn_items[slot_index];
+	if (fn_item == nullptr || fn_item->fn_id != fn_id || !d->fn_slot_table.check_pending(fn_id))
+		return nullptr;
+	return fn_item;
+}
+
+std::shared_ptr<ks_thread_pool_apartment_imp::_FN_ITEM> ks_thread_pool_apartment_imp::_try_detach_now_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//取出now队列中的指定项：原项留在队列中作为空壳（fn_id置0，出队时丢弃），返回承接其内容（含fn_id及槽位）的新项，
+	//从而免于在各队列中查找和删除
+	_FN_ITEM* fn_item = _find_queued_fn_item_locked(d, fn_id, lock);
+	if (fn_item == nullptr || fn_item->is_in_delaying_queue)
+		return nullptr;
+
+	auto detached_fn_item = ks_apartment_make_pooled_shared<_FN_ITEM>();
+	*detached_fn_item = std::move(*fn_item);
+	detached_fn_item->sched_class_item = nullptr; //空壳仍在原队列中，出队时以其sched_class_item计数
+	fn_item->fn = {};
+	fn_item->fn_id = 0;
+
+	d->slotted_fn_items[ks_apartment_fn_slot_table::slot_index_of(fn_id)] = detached_fn_item.get();
+	return detached_fn_item;
+}
+
+bool ks_thread_pool_apartment_imp::_check_normal_fn_queue_empty_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	return d->now_fn_queue_normal.empty() && d->now_fn_queue_deadline.empty() && d->now_fn_queue_sjf.empty() && d->sched_class_fn_count == 0;
+}
+
+bool ks_thread_pool_apartment_imp::_check_sched_class_runnable_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const _SCHED_CLASS_ITEM* sched_class_item, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	if (d->total_reserved_thread_count == 0 || d->state_v != _STATE::RUNNING)
+		return true;
+	if (sched_class_item != nullptr && sched_class_item->busy_thread_count < sched_class_item->reserved_thread_count)
+		return true; //在本类别的预留之内
+
+	//其他类别尚未用满的预留不可被挤占，但至少保留1个线程给本类别（即推广了“保留1个线程不去执行idle任务”的规则）
+	size_t unmet_reserved_thread_count = 0;
+	for (const auto& other_item : d->sched_class_items) {
+		if (other_item.get() != sched_class_item && other_item->busy_thread_count < other_item->reserved_thread_count)
+			unmet_reserved_thread_count += other_item->reserved_thread_count - other_item->busy_thread_count;
+	}
+
+	const size_t max_thread_count = _get_compensated_max_thread_count_locked(d, lock);
+	if (unmet_reserved_thread_count + 1 > max_thread_count)
+		unmet_reserved_thread_count = max_thread_count - 1;
+	return d->busy_thread_count + unmet_reserved_thread_count < max_thread_count;
+}
+
+void ks_thread_pool_apartment_imp::_do_put_fn_item_into_delaying_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock) {
+	bool should_notify = d->delaying_fn_queue.empty() || fn_item->until_time < d->delaying_fn_queue.front()->until_time;
+
+	//（忽略priority）
+	fn_item->is_in_delaying_queue = true;
+	d->delaying_fn_queue.push(std::move(fn_item));
+
 	if (should_notify) {
 		//只需notify_one即可，即使有多项。
 		//这是因为调度时到期的delayed项会被先移至now队列，即使瞬间由一个线程处理多项也没什么负担。
 		//参见_thread_proc中对于delayed的调度算法。
-		d->any_fn_queue_cv.notify_one();
+		_unpark_one_thread_locked(d, lock);
 	}
 }
 
+void ks_thread_pool_apartment_imp::_do_index_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _FN_ITEM* fn_item, std::unique_lock<ks_mutex>& lock) {
+	if (!ks_apartment_fn_slot_table::is_slotted_fn_id(fn_item->fn_id))
+		return; //槽位耗尽时退化为不占槽位
+
+	const uint32_t slot_index = ks_apartment_fn_slot_table::slot_index_of(fn_item->fn_id);
+	if (slot_index >= d->slotted_fn_items.size())
+		d->slotted_fn_items.resize(slot_index + 1, nullptr);
+	ASSERT(d->slotted_fn_items[slot_index] == nullptr);
+	d->slotted_fn_items[slot_index] = fn_item;
+}
+
+void ks_thread_pool_apartment_imp::_do_unindex_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _FN_ITEM* fn_item, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(ks_apartment_fn_slot_table::is_slotted_fn_id(fn_item->fn_id));
+	const uint32_t slot_index = ks_apartment_fn_slot_table::slot_index_of(fn_item->fn_id);
+	ASSERT(slot_index < d->slotted_fn_items.size() && d->slotted_fn_items[slot_index] == fn_item);
+	d->slotted_fn_items[slot_index] = nullptr;
+}
+
+bool ks_thread_pool_apartment_imp::_try_claim_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item, std::unique_lock<ks_mutex>& lock) {
+	if (fn_item->fn_id == 0)
+		return false; //已被取出而留下的空壳（见_try_detach_now_fn_item_locked），丢弃
+	if (!ks_apartment_fn_slot_table::is_slotted_fn_id(fn_item->fn_id))
+		return true;
+
+	bool claimed = d->fn_slot_table.try_claim(fn_item->fn_id);
+	_do_unindex_fn_item_locked(d, fn_item.get(), lock);
+	d->fn_slot_table.free_slot_locked(fn_item->fn_id);
+	if (!claimed) {
+		ASSERT(d->lazily_cancelled_count_v.load() > 0);
+		--d->lazily_cancelled_count_v;
+	}
+	return claimed;
+}
+
+void ks_thread_pool_apartment_imp::_do_compact_cancelled_fn_items_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::vector<std::shared_ptr<_FN_ITEM>>* removed_fn_items, std::unique_lock<ks_mutex>& lock) {
+	auto check_cancelled_fn = [&d](const std::shared_ptr<_FN_ITEM>& fn_item) -> bool {
+		return fn_item->fn_id == 0 || !d->fn_slot_table.check_pending(fn_item->fn_id); //空壳（见_try_detach_now_fn_item_locked）一并清理
+	};
+
+	const size_t removed_start = removed_fn_items->size();
+
+	//检查延时任务队列
+	d->delaying_fn_queue.remove_if(check_cancelled_fn, removed_fn_items);
+	//检查idle任务队列
+	d->now_fn_queue_idle.remove_if(check_cancelled_fn, removed_fn_items);
+	//（已到期而移入prior和normal队列的被撤销任务，很快就会出队丢弃，不必检查）
+
+	size_t removed_count = 0;
+	for (size_t i = removed_start; i < removed_fn_items->size(); ++i) {
+		if ((*removed_fn_items)[i]->fn_id == 0)
+			continue; //空壳不占槽位，亦不计入已撤销数
+
+		_do_unindex_fn_item_locked(d, (*removed_fn_items)[i].get(), lock);
+		d->fn_slot_table.free_slot_locked((*removed_fn_items)[i]->fn_id);
+		++removed_count;
+	}
+
+	ASSERT(d->lazily_cancelled_count_v.load() >= removed_count);
+	d->lazily_cancelled_count_v -= removed_count;
+}
+
 #ifdef _DEBUG
 bool ks_thread_pool_apartment_imp::_check_fn_id_exists_when_debug_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock) {
 	auto do_check_fn_exists = [](std::deque<std::shared_ptr<_FN_ITEM>>* fn_queue, uint64_t a_fn_id) -> bool {
@@ -524,10 +1449,17 @@ bool ks_thread_pool_apartment_imp::_check_fn_id_exists_when_debug_locked(const s
 			[a_fn_id](const auto& item) {return item->fn_id == a_fn_id; }) != fn_queue->cend();
 	};
 
-	return do_check_fn_exists(&d->now_fn_queue_prior, fn_id)
+	for (const auto& sched_class_item : d->sched_class_items) {
+		if (do_check_fn_exists(&sched_class_item->fn_queue, fn_id))
+			return true;
+	}
+
+	return d->now_fn_queue_prior.contains(fn_id)
+		|| d->now_fn_queue_deadline.contains(fn_id)
+		|| d->now_fn_queue_sjf.contains(fn_id)
 		|| do_check_fn_exists(&d->now_fn_queue_normal, fn_id)
-		|| do_check_fn_exists(&d->now_fn_queue_idle, fn_id)
-		|| do_check_fn_exists(&d->delaying_fn_queue, fn_id);
+		|| d->now_fn_queue_idle.contains(fn_id)
+		|| d->delaying_fn_queue.contains(fn_id);
 }
 #endif
 
@@ -544,14 +1476,15 @@ void ks_thread_pool_apartment_imp::atfork_prepare() {
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
 	m_d->atforking_flag_v = true;
 
-	m_d->any_fn_queue_cv.notify_all();
+	_unpark_all_threads_locked(m_d, lock);
 
 	while (m_d->working_rc_v != 0)
 		m_d->working_done_cv.wait(lock);
 
 #ifdef _DEBUG
-	for (auto& fn_item : m_d->delaying_fn_queue) 
+	m_d->delaying_fn_queue.for_each([](const std::shared_ptr<_FN_ITEM>& fn_item) {
 		ASSERT(!fn_item->is_waiting_until_flag);
+	});
 #endif
 
 	lock.release();
@@ -578,12 +1511,23 @@ void ks_thread_pool_apartment_imp::atfork_child() {
 	const bool atfork_calling_in_my_thread_flag = (ks_apartment::current_thread_apartment() == this);
 	const size_t atfork_calling_in_my_thread_index = atfork_calling_in_my_thread_flag ? tls_current_thread_index_plus - 1 : size_t(-1);
 
-	//重建线程
+	//正在退休的线程在子进程中已不复存在（其槽位随即可被复用）
+	m_d->living_thread_count -= m_d->retiring_thread_count;
+	m_d->retiring_thread_count = 0;
+	for (const auto& thread_item : m_d->thread_pool) {
+		if (thread_item->retired)
+			thread_item->exited = true;
+	}
+	ASSERT(m_d->parked_thread_stack.empty()); //atfork_prepare时已全部唤醒
+
+	//重建线程（已退休的槽位除外）
 	for (size_t i = 0; i < m_d->thread_pool.size(); ++i) {
+		if (m_d->thread_pool[i]->retired)
+			continue;
 		if (!atfork_calling_in_my_thread_flag || i != atfork_calling_in_my_thread_index) {
-			std::thread([self = this, d = m_d, thread_index = i]() {
+			ks_apartment::__start_native_thread([self = this, d = m_d, thread_index = i]() {
 				_work_thread_proc(self, d, thread_index);
-			}).detach();
+			}, m_d->thread_stack_size);
 		}
 	}
 
@@ -602,7 +1546,17 @@ bool ks_thread_pool_apartment_imp::__run_nested_pump_loop_for_extern_waiting(voi
 
 	ASSERT(tls_current_thread_index_plus != 0);
 	const size_t thread_index = tls_current_thread_index_plus - 1;
-	_UNUSED(thread_index);
+	_THREAD_ITEM* work_stealing_thread_item = (_THREAD_ITEM*)tls_current_thread_item_for_work_stealing;
+
+	if ((m_d->flags & fiber_mode_flag) != 0 && ks_apartment_fiber::current() != nullptr) {
+		//fiber模式：park当前fiber而非嵌套泵任务
+		_THREAD_ITEM* thread_item = nullptr;
+		if (true) {
+			std::unique_lock<ks_mutex> lock(m_d->mutex);
+			thread_item = m_d->thread_pool[thread_index].get();
+		}
+		return _park_current_fiber_for_extern_waiting(m_d, thread_item, extern_obj, std::move(extern_pred_fn));
+	}
 
 	ASSERT(tls_current_thread_pump_loop_depth >= 1);
 	++tls_current_thread_pump_loop_depth;
@@ -640,8 +1594,7 @@ bool ks_thread_pool_apartment_imp::__run_nested_pump_loop_for_extern_waiting(voi
 			const auto now = std::chrono::steady_clock::now();
 			while (!d->delaying_fn_queue.empty() && d->delaying_fn_queue.front()->until_time <= now) {
 				//直接将到期的delaying项移入now队列
-				_do_put_fn_item_into_now_list_locked(d, std::move(d->delaying_fn_queue.front()), lock);
-				d->delaying_fn_queue.pop_front();
+				_do_put_fn_item_into_now_list_locked(d, d->delaying_fn_queue.pop_front(), lock);
 				++moved_fn_count;
 			}
 
@@ -651,23 +1604,53 @@ bool ks_thread_pool_apartment_imp::__run_nested_pump_loop_for_extern_waiting(voi
 			}
 		}
 
+		//try next local_fn (work-stealing)
+		if (work_stealing_thread_item != nullptr && d->now_fn_queue_prior.empty()) {
+			auto local_fn_item = _try_pop_local_fn_item(d, work_stealing_thread_item);
+			if (local_fn_item == nullptr && _check_normal_fn_queue_empty_locked(d, lock))
+				local_fn_item = _try_steal_local_fn_item_locked(d, work_stealing_thread_item, thread_index, lock);
+
+			if (local_fn_item != nullptr) {
+				//exec a local fn（嵌套pump中逐个执行，以便及时检查extern_pred_fn）
+				const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(local_fn_item->sched_class);
+				const int pre_priority = _begin_running_fn(local_fn_item->priority);
+				lock.unlock();
+				local_fn_item->fn();
+				local_fn_item->fn = {};
+				local_fn_item.reset();
+
+				lock.lock(); //for working_rc and busy_thread_count
+				_begin_running_fn(pre_priority);
+				ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
+				continue;
+			}
+		}
+
 		//try next now_fn
 		if (true) {
-			auto* now_fn_queue_sel = !d->now_fn_queue_prior.empty() ? &d->now_fn_queue_prior : &d->now_fn_queue_normal;
-			if (now_fn_queue_sel->empty() && !d->now_fn_queue_idle.empty() && d->thread_pool.size() > 1 && d->busy_thread_count_for_idle + 1 < d->thread_pool.size() && d->state_v == _STATE::RUNNING)
-				now_fn_queue_sel = &d->now_fn_queue_idle; //保留1个线程不去执行idle任务（除非是单线程套间）
-
-			if (!now_fn_queue_sel->empty()) {
+			const bool idle_allowed = d->living_thread_count > 1 && d->busy_thread_count_for_idle + 1 < d->living_thread_count && d->state_v == _STATE::RUNNING; //保留1个线程不去执行idle任务（除非是单线程套间）
+			auto now_fn_item = _try_pop_now_fn_item_locked(d, idle_allowed, nullptr, lock);
+			if (now_fn_item != nullptr) {
 				//pop and exec a fn
-				auto now_fn_item = std::move(now_fn_queue_sel->front());
-				now_fn_queue_sel->pop_front();
+				if (!_try_claim_fn_item_locked(d, now_fn_item, lock)) {
+					//已被撤销，丢弃（在锁外释放fn）
+					lock.unlock();
+					now_fn_item->fn = {};
+					now_fn_item.reset();
+					lock.lock();
+					continue;
+				}
 
+				const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(now_fn_item->sched_class);
+				const int pre_priority = _begin_running_fn(now_fn_item->priority);
 				lock.unlock();
 				now_fn_item->fn();
 				now_fn_item->fn = {};
 				now_fn_item.reset();
 
 				lock.lock(); //for working_rc and busy_thread_count
+				_begin_running_fn(pre_priority);
+				ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
 				continue;
 			}
 		}
@@ -690,25 +1673,40 @@ bool ks_thread_pool_apartment_imp::__run_nested_pump_loop_for_extern_waiting(voi
 
 		ks_defer defer_recover_busy_thread_count([&d, pre_busy_for_idle_flag, &lock]() {
 			ASSERT(lock.owns_lock());
-			ASSERT(d->busy_thread_count < d->thread_pool.size());
+			ASSERT(d->busy_thread_count < d->living_thread_count);
 			++d->busy_thread_count;
 			if (pre_busy_for_idle_flag) {
-				ASSERT(d->busy_thread_count_for_idle + 1 < d->thread_pool.size());
+				ASSERT(d->busy_thread_count_for_idle < d->living_thread_count);
 				++d->busy_thread_count_for_idle;
 				ASSERT(!tls_current_thread_pump_loop_busy_for_idle_flag);
 				tls_current_thread_pump_loop_busy_for_idle_flag = true;
 			}
 		});
 
+		if (work_stealing_thread_item != nullptr) {
+			//同_work_thread_proc：先登记为等待者、再检查本地任务数
+			d->waiting_thread_count_v.fetch_add(1);
+			if (d->local_fn_count_v.load() != 0) {
+				d->waiting_thread_count_v.fetch_sub(1);
+				continue;
+			}
+		}
+
+		++d->nested_pump_waiting_thread_count;
 		if (!d->delaying_fn_queue.empty() && !d->delaying_fn_queue.front()->is_waiting_until_flag) {
 			const auto waiting_fn_item = d->delaying_fn_queue.front();
 			waiting_fn_item->is_waiting_until_flag = true;
-			d->any_fn_queue_cv.wait_until(lock, waiting_fn_item->until_time); //waiting
+			_park_current_thread_locked(d, d->thread_pool[thread_index].get(), &waiting_fn_item->until_time, lock); //waiting
 			waiting_fn_item->is_waiting_until_flag = false;
 		}
 		else {
-			d->any_fn_queue_cv.wait(lock);
+			_park_current_thread_locked(d, d->thread_pool[thread_index].get(), nullptr, lock);
 		}
+		ASSERT(d->nested_pump_waiting_thread_count >= 1);
+		--d->nested_pump_waiting_thread_count;
+
+		if (work_stealing_thread_item != nullptr)
+			d->waiting_thread_count_v.fetch_sub(1);
 	}
 
 	return was_satisified;
@@ -716,5 +1714,249 @@ bool ks_thread_pool_apartment_imp::__run_nested_pump_loop_for_extern_waiting(voi
 
 void ks_thread_pool_apartment_imp::__awaken_nested_pump_loop_for_extern_waiting_once(void* extern_obj) {
 	std::unique_lock<ks_mutex> lock(m_d->mutex);
-	m_d->any_fn_queue_cv.notify_all();
+
+	//fiber模式：将等待extern_obj的fiber移入其各自线程的ready队列，并只唤醒这些线程（fiber只在原线程上恢复执行）
+	++m_d->fiber_awaken_seq;
+	if (!m_d->parked_fibers.empty()) {
+		auto it = std::stable_partition(m_d->parked_fibers.begin(), m_d->parked_fibers.end(),
+			[extern_obj](const _THREAD_POOL_APARTMENT_DATA::_PARKED_FIBER_ITEM& parked_item) { return parked_item.extern_obj != extern_obj; });
+		for (auto it2 = it; it2 != m_d->parked_fibers.end(); ++it2) {
+			it2->thread_item->ready_fibers.push_back(it2->fiber);
+			_unpark_thread_locked(m_d, it2->thread_item, lock);
+		}
+		m_d->parked_fibers.erase(it, m_d->parked_fibers.end());
+	}
+
+	//非fiber的嵌套泵不按extern_obj登记，有线程在其中park时只得全部唤醒，由它们各自重新检查等待条件
+	if (m_d->nested_pump_waiting_thread_count != 0)
+		_unpark_all_threads_locked(m_d, lock);
+}
+
+void ks_thread_pool_apartment_imp::__enter_blocking_region() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return;
+	}
+	if (tls_current_thread_blocking_region_depth++ != 0)
+		return; //嵌套的阻塞区间，仅最外层生效
+	if ((m_d->flags & blocking_compensation_flag) == 0 || m_d->is_sequential)
+		return;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	++m_d->blocking_thread_count;
+	m_d->thread_pool_full_v = _get_active_thread_count_locked(m_d, lock) >= _get_compensated_max_thread_count_locked(m_d, lock);
+	if (m_d->state_v == _STATE::RUNNING)
+		_prepare_work_thread_locked(this, m_d, lock, true); //若有任务排队，立即增派补偿线程（不受弹性扩充的等待阈值限制）
+}
+
+void ks_thread_pool_apartment_imp::__leave_blocking_region() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return;
+	}
+	ASSERT(tls_current_thread_blocking_region_depth >= 1);
+	if (--tls_current_thread_blocking_region_depth != 0)
+		return;
+	if ((m_d->flags & blocking_compensation_flag) == 0 || m_d->is_sequential)
+		return;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	ASSERT(m_d->blocking_thread_count >= 1);
+	--m_d->blocking_thread_count;
+	const size_t active_thread_count = _get_active_thread_count_locked(m_d, lock);
+	const size_t max_thread_count = _get_compensated_max_thread_count_locked(m_d, lock);
+	m_d->thread_pool_full_v = active_thread_count >= max_thread_count;
+	if (active_thread_count > max_thread_count)
+		_unpark_one_thread_locked(m_d, lock); //唤醒一个空闲线程使之退休（若无空闲线程，则由执行完手头任务的线程退休）
+}
+
+void ks_thread_pool_apartment_imp::_exec_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item) {
+	_begin_running_fn(fn_item->priority);
+	if ((d->flags & fiber_mode_flag) != 0)
+		ks_apartment_fiber::run(std::move(fn_item->fn)); //若中途park，fiber会被登记于parked_fibers，之后由原线程resume
+	else
+		fn_item->fn();
+	fn_item->fn = {};
+}
+
+bool ks_thread_pool_apartment_imp::_park_current_fiber_for_extern_waiting(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, void* extern_obj, std::function<bool()>&& extern_pred_fn) {
+	ks_apartment_fiber* fiber = ks_apartment_fiber::current();
+	ASSERT(fiber != nullptr);
+
+	while (true) {
+		uint64_t awaken_seq;
+		if (true) {
+			std::unique_lock<ks_mutex> lock(d->mutex);
+			awaken_seq = d->fiber_awaken_seq;
+		}
+
+		if (extern_pred_fn())
+			return true; //waiting was satisified, ok
+
+		std::unique_lock<ks_mutex> lock(d->mutex);
+		if (d->fiber_awaken_seq != awaken_seq)
+			continue; //检查pred期间可能已被awaken，须重新检查
+		if (d->state_v != _STATE::RUNNING)
+			return false; //同嵌套泵，非RUNNING时放弃等待
+
+		d->parked_fibers.push_back({ extern_obj, fiber, thread_item });
+		++thread_item->parked_fiber_count;
+		lock.unlock();
+		ks_apartment_fiber::park();
+	}
+}
+
+bool ks_thread_pool_apartment_imp::__try_run_scheduled_fn_inline(uint64_t id) {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+	if (id == 0)
+		return false;
+
+	auto d = m_d;
+
+	//先查找本线程的本地队列（本线程投递的任务多半在此），再查找各now队列；其他线程的本地队列不予查找
+	_THREAD_ITEM* work_stealing_thread_item = (_THREAD_ITEM*)tls_current_thread_item_for_work_stealing;
+	std::shared_ptr<_FN_ITEM> fn_item = work_stealing_thread_item != nullptr ? _try_take_local_fn_item(d, work_stealing_thread_item, id) : nullptr;
+
+	std::unique_lock<ks_mutex> lock(d->mutex);
+	if (fn_item == nullptr) {
+		fn_item = _try_detach_now_fn_item_locked(d, id, lock);
+		if (fn_item == nullptr)
+			return false;
+
+		if (!_try_claim_fn_item_locked(d, fn_item, lock)) {
+			//已被撤销，丢弃（在锁外释放fn）
+			lock.unlock();
+			fn_item->fn = {};
+			fn_item.reset();
+			return false;
+		}
+	}
+
+	//exec the fn inline
+	const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(fn_item->sched_class);
+	const int pre_priority = _begin_running_fn(fn_item->priority);
+	lock.unlock();
+	fn_item->fn();
+	fn_item->fn = {};
+	fn_item.reset();
+
+	_begin_running_fn(pre_priority);
+	ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
+	return true;
+}
+
+bool ks_thread_pool_apartment_imp::__is_using_schedule_duration_hint() {
+	return (m_d->flags & shortest_job_first_flag) != 0;
+}
+
+bool ks_thread_pool_apartment_imp::__check_yield_needed() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+
+	//有prior任务待执行而当前任务非prior；或时间片已用尽（自任务内首次检查时起算）
+	const bool prior_fn_pending = tls_current_thread_running_fn_priority <= 0 && m_d->prior_fn_count_v.load(std::memory_order_relaxed) != 0;
+	const int64_t time_slice = m_d->yield_time_slice_v.load(std::memory_order_relaxed);
+	if (!prior_fn_pending && time_slice <= 0)
+		return false;
+
+	const auto now = std::chrono::steady_clock::now();
+	bool time_slice_expired = false;
+	if (!prior_fn_pending) {
+		if (tls_current_thread_time_slice_begin_time == std::chrono::steady_clock::time_point{}) {
+			tls_current_thread_time_slice_begin_time = now;
+			return false;
+		}
+		if (now < tls_current_thread_time_slice_begin_time + std::chrono::milliseconds(time_slice))
+			return false;
+
+		time_slice_expired = true;
+	}
+
+	//尚有空闲线程（或可扩充线程）可承接等待中的任务时，不必让出（在锁外判断）
+	if (m_d->parked_thread_count_v.load(std::memory_order_relaxed) != 0 || !m_d->thread_pool_full_v.load(std::memory_order_relaxed)) {
+		if (time_slice_expired)
+			tls_current_thread_time_slice_begin_time = now; //重新计时
+		return false;
+	}
+
+	//否则加锁确认有同级或更高优先级的任务在等待，则让出；加锁检查的频度受限，以免（让出不成时）每次调用都争抢套间锁
+	if (tls_current_thread_yield_locked_check_time != std::chrono::steady_clock::time_point{}
+		&& now < tls_current_thread_yield_locked_check_time + std::chrono::microseconds(_YIELD_LOCKED_CHECK_MIN_INTERVAL_US))
+		return false;
+	tls_current_thread_yield_locked_check_time = now;
+
+	std::unique_lock<ks_mutex> lock(m_d->mutex);
+	ASSERT(tls_current_thread_index_plus != 0);
+	_THREAD_ITEM* thread_item = m_d->thread_pool[tls_current_thread_index_plus - 1].get();
+	if (_check_fn_pending_for_yield_locked(m_d, thread_item, lock))
+		return true;
+
+	if (time_slice_expired)
+		tls_current_thread_time_slice_begin_time = now; //重新计时
+	return false;
+}
+
+bool ks_thread_pool_apartment_imp::__try_yield_current_fiber() {
+	if (ks_apartment::current_thread_apartment() != this) {
+		ASSERT(false);
+		return false;
+	}
+
+	if ((m_d->flags & fiber_mode_flag) == 0 || ks_apartment_fiber::current() == nullptr) {
+		tls_current_thread_time_slice_begin_time = {}; //无法让出，则重新计时，以免此后每次检查都因时间片已用尽而加锁
+		return false;
+	}
+
+	ASSERT(tls_current_thread_index_plus != 0);
+	_THREAD_ITEM* thread_item = nullptr;
+	if (true) {
+		std::unique_lock<ks_mutex> lock(m_d->mutex);
+		thread_item = m_d->thread_pool[tls_current_thread_index_plus - 1].get();
+	}
+	return _park_current_fiber_for_yield(this, m_d, thread_item);
+}
+
+bool ks_thread_pool_apartment_imp::_park_current_fiber_for_yield(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item) {
+	ks_apartment_fiber* fiber = ks_apartment_fiber::current();
+	ASSERT(fiber != nullptr);
+
+	if (true) {
+		std::unique_lock<ks_mutex> lock(d->mutex);
+		if (d->state_v != _STATE::RUNNING)
+			return false;
+
+		//以fiber自身为extern_obj登记，由续体awaken之（即使续体在其他线程上先于park执行，fiber亦只由本线程在park之后恢复）
+		d->parked_fibers.push_back({ fiber, fiber, thread_item });
+		++thread_item->parked_fiber_count;
+	}
+
+	//续体以当前任务的优先级投递，排在已待执行的任务之后；轮到它时，将fiber移入本线程的ready队列以恢复执行。
+	//续体须经全局队列，而不进入本线程的lifo-slot（否则会被本线程立即取回）
+	void* pre_thread_item_for_work_stealing = tls_current_thread_item_for_work_stealing;
+	tls_current_thread_item_for_work_stealing = nullptr;
+	self->schedule([self, fiber]() { self->__awaken_nested_pump_loop_for_extern_waiting_once(fiber); }, tls_current_thread_running_fn_priority);
+	tls_current_thread_item_for_work_stealing = pre_thread_item_for_work_stealing;
+
+	ks_apartment_fiber::park();
+	return true;
+}
+
+bool ks_thread_pool_apartment_imp::_check_fn_pending_for_yield_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::unique_lock<ks_mutex>& lock) {
+	ASSERT(lock.owns_lock());
+	//与当前任务同级或更高优先级的任务（prior/normal/idle三级）在等待；本线程已被awaken的fiber总算在内
+	const int running_priority = tls_current_thread_running_fn_priority;
+	if (!thread_item->ready_fibers.empty() || !d->now_fn_queue_prior.empty())
+		return true;
+	if (running_priority > 0)
+		return false;
+	if (!_check_normal_fn_queue_empty_locked(d, lock) || d->local_fn_count_v.load() != 0)
+		return true;
+	if (running_priority == 0)
+		return false;
+	return !d->now_fn_queue_idle.empty();
 }
@@ -17,9 +17,12 @@ limitations under the License.
 
 #include "ks_async_base.h"
 #include "ks_apartment.h"
+#include "ks_apartment_internal_helper.hpp"
 #include "ktl/ks_concurrency.h"
 #include <deque>
 
+class ks_apartment_fiber;
+
 
 class ks_thread_pool_apartment_imp final : public ks_apartment {
 public:
@@ -28,6 +31,14 @@ public:
 		auto_register_flag            = 0x00010000,
 		endless_instance_flag         = 0x01000000,
 		delayed_always_low_prior_flag = 0x04000000,
+		fiber_mode_flag               = 0x00100000, //fiber模式：任务在池化的fiber栈上执行，wait时park其fiber（而非嵌套泵任务），待被唤醒后在原线程上恢复执行
+		blocking_compensation_flag    = 0x00200000, //阻塞补偿：任务处于ks_blocking_region中时，临时增派补偿线程（可超出max_thread_count），阻塞结束后多出的线程退休
+		prewarm_flag                  = 0x00400000, //预热：start时即创建全部max_thread_count个线程，并预先触及其栈和TLS，以免首批任务承担线程创建的开销（与elastic_flag同用时，空闲线程仍会退休）
+		work_stealing_flag            = 0x08000000, //work-stealing模式：工作线程内投递的normal任务进入线程本地队列，空闲线程可窃取
+		elastic_flag                  = 0x10000000, //弹性模式：空闲超时的线程退休（超时时长可由set_elastic_policy调整）
+		numa_aware_flag               = 0x20000000, //NUMA感知：工作线程按节点分组并绑定到节点的cpu，窃取时优先同节点（宜与work_stealing_flag同用）
+		deadline_first_flag           = 0x40000000, //EDF模式：带截止时刻（future的超时）的normal任务按截止时刻先后执行，且先于无截止时刻的normal任务
+		shortest_job_first_flag       = 0x80000000, //SJF模式：normal任务按“投递时刻+预估耗时（按调用点统计的历史耗时）”排序，短任务先于长任务执行，而长任务至多被推迟其预估耗时
 	};
 
 	KS_ASYNC_API explicit ks_thread_pool_apartment_imp(const char* name, size_t max_thread_count, uint flags = 0);
@@ -48,10 +59,51 @@ public:
 	virtual bool is_stopped() override;
 	virtual bool is_stopping_or_stopped() override;
 
-	virtual uint64_t schedule(std::function<void()>&& fn, int priority) override;
-	virtual uint64_t schedule_delayed(std::function<void()>&& fn, int priority, int64_t delay) override;
+	virtual uint64_t schedule(ks_unique_function<void()>&& fn, int priority) override;
+	virtual uint64_t schedule_delayed(ks_unique_function<void()>&& fn, int priority, int64_t delay) override;
+	virtual size_t schedule_batch(ks_unique_function<void()>* fns, size_t fn_count, int priority, uint64_t* out_fn_ids) override;
 
 	virtual void try_unschedule(uint64_t id) override;
+	virtual bool try_boost_priority(uint64_t id, int priority) override;
+
+public:
+	//注：运行时调整最大线程数；调小时，多出的线程在执行完手头任务后退休。
+	//sequential套间（创建时max_thread_count为1）不可调整，返回false。
+	KS_ASYNC_API bool set_max_thread_count(size_t max_thread_count);
+
+	//注：弹性策略（毫秒）。
+	//thread_idle_timeout：线程空闲超过此时长则退休（至少保留1个线程），0为不退休；
+	//grow_wait_threshold：仅当已无空闲线程、且队首任务的等待时长超过此阈值时才扩充线程（每次1个），0为按队列长度扩充。
+	//注意：扩充时机仅在投递任务和取出任务时检查，故在此模式下，任务不应阻塞等待其后投递的任务（future的wait除外，其内有嵌套的消息循环；或在blocking_compensation_flag模式下以ks_blocking_region声明阻塞）。
+	KS_ASYNC_API void set_elastic_policy(int64_t thread_idle_timeout, int64_t grow_wait_threshold);
+
+	//注：将工作线程绑定到指定的cpu集合，对此后创建的线程生效（故宜在start前调用），空集合为不绑定。
+	//numa_aware_flag模式下，线程绑定到其所属节点的cpu与该集合的交集（交集为空时仅按节点绑定）。
+	KS_ASYNC_API void set_thread_cpu_affinity(const std::vector<int>& cpu_ids);
+
+	//注：工作线程的栈大小（字节），对此后创建的线程生效（故宜在start前调用），0为平台默认。
+	KS_ASYNC_API void set_thread_stack_size(size_t stack_size);
+
+	//注：调度类别策略（调度类别由ks_async_context::set_sched_class指定，见ks_apartment::__get_current_thread_sched_class）。
+	//已配置的各类别的normal任务各自排队，按weight加权轮转（deficit-round-robin，每任务计1）；未配置的类别共用一个权重为1的队列。
+	//reserved_thread_count：为该类别预留的线程数，其他类别的任务不会挤占之（至少保留1个线程给其他类别；仅在RUNNING状态下生效）。
+	//配置了调度类别后，normal任务一律经全局队列（不再进入work-stealing本地队列），以便按类别调度。
+	KS_ASYNC_API void set_sched_class_policy(int sched_class, uint weight, size_t reserved_thread_count = 0);
+
+	//注：让出的时间片（毫秒，见ks_apartment::is_yield_needed），自任务内首次检查时起算，0为不按时间片让出（仍让位于prior任务）。
+	//尚有空闲线程（或可扩充线程）承接等待中的任务时，任务不必让出。
+	KS_ASYNC_API void set_yield_time_slice(int64_t time_slice);
+
+	//注：线程统计（快照），用于观测负载和调整容量。
+	//对blocking_mta这类专门执行阻塞调用的套间而言，busy_thread_count即为被阻塞的线程数。
+	struct thread_stats {
+		size_t max_thread_count;      //最大线程数（不含阻塞补偿临时增派的线程）
+		size_t active_thread_count;   //现有线程数（不含正在退休的线程）
+		size_t busy_thread_count;     //正在执行任务的线程数
+		size_t blocking_thread_count; //处于ks_blocking_region中的线程数（仅blocking_compensation_flag模式）
+		size_t queued_fn_count;       //排队中的任务数（不含延时任务）
+	};
+	KS_ASYNC_API thread_stats get_thread_stats();
 
 #if __KS_APARTMENT_ATFORK_ENABLED
 	virtual void atfork_prepare() override;
@@ -61,6 +113,12 @@ public:
 
 	virtual bool __run_nested_pump_loop_for_extern_waiting(void* extern_obj, std::function<bool()>&& extern_pred_fn) override;
 	virtual void __awaken_nested_pump_loop_for_extern_waiting_once(void* extern_obj) override;
+	virtual bool __try_run_scheduled_fn_inline(uint64_t id) override;
+	virtual void __enter_blocking_region() override;
+	virtual void __leave_blocking_region() override;
+	virtual bool __check_yield_needed() override;
+	virtual bool __try_yield_current_fiber() override;
+	virtual bool __is_using_schedule_duration_hint() override;
 
 private:
 	struct _THREAD_POOL_APARTMENT_DATA;
@@ -68,23 +126,76 @@ private:
 	void _try_start_locked(std::unique_lock<ks_mutex>& lock);
 	void _try_stop_locked(bool should_thread_exit, std::unique_lock<ks_mutex>& lock, bool must_keep_locked);
 
-	static void _prepare_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static void _prepare_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock, bool fn_waited_too_long = false);
+	static void _prewarm_work_threads_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static void _spawn_work_thread_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
 	static void _work_thread_proc(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, size_t thread_index);
 
+	struct _THREAD_ITEM;
+	struct _FN_ITEM;
+	struct _SCHED_CLASS_ITEM;
+	static std::shared_ptr<_FN_ITEM> _try_pop_local_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item);
+	static std::shared_ptr<_FN_ITEM> _try_steal_local_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thief_thread_item, size_t thief_thread_index, std::unique_lock<ks_mutex>& lock);
+	static void _run_local_fn_items_batch(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::shared_ptr<_FN_ITEM>&& first_fn_item);
+	static bool _check_local_fn_queue_empty(_THREAD_ITEM* thread_item);
+	static void _exec_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item);
+	static bool _park_current_fiber_for_extern_waiting(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, void* extern_obj, std::function<bool()>&& extern_pred_fn);
+	static std::shared_ptr<_FN_ITEM> _try_take_local_fn_item(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, uint64_t fn_id);
+	static bool _park_current_fiber_for_yield(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item);
+	static bool _check_fn_pending_for_yield_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::unique_lock<ks_mutex>& lock);
+
+	static void _park_current_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, const std::chrono::steady_clock::time_point* until_time, std::unique_lock<ks_mutex>& lock);
+	static void _unpark_one_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static void _unpark_thread_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _THREAD_ITEM* thread_item, std::unique_lock<ks_mutex>& lock);
+	static void _unpark_all_threads_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+
+	static std::vector<int> _determine_thread_cpu_ids_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, size_t thread_index, std::unique_lock<ks_mutex>& lock);
+
+	static size_t _get_active_thread_count_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static size_t _get_compensated_max_thread_count_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static bool _check_fn_queue_waited_too_long_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static void _try_grow_work_thread_on_dequeue_locked(ks_thread_pool_apartment_imp* self, const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const _FN_ITEM* fn_item, std::unique_lock<ks_mutex>& lock);
+
 private:
+	//注：_FN_ITEM经由线程本地回收池分配（见ks_apartment_make_pooled_shared），fn为带小缓冲区的ks_unique_function
 	struct _FN_ITEM {
-		std::function<void()> fn;
+		ks_unique_function<void()> fn;
 		std::chrono::steady_clock::time_point until_time;
+		std::chrono::steady_clock::time_point queued_time; //入队时刻，仅当grow_wait_threshold>0时记录
 		uint64_t fn_id;
 		int64_t delay = 0;
 		int priority = 0;
+		std::chrono::steady_clock::time_point deadline_time; //截止时刻，仅deadline_first_flag模式（空为无截止时刻）
+		std::chrono::steady_clock::time_point sjf_rank_time; //SJF排序键，即投递（或延时到期）时刻+预估耗时，仅shortest_job_first_flag模式
+		int sched_class = 0;
+		_SCHED_CLASS_ITEM* sched_class_item = nullptr; //所属的已配置调度类别（仅当在其队列中排队时）
 		bool is_delaying_fn = false;
+		bool is_in_delaying_queue = false; //尚在delaying_fn_queue中（未到期）
 		bool is_waiting_until_flag = false;
 	};
 
-	static void _do_put_fn_item_into_now_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock);
+	struct _SCHED_CLASS_ITEM {
+		int sched_class = 0;
+		uint weight = 1;
+		size_t reserved_thread_count = 0;
+		std::deque<std::shared_ptr<_FN_ITEM>> fn_queue;
+		size_t busy_thread_count = 0;
+	};
+
+	static void _do_put_fn_item_into_now_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock, bool should_notify = true);
+	static std::shared_ptr<_FN_ITEM> _try_pop_now_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, bool idle_allowed, bool* is_from_idle, std::unique_lock<ks_mutex>& lock);
+	static std::shared_ptr<_FN_ITEM> _try_pop_normal_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static _FN_ITEM* _find_queued_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock);
+	static std::shared_ptr<_FN_ITEM> _try_detach_now_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock);
+	static bool _check_normal_fn_queue_empty_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::unique_lock<ks_mutex>& lock);
+	static bool _check_sched_class_runnable_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const _SCHED_CLASS_ITEM* sched_class_item, std::unique_lock<ks_mutex>& lock);
 	static void _do_put_fn_item_into_delaying_list_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::shared_ptr<_FN_ITEM>&& fn_item, std::unique_lock<ks_mutex>& lock);
 
+	static void _do_index_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _FN_ITEM* fn_item, std::unique_lock<ks_mutex>& lock);
+	static void _do_unindex_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, _FN_ITEM* fn_item, std::unique_lock<ks_mutex>& lock);
+	static bool _try_claim_fn_item_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, const std::shared_ptr<_FN_ITEM>& fn_item, std::unique_lock<ks_mutex>& lock);
+	static void _do_compact_cancelled_fn_items_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, std::vector<std::shared_ptr<_FN_ITEM>>* removed_fn_items, std::unique_lock<ks_mutex>& lock);
+
 #ifdef _DEBUG
 	static bool _check_fn_id_exists_when_debug_locked(const std::shared_ptr<_THREAD_POOL_APARTMENT_DATA>& d, uint64_t fn_id, std::unique_lock<ks_mutex>& lock);
 #endif
@@ -93,6 +204,22 @@ private:
 	enum class _STATE { NOT_START, RUNNING, STOPPING, STOPPED };
 
 	struct _THREAD_ITEM {
+		bool retired = false; //线程已退休（或正在退出）
+		bool exited = false; //已退休的线程已完成退出时的计数处理，此后其槽位才可被新线程复用
+		size_t numa_node = 0; //所属NUMA节点的序号（仅numa_aware_flag模式）
+
+		//每个线程在各自的cv上等待（即parking，仍以d->mutex为锁），以便有选择地唤醒
+		ks_condition_variable park_cv{};
+		bool parked = false; //位于parked_thread_stack中
+
+		//以下仅用于work-stealing模式
+		ks_spinlock local_mutex;
+		std::shared_ptr<_FN_ITEM> local_lifo_slot; //本线程最近投递的任务，优先执行（cache亲和）
+		std::deque<std::shared_ptr<_FN_ITEM>> local_fn_queue; //被挤出lifo-slot的任务，本线程从队头取，其他线程也从队头窃取
+
+		//以下仅用于fiber模式：fiber只在park它的线程上恢复执行，故本线程尚有被park的fiber时不退休
+		std::deque<ks_apartment_fiber*> ready_fibers; //已被awaken、待恢复执行的fiber
+		size_t parked_fiber_count = 0; //本线程被park（含已在ready_fibers中）的fiber数
 	};
 
 	struct _THREAD_POOL_APARTMENT_DATA {
@@ -103,18 +230,70 @@ private:
 		std::function<void()> thread_init_fn = nullptr; //const-like, optional
 		std::function<void()> thread_term_fn = nullptr; //const-like, optional
 
-		//prior简化为三级：>0为高优先，=0为普通，<0为低且简单地加入到idle队列
-		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_prior;
+		//prior分为三个队列：>0为高优先，=0为普通，<0为低且加入到idle队列；prior和idle队列内部再按优先级（带老化）排序
+		ks_apartment_priority_fn_heap<_FN_ITEM> now_fn_queue_prior;
 		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_normal;
-		std::deque<std::shared_ptr<_FN_ITEM>> now_fn_queue_idle; //idle任务地位低下，与prior和normal不是同等对待
-		std::deque<std::shared_ptr<_FN_ITEM>> delaying_fn_queue;
-		ks_condition_variable any_fn_queue_cv{};
-
-		std::deque<std::shared_ptr<_THREAD_ITEM>> thread_pool;
-		size_t max_thread_count = 0; //const-like
-		size_t living_thread_count = 0; //存活线程数
+		ks_apartment_priority_fn_heap<_FN_ITEM> now_fn_queue_idle; //idle任务地位低下，与prior和normal不是同等对待
+		size_t idle_fn_bypassed_count = 0; //idle任务被越过的次数，达到上限则轮到idle任务一次（跨队列老化）
+		ks_apartment_delaying_fn_heap<_FN_ITEM> delaying_fn_queue; //4叉最小堆
+		ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::deadline_time> now_fn_queue_deadline; //带截止时刻的normal任务，按截止时刻排序（仅deadline_first_flag模式）
+		ks_apartment_delaying_fn_heap<_FN_ITEM, &_FN_ITEM::sjf_rank_time> now_fn_queue_sjf; //normal任务，按投递时刻+预估耗时排序（仅shortest_job_first_flag模式）
+
+		//已配置的调度类别（见set_sched_class_policy），其normal任务不进入now_fn_queue_normal，而在各自的队列中排队
+		std::vector<std::unique_ptr<_SCHED_CLASS_ITEM>> sched_class_items; //只增不减，故_FN_ITEM可持有其裸指针
+		size_t sched_class_fn_count = 0; //各类别队列中的任务总数
+		size_t sched_class_cursor = 0; //轮转游标，sched_class_items.size()代表now_fn_queue_normal
+		uint sched_class_deficit = 0; //游标所指队列在本轮中的剩余配额
+		size_t total_reserved_thread_count = 0;
+		std::atomic<bool> has_sched_class_policy_v{ false }; //在锁外投递本地任务时亦被访问，故为atomic
+
+		//延时任务和idle任务占用槽位，可被O(1)撤销；被撤销的任务仍滞留在队列中，待出队或压缩时丢弃
+		ks_apartment_fn_slot_table fn_slot_table;
+		std::atomic<size_t> lazily_cancelled_count_v{ 0 }; //已撤销而仍滞留在队列中的任务数
+		//经由全局队列的任务都占用槽位（normal和prior任务的槽位不可撤销），以槽位序号为下标索引之，供优先级继承和定向等待按id O(1)查找；
+		//work-stealing本地队列中的任务不占槽位，不在索引中
+		std::vector<_FN_ITEM*> slotted_fn_items;
+
+		std::deque<std::shared_ptr<_THREAD_ITEM>> thread_pool; //以thread_index为下标，含已退休线程的槽位
+		std::atomic<size_t> max_thread_count_v{ 0 }; //可由set_max_thread_count调整
+		bool is_sequential = false; //const-like
+		size_t living_thread_count = 0; //存活线程数（含正在退休的线程）
+		size_t retiring_thread_count = 0; //已决定退休而尚未退出的线程数
 		size_t busy_thread_count = 0;
 		size_t busy_thread_count_for_idle = 0;
+		size_t blocking_thread_count = 0; //处于阻塞区间中的线程数（仅blocking_compensation_flag模式），线程数上限相应临时调高
+
+		//空闲线程栈（后入先出）：栈顶为最近空闲的线程，其cache尚热，优先唤醒；久已空闲的线程则继续沉睡（或超时退休）
+		std::vector<_THREAD_ITEM*> parked_thread_stack;
+		std::atomic<size_t> parked_thread_count_v{ 0 }; //parked_thread_stack.size()的镜像，供__check_yield_needed在锁外判断有无空闲线程
+
+		//以下仅用于work-stealing模式（在锁外被访问，故为atomic）
+		std::atomic<size_t> local_fn_count_v{ 0 }; //全部线程本地队列（含lifo-slot）中的任务数
+		std::atomic<size_t> prior_fn_count_v{ 0 }; //now_fn_queue_prior.size()的镜像，用于在锁外执行本地任务时及时让位于prior任务
+		std::atomic<size_t> waiting_thread_count_v{ 0 }; //正在cv上等待的线程数
+		std::atomic<bool> thread_pool_full_v{ false }; //有效线程数 >= max_thread_count
+
+		//以下仅用于fiber模式：因wait而被park的fiber（按所等待的extern_obj登记），被awaken后移入其线程的ready_fibers
+		struct _PARKED_FIBER_ITEM {
+			void* extern_obj;
+			ks_apartment_fiber* fiber;
+			_THREAD_ITEM* thread_item;
+		};
+		std::vector<_PARKED_FIBER_ITEM> parked_fibers;
+		uint64_t fiber_awaken_seq = 0; //每次awaken递增，park前据此判断期间是否错过了唤醒
+
+		size_t nested_pump_waiting_thread_count = 0; //在（非fiber的）嵌套泵中park的线程数，awaken时须唤醒它们以重新检查等待条件
+
+		//以下用于弹性策略（见set_elastic_policy）
+		int64_t thread_idle_timeout = 0;
+		std::atomic<int64_t> grow_wait_threshold_v{ 0 }; //在锁外投递本地任务时亦被访问，故为atomic
+
+		std::atomic<int64_t> yield_time_slice_v{ 10 }; //让出的时间片（毫秒），0为不按时间片让出
+
+		//以下用于线程绑定
+		std::vector<int> thread_cpu_ids; //空为不绑定
+		size_t thread_stack_size = 0; //0为平台默认
+		std::vector<std::vector<int>> numa_node_cpu_ids; //const-like，仅numa_aware_flag模式
 
 		volatile _STATE state_v = _STATE::NOT_START;
 		ks_condition_variable stopped_state_cv{};
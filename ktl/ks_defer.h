@@ -19,6 +19,7 @@ limitations under the License.
 #define __KS_DEFER_DEF
 
 #include "ks_cxxbase.h"
+#include "ks_unique_function.h"
 #include <functional>
 #include <vector>
 
@@ -26,7 +27,7 @@ limitations under the License.
 class ks_defer {
 public:
 	ks_defer() noexcept {}
-	explicit ks_defer(std::function<void()>&& fn) noexcept : m_pri_fn(std::move(fn)) {}
+	explicit ks_defer(ks_unique_function<void()>&& fn) noexcept : m_pri_fn(std::move(fn)) {}
 
 	ks_defer(const ks_defer&) = delete;
 	ks_defer(ks_defer&& other) noexcept { //仅支持移动构造
@@ -42,12 +43,12 @@ public:
 	}
 
 public:
-	template <class FN, class _ = std::enable_if_t<std::is_convertible_v<FN, std::function<void()>>>>
+	template <class FN, class _ = std::enable_if_t<std::is_convertible_v<FN, ks_unique_function<void()>>>>
 	ks_defer& add(FN&& fn) {
 		if (!m_pri_fn)
 			m_pri_fn = std::forward<FN>(fn);
 		else
-			m_more_fns.push_back(std::forward<FN>(fn));
+			m_more_fns.emplace_back(std::forward<FN>(fn));
 
 		return *this;
 	}
@@ -69,8 +70,8 @@ public:
 	}
 
 private:
-	std::function<void()> m_pri_fn;
-	std::vector<std::function<void()>> m_more_fns;
+	ks_unique_function<void()> m_pri_fn; //注：采用ks_unique_function，使捕获不多的lambda免于堆分配
+	std::vector<ks_unique_function<void()>> m_more_fns;
 };
 
 #endif //__KS_DEFER_DEF
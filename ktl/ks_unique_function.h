@@ -0,0 +1,205 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#pragma once
+
+#ifndef __KS_UNIQUE_FUNCTION_DEF
+#define __KS_UNIQUE_FUNCTION_DEF
+
+#include "ks_cxxbase.h"
+#include "ks_type_traits.h"
+#include "ks_functional.h"
+#include <functional>
+#include <new>
+#include <utility>
+
+
+//ks_unique_function类似于c++23的std::move_only_function：
+//仅支持移动，并内置一个小缓冲区（使对象恰为64字节），较小的可调用对象（如捕获不多的lambda、std::function本身）直接就地存放，免于堆分配。
+//注：可由任意可调用对象隐式构造，故可直接取代std::function作为参数类型；由空的std::function构造时，结果也为空。
+template <class SIG>
+class ks_unique_function;
+
+template <class R, class... ARGs>
+class ks_unique_function<R(ARGs...)> {
+public:
+	static constexpr size_t small_buffer_size = 64 - sizeof(void*);
+
+	ks_unique_function() noexcept : m_ops(nullptr) {}
+	ks_unique_function(nullptr_t) noexcept : m_ops(nullptr) {}
+
+	template <class FN, class _ = std::enable_if_t<
+		!std::is_same<std::decay_t<FN>, ks_unique_function>::value && std::is_invocable_r_v<R, std::decay_t<FN>&, ARGs...>>>
+	ks_unique_function(FN&& fn) : m_ops(nullptr) {
+		this->do_assign(std::forward<FN>(fn));
+	}
+
+	ks_unique_function(const ks_unique_function&) = delete;
+	ks_unique_function(ks_unique_function&& r) noexcept : m_ops(nullptr) {
+		if (r.m_ops != nullptr) {
+			r.m_ops->move_to_fn(&r.m_storage, &m_storage);
+			m_ops = r.m_ops;
+			r.m_ops = nullptr;
+		}
+	}
+
+	ks_unique_function& operator=(const ks_unique_function&) = delete;
+	ks_unique_function& operator=(ks_unique_function&& r) noexcept {
+		if (this != &r) {
+			this->reset();
+			if (r.m_ops != nullptr) {
+				r.m_ops->move_to_fn(&r.m_storage, &m_storage);
+				m_ops = r.m_ops;
+				r.m_ops = nullptr;
+			}
+		}
+		return *this;
+	}
+	ks_unique_function& operator=(nullptr_t) noexcept {
+		this->reset();
+		return *this;
+	}
+
+	~ks_unique_function() {
+		this->reset();
+	}
+
+public:
+	explicit operator bool() const noexcept { return m_ops != nullptr; }
+
+	R operator()(ARGs... args) const {
+		if (m_ops == nullptr)
+			throw std::bad_function_call();
+		return m_ops->invoke_fn(const_cast<_STORAGE*>(&m_storage), std::forward<ARGs>(args)...);
+	}
+
+	void swap(ks_unique_function& r) noexcept {
+		ks_unique_function t(std::move(r));
+		r = std::move(*this);
+		*this = std::move(t);
+	}
+
+	void reset() noexcept {
+		if (m_ops != nullptr) {
+			m_ops->destroy_fn(&m_storage);
+			m_ops = nullptr;
+		}
+	}
+
+private:
+	union _STORAGE {
+		void* heap_p;
+		alignas(void*) unsigned char embed_mem[small_buffer_size];
+	};
+
+	struct _OPS {
+		R(*invoke_fn)(_STORAGE* storage, ARGs&&... args);
+		void(*move_to_fn)(_STORAGE* src, _STORAGE* dst) noexcept;
+		void(*destroy_fn)(_STORAGE* storage) noexcept;
+	};
+
+	//就地存放的条件：尺寸和对齐合适，且移动构造不抛异常（以保证ks_unique_function自身的移动是noexcept的）
+	template <class XFN>
+	struct _IS_EMBED_FN : std::integral_constant<bool,
+		sizeof(XFN) <= small_buffer_size && alignof(XFN) <= alignof(_STORAGE) && std::is_nothrow_move_constructible<XFN>::value> {};
+
+	template <class XFN>
+	struct _EMBED_OPS {
+		static R invoke(_STORAGE* storage, ARGs&&... args) {
+			return (R)(*reinterpret_cast<XFN*>(storage->embed_mem))(std::forward<ARGs>(args)...);
+		}
+		static void move_to(_STORAGE* src, _STORAGE* dst) noexcept {
+			XFN* src_fn = reinterpret_cast<XFN*>(src->embed_mem);
+			::new (dst->embed_mem) XFN(std::move(*src_fn));
+			src_fn->~XFN();
+		}
+		static void destroy(_STORAGE* storage) noexcept {
+			reinterpret_cast<XFN*>(storage->embed_mem)->~XFN();
+		}
+		static const _OPS ops;
+	};
+
+	template <class XFN>
+	struct _HEAP_OPS {
+		static R invoke(_STORAGE* storage, ARGs&&... args) {
+			return (R)(*static_cast<XFN*>(storage->heap_p))(std::forward<ARGs>(args)...);
+		}
+		static void move_to(_STORAGE* src, _STORAGE* dst) noexcept {
+			dst->heap_p = src->heap_p;
+			src->heap_p = nullptr;
+		}
+		static void destroy(_STORAGE* storage) noexcept {
+			delete static_cast<XFN*>(storage->heap_p);
+		}
+		static const _OPS ops;
+	};
+
+	template <class FN>
+	void do_assign(FN&& fn) {
+		using XFN = std::decay_t<FN>;
+		if (_check_null_fn(fn))
+			return;
+
+		this->do_assign_imp<XFN>(std::forward<FN>(fn), _IS_EMBED_FN<XFN>{});
+	}
+
+	template <class XFN, class FN>
+	void do_assign_imp(FN&& fn, std::true_type is_embed) {
+		::new (m_storage.embed_mem) XFN(std::forward<FN>(fn));
+		m_ops = &_EMBED_OPS<XFN>::ops;
+	}
+	template <class XFN, class FN>
+	void do_assign_imp(FN&& fn, std::false_type is_embed) {
+		m_storage.heap_p = new XFN(std::forward<FN>(fn));
+		m_ops = &_HEAP_OPS<XFN>::ops;
+	}
+
+	template <class XFN>
+	static bool _check_null_fn(const XFN& fn) noexcept { return false; }
+	template <class XSIG>
+	static bool _check_null_fn(const std::function<XSIG>& fn) noexcept { return !fn; }
+	template <class XR, class... XARGs>
+	static bool _check_null_fn(XR(* const& fn)(XARGs...)) noexcept { return fn == nullptr; }
+
+private:
+	const _OPS* m_ops;
+	_STORAGE m_storage;
+};
+
+template <class R, class... ARGs>
+template <class XFN>
+const typename ks_unique_function<R(ARGs...)>::_OPS ks_unique_function<R(ARGs...)>::_EMBED_OPS<XFN>::ops = {
+	&ks_unique_function<R(ARGs...)>::_EMBED_OPS<XFN>::invoke,
+	&ks_unique_function<R(ARGs...)>::_EMBED_OPS<XFN>::move_to,
+	&ks_unique_function<R(ARGs...)>::_EMBED_OPS<XFN>::destroy,
+};
+
+template <class R, class... ARGs>
+template <class XFN>
+const typename ks_unique_function<R(ARGs...)>::_OPS ks_unique_function<R(ARGs...)>::_HEAP_OPS<XFN>::ops = {
+	&ks_unique_function<R(ARGs...)>::_HEAP_OPS<XFN>::invoke,
+	&ks_unique_function<R(ARGs...)>::_HEAP_OPS<XFN>::move_to,
+	&ks_unique_function<R(ARGs...)>::_HEAP_OPS<XFN>::destroy,
+};
+
+
+namespace std {
+	template <class SIG>
+	inline void swap(ks_unique_function<SIG>& l, ks_unique_function<SIG>& r) noexcept {
+		l.swap(r);
+	}
+}
+
+#endif //__KS_UNIQUE_FUNCTION_DEF
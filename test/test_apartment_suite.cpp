@@ -0,0 +1,1146 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "test_base.h"
+#include "../ks_single_thread_apartment_imp.h"
+#include "../ks_thread_pool_apartment_imp.h"
+#include <set>
+#include <climits>
+
+TEST(test_apartment_suite, test_work_stealing) {
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_work_stealing_mta", 4, ks_thread_pool_apartment_imp::work_stealing_flag | ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_work_stealing_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    ks_waitgroup work_wg(0);
+    auto c = std::make_shared<std::atomic<int>>(0);
+
+    //在工作线程内扇出大量normal任务（进入本地队列并被其他线程窃取），其中夹杂prior任务
+    work_wg.add(1);
+    mta->schedule([mta, c, &work_wg]() {
+        for (int i = 0; i < 1000; ++i) {
+            work_wg.add(1);
+            mta->schedule([mta, c, &work_wg]() {
+                work_wg.add(1);
+                mta->schedule([c, &work_wg]() {
+                    ++(*c);
+                    work_wg.done();
+                }, 0);
+                ++(*c);
+                work_wg.done();
+            }, (i % 100 == 0) ? 1 : 0);
+        }
+        work_wg.done();
+    }, 0);
+
+    work_wg.wait();
+    ASSERT_EQ(*c, 2000);
+
+    //future链式调度
+    work_wg.add(1);
+    ks_future<int>::resolved(0)
+        .then<int>(mta, make_async_context(), [](int v) { return v + 1; })
+        .then<int>(mta, make_async_context(), [](int v) { return v + 1; })
+        .then<int>(mta, make_async_context(), [](int v) { return v + 1; })
+        .on_completion(mta, make_async_context(), [&work_wg](const auto& result) {
+            EXPECT_EQ(_result_to_str(result), "3");
+            work_wg.done();
+        });
+
+    work_wg.wait();
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_sta_multi_producer) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_multi_producer_sta", ks_single_thread_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_multi_producer_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    //多个线程同时向sta投递，每个生产者的任务须按投递次序执行
+    constexpr int producer_count = 4;
+    constexpr int fn_count_per_producer = 10000;
+    ks_waitgroup work_wg(0);
+    work_wg.add(producer_count * fn_count_per_producer);
+
+    std::vector<int> last_seq_vec(producer_count, -1);
+    std::atomic<bool> order_ok{ true };
+    std::vector<std::thread> producer_threads;
+    for (int p = 0; p < producer_count; ++p) {
+        producer_threads.emplace_back([sta, p, &last_seq_vec, &order_ok, &work_wg]() {
+            for (int i = 0; i < fn_count_per_producer; ++i) {
+                sta->schedule([p, i, &last_seq_vec, &order_ok, &work_wg]() {
+                    if (last_seq_vec[p] + 1 != i)
+                        order_ok = false;
+                    last_seq_vec[p] = i;
+                    work_wg.done();
+                }, 0);
+            }
+        });
+    }
+
+    for (auto& t : producer_threads)
+        t.join();
+    work_wg.wait();
+    ASSERT_TRUE(order_ok);
+
+    //prior任务先于normal任务，normal任务先于idle任务
+    std::string seq;
+    work_wg.add(1);
+    sta->schedule([sta, &seq, &work_wg]() {
+        sta->schedule([&seq]() { seq += "i"; }, -1);
+        sta->schedule([&seq]() { seq += "n"; }, 0);
+        sta->schedule([&seq]() { seq += "p"; }, 1);
+        sta->schedule([&work_wg]() { work_wg.done(); }, -2);
+    }, 0);
+
+    work_wg.wait();
+    ASSERT_EQ(seq, "pni");
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
+
+TEST(test_apartment_suite, test_delayed_order_and_unschedule) {
+    ks_apartment* sta = ks_apartment::background_sta();
+
+    //延时任务须按到期时点执行；被撤销的任务不应执行
+    constexpr int fn_count = 200;
+    std::vector<int> delay_vec;
+    for (int i = 0; i < fn_count; ++i)
+        delay_vec.push_back(((i * 37) % 21) * 5);
+
+    ks_waitgroup work_wg(0);
+    std::vector<int> exec_delay_vec;
+    std::atomic<int> cancelled_exec_count{ 0 };
+    std::vector<uint64_t> cancelled_id_vec;
+    for (int i = 0; i < fn_count; ++i) {
+        const int delay = delay_vec[i];
+        if (i % 3 == 0) {
+            uint64_t id = sta->schedule_delayed([&cancelled_exec_count]() { ++cancelled_exec_count; }, 0, delay + 20);
+            cancelled_id_vec.push_back(id);
+        }
+        else {
+            work_wg.add(1);
+            sta->schedule_delayed([delay, &exec_delay_vec, &work_wg]() {
+                exec_delay_vec.push_back(delay);
+                work_wg.done();
+            }, 0, delay);
+        }
+    }
+
+    for (uint64_t id : cancelled_id_vec)
+        sta->try_unschedule(id);
+
+    work_wg.wait();
+    ASSERT_TRUE(std::is_sorted(exec_delay_vec.begin(), exec_delay_vec.end()));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    ASSERT_EQ(cancelled_exec_count, 0);
+}
+
+TEST(test_apartment_suite, test_unschedule_lazily) {
+    ks_apartment* mta = ks_apartment::default_mta();
+
+    //大量撤销延时任务：撤销是惰性的，但滞留过多时会压缩队列，及时释放被撤销任务的fn
+    constexpr int fn_count = 1000;
+    auto alive_token = std::make_shared<int>(0);
+    std::vector<uint64_t> id_vec;
+    for (int i = 0; i < fn_count; ++i)
+        id_vec.push_back(mta->schedule_delayed([alive_token]() { ASSERT_TRUE(false); }, 0, 60 * 1000));
+
+    ASSERT_EQ(alive_token.use_count(), fn_count + 1);
+    for (uint64_t id : id_vec)
+        mta->try_unschedule(id);
+    ASSERT_LT(alive_token.use_count(), fn_count / 2);
+
+    //重复撤销、撤销已执行的任务，都是无害的
+    for (uint64_t id : id_vec)
+        mta->try_unschedule(id);
+
+    ks_waitgroup work_wg(0);
+    work_wg.add(1);
+    uint64_t done_id = mta->schedule([&work_wg]() { work_wg.done(); }, -1);
+    work_wg.wait();
+    mta->try_unschedule(done_id);
+
+    //撤销idle任务
+    ks_apartment* sta = ks_apartment::background_sta();
+    ks_event blocker_event(false, true);
+    std::atomic<int> exec_count{ 0 };
+    sta->schedule([&blocker_event]() { blocker_event.wait(); }, 0);
+    std::vector<uint64_t> idle_id_vec;
+    for (int i = 0; i < 10; ++i)
+        idle_id_vec.push_back(sta->schedule([&exec_count]() { ++exec_count; }, -1));
+    for (int i = 0; i < 10; i += 2)
+        sta->try_unschedule(idle_id_vec[i]);
+
+    work_wg.add(1);
+    sta->schedule([&work_wg]() { work_wg.done(); }, -2);
+    blocker_event.set_event();
+    work_wg.wait();
+    ASSERT_EQ(exec_count, 5);
+}
+
+TEST(test_apartment_suite, test_schedule_move_only_fn) {
+    //ks_unique_function：空std::function转换后仍为空；小对象就地存放，大对象退化为堆存放，二者移动后均可正常调用
+    std::function<void()> null_std_fn;
+    ks_unique_function<void()> null_fn = std::move(null_std_fn);
+    ASSERT_FALSE(null_fn);
+
+    auto token = std::make_shared<int>(1);
+    char big_mem[128] = { 1 };
+    std::atomic<int> exec_count{ 0 };
+    ks_unique_function<void()> small_fn = [token, &exec_count]() { ++exec_count; };
+    ks_unique_function<void()> big_fn = [token, big_mem, &exec_count]() { exec_count += big_mem[0]; };
+    ASSERT_EQ(token.use_count(), 3);
+    ks_unique_function<void()> small_fn_2 = std::move(small_fn);
+    ks_unique_function<void()> big_fn_2 = std::move(big_fn);
+    ASSERT_FALSE(small_fn);
+    ASSERT_FALSE(big_fn);
+    small_fn_2();
+    big_fn_2();
+    ASSERT_EQ(exec_count, 2);
+    small_fn_2 = nullptr;
+    big_fn_2 = nullptr;
+    ASSERT_EQ(token.use_count(), 1);
+
+    //可直接schedule仅可移动的lambda
+    ks_waitgroup work_wg(0);
+    std::unique_ptr<int> value_ptr(new int(42));
+    std::atomic<int> value{ 0 };
+    work_wg.add(2);
+    ks_apartment::default_mta()->schedule([value_ptr = std::move(value_ptr), &value, &work_wg]() {
+        value += *value_ptr;
+        work_wg.done();
+    }, 0);
+    std::unique_ptr<int> value_ptr_2(new int(58));
+    ks_apartment::background_sta()->schedule_delayed([value_ptr_2 = std::move(value_ptr_2), &value, &work_wg]() {
+        value += *value_ptr_2;
+        work_wg.done();
+    }, 0, 10);
+    work_wg.wait();
+    ASSERT_EQ(value, 100);
+}
+
+TEST(test_apartment_suite, test_schedule_batch) {
+    ks_apartment* apartments[] = { ks_apartment::default_mta(), ks_apartment::background_sta() };
+    for (ks_apartment* apartment : apartments) {
+        constexpr size_t fn_count = 100;
+        ks_waitgroup work_wg(0);
+        std::mutex order_mutex;
+        std::vector<size_t> order_vec;
+
+        std::vector<ks_unique_function<void()>> fns;
+        for (size_t i = 0; i < fn_count; ++i) {
+            fns.push_back([i, &order_mutex, &order_vec, &work_wg]() {
+                if (true) {
+                    std::lock_guard<std::mutex> lock(order_mutex);
+                    order_vec.push_back(i);
+                }
+                work_wg.done(); //须在解锁之后，否则等待者返回后order_mutex即被销毁
+            });
+        }
+
+        std::vector<uint64_t> fn_ids(fn_count, 0);
+        work_wg.add(fn_count);
+        size_t scheduled_count = apartment->schedule_batch(fns.data(), fns.size(), 0, fn_ids.data());
+        ASSERT_EQ(scheduled_count, fn_count);
+        work_wg.wait();
+
+        ASSERT_EQ(order_vec.size(), fn_count);
+        ASSERT_EQ(std::set<uint64_t>(fn_ids.begin(), fn_ids.end()).size(), fn_count);
+        ASSERT_TRUE(std::find(fn_ids.begin(), fn_ids.end(), uint64_t(0)) == fn_ids.end());
+        if (apartment->features() & ks_apartment::sequential_feature) {
+            for (size_t i = 0; i < fn_count; ++i)
+                ASSERT_EQ(order_vec[i], i); //单线程套间保持投递次序
+        }
+    }
+
+    //parallel_n经由schedule_batch投递；all连接多个已完成的future时feed亦被合并
+    std::atomic<int> exec_count{ 0 };
+    ks_future_util::parallel_n(ks_apartment::default_mta(), [&exec_count]() { ++exec_count; }, 200).__wait();
+    ASSERT_EQ(exec_count, 200);
+
+    std::vector<ks_future<int>> resolved_futures;
+    for (int i = 0; i < 10; ++i)
+        resolved_futures.push_back(ks_future<int>::resolved(i));
+    auto all_future = ks_future_util::all(resolved_futures);
+    all_future.__wait();
+    ASSERT_TRUE(all_future.peek_result().is_value());
+    ASSERT_EQ(all_future.peek_result().to_value().size(), 10);
+}
+
+TEST(test_apartment_suite, test_elastic_thread_pool) {
+    auto init_count = std::make_shared<std::atomic<int>>(0);
+    auto term_count = std::make_shared<std::atomic<int>>(0);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_elastic_mta", 4, ks_thread_pool_apartment_imp::elastic_flag | ks_thread_pool_apartment_imp::auto_register_flag,
+        [init_count]() { ++(*init_count); }, [term_count]() { ++(*term_count); });
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_elastic_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    auto wait_until_fn = [](const std::function<bool()>& pred_fn) {
+        for (int i = 0; i < 500 && !pred_fn(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return pred_fn();
+    };
+
+    //按队列长度扩充至4个线程，空闲超时后退休至1个
+    mta_imp->set_elastic_policy(50, 0);
+    ks_waitgroup work_wg(0);
+    std::atomic<int> running_count{ 0 };
+    for (int i = 0; i < 4; ++i) {
+        work_wg.add(1);
+        mta->schedule([&running_count, &wait_until_fn, &work_wg]() {
+            ++running_count;
+            wait_until_fn([&running_count]() { return running_count == 4; });
+            work_wg.done();
+        }, 0);
+    }
+    work_wg.wait();
+    ASSERT_EQ(running_count, 4);
+    ASSERT_EQ(*init_count, 4);
+    ASSERT_TRUE(wait_until_fn([term_count]() { return *term_count == 3; }));
+
+    //按等待时长扩充：队首任务等待超过阈值前不扩充
+    mta_imp->set_elastic_policy(0, 100);
+    std::atomic<bool> blocker_released{ false };
+    std::atomic<bool> waiter_executed{ false };
+    work_wg.add(2);
+    mta->schedule([&blocker_released, &wait_until_fn, &work_wg]() {
+        wait_until_fn([&blocker_released]() { return blocker_released.load(); });
+        work_wg.done();
+    }, 0);
+    mta->schedule([&waiter_executed, &work_wg]() {
+        waiter_executed = true;
+        work_wg.done();
+    }, 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_FALSE(waiter_executed);
+    ASSERT_EQ(*init_count, 4);
+
+    work_wg.add(1);
+    mta->schedule([&work_wg]() { work_wg.done(); }, 0); //投递时发现队首任务等待过久，扩充1个线程
+    ASSERT_TRUE(wait_until_fn([&waiter_executed]() { return waiter_executed.load(); }));
+    ASSERT_EQ(*init_count, 5);
+
+    //运行时调小最大线程数，多出的线程退休
+    ASSERT_TRUE(mta_imp->set_max_thread_count(1));
+    ASSERT_EQ(mta->concurrency(), 1);
+    blocker_released = true;
+    work_wg.wait();
+    ASSERT_TRUE(wait_until_fn([term_count]() { return *term_count == 4; }));
+
+    mta->async_stop();
+    mta->wait();
+    ASSERT_TRUE(wait_until_fn([init_count, term_count]() { return *term_count == *init_count; }));
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_retired_thread_slot_reuse) {
+    auto init_count = std::make_shared<std::atomic<int>>(0);
+    auto term_count = std::make_shared<std::atomic<int>>(0);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_slot_reuse_mta", 4, 0,
+        [init_count]() { ++(*init_count); }, [term_count]() { ++(*term_count); });
+    ks_apartment* mta = mta_imp;
+    mta->start();
+
+    //反复调小、调大最大线程数：退休线程尚在退出时，新线程不可复用其槽位（否则退休计数泄漏，且新旧线程共用同一槽位）
+    std::atomic<int> done_count{ 0 };
+    const int round_count = 200;
+    const int fn_count_per_round = 8;
+    for (int round = 0; round < round_count; ++round) {
+        ASSERT_TRUE(mta_imp->set_max_thread_count(round % 2 == 0 ? 1 : 4));
+        for (int i = 0; i < fn_count_per_round; ++i)
+            mta->schedule([&done_count]() { ++done_count; }, 0);
+    }
+
+    for (int i = 0; i < 1000 && done_count != round_count * fn_count_per_round; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_EQ(done_count, round_count * fn_count_per_round);
+
+    //调大后仍可并发执行满4个任务（活动线程数未被低估）
+    ASSERT_TRUE(mta_imp->set_max_thread_count(4));
+    ks_waitgroup work_wg(0);
+    std::atomic<int> running_count{ 0 };
+    for (int i = 0; i < 4; ++i) {
+        work_wg.add(1);
+        mta->schedule([&running_count, &work_wg]() {
+            ++running_count;
+            for (int j = 0; j < 500 && running_count != 4; ++j)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            work_wg.done();
+        }, 0);
+    }
+    work_wg.wait();
+    ASSERT_EQ(running_count, 4);
+
+    mta->async_stop();
+    mta->wait();
+    for (int i = 0; i < 500 && *term_count != *init_count; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(*term_count, *init_count);
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_numa_aware_thread_pool) {
+    const auto& numa_node_cpu_ids = ks_apartment::__get_numa_node_cpu_ids();
+    ASSERT_FALSE(numa_node_cpu_ids.empty());
+    for (const auto& cpu_ids : numa_node_cpu_ids)
+        ASSERT_FALSE(cpu_ids.empty());
+
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_numa_aware_mta", 4, ks_thread_pool_apartment_imp::work_stealing_flag | ks_thread_pool_apartment_imp::numa_aware_flag | ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_numa_aware_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+
+    const int pinned_cpu_id = numa_node_cpu_ids[0][0];
+    mta_imp->set_thread_cpu_affinity({ pinned_cpu_id });
+    mta->start();
+
+    ks_waitgroup work_wg(0);
+    auto c = std::make_shared<std::atomic<int>>(0);
+    auto unpinned_count = std::make_shared<std::atomic<int>>(0);
+    auto check_pinned_fn = [pinned_cpu_id, unpinned_count]() {
+#if defined(__linux__)
+        //节点0的线程应被绑定到pinned_cpu_id（其他节点的线程则绑定到其节点的cpu）
+        if (ks_apartment::__get_numa_node_cpu_ids().size() == 1) {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0 && (CPU_COUNT(&cpu_set) != 1 || !CPU_ISSET(pinned_cpu_id, &cpu_set)))
+                ++(*unpinned_count);
+        }
+#endif
+    };
+
+    work_wg.add(1);
+    mta->schedule([mta, c, check_pinned_fn, &work_wg]() {
+        for (int i = 0; i < 200; ++i) {
+            work_wg.add(1);
+            mta->schedule([c, check_pinned_fn, &work_wg]() {
+                check_pinned_fn();
+                ++(*c);
+                work_wg.done();
+            }, 0);
+        }
+        work_wg.done();
+    }, 0);
+
+    work_wg.wait();
+    ASSERT_EQ(*c, 200);
+    ASSERT_EQ(*unpinned_count, 0);
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_lifo_idle_thread_wakeup) {
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_lifo_wakeup_mta", 4, ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_lifo_wakeup_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    //先令4个线程都被创建出来
+    ks_waitgroup work_wg(0);
+    std::atomic<int> running_count{ 0 };
+    for (int i = 0; i < 4; ++i) {
+        work_wg.add(1);
+        mta->schedule([&running_count, &work_wg]() {
+            ++running_count;
+            for (int k = 0; k < 500 && running_count != 4; ++k)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            work_wg.done();
+        }, 0);
+    }
+    work_wg.wait();
+    ASSERT_EQ(running_count, 4);
+
+    //轻负载下逐个投递，应总是唤醒最近空闲的线程，而非轮流唤醒各个线程
+    std::mutex thread_id_mutex;
+    std::set<std::thread::id> thread_ids;
+    for (int i = 0; i < 50; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2)); //待执行者重新进入空闲
+        work_wg.add(1);
+        mta->schedule([&thread_id_mutex, &thread_ids, &work_wg]() {
+            std::lock_guard<std::mutex> lock(thread_id_mutex);
+            thread_ids.insert(std::this_thread::get_id());
+            work_wg.done();
+        }, 0);
+        work_wg.wait();
+    }
+    ASSERT_LE(thread_ids.size(), 2);
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_priority_aging) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_priority_aging_sta", ks_single_thread_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_priority_aging_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    constexpr int busy_fn_count = 100;
+    constexpr int total_fn_count = busy_fn_count * 2 + 4;
+    int exec_count = 0;
+    int top_pos = -1, aged_pos = -1, idle_pos = -1, bottom_pos = -1;
+    ks_waitgroup work_wg(0);
+    work_wg.add(total_fn_count);
+    sta->schedule([sta, &exec_count, &top_pos, &aged_pos, &idle_pos, &bottom_pos, &work_wg]() {
+        //idle任务不会被持续的normal任务饿死
+        sta->schedule([&exec_count, &idle_pos, &work_wg]() { idle_pos = exec_count++; work_wg.done(); }, -1);
+        for (int i = 0; i < busy_fn_count; ++i)
+            sta->schedule([&exec_count, &work_wg]() { ++exec_count; work_wg.done(); }, 0);
+
+        //先投递的低prior任务随等待而老化，不会排在所有后投递的高prior任务之后
+        sta->schedule([&exec_count, &aged_pos, &work_wg]() { aged_pos = exec_count++; work_wg.done(); }, 1);
+        for (int i = 0; i < busy_fn_count; ++i)
+            sta->schedule([&exec_count, &work_wg]() { ++exec_count; work_wg.done(); }, 2);
+
+        //支持完整的int优先级范围
+        sta->schedule([&exec_count, &top_pos, &work_wg]() { top_pos = exec_count++; work_wg.done(); }, INT_MAX);
+        sta->schedule([&exec_count, &bottom_pos, &work_wg]() { bottom_pos = exec_count++; work_wg.done(); }, INT_MIN);
+    }, 0);
+
+    work_wg.wait();
+    ASSERT_EQ(exec_count, total_fn_count);
+    ASSERT_EQ(top_pos, 0);
+    ASSERT_GT(aged_pos, 1);
+    ASSERT_LT(aged_pos, busy_fn_count);
+    ASSERT_GE(idle_pos, 0);
+    ASSERT_LT(idle_pos, busy_fn_count);
+    ASSERT_GT(bottom_pos, idle_pos);
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
+
+TEST(test_apartment_suite, test_sched_class_policy) {
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_sched_class_mta", 4, ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_sched_class_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta_imp->set_sched_class_policy(1, 1, 1); //为类别1预留1个线程
+    mta_imp->set_sched_class_policy(2, 1, 0);
+    mta->start();
+
+    //类别2大量投递，但不会挤占为类别1预留的线程
+    constexpr int noisy_fn_count = 60;
+    std::atomic<int> noisy_running_count{ 0 };
+    std::atomic<int> noisy_max_running_count{ 0 };
+    std::atomic<bool> noisy_sched_class_ok{ true };
+    std::vector<ks_future<void>> noisy_futures;
+    for (int i = 0; i < noisy_fn_count; ++i) {
+        noisy_futures.push_back(ks_future<void>::post(mta, [&]() {
+            if (ks_apartment::__get_current_thread_sched_class() != 2)
+                noisy_sched_class_ok = false;
+            int running_count = ++noisy_running_count;
+            int max_running_count = noisy_max_running_count;
+            while (running_count > max_running_count && !noisy_max_running_count.compare_exchange_weak(max_running_count, running_count)) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            --noisy_running_count;
+        }, make_async_context().set_sched_class(2)));
+    }
+
+    //类别1的任务及时执行，且其内投递的任务沿用类别1
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const auto post_time = std::chrono::steady_clock::now();
+    std::atomic<int64_t> latency_ms{ -1 };
+    std::atomic<int> nested_sched_class{ -1 };
+    ks_waitgroup work_wg(0);
+    work_wg.add(1);
+    ks_future<void>::post(mta, [mta, post_time, &latency_ms, &nested_sched_class, &work_wg]() {
+        latency_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - post_time).count();
+        mta->schedule([&nested_sched_class, &work_wg]() {
+            nested_sched_class = ks_apartment::__get_current_thread_sched_class();
+            work_wg.done();
+        }, 0);
+    }, make_async_context().set_sched_class(1));
+
+    work_wg.wait();
+    ASSERT_GE(latency_ms, 0);
+    ASSERT_LT(latency_ms, 100);
+    ASSERT_EQ(nested_sched_class, 1);
+
+    for (auto& noisy_future : noisy_futures)
+        noisy_future.__wait();
+    ASSERT_TRUE(noisy_sched_class_ok);
+    ASSERT_LE(noisy_max_running_count, 3);
+    ASSERT_EQ(ks_apartment::__get_current_thread_sched_class(), 0);
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_deadline_first) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_deadline_first_sta", ks_single_thread_apartment_imp::auto_register_flag | ks_single_thread_apartment_imp::deadline_first_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_deadline_first_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    std::vector<int> exec_order;
+    std::atomic<bool> expired_fn_ran{ false };
+    std::vector<ks_future<void>> futures;
+    ks_future<void>::post(sta, [sta, &exec_order, &expired_fn_ran, &futures]() {
+        //无截止时刻的任务排在带截止时刻的任务之后，带截止时刻者按截止时刻先后执行
+        futures.push_back(ks_future<void>::post(sta, [&exec_order]() { exec_order.push_back(0); }));
+        futures.push_back(ks_future<void>::post(sta, [&exec_order]() { exec_order.push_back(3000); }, make_async_context().set_timeout(3000)));
+        futures.push_back(ks_future<void>::post(sta, [&exec_order]() { exec_order.push_back(1000); }, make_async_context().set_timeout(1000)));
+        futures.push_back(ks_future<void>::post(sta, [&exec_order]() { exec_order.push_back(2000); }, make_async_context().set_timeout(2000)));
+
+        //已过截止时刻的任务以timeout_error完成，而不执行任务函数
+        futures.push_back(ks_future<void>::post(sta, [&expired_fn_ran]() { expired_fn_ran = true; }, make_async_context().set_timeout(1)));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }).__wait();
+
+    for (auto& future : futures)
+        future.__wait();
+    ASSERT_EQ(exec_order, std::vector<int>({ 1000, 2000, 3000, 0 }));
+    ASSERT_FALSE(expired_fn_ran);
+    ASSERT_EQ(futures.back().peek_result().to_error().get_code(), ks_error::timeout_error().get_code());
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
+
+TEST(test_apartment_suite, test_shortest_job_first) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_shortest_job_first_sta", ks_single_thread_apartment_imp::auto_register_flag | ks_single_thread_apartment_imp::shortest_job_first_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_shortest_job_first_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    auto schedule_with_duration_hint = [sta](int64_t duration_hint, std::function<void()>&& fn) {
+        const int64_t pre_duration_hint = ks_apartment::__exchange_current_thread_schedule_duration_hint(duration_hint);
+        sta->schedule(std::move(fn), 0);
+        ks_apartment::__exchange_current_thread_schedule_duration_hint(pre_duration_hint);
+    };
+
+    std::vector<std::string> exec_order;
+    ks_waitgroup work_wg(0);
+    work_wg.add(5); //各任务均done后才读取exec_order
+    sta->schedule([schedule_with_duration_hint, &exec_order, &work_wg]() {
+        //同优先级内，预估耗时短者先于长者执行（耗时未知者视为0）
+        schedule_with_duration_hint(50000, [&exec_order, &work_wg]() { exec_order.push_back("long"); work_wg.done(); });
+        schedule_with_duration_hint(0, [&exec_order, &work_wg]() { exec_order.push_back("unknown"); work_wg.done(); });
+        schedule_with_duration_hint(5, [&exec_order, &work_wg]() { exec_order.push_back("short"); work_wg.done(); });
+
+        //长任务至多被推迟其预估耗时，不会被后投递的短任务持续挤占
+        schedule_with_duration_hint(1000, [&exec_order, &work_wg]() { exec_order.push_back("aged"); work_wg.done(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        schedule_with_duration_hint(5, [&exec_order, &work_wg]() { exec_order.push_back("late_short"); work_wg.done(); });
+    }, 0);
+
+    work_wg.wait();
+    ASSERT_EQ(exec_order, std::vector<std::string>({ "unknown", "short", "aged", "late_short", "long" }));
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
+
+TEST(test_apartment_suite, test_priority_inheritance) {
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_priority_inheritance_mta", 1, ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_priority_inheritance_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    std::mutex exec_order_mutex;
+    std::vector<std::string> exec_order;
+    auto record = [&exec_order_mutex, &exec_order](const char* name) {
+        std::lock_guard<std::mutex> lock(exec_order_mutex);
+        exec_order.push_back(name);
+    };
+
+    //唯一的工作线程被占住，使后续任务都在队列中排队
+    std::atomic<bool> blocker_released{ false };
+    ks_future<void> blocker = ks_future<void>::post(mta, [&blocker_released]() {
+        while (!blocker_released)
+            std::this_thread::yield();
+    });
+
+    //idle任务被高优先级的后继所依赖，则提升至后继的优先级，先于normal任务执行
+    ks_future<void> idle_future = ks_future<void>::post(mta, [&record]() { record("idle"); }, make_async_context().set_priority(-1));
+    std::vector<ks_future<void>> normal_futures;
+    for (int i = 0; i < 10; ++i)
+        normal_futures.push_back(ks_future<void>::post(mta, [&record]() { record("normal"); }));
+    ks_future<void> then_future = idle_future.then<void>(mta, [&record]() { record("then"); }, make_async_context().set_priority(0x8000));
+
+    blocker_released = true;
+    then_future.__wait();
+    for (auto& future : normal_futures)
+        future.__wait();
+    ASSERT_EQ(exec_order.size(), size_t(12));
+    ASSERT_EQ(exec_order[0], "idle");
+    ASSERT_EQ(exec_order[1], "then");
+
+    //prior任务中__wait等待排队中的idle任务，同样使之提升至等待者的优先级
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_priority_inheritance_sta", ks_single_thread_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_priority_inheritance_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    exec_order.clear();
+    blocker_released = false;
+    blocker = ks_future<void>::post(mta, [&blocker_released]() {
+        while (!blocker_released)
+            std::this_thread::yield();
+    });
+    idle_future = ks_future<void>::post(mta, [&record]() { record("idle"); }, make_async_context().set_priority(-1));
+    normal_futures.clear();
+    for (int i = 0; i < 10; ++i)
+        normal_futures.push_back(ks_future<void>::post(mta, [&record]() { record("normal"); }));
+    ks_future<void> waiter_future = ks_future<void>::post(sta, [&idle_future]() { idle_future.__wait(); }, make_async_context().set_priority(1));
+    std::thread release_thread([&blocker_released]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        blocker_released = true;
+    });
+    waiter_future.__wait();
+    release_thread.join();
+    for (auto& future : normal_futures)
+        future.__wait();
+    ASSERT_EQ(exec_order.size(), size_t(11));
+    ASSERT_EQ(exec_order[0], "idle");
+
+    //只有严格更高的优先级才会被继承：normal等待者不会把normal任务提升为prior
+    exec_order.clear();
+    blocker_released = false;
+    blocker = ks_future<void>::post(mta, [&blocker_released]() {
+        while (!blocker_released)
+            std::this_thread::yield();
+    });
+    normal_futures.clear();
+    for (int i = 0; i < 10; ++i)
+        normal_futures.push_back(ks_future<void>::post(mta, [&record]() { record("normal"); }));
+    ks_future<void> target_future = ks_future<void>::post(mta, [&record]() { record("target"); });
+    release_thread = std::thread([&blocker_released]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        blocker_released = true;
+    });
+    target_future.__wait();
+    release_thread.join();
+    for (auto& future : normal_futures)
+        future.__wait();
+    ASSERT_EQ(exec_order.size(), size_t(11));
+    ASSERT_EQ(exec_order[10], "target");
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_try_boost_priority) {
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_try_boost_priority_mta", 1, ks_thread_pool_apartment_imp::auto_register_flag | ks_thread_pool_apartment_imp::work_stealing_flag);
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_try_boost_priority_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    ks_event blocker_event(false, true);
+    ks_waitgroup work_wg(0);
+    work_wg.add(1);
+    mta->schedule([&blocker_event, &work_wg]() { blocker_event.wait(); work_wg.done(); }, 0);
+
+    //排队中的任务可被提升，但只升不降
+    std::vector<std::string> exec_order;
+    work_wg.add(2);
+    uint64_t normal_id = mta->schedule([&exec_order, &work_wg]() { exec_order.push_back("normal"); work_wg.done(); }, 0);
+    uint64_t target_id = mta->schedule([&exec_order, &work_wg]() { exec_order.push_back("target"); work_wg.done(); }, 0);
+    ASSERT_TRUE(mta->try_boost_priority(target_id, 2));
+    ASSERT_FALSE(mta->try_boost_priority(target_id, 2));
+    ASSERT_FALSE(mta->try_boost_priority(target_id, 1));
+    ASSERT_FALSE(mta->try_boost_priority(normal_id, 0));
+
+    blocker_event.set_event();
+    work_wg.wait();
+    ASSERT_EQ(exec_order, (std::vector<std::string>{ "target", "normal" }));
+    ASSERT_FALSE(mta->try_boost_priority(target_id, 3)); //已执行
+
+    //work-stealing本地队列（含lifo-slot）中的任务不在索引中，不予提升
+    std::atomic<bool> local_boosted{ true };
+    work_wg.add(1);
+    mta->schedule([mta, &local_boosted, &work_wg]() {
+        uint64_t local_id = mta->schedule([]() {}, 0);
+        local_boosted = mta->try_boost_priority(local_id, 1);
+        work_wg.done();
+    }, 0);
+    work_wg.wait();
+    ASSERT_FALSE(local_boosted);
+
+    mta->async_stop();
+    mta->wait();
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_help_first_waiting) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_help_first_waiting_sta", ks_single_thread_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_help_first_waiting_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    std::vector<std::string> exec_order;
+    std::vector<ks_future<void>> unrelated_futures;
+    ks_future<void>::post(sta, [sta, &exec_order, &unrelated_futures]() {
+        for (int i = 0; i < 5; ++i)
+            unrelated_futures.push_back(ks_future<void>::post(sta, [&exec_order]() { exec_order.push_back("unrelated"); }));
+
+        //wait时先就地执行依赖路径上排队的任务（含上游），而不是按序泵排在前面的无关任务
+        ks_future<int> head_future = ks_future<int>::post(sta, [&exec_order]() { exec_order.push_back("head"); return 1; });
+        ks_future<int> tail_future = head_future.then<int>(sta, [&exec_order](const int& value) { exec_order.push_back("tail"); return value + 1; });
+        tail_future.__wait();
+        exec_order.push_back("waited");
+        ASSERT_EQ(tail_future.peek_result().to_value(), 2);
+    }).__wait();
+
+    for (auto& future : unrelated_futures)
+        future.__wait();
+    ASSERT_EQ(exec_order.size(), size_t(8));
+    ASSERT_EQ(std::vector<std::string>(exec_order.begin(), exec_order.begin() + 3), std::vector<std::string>({ "head", "tail", "waited" }));
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
+
+TEST(test_apartment_suite, test_fiber_mode_waiting) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_fiber_mode_sta", ks_single_thread_apartment_imp::fiber_mode_flag | ks_single_thread_apartment_imp::auto_register_flag);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_fiber_mode_mta", 1, ks_thread_pool_apartment_imp::fiber_mode_flag | ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_fiber_mode_sta");
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_fiber_mode_mta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    sta->start();
+    mta->start();
+
+    for (ks_apartment* apartment : { sta, mta }) {
+        //两个任务先后wait，而依次完成的是先wait者：嵌套泵时先wait者被压在后者之下，须待后者完成方可返回；fiber模式则各自独立返回
+        ks_promise<int> promise_a = ks_promise<int>::create();
+        ks_promise<int> promise_b = ks_promise<int>::create();
+        std::atomic<int> parked_count = { 0 };
+        std::atomic<bool> a_done = { false };
+
+        ks_future<void> future_a = ks_future<void>::post(apartment, [promise_a, &parked_count, &a_done]() {
+            const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(7);
+            ++parked_count;
+            ks_future<int> waiting_future = promise_a.get_future();
+            waiting_future.__wait();
+            ASSERT_EQ(waiting_future.peek_result().to_value(), 1);
+            ASSERT_EQ(ks_apartment::__get_current_thread_sched_class(), 7); //线程局部状态随fiber恢复
+            ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
+            a_done = true;
+        });
+        ks_future<void> future_b = ks_future<void>::post(apartment, [promise_b, &parked_count]() {
+            const int pre_sched_class = ks_apartment::__exchange_current_thread_sched_class(9);
+            ++parked_count;
+            ks_future<int> waiting_future = promise_b.get_future();
+            waiting_future.__wait();
+            ASSERT_EQ(waiting_future.peek_result().to_value(), 2);
+            ASSERT_EQ(ks_apartment::__get_current_thread_sched_class(), 9);
+            ks_apartment::__exchange_current_thread_sched_class(pre_sched_class);
+        });
+
+        while (parked_count != 2)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        promise_a.resolve(1);
+        const auto until_time = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!a_done && std::chrono::steady_clock::now() < until_time)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ASSERT_TRUE(a_done.load());
+        ASSERT_FALSE(future_b.is_completed());
+
+        promise_b.resolve(2);
+        future_a.__wait();
+        future_b.__wait();
+        ASSERT_TRUE(future_a.peek_result().is_value());
+        ASSERT_TRUE(future_b.peek_result().is_value());
+    }
+
+    sta->async_stop();
+    mta->async_stop();
+    sta->wait();
+    mta->wait();
+    delete sta_imp;
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_blocking_compensation) {
+    auto init_count = std::make_shared<std::atomic<int>>(0);
+    auto term_count = std::make_shared<std::atomic<int>>(0);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_blocking_compensation_mta", 2, ks_thread_pool_apartment_imp::blocking_compensation_flag | ks_thread_pool_apartment_imp::auto_register_flag,
+        [init_count]() { ++(*init_count); }, [term_count]() { ++(*term_count); });
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_blocking_compensation_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta->start();
+
+    auto wait_until_fn = [](const std::function<bool()>& pred_fn) {
+        for (int i = 0; i < 500 && !pred_fn(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return pred_fn();
+    };
+
+    //2个任务在阻塞区间中占满了线程，其后的任务仍由补偿线程执行
+    ks_waitgroup work_wg(0);
+    std::atomic<int> blocking_count{ 0 };
+    std::atomic<bool> blocker_released{ false };
+    for (int i = 0; i < 2; ++i) {
+        work_wg.add(1);
+        mta->schedule([&blocking_count, &blocker_released, &wait_until_fn, &work_wg]() {
+            ks_blocking_region blocking_region;
+            ks_blocking_region nested_blocking_region; //嵌套时只计一次
+            ++blocking_count;
+            wait_until_fn([&blocker_released]() { return blocker_released.load(); });
+            work_wg.done();
+        }, 0);
+    }
+    ASSERT_TRUE(wait_until_fn([&blocking_count]() { return blocking_count == 2; }));
+
+    std::atomic<bool> waiter_executed{ false };
+    work_wg.add(1);
+    mta->schedule([&waiter_executed, &work_wg]() {
+        waiter_executed = true;
+        work_wg.done();
+    }, 0);
+    ASSERT_TRUE(wait_until_fn([&waiter_executed]() { return waiter_executed.load(); }));
+    ASSERT_FALSE(blocker_released);
+    ASSERT_EQ(*init_count, 3);
+    ASSERT_EQ(mta_imp->get_thread_stats().blocking_thread_count, size_t(2));
+
+    //阻塞结束后，多出的线程退休
+    blocker_released = true;
+    work_wg.wait();
+    ASSERT_TRUE(wait_until_fn([term_count]() { return *term_count == 1; }));
+    ASSERT_EQ(*init_count, 3);
+
+    mta->async_stop();
+    mta->wait();
+    ASSERT_TRUE(wait_until_fn([init_count, term_count]() { return *term_count == *init_count; }));
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_blocking_mta) {
+    ks_apartment* blocking_mta = ks_apartment::blocking_mta();
+    ASSERT_EQ(ks_apartment::find_public_apartment("blocking_mta"), blocking_mta);
+    auto* blocking_mta_imp = static_cast<ks_thread_pool_apartment_imp*>(blocking_mta);
+
+    auto wait_until_fn = [](const std::function<bool()>& pred_fn) {
+        for (int i = 0; i < 500 && !pred_fn(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return pred_fn();
+    };
+
+    //阻塞任务各占一个线程，可远超default_mta的线程数
+    constexpr int blocking_task_count = 32;
+    std::atomic<int> blocking_count{ 0 };
+    std::atomic<bool> blocker_released{ false };
+    std::vector<ks_future<int>> blocking_futures;
+    for (int i = 0; i < blocking_task_count; ++i) {
+        blocking_futures.push_back(ks_future<int>::post_blocking([i, &blocking_count, &blocker_released, &wait_until_fn]() {
+            EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::blocking_mta());
+            ++blocking_count;
+            wait_until_fn([&blocker_released]() { return blocker_released.load(); });
+            return i;
+        }));
+    }
+
+    ASSERT_TRUE(wait_until_fn([&blocking_count]() { return blocking_count == blocking_task_count; }));
+    ks_thread_pool_apartment_imp::thread_stats stats = blocking_mta_imp->get_thread_stats();
+    ASSERT_GE(stats.busy_thread_count, size_t(blocking_task_count));
+    ASSERT_GE(stats.active_thread_count, size_t(blocking_task_count));
+    ASSERT_EQ(stats.queued_fn_count, size_t(0));
+
+    blocker_released = true;
+    for (int i = 0; i < blocking_task_count; ++i) {
+        blocking_futures[i].__wait();
+        ASSERT_EQ(blocking_futures[i].peek_result().to_value(), i);
+    }
+
+    ks_future<void>::post_blocking([]() {}).__wait();
+    ASSERT_TRUE(wait_until_fn([blocking_mta_imp]() { return blocking_mta_imp->get_thread_stats().busy_thread_count == 0; }));
+}
+
+TEST(test_apartment_suite, test_prewarm_and_stack_size) {
+    auto init_count = std::make_shared<std::atomic<int>>(0);
+    auto term_count = std::make_shared<std::atomic<int>>(0);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_prewarm_mta", 4, ks_thread_pool_apartment_imp::prewarm_flag | ks_thread_pool_apartment_imp::auto_register_flag,
+        [init_count]() { ++(*init_count); }, [term_count]() { ++(*term_count); });
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_prewarm_mta");
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    mta_imp->set_thread_stack_size(256 * 1024);
+
+    auto wait_until_fn = [](const std::function<bool()>& pred_fn) {
+        for (int i = 0; i < 500 && !pred_fn(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return pred_fn();
+    };
+
+    //start时即创建全部线程，尚未投递任何任务
+    ASSERT_EQ(*init_count, 0);
+    mta->start();
+    ASSERT_TRUE(wait_until_fn([init_count]() { return *init_count == 4; }));
+    ASSERT_EQ(mta_imp->get_thread_stats().active_thread_count, size_t(4));
+
+    //调大最大线程数，同样即时补足
+    ASSERT_TRUE(mta_imp->set_max_thread_count(6));
+    ASSERT_TRUE(wait_until_fn([init_count]() { return *init_count == 6; }));
+
+    //任务在指定栈大小的线程上正常执行
+    std::vector<ks_future<int>> futures;
+    for (int i = 0; i < 6; ++i) {
+        futures.push_back(ks_future<int>::post(mta, [i]() {
+            volatile char buf[64 * 1024];
+            for (size_t k = 0; k < sizeof(buf); k += 1024)
+                buf[k] = (char)i;
+            return buf[0] + 1;
+        }));
+    }
+    for (int i = 0; i < 6; ++i) {
+        futures[i].__wait();
+        ASSERT_EQ(futures[i].peek_result().to_value(), i + 1);
+    }
+    ASSERT_EQ(*init_count, 6);
+
+    mta->async_stop();
+    mta->wait();
+    ASSERT_TRUE(wait_until_fn([init_count, term_count]() { return *term_count == *init_count; }));
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_yield_if_needed) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_yield_sta", ks_single_thread_apartment_imp::fiber_mode_flag | ks_single_thread_apartment_imp::auto_register_flag);
+    auto* mta_imp = new ks_thread_pool_apartment_imp("test_yield_mta", 1, ks_thread_pool_apartment_imp::fiber_mode_flag | ks_thread_pool_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_yield_sta");
+    ks_apartment* mta = ks_apartment::find_public_apartment("test_yield_mta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    ASSERT_EQ(mta, (ks_apartment*)mta_imp);
+    sta_imp->set_yield_time_slice(5);
+    mta_imp->set_yield_time_slice(5);
+    sta->start();
+    mta->start();
+
+    //不在套间线程中，不需要也无法让出
+    ASSERT_FALSE(ks_apartment::is_yield_needed());
+    ASSERT_FALSE(ks_apartment::yield_if_needed());
+
+    //注：以轮询等待，而非wait，使执行次序只取决于套间的调度（不受wait的优先级继承和定向等待影响）
+    auto wait_until_completed = [](const ks_future<void>& future) {
+        while (!future.is_completed())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+
+    for (ks_apartment* apartment : { sta, mta }) {
+        //长任务中途投递的prior任务，在长任务让出时即被执行，而非等到长任务结束
+        std::atomic<int> step = { 0 };
+        std::atomic<int> prior_step = { -1 };
+        std::atomic<int> yield_count = { 0 };
+        ks_future<void> long_future = ks_future<void>::post(apartment, [apartment, &step, &prior_step, &yield_count]() {
+            for (int i = 0; i < 20; ++i) {
+                if (i == 2)
+                    ks_future<void>::post(apartment, [&step, &prior_step]() { prior_step = step.load(); }, make_async_context().set_priority(1));
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++step;
+                if (ks_apartment::yield_if_needed())
+                    ++yield_count;
+            }
+        });
+        wait_until_completed(long_future);
+        ASSERT_TRUE(long_future.peek_result().is_value());
+        ASSERT_EQ(step.load(), 20);
+        ASSERT_TRUE(prior_step >= 3 && prior_step < 20);
+        ASSERT_GE(yield_count.load(), 1);
+
+        //同为normal的两个长任务，按时间片交替执行
+        std::vector<int> trace;
+        auto make_long_fn = [&trace](int id) {
+            return [&trace, id]() {
+                for (int i = 0; i < 20; ++i) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    trace.push_back(id);
+                    ks_apartment::yield_if_needed();
+                }
+            };
+        };
+        ks_future<void> future_a = ks_future<void>::post(apartment, make_long_fn(1));
+        ks_future<void> future_b = ks_future<void>::post(apartment, make_long_fn(2));
+        wait_until_completed(future_a);
+        wait_until_completed(future_b);
+        ASSERT_EQ(trace.size(), size_t(40));
+        ASSERT_EQ(trace.front(), 1);
+        ASSERT_NE(std::find(trace.begin(), trace.end(), 2), trace.begin() + 20); //b在a结束前即已开始执行
+    }
+
+    sta->async_stop();
+    mta->async_stop();
+    sta->wait();
+    mta->wait();
+    delete sta_imp;
+    delete mta_imp;
+}
+
+TEST(test_apartment_suite, test_post_resumable) {
+    auto* sta_imp = new ks_single_thread_apartment_imp("test_resumable_sta", ks_single_thread_apartment_imp::auto_register_flag);
+    ks_apartment* sta = ks_apartment::find_public_apartment("test_resumable_sta");
+    ASSERT_EQ(sta, (ks_apartment*)sta_imp);
+    sta->start();
+
+    //非fiber模式：yield_if_needed不让出；post_resumable则在需让出时结束本轮、稍后继续
+    auto step = std::make_shared<std::atomic<int>>(0);
+    auto prior_step = std::make_shared<std::atomic<int>>(-1);
+    ks_future<void> resumable_future = ks_future_util::post_resumable(sta, [sta, step, prior_step]() -> bool {
+        if (*step == 2)
+            ks_future<void>::post(sta, [step, prior_step]() { *prior_step = step->load(); }, make_async_context().set_priority(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ++(*step);
+        if (*step == 5) {
+            EXPECT_TRUE(ks_apartment::is_yield_needed() || *prior_step != -1);
+            EXPECT_FALSE(ks_apartment::yield_if_needed());
+        }
+        return *step == 20;
+    });
+    resumable_future.__wait();
+    ASSERT_TRUE(resumable_future.peek_result().is_value());
+    ASSERT_EQ(step->load(), 20);
+    ASSERT_TRUE(*prior_step >= 3 && *prior_step < 20);
+
+    //撤销
+    auto cancel_step = std::make_shared<std::atomic<int>>(0);
+    ks_future<void> cancelled_future = ks_future_util::post_resumable(sta, [cancel_step](ks_cancel_inspector* inspector) -> bool {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ++(*cancel_step);
+        return false;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    cancelled_future.__try_cancel();
+    cancelled_future.__wait();
+    ASSERT_TRUE(cancelled_future.peek_result().is_error());
+    ASSERT_EQ(cancelled_future.peek_result().to_error().get_code(), (HRESULT)ks_error::CANCELLED_ERROR_CODE);
+
+    sta->async_stop();
+    sta->wait();
+    delete sta_imp;
+}
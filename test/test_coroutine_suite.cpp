@@ -0,0 +1,310 @@
+﻿/* Copyright 2024 The Kingsoft's ks-async Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "test_base.h"
+#include "../ks_coroutine.h"
+
+#if __KS_ASYNC_COROUTINE_ENABLED
+
+TEST(test_coroutine_suite, test_await_future) {
+    auto coro_fn = [](ks_apartment* apartment) -> ks_task<int> {
+        int a = co_await ks_future<int>::post(ks_apartment::default_mta(), []() -> int { return 1; });
+        EXPECT_EQ(ks_apartment::current_thread_apartment(), apartment); //恢复于task的套间
+
+        int b = co_await ks_future<int>::post_delayed(ks_apartment::default_mta(), []() -> int { return 2; }, 20);
+        EXPECT_EQ(ks_apartment::current_thread_apartment(), apartment);
+
+        co_await ks_future<void>::resolved(); //已完成者不挂起
+        co_return a + b;
+    };
+
+    ks_future<int> future = coro_fn(ks_apartment::background_sta()).post(ks_apartment::background_sta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), "3");
+}
+
+TEST(test_coroutine_suite, test_await_error) {
+    auto coro_fn = []() -> ks_task<int> {
+        try {
+            co_await ks_future<int>::rejected(ks_error::eof_error());
+            ADD_FAILURE();
+        }
+        catch (const ks_error& error) {
+            EXPECT_EQ(error.get_code(), ks_error::eof_error().get_code());
+        }
+
+        co_await ks_future<void>::post(ks_apartment::default_mta(), []() -> ks_result<void> { return ks_error::unexpected_error(); });
+        ADD_FAILURE();
+        co_return 0;
+    };
+
+    ks_future<int> future = coro_fn().post(ks_apartment::default_mta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), _result_to_str(ks_result<int>(ks_error::unexpected_error())));
+}
+
+TEST(test_coroutine_suite, test_nested_task) {
+    struct _COROS {
+        static ks_task<int> leaf(int n) {
+            co_return n;
+        }
+        static ks_task<void> check_apartment(ks_apartment* apartment) {
+            co_await ks_future<void>::post(ks_apartment::default_mta(), []() {});
+            EXPECT_EQ(ks_apartment::current_thread_apartment(), apartment); //子task恢复于父task的套间
+        }
+        static ks_task<int> root(ks_apartment* apartment) {
+            co_await check_apartment(apartment);
+
+            //同步完成的子task经对称转移切入切出，大量串行亦不会耗尽栈
+            int sum = 0;
+            for (int i = 1; i <= 100000; ++i)
+                sum += co_await leaf(i % 10);
+            co_return sum;
+        }
+    };
+
+    ks_future<int> future = _COROS::root(ks_apartment::background_sta()).post(ks_apartment::background_sta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), "450000");
+}
+
+TEST(test_coroutine_suite, test_resume_on) {
+    auto coro_fn = []() -> ks_task<void> {
+        EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::default_mta());
+        co_await ks_coroutine_util::resume_on(ks_apartment::background_sta());
+        EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::background_sta());
+        co_await ks_future<void>::post(ks_apartment::default_mta(), []() {});
+        EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::background_sta());
+    };
+
+    ks_future<void> future = coro_fn().post(ks_apartment::default_mta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), "VOID");
+}
+
+TEST(test_coroutine_suite, test_cancel) {
+    std::atomic<int> step_count = { 0 };
+    std::atomic<bool> inspector_saw_cancelled = { false };
+
+    auto coro_fn = [&step_count, &inspector_saw_cancelled]() -> ks_task<void> {
+        ks_cancel_inspector* inspector = co_await ks_coroutine_util::cancel_inspector();
+        try {
+            while (true) {
+                co_await ks_future<void>::post_delayed(ks_apartment::default_mta(), []() {}, 10);
+                ++step_count;
+            }
+        }
+        catch (const ks_error&) {
+            inspector_saw_cancelled = inspector->check_cancelled();
+            throw;
+        }
+    };
+
+    //cancel by controller
+    if (true) {
+        ks_async_controller controller;
+        ks_future<void> future = coro_fn().post(ks_apartment::default_mta(), make_async_context().bind_controller(&controller));
+        while (step_count < 3)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        controller.try_cancel();
+        future.__wait();
+        EXPECT_EQ(_result_to_str(future.peek_result()), _result_to_str(ks_result<void>(ks_error::cancelled_error())));
+        EXPECT_TRUE(inspector_saw_cancelled);
+    }
+
+    //cancel by owner expired
+    if (true) {
+        step_count = 0;
+        inspector_saw_cancelled = false;
+        auto owner = std::make_shared<int>(0);
+        ks_future<void> future = coro_fn().post(ks_apartment::default_mta(), make_async_context().bind_owner(std::weak_ptr<int>(owner)));
+        while (step_count < 3)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        owner.reset();
+        future.__wait();
+        EXPECT_EQ(_result_to_str(future.peek_result()), _result_to_str(ks_result<void>(ks_error::cancelled_error())));
+        EXPECT_TRUE(inspector_saw_cancelled);
+    }
+
+    //timeout
+    if (true) {
+        step_count = 0;
+        inspector_saw_cancelled = false;
+        ks_future<void> future = coro_fn().post(ks_apartment::default_mta(), make_async_context().set_timeout(50));
+        future.__wait();
+        EXPECT_EQ(_result_to_str(future.peek_result()), _result_to_str(ks_result<void>(ks_error::timeout_error())));
+        while (step_count.load() == 0 || !inspector_saw_cancelled) //协程在下次恢复时才结束
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+TEST(test_coroutine_suite, test_async_generator) {
+    struct _COROS {
+        static ks_async_generator<int> produce(int n) {
+            for (int i = 1; i <= n; ++i) {
+                EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::background_sta()); //生产者恢复于其套间
+                if (i % 10 == 0)
+                    co_await ks_future<void>::post(ks_apartment::default_mta(), []() {});
+                co_yield i;
+            }
+        }
+        static ks_task<int> consume(ks_async_generator<int> generator) {
+            int sum = 0;
+            while (true) {
+                ks_result<int> result = co_await generator.next();
+                EXPECT_EQ(ks_apartment::current_thread_apartment(), ks_apartment::default_mta()); //消费者恢复于其task的套间
+                if (!result.is_value()) {
+                    EXPECT_EQ(result.to_error().get_code(), ks_error::eof_error().get_code());
+                    break;
+                }
+                sum += result.to_value();
+            }
+
+            ks_result<int> result_after_eof = co_await generator.next();
+            EXPECT_EQ(result_after_eof.to_error().get_code(), ks_error::eof_error().get_code());
+            co_return sum;
+        }
+    };
+
+    for (size_t buffer_capacity : { 1, 4, 1000 }) {
+        ks_async_generator<int> generator = _COROS::produce(1000);
+        generator.start(ks_apartment::background_sta(), buffer_capacity, make_async_context());
+        ks_future<int> future = _COROS::consume(std::move(generator)).post(ks_apartment::default_mta(), make_async_context());
+        future.__wait();
+        EXPECT_EQ(_result_to_str(future.peek_result()), "500500");
+    }
+}
+
+TEST(test_coroutine_suite, test_async_generator_run_ahead) {
+    static std::atomic<int> produced_count = { 0 };
+    produced_count = 0;
+
+    struct _COROS {
+        static ks_async_generator<int> produce() {
+            for (int i = 0; i < 10; ++i) {
+                co_yield i;
+                ++produced_count;
+            }
+        }
+        static ks_task<int> consume(ks_async_generator<int>* generator) {
+            int count = 0;
+            while ((co_await generator->next()).is_value())
+                ++count;
+            co_return count;
+        }
+    };
+
+    //缓冲满后生产者挂起，不会无限领先
+    ks_async_generator<int> generator = _COROS::produce();
+    generator.start(ks_apartment::background_sta(), 3, make_async_context());
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(produced_count.load(), 2); //第3个值放入缓冲后即挂起
+
+    ks_future<int> future = _COROS::consume(&generator).post(ks_apartment::default_mta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), "10");
+    EXPECT_EQ(produced_count.load(), 10);
+}
+
+TEST(test_coroutine_suite, test_async_generator_error) {
+    struct _COROS {
+        static ks_async_generator<std::string> produce() {
+            co_yield std::string("a");
+            co_await ks_future<void>::post(ks_apartment::default_mta(), []() -> ks_result<void> { return ks_error::unexpected_error(); });
+            co_yield std::string("b");
+        }
+        static ks_task<std::string> consume(ks_async_generator<std::string> generator) {
+            std::string str;
+            while (true) {
+                ks_result<std::string> result = co_await generator.next();
+                if (!result.is_value())
+                    throw result.to_error();
+                str += result.to_value();
+            }
+        }
+    };
+
+    ks_async_generator<std::string> generator = _COROS::produce();
+    generator.start(ks_apartment::default_mta(), 2, make_async_context());
+    ks_future<std::string> future = _COROS::consume(std::move(generator)).post(ks_apartment::background_sta(), make_async_context());
+    future.__wait();
+    EXPECT_EQ(_result_to_str(future.peek_result()), _result_to_str(ks_result<std::string>(ks_error::unexpected_error())));
+}
+
+TEST(test_coroutine_suite, test_async_generator_detach) {
+    struct _COROS {
+        //frame_token随帧销毁而释放
+        static ks_async_generator<int> produce(std::shared_ptr<int> frame_token, std::atomic<bool>* saw_cancelled, bool with_delay) {
+            try {
+                for (int i = 0; ; ++i) {
+                    if (with_delay)
+                        co_await ks_future<void>::post_delayed(ks_apartment::default_mta(), []() {}, 5);
+                    co_yield i;
+                }
+            }
+            catch (const ks_error& error) {
+                *saw_cancelled = error.get_code() == ks_error::cancelled_error().get_code();
+                throw;
+            }
+        }
+        static ks_task<int> consume_some(ks_async_generator<int> generator, int n) {
+            int sum = 0;
+            for (int i = 0; i < n; ++i)
+                sum += (co_await generator.next()).to_value();
+            co_return sum; //generator随task帧销毁，即消费者放弃
+        }
+    };
+
+    //生产者执行中时放弃：由生产者在下次恢复时结束并自行销毁
+    if (true) {
+        auto frame_token = std::make_shared<int>(0);
+        std::weak_ptr<int> frame_token_weak = frame_token;
+        std::atomic<bool> saw_cancelled = { false };
+        ks_async_generator<int> generator = _COROS::produce(std::move(frame_token), &saw_cancelled, true);
+        generator.start(ks_apartment::background_sta(), 1, make_async_context());
+        ks_future<int> future = _COROS::consume_some(std::move(generator), 3).post(ks_apartment::default_mta(), make_async_context());
+        future.__wait();
+        EXPECT_EQ(_result_to_str(future.peek_result()), "3");
+        while (!frame_token_weak.expired())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        EXPECT_TRUE(saw_cancelled);
+    }
+
+    //生产者因缓冲满而挂起时放弃：就地销毁帧
+    if (true) {
+        auto frame_token = std::make_shared<int>(0);
+        std::weak_ptr<int> frame_token_weak = frame_token;
+        std::atomic<bool> saw_cancelled = { false };
+        ks_async_generator<int> generator = _COROS::produce(std::move(frame_token), &saw_cancelled, false);
+        generator.start(ks_apartment::background_sta(), 2, make_async_context());
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_FALSE(frame_token_weak.expired());
+        generator = nullptr;
+        EXPECT_TRUE(frame_token_weak.expired());
+        EXPECT_FALSE(saw_cancelled);
+    }
+
+    //未启动即放弃
+    if (true) {
+        auto frame_token = std::make_shared<int>(0);
+        std::weak_ptr<int> frame_token_weak = frame_token;
+        std::atomic<bool> saw_cancelled = { false };
+        ks_async_generator<int> generator = _COROS::produce(std::move(frame_token), &saw_cancelled, false);
+        generator = nullptr;
+        EXPECT_TRUE(frame_token_weak.expired());
+    }
+}
+
+#endif //__KS_ASYNC_COROUTINE_ENABLED
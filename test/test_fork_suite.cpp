@@ -26,6 +26,7 @@ TEST(test_fork_suite, test_fork) {
     work_wg.add(1);
 
     ks_apartment::default_mta()->atfork_prepare();
+    ks_apartment::blocking_mta()->atfork_prepare();
     ks_apartment::background_sta()->atfork_prepare();
 
     pid_t pid = fork();
@@ -33,18 +34,22 @@ TEST(test_fork_suite, test_fork) {
 
     if (pid == 0) {
         ks_apartment::default_mta()->atfork_child();
+        ks_apartment::blocking_mta()->atfork_child();
         ks_apartment::background_sta()->atfork_child();
     }
     else {
         ks_apartment::default_mta()->atfork_parent();
+        ks_apartment::blocking_mta()->atfork_parent();
         ks_apartment::background_sta()->atfork_parent();
     }
 
     if (pid == 0) {
         // 子进程
         ks_apartment::default_mta()->async_stop();
+        ks_apartment::blocking_mta()->async_stop();
         ks_apartment::background_sta()->async_stop();
         ks_apartment::default_mta()->wait();
+        ks_apartment::blocking_mta()->wait();
         ks_apartment::background_sta()->wait();
         exit(0);
     }
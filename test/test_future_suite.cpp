@@ -601,3 +601,125 @@ TEST(test_future_suite, test_methods_combination) {
     work_wg.wait();
     EXPECT_EQ(failure, 0);
 }
+
+TEST(test_future_suite, test_many_nexts_and_waiters) {
+    //后继和等待者的个数都超出就地存放的容量
+    ks_promise<int> promise = ks_promise<int>::create();
+    ks_future<int> future = promise.get_future();
+
+    std::atomic<int> sum = { 0 };
+    std::vector<ks_future<void>> next_futures;
+    for (int i = 0; i < 8; ++i) {
+        next_futures.push_back(future.then<void>(ks_apartment::default_mta(), make_async_context(), [&sum, i](const int& value) {
+            sum += value + i;
+        }));
+    }
+
+    std::atomic<int> waiting_count = { 0 };
+    std::vector<ks_future<int>> waiter_futures;
+    for (ks_apartment* apartment : { ks_apartment::default_mta(), ks_apartment::background_sta(), ks_apartment::blocking_mta() }) {
+        waiter_futures.push_back(ks_future<int>::post(apartment, make_async_context(), [future, &waiting_count]() -> int {
+            ++waiting_count;
+            future.__wait();
+            return future.peek_result().to_value();
+        }));
+    }
+
+    while (waiting_count != 3)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    promise.resolve(10);
+
+    for (auto& next_future : next_futures) {
+        next_future.__wait();
+        ASSERT_TRUE(next_future.peek_result().is_value());
+    }
+    EXPECT_EQ(sum, 8 * 10 + 28);
+
+    for (auto& waiter_future : waiter_futures) {
+        waiter_future.__wait();
+        EXPECT_EQ(waiter_future.peek_result().to_value(), 10);
+    }
+
+    //已完成后再添加的后继
+    ks_future<int> late_future = future.then<int>(ks_apartment::default_mta(), make_async_context(), [](const int& value) { return value + 1; });
+    late_future.__wait();
+    EXPECT_EQ(late_future.peek_result().to_value(), 11);
+}
+
+TEST(test_future_suite, test_inline_continuation) {
+    //同套间的then链：在套间线程上resolve后，链上的后继就地执行，之后投递的任务只能在整条链完成后执行（链长超过就地执行的深度上限，经由蹦床）
+    ks_apartment* apartment = ks_apartment::background_sta();
+    for (int node_count : { 200, 2000 }) {
+        std::atomic<int> progress = { 0 };
+        std::atomic<int> marker_progress = { -1 };
+        ks_future<int> chain_future = ks_future<int>::rejected(ks_error::unexpected_error());
+
+        ks_future<void>::post(apartment, make_async_context(), [apartment, node_count, &progress, &marker_progress, &chain_future]() {
+            ks_promise<int> promise = ks_promise<int>::create();
+            ks_future<int> future = promise.get_future();
+            for (int i = 0; i < node_count; ++i) {
+                future = future.then<int>(apartment, make_async_context(), [&progress](const int& value) {
+                    ++progress;
+                    return value + 1;
+                });
+            }
+            chain_future = future;
+
+            promise.resolve(0);
+            ks_future<void>::post(apartment, make_async_context(), [&progress, &marker_progress]() {
+                marker_progress = progress.load();
+            });
+        }).__wait();
+
+        //注：先轮询marker，再wait链尾（wait会将尚在排队的后继提升为prior，见优先级继承）
+        while (marker_progress == -1)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        chain_future.__wait();
+        ASSERT_TRUE(chain_future.peek_result().is_value());
+        EXPECT_EQ(chain_future.peek_result().to_value(), node_count);
+
+        if (node_count == 200)
+            EXPECT_EQ(marker_progress, node_count);
+        else
+            EXPECT_LT(marker_progress, node_count); //就地执行的总数有上限，长链终会让出套间
+    }
+}
+
+TEST(test_future_suite, test_racing_add_next_and_complete) {
+    //多个线程添加后继的同时resolve：每个后继都恰被feed一次
+    for (int round = 0; round < 50; ++round) {
+        ks_promise<int> promise = ks_promise<int>::create();
+        ks_future<int> future = promise.get_future();
+
+        std::atomic<int> fed_count = { 0 };
+        std::atomic<bool> go = { false };
+        std::vector<std::thread> threads;
+        std::vector<std::vector<ks_future<void>>> next_futures_seq(4);
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&go, &future, &fed_count, &next_futures = next_futures_seq[t]]() {
+                while (!go)
+                    std::this_thread::yield();
+                for (int i = 0; i < 50; ++i) {
+                    next_futures.push_back(future.then<void>(ks_apartment::default_mta(), make_async_context(), [&fed_count](const int& value) {
+                        ASSERT_EQ(value, 1);
+                        ++fed_count;
+                    }));
+                }
+            });
+        }
+
+        go = true;
+        promise.resolve(1);
+        for (auto& thread : threads)
+            thread.join();
+
+        for (auto& next_futures : next_futures_seq) {
+            for (auto& next_future : next_futures) {
+                next_future.__wait();
+                ASSERT_TRUE(next_future.peek_result().is_value());
+            }
+        }
+        ASSERT_EQ(fed_count, 4 * 50);
+    }
+}
@@ -21,8 +21,10 @@ int main(int argc, char** argv) {
     int exit_code = RUN_ALL_TESTS();
 
     ks_apartment::default_mta()->async_stop();
+    ks_apartment::blocking_mta()->async_stop();
     ks_apartment::background_sta()->async_stop();
     ks_apartment::default_mta()->wait();
+    ks_apartment::blocking_mta()->wait();
     ks_apartment::background_sta()->wait();
     return exit_code;
 }